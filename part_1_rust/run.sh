@@ -21,9 +21,13 @@ function my_exit() {
 for i in "${test_projects[@]}"; do
 	printf "\n****************************\n"
 	printf "\nRunning $i\n"
-	$CLANG_COMMAND -O0 -g -fstandalone-debug -fpass-plugin=target/debug/libpart_1_rust.so ../test_files/"$i" || my_exit "Failed to compile $i"
+	# The pass writes the location of every br_N to the dictionary while it
+	# compiles; the program only prints the ids. Modules append to a shared
+	# dictionary, so each program starts a new one.
+	rm -f dictionary.txt
+	KPC_PASS_DICT=dictionary.txt $CLANG_COMMAND -O0 -g -fstandalone-debug -fpass-plugin=target/debug/libpart_1_rust.so ../test_files/"$i" || my_exit "Failed to compile $i"
 	printf "\nRunning compiled program\n"
-	./a.out | tee /dev/tty | grep "}: br_" | sort --unique >dictionary.txt || my_exit "$i exited with $?"
+	./a.out || my_exit "$i exited with $?"
 	printf "\ndictionary.txt\n"
 	cat dictionary.txt
 	valgrind --tool=callgrind --callgrind-out-file=callgrind_output ./a.out &>/dev/null || my_exit "Failed to execute valgrind on $i: Status $?"
@@ -0,0 +1,220 @@
+/* Runtime of the latency mode of the pass (KPC_PASS_MODE=latency). Link it
+ * into the instrumented program:
+ *
+ *   KPC_PASS_MODE=latency clang -O0 -g -fpass-plugin=... prog.c \
+ *       runtime/kpc_latency.c
+ *
+ * Every branch target calls kpc_latency_enter() with its module's histogram
+ * table and the id of the module's first block, which modules compiled one
+ * by one into a shared dictionary do not start from 0. The region of a target
+ * lasts until the next target of the same thread, and its length is added to
+ * the target's histogram. At exit each
+ * target prints
+ *   "latency br_N n=COUNT ns=TOTAL bK=c ..."
+ * where bK counts the regions of 2^K to 2^(K+1)-1 ns (b0 from 0 ns), the
+ * lines the instrumented programs of FeatureDetector --latency print, so
+ * --trace-stats reads both. Time is read from the TSC, converted with a rate
+ * measured against CLOCK_MONOTONIC for a millisecond when the first target
+ * is reached, or with -DKPC_CLOCK_GETTIME (and off x86) from clock_gettime,
+ * which the vDSO serves without a system call. If KPC_TIMELINE names a file,
+ * the first KPC_TIMELINE_MAX regions are also written there as Chrome trace
+ * events, for chrome://tracing or ui.perfetto.dev.
+ *
+ * Compile with -DKPC_THREADED for threaded programs: the histograms are then
+ * updated atomically. Regions still open in other threads at exit are
+ * dropped; join them first. */
+#define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* The pass sizes its tables with the same histogram layout. */
+#define KPC_BUCKETS 48
+#if !defined(KPC_TIMELINE_MAX)
+#define KPC_TIMELINE_MAX (1 << 20)
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(KPC_CLOCK_GETTIME)
+#define KPC_TSC
+#endif
+#if defined(KPC_THREADED)
+#define KPC_TLS __thread
+#define KPC_ADD(COUNTER, VALUE)                                                \
+  __atomic_fetch_add(&(COUNTER), (VALUE), __ATOMIC_RELAXED)
+#else
+#define KPC_TLS
+#define KPC_ADD(COUNTER, VALUE) ((COUNTER) += (VALUE))
+#endif
+
+struct kpc_histogram {
+  uint64_t count;
+  uint64_t ns;
+  uint64_t buckets[KPC_BUCKETS];
+};
+
+/* Kept in the slot past the last block of each module's table. */
+struct kpc_table {
+  uint64_t registered;
+  struct kpc_histogram *next;
+  uint64_t size;
+  uint64_t first_id;
+};
+
+struct kpc_span {
+  uint64_t start;
+  uint64_t ns;
+  uint32_t id;
+  uint32_t thread;
+};
+
+static double kpc_ns_per_tick;
+static uint64_t kpc_start_ticks;
+static int kpc_state;
+static struct kpc_histogram *kpc_tables;
+static struct kpc_span *kpc_timeline;
+static uint64_t kpc_timeline_size;
+static uint32_t kpc_timeline_threads;
+static KPC_TLS struct kpc_histogram *kpc_open;
+static KPC_TLS uint64_t kpc_open_start;
+static KPC_TLS uint32_t kpc_open_id;
+static KPC_TLS uint32_t kpc_open_thread;
+
+static inline uint64_t kpc_now(void) {
+#if defined(KPC_TSC)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+/* Ends the region open in this thread, if any. */
+static inline void kpc_close(uint64_t now) {
+  struct kpc_histogram *histogram = kpc_open;
+  uint64_t ns, slot;
+  unsigned bucket;
+  if (histogram == NULL) return;
+  kpc_open = NULL;
+  ns = (uint64_t)((now - kpc_open_start) * kpc_ns_per_tick);
+  bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+  if (bucket >= KPC_BUCKETS) bucket = KPC_BUCKETS - 1;
+  KPC_ADD(histogram->count, 1);
+  KPC_ADD(histogram->ns, ns);
+  KPC_ADD(histogram->buckets[bucket], 1);
+  if (kpc_timeline == NULL) return;
+  slot = __atomic_fetch_add(&kpc_timeline_size, 1, __ATOMIC_RELAXED);
+  if (slot >= KPC_TIMELINE_MAX) return;
+  if (kpc_open_thread == 0)
+    kpc_open_thread =
+        __atomic_add_fetch(&kpc_timeline_threads, 1, __ATOMIC_RELAXED);
+  kpc_timeline[slot].start =
+      (uint64_t)((kpc_open_start - kpc_start_ticks) * kpc_ns_per_tick);
+  kpc_timeline[slot].ns = ns;
+  kpc_timeline[slot].id = kpc_open_id;
+  kpc_timeline[slot].thread = kpc_open_thread - 1;
+}
+
+static void kpc_write_timeline(void) {
+  const char *path = getenv("KPC_TIMELINE");
+  uint64_t size = kpc_timeline_size, i;
+  FILE *out;
+  if (kpc_timeline == NULL || (out = fopen(path, "w")) == NULL) return;
+  if (size > KPC_TIMELINE_MAX) size = KPC_TIMELINE_MAX;
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+  for (i = 0; i < size; i++)
+    fprintf(out,
+            "%s\n{\"name\":\"br_%u\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+            "\"ts\":%.3f,\"dur\":%.3f}",
+            i > 0 ? "," : "", kpc_timeline[i].id, kpc_timeline[i].thread,
+            kpc_timeline[i].start / 1000.0, kpc_timeline[i].ns / 1000.0);
+  fputs("\n]}\n", out);
+  fclose(out);
+}
+
+static void kpc_report(void) {
+  struct kpc_histogram *table;
+  uint64_t id;
+  unsigned bucket;
+  kpc_close(kpc_now());
+  table = __atomic_load_n(&kpc_tables, __ATOMIC_ACQUIRE);
+  while (table != NULL) {
+    const struct kpc_table *header = (const struct kpc_table *)table;
+    const struct kpc_histogram *histograms = table - header->size;
+    for (id = 0; id < header->size; id++) {
+      if (histograms[id].count == 0) continue;
+      printf("latency br_%llu n=%llu ns=%llu",
+             (unsigned long long)(header->first_id + id),
+             (unsigned long long)histograms[id].count,
+             (unsigned long long)histograms[id].ns);
+      for (bucket = 0; bucket < KPC_BUCKETS; bucket++)
+        if (histograms[id].buckets[bucket] != 0)
+          printf(" b%u=%llu", bucket,
+                 (unsigned long long)histograms[id].buckets[bucket]);
+      putchar('\n');
+    }
+    table = header->next;
+  }
+  kpc_write_timeline();
+}
+
+static void kpc_init(void) {
+  int expected = 0;
+#if defined(KPC_TSC)
+  struct timespec begin, now;
+  uint64_t ticks, ns;
+#endif
+  if (!__atomic_compare_exchange_n(&kpc_state, &expected, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&kpc_state, __ATOMIC_ACQUIRE) != 2)
+      ;
+    return;
+  }
+#if defined(KPC_TSC)
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  ticks = kpc_now();
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (uint64_t)(now.tv_sec - begin.tv_sec) * 1000000000u + now.tv_nsec -
+         begin.tv_nsec;
+  } while (ns < 1000000);
+  kpc_ns_per_tick = (double)ns / (kpc_now() - ticks);
+#else
+  kpc_ns_per_tick = 1.0;
+#endif
+  kpc_start_ticks = kpc_now();
+  if (getenv("KPC_TIMELINE") != NULL)
+    kpc_timeline =
+        (struct kpc_span *)malloc(KPC_TIMELINE_MAX * sizeof(struct kpc_span));
+  atexit(kpc_report);
+  __atomic_store_n(&kpc_state, 2, __ATOMIC_RELEASE);
+}
+
+/* Links a module's table into the list kpc_report() prints. */
+static void kpc_register(struct kpc_histogram *table, uint32_t size,
+                         uint32_t first_id) {
+  struct kpc_table *header = (struct kpc_table *)&table[size];
+  if (__atomic_load_n(&kpc_state, __ATOMIC_ACQUIRE) != 2) kpc_init();
+  if (__atomic_exchange_n(&header->registered, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  header->size = size;
+  header->first_id = first_id;
+  header->next = __atomic_load_n(&kpc_tables, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&kpc_tables, &header->next, &table[size],
+                                      1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+/* slot is the block's index in table, its id less first_id. */
+void kpc_latency_enter(struct kpc_histogram *table, uint32_t size,
+                       uint32_t first_id, uint32_t slot) {
+  struct kpc_table *header = (struct kpc_table *)&table[size];
+  uint64_t now;
+  if (!__atomic_load_n(&header->registered, __ATOMIC_ACQUIRE))
+    kpc_register(table, size, first_id);
+  now = kpc_now();
+  kpc_close(now);
+  kpc_open = &table[slot];
+  kpc_open_start = now;
+  kpc_open_id = first_id + slot;
+}
@@ -4,14 +4,32 @@ use crate::my_pass::MyPass;
 use flexi_logger::Logger;
 use llvm_plugin::{PassBuilder, PipelineParsing};
 
+/// With `KPC_PASS_LTO=1` the pass runs once on the merged module at the end
+/// of full LTO instead of on each module as it is compiled, so a program
+/// linked from many object files is numbered at once and its dictionary is
+/// rewritten on every link, without the entries of stale objects that a
+/// shared dictionary of separately compiled modules keeps:
+///
+/// ```sh
+/// export KPC_PASS_LTO=1 KPC_PASS_DICT=dictionary.txt
+/// clang -O0 -g -flto -c a.c b.c
+/// clang -flto -fuse-ld=lld -Wl,--load-pass-plugin=libpart_1_rust.so a.o b.o
+/// ```
+///
+/// The compile step then leaves the modules alone even if it loads the
+/// plugin. `validate_ids.sh` builds a two-file program this way.
 #[llvm_plugin::plugin(name = "my_pass", version = "0.1")]
 fn plugin_registrar(builder: &mut PassBuilder) {
     Logger::try_with_str("debug").unwrap().start().unwrap();
 
-    builder.add_pipeline_start_ep_callback(|manager, _| manager.add_pass(MyPass));
+    if std::env::var("KPC_PASS_LTO").as_deref() == Ok("1") {
+        builder.add_full_lto_last_ep_callback(|manager, _| manager.add_pass(MyPass::from_env()));
+    } else {
+        builder.add_pipeline_start_ep_callback(|manager, _| manager.add_pass(MyPass::from_env()));
+    }
     builder.add_module_pipeline_parsing_callback(|name, manager| {
         if name == "my_pass" {
-            manager.add_pass(MyPass);
+            manager.add_pass(MyPass::from_env());
             PipelineParsing::Parsed
         } else {
             PipelineParsing::NotParsed
@@ -1,7 +1,10 @@
 use std::{
     collections::HashMap,
     ffi::{CStr, OsStr},
-    path::PathBuf,
+    fmt::Write as _,
+    fs::{File, OpenOptions},
+    io::{Read, Write},
+    path::{Path, PathBuf},
 };
 
 use llvm_plugin::{
@@ -9,28 +12,210 @@ use llvm_plugin::{
         basic_block::BasicBlock,
         builder::Builder,
         llvm_sys::{
-            core::LLVMIsABranchInst,
+            core::{LLVMIsABranchInst, LLVMIsADbgInfoIntrinsic},
             debuginfo::{
                 LLVMDIFileGetFilename, LLVMDILocationGetLine, LLVMDILocationGetScope,
                 LLVMDIScopeGetFile, LLVMInstructionGetDebugLoc,
             },
             prelude::*,
         },
-        module::Module,
-        values::{AnyValue, AsValueRef, FunctionValue, InstructionValue},
+        module::{Linkage, Module},
+        values::{
+            AnyValue, AsValueRef, FunctionValue, GlobalValue, InstructionOpcode,
+            InstructionValue,
+        },
         AddressSpace,
     },
     utils::InstructionIterator,
     LlvmModulePass, ModuleAnalysisManager, PreservedAnalyses,
 };
 
-pub struct MyPass;
+/// What the pass instruments, chosen at compile time through `KPC_PASS_MODE`.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Mode {
+    /// Print a `br_N` line whenever a branch target runs. The location of
+    /// every `br_N` is written to the dictionary file at compile time.
+    Trace,
+    /// Add every block's static instruction count to a counter of its
+    /// function, and print the counts at exit (`KPC_PASS_MODE=count`).
+    Count,
+    /// Time the region from each branch target to the next one into
+    /// histograms, printed at exit as `latency br_N ...` lines
+    /// (`KPC_PASS_MODE=latency`). The blocks are numbered and written to the
+    /// dictionary as in trace mode; the program is linked with
+    /// `runtime/kpc_latency.c`.
+    Latency,
+}
+
+pub struct MyPass {
+    pub mode: Mode,
+    /// The program's dictionary (`KPC_PASS_DICT`). Without it each module
+    /// writes `<source path>.dict`, next to its source, with ids from 0; so
+    /// does a module that cannot open or lock it, as `<path>.<source>.dict`.
+    pub dictionary: Option<PathBuf>,
+    /// Whether the pass runs on the whole program at the end of full LTO
+    /// (`KPC_PASS_LTO=1`) rather than on one module at a time.
+    pub lto: bool,
+}
+
+/// Where the entries of a module go.
+enum Dictionary {
+    /// A file of the module's own (or, under LTO, of the whole program),
+    /// rewritten each time it is compiled. Ids start from 0.
+    Own(PathBuf),
+    /// The dictionary of a program whose modules are compiled one by one,
+    /// locked while the module is numbered so a parallel build cannot
+    /// interleave. The module's ids continue after the last one in it, so
+    /// the program has one id space; remove the file before a clean build.
+    Shared(PathBuf, File, u32),
+}
+
+impl Dictionary {
+    fn first_id(&self) -> u32 {
+        match self {
+            Dictionary::Own(_) => 0,
+            Dictionary::Shared(_, _, first_id) => *first_id,
+        }
+    }
+}
+
+impl MyPass {
+    pub fn from_env() -> Self {
+        let mode = match std::env::var("KPC_PASS_MODE").as_deref() {
+            Ok("count") => Mode::Count,
+            Ok("latency") => Mode::Latency,
+            _ => Mode::Trace,
+        };
+        let dictionary = std::env::var_os("KPC_PASS_DICT").map(PathBuf::from);
+        let lto = std::env::var("KPC_PASS_LTO").as_deref() == Ok("1");
+        MyPass {
+            mode,
+            dictionary,
+            lto,
+        }
+    }
+
+    fn open_dictionary(&self, module: &Module) -> Dictionary {
+        match &self.dictionary {
+            Some(path) if !self.lto => match open_shared_dictionary(path) {
+                Ok((file, first_id)) => Dictionary::Shared(path.clone(), file, first_id),
+                Err(error) => {
+                    // Writing the shared path as our own would truncate the
+                    // entries of the modules already compiled.
+                    let private = private_dictionary_path(path, module);
+                    log::error!(
+                        "Unable to open dictionary {:?}: {}; writing {:?} with ids from 0",
+                        path,
+                        error,
+                        private
+                    );
+                    Dictionary::Own(private)
+                }
+            },
+            Some(path) => Dictionary::Own(path.clone()),
+            None => {
+                let source = module.get_source_file_name().to_string_lossy().to_string();
+                if source.is_empty() || source == "-" {
+                    Dictionary::Own(PathBuf::from("module.dict"))
+                } else {
+                    Dictionary::Own(PathBuf::from(format!("{}.dict", source)))
+                }
+            }
+        }
+    }
+}
+
+/// `<path>.<source file name>.dict`: the dictionary of a module whose
+/// shared dictionary cannot be opened or locked.
+fn private_dictionary_path(path: &Path, module: &Module) -> PathBuf {
+    let source = module.get_source_file_name().to_string_lossy().to_string();
+    let name = Path::new(&source)
+        .file_name()
+        .map(|name| name.to_string_lossy().to_string())
+        .filter(|name| name != "-")
+        .unwrap_or_else(|| "module".to_string());
+    let mut private = path.as_os_str().to_owned();
+    private.push(format!(".{}.dict", name));
+    PathBuf::from(private)
+}
+
+/// Opens and locks a shared dictionary, and returns the id after the
+/// largest one in it.
+fn open_shared_dictionary(path: &Path) -> std::io::Result<(File, u32)> {
+    let mut file = OpenOptions::new()
+        .read(true)
+        .append(true)
+        .create(true)
+        .open(path)?;
+    file.lock()?;
+    let mut text = String::new();
+    file.read_to_string(&mut text)?;
+    let first_id = text
+        .lines()
+        .filter_map(|line| line.rsplit_once(": br_"))
+        .filter_map(|(_, rest)| rest.split(' ').next()?.parse::<u32>().ok())
+        .max()
+        .map_or(0, |id| id + 1);
+    Ok((file, first_id))
+}
+
+/// Location of an instrumented block: one line of the dictionary.
+struct DictionaryEntry {
+    id: u32,
+    file: String,
+    start_line: u32,
+    end_line: Option<u32>,
+    function: String,
+}
+
+/// Writes the dictionary as `file {start, end}: br_N function` lines in id
+/// order, the lines the trace used to carry followed by the function; `_`
+/// stands for an end line without debug information. A shared dictionary
+/// gets the lines appended and is unlocked when it is closed.
+fn write_dictionary(dictionary: Dictionary, entries: &mut [DictionaryEntry]) {
+    entries.sort_by_key(|entry| entry.id);
+    let mut text = String::new();
+    for entry in entries.iter() {
+        let end_line = entry
+            .end_line
+            .map_or_else(|| "_".to_string(), |line| line.to_string());
+        let _ = writeln!(
+            text,
+            "{} {{{}, {}}}: br_{} {}",
+            entry.file, entry.start_line, end_line, entry.id, entry.function
+        );
+    }
+    let (path, result) = match dictionary {
+        Dictionary::Own(path) => {
+            let result = std::fs::write(&path, text);
+            (path, result)
+        }
+        Dictionary::Shared(path, mut file, _) => {
+            let result = file.write_all(text.as_bytes());
+            (path, result)
+        }
+    };
+    match result {
+        Ok(()) => log::info!("Wrote {} blocks to dictionary {:?}", entries.len(), path),
+        Err(error) => log::error!("Unable to write dictionary {:?}: {}", path, error),
+    }
+}
+
 impl LlvmModulePass for MyPass {
     fn run_pass(&self, module: &mut Module, _manager: &ModuleAnalysisManager) -> PreservedAnalyses {
-        log::info!("Module {:?}", module.get_name());
+        log::info!("Module {:?} in {:?} mode", module.get_name(), self.mode);
 
+        if self.mode == Mode::Count {
+            insert_instruction_counters(module);
+            return PreservedAnalyses::None;
+        }
+
+        let dictionary = self.open_dictionary(module);
+        let first_id = dictionary.first_id();
         let mut block_address_to_id = HashMap::new();
-        let mut block_index = 0;
+        let mut block_index = first_id;
+        let mut entries = Vec::new();
+        let latency = (self.mode == Mode::Latency).then(|| create_latency_table(module, first_id));
         module
             .get_functions()
             .into_iter()
@@ -55,9 +240,12 @@ impl LlvmModulePass for MyPass {
                             block,
                             &mut block_address_to_id,
                             &mut block_index,
+                            &mut entries,
+                            latency,
                         )
                     });
             });
+        write_dictionary(dictionary, &mut entries);
         PreservedAnalyses::None
     }
 }
@@ -68,6 +256,8 @@ fn insert_printf(
     block: BasicBlock,
     block_address_to_id: &mut HashMap<String, u32>,
     block_index: &mut u32,
+    entries: &mut Vec<DictionaryEntry>,
+    latency: Option<LatencyTable>,
 ) {
     log::debug!("Getting instructions");
     for instruction in InstructionIterator::new(&block) {
@@ -86,6 +276,8 @@ fn insert_printf(
                     &false_block,
                     block_address_to_id,
                     block_index,
+                    entries,
+                    latency,
                 );
 
                 let true_block = instruction.get_operand(2).unwrap().unwrap_right();
@@ -95,6 +287,8 @@ fn insert_printf(
                     &true_block,
                     block_address_to_id,
                     block_index,
+                    entries,
+                    latency,
                 );
             }
         }
@@ -110,6 +304,8 @@ fn attempt_to_insert_branch_printf<'a>(
     block: &BasicBlock<'a>,
     block_address_to_id: &mut HashMap<String, u32>,
     block_index: &mut u32,
+    entries: &mut Vec<DictionaryEntry>,
+    latency: Option<LatencyTable>,
 ) {
     let cx = module.get_context();
     let builder = cx.create_builder();
@@ -118,9 +314,27 @@ fn attempt_to_insert_branch_printf<'a>(
         log::info!("Skipping adding printf for block {}", block_id);
         return;
     }
-    match prep_block_builder_and_printf_string(block, &builder, block_id) {
-        Some(printf_string) => insert_printf_at_builder(module, &function, &builder, printf_string),
-        None => log::warn!("Prepping builder and printf string failed"),
+    match prep_block_builder_and_location(block, &builder, block_id) {
+        Some((start_line, end_line, file)) => {
+            let function_name = function.get_name().to_string_lossy().to_string();
+            match latency {
+                Some(table) => insert_latency_call_at_builder(module, &builder, table, block_id),
+                None => insert_printf_at_builder(
+                    module,
+                    &function_name,
+                    &builder,
+                    format!("br_{}", block_id),
+                ),
+            }
+            entries.push(DictionaryEntry {
+                id: block_id,
+                file,
+                start_line,
+                end_line,
+                function: function_name,
+            });
+        }
+        None => log::warn!("Prepping builder and block location failed"),
     }
 }
 
@@ -179,13 +393,14 @@ fn get_instruction_line_and_file(instruction: &InstructionValue) -> Option<(u32,
     }
 }
 
-/// Returns a string if the block has instructions in it and debug lines attached to them
-fn prep_block_builder_and_printf_string(
+/// Returns the block's start line, end line and file if the block has
+/// instructions in it and debug lines attached to them
+fn prep_block_builder_and_location(
     block: &BasicBlock,
     builder: &Builder,
     block_id: u32,
-) -> Option<String> {
-    match block
+) -> Option<(u32, Option<u32>, String)> {
+    let location = block
         .get_first_instruction()
         .map_or_else(
             || {
@@ -193,7 +408,9 @@ fn prep_block_builder_and_printf_string(
                 None
             },
             |instruction| {
-                builder.position_before(&instruction);
+                // The successors of && and || start with the PHI merging
+                // their value, which the call has to follow.
+                builder.position_before(&counter_insertion_point(block).unwrap_or(instruction));
                 get_instruction_line_and_file(&instruction)
             },
         )
@@ -224,26 +441,17 @@ fn prep_block_builder_and_printf_string(
                     }
                 }
             },
-        ) {
-        Some((start_line, Some(end_line), file_name)) => Some(format!(
-            "{} {{{}, {}}}: br_{}",
-            file_name, start_line, end_line, block_id
-        )),
-        Some((start_line, None, file_name)) => Some(format!(
-            "{} {{{}, _}}: br_{}",
-            file_name, start_line, block_id
-        )),
-        None => {
-            log::warn!("Skipping printf insertion");
-            None
-        }
+        );
+    if location.is_none() {
+        log::warn!("Skipping printf insertion");
     }
+    location
 }
 
 /// Code adapted from https://github.com/jamesmth/llvm-plugin-rs/blob/master/examples/inject_printf.rs
 fn insert_printf_at_builder(
     module: &Module,
-    function: &FunctionValue,
+    function_name: &str,
     builder: &Builder,
     printf_string: String,
 ) {
@@ -271,13 +479,6 @@ fn insert_printf_at_builder(
     format_str_global.set_initializer(&format_str);
     format_str_global.set_constant(true);
 
-    // create printf args
-    let function_name = function.get_name().to_string_lossy();
-    let function_name_global = builder.build_global_string_ptr(&function_name, "");
-    let function_argc = cx
-        .i32_type()
-        .const_int(function.count_params() as u64, false);
-
     log::info!(
         "Injecting call to printf inside function {} {:?}",
         function_name,
@@ -290,13 +491,286 @@ fn insert_printf_at_builder(
         "",
     );
 
+    builder.build_call(printf, &[format_str_global.into()], "");
+}
+
+/// Words of one histogram of the latency runtime: the region count, their
+/// total in nanoseconds and 48 power-of-two buckets.
+const LATENCY_HISTOGRAM_WORDS: u32 = 50;
+
+/// The module's histogram table: its number of block slots, and the id of
+/// the block in slot 0, which the runtime adds back when it prints.
+#[derive(Clone, Copy)]
+struct LatencyTable {
+    size: u32,
+    first_id: u32,
+}
+
+/// Latency mode: adds the module's zeroed histogram table, with a slot for
+/// every block that may be numbered and one more that the runtime keeps its
+/// bookkeeping in, and declares the runtime's entry point.
+fn create_latency_table(module: &Module, first_id: u32) -> LatencyTable {
+    let cx = module.get_context();
+    let i32_type = cx.i32_type();
+    let i64_type = cx.i64_type();
+    let ptr_type = cx.i8_type().ptr_type(AddressSpace::default());
+
+    let size: u32 = module
+        .get_functions()
+        .map(|function| function.count_basic_blocks())
+        .sum();
+    let table_type = i64_type.array_type((size + 1) * LATENCY_HISTOGRAM_WORDS);
+    let table = module.add_global(table_type, None, "__kpc_latency");
+    table.set_linkage(Linkage::Internal);
+    table.set_initializer(&table_type.const_zero());
+
+    if module.get_function("kpc_latency_enter").is_none() {
+        let func_ty = cx.void_type().fn_type(
+            &[
+                ptr_type.into(),
+                i32_type.into(),
+                i32_type.into(),
+                i32_type.into(),
+            ],
+            false,
+        );
+        module.add_function("kpc_latency_enter", func_ty, None);
+    }
+    log::debug!("Latency table of {} blocks", size);
+    LatencyTable { size, first_id }
+}
+
+/// Calls `kpc_latency_enter(table, size, first_id, slot)`, which ends the
+/// region open in the thread and starts the one of block `block_id`.
+fn insert_latency_call_at_builder(
+    module: &Module,
+    builder: &Builder,
+    latency: LatencyTable,
+    block_id: u32,
+) {
+    let cx = module.get_context();
+    let i32_type = cx.i32_type();
+    let ptr_type = cx.i8_type().ptr_type(AddressSpace::default());
+    let table = module
+        .get_global("__kpc_latency")
+        .unwrap()
+        .as_pointer_value()
+        .const_cast(ptr_type);
+    let enter = module.get_function("kpc_latency_enter").unwrap();
+
+    log::info!("Injecting latency call for br_{}", block_id);
+    builder.build_call(
+        enter,
+        &[
+            table.into(),
+            i32_type.const_int(latency.size as u64, false).into(),
+            i32_type.const_int(latency.first_id as u64, false).into(),
+            i32_type
+                .const_int((block_id - latency.first_id) as u64, false)
+                .into(),
+        ],
+        "",
+    );
+}
+
+/// Counting mode: every defined function gets an internal i64 counter, and
+/// each of its blocks adds its static instruction count to it on entry. A
+/// handler registered with atexit prints the counters and the module total
+/// to stderr as `kpc_count <function> <n>` and `kpc_count_total <module> <n>`
+/// lines. Counters are updated without atomics, so threaded programs may
+/// lose counts.
+fn insert_instruction_counters(module: &Module) {
+    let cx = module.get_context();
+    let builder = cx.create_builder();
+    let i64_type = cx.i64_type();
+
+    let mut counters = Vec::new();
+    for function in module.get_functions() {
+        if function.count_basic_blocks() == 0 {
+            continue;
+        }
+        let name = function.get_name().to_string_lossy().to_string();
+        let counter = module.add_global(i64_type, None, &format!("__kpc_icount.{}", name));
+        counter.set_linkage(Linkage::Internal);
+        counter.set_initializer(&i64_type.const_zero());
+
+        for block in function.get_basic_blocks() {
+            // Counted before the increment is inserted, so it is not part of
+            // the cost.
+            let cost = count_block_instructions(&block);
+            let insertion_point = match counter_insertion_point(&block) {
+                Some(instruction) if cost > 0 => instruction,
+                _ => continue,
+            };
+            builder.position_before(&insertion_point);
+            let pointer = counter.as_pointer_value();
+            let count = builder.build_load(i64_type, pointer, "").into_int_value();
+            let count = builder.build_int_add(count, i64_type.const_int(cost, false), "");
+            builder.build_store(pointer, count);
+        }
+        log::debug!("Counting instructions of function {}", name);
+        counters.push((name, counter));
+    }
+
+    if counters.is_empty() {
+        log::warn!("No function definitions to count in {:?}", module.get_name());
+        return;
+    }
+    let dump = build_count_dump(module, &builder, &counters);
+    register_at_exit(module, &builder, dump);
+}
+
+/// Instructions of the block that end up in the binary; debug intrinsics
+/// such as `llvm.dbg.declare` generate no code.
+fn count_block_instructions(block: &BasicBlock) -> u64 {
+    InstructionIterator::new(block)
+        .filter(|instruction| unsafe {
+            LLVMValueRef::is_null(LLVMIsADbgInfoIntrinsic(instruction.as_value_ref()))
+        })
+        .count() as u64
+}
+
+/// First instruction a counter update, printf or latency call may be
+/// inserted before: PHI nodes and landing pads have to stay at the top of
+/// their block.
+fn counter_insertion_point<'a>(block: &BasicBlock<'a>) -> Option<InstructionValue<'a>> {
+    let mut instruction = block.get_first_instruction();
+    while let Some(current) = instruction {
+        match current.get_opcode() {
+            InstructionOpcode::Phi | InstructionOpcode::LandingPad => {
+                instruction = current.get_next_instruction()
+            }
+            _ => return Some(current),
+        }
+    }
+    None
+}
+
+fn build_count_dump<'a>(
+    module: &Module<'a>,
+    builder: &Builder<'a>,
+    counters: &[(String, GlobalValue<'a>)],
+) -> FunctionValue<'a> {
+    let cx = module.get_context();
+    let i32_type = cx.i32_type();
+    let i64_type = cx.i64_type();
+    let ptr_type = cx.i8_type().ptr_type(AddressSpace::default());
+
+    // `int dprintf(int fd, const char *format, ...)` writes to stderr without
+    // needing the `stderr` global of the C library.
+    let dprintf = module.get_function("dprintf").unwrap_or_else(|| {
+        let func_ty = i32_type.fn_type(&[i32_type.into(), ptr_type.into()], true);
+        module.add_function("dprintf", func_ty, None)
+    });
+
+    let dump = module.add_function(
+        "__kpc_icount_dump",
+        cx.void_type().fn_type(&[], false),
+        Some(Linkage::Internal),
+    );
+    builder.position_at_end(cx.append_basic_block(dump, "entry"));
+
+    let stderr_fd = i32_type.const_int(2, false);
+    let function_format = builder.build_global_string_ptr("kpc_count %s %llu\n", "");
+    let total_format = builder.build_global_string_ptr("kpc_count_total %s %llu\n", "");
+
+    let mut total = i64_type.const_zero();
+    for (name, counter) in counters {
+        let count = builder
+            .build_load(i64_type, counter.as_pointer_value(), "")
+            .into_int_value();
+        let name = builder.build_global_string_ptr(name, "");
+        builder.build_call(
+            dprintf,
+            &[
+                stderr_fd.into(),
+                function_format.as_pointer_value().into(),
+                name.as_pointer_value().into(),
+                count.into(),
+            ],
+            "",
+        );
+        total = builder.build_int_add(total, count, "");
+    }
+
+    let module_name = builder.build_global_string_ptr(&module.get_name().to_string_lossy(), "");
     builder.build_call(
-        printf,
+        dprintf,
         &[
-            format_str_global.into(),
-            function_name_global.as_pointer_value().into(),
-            function_argc.into(),
+            stderr_fd.into(),
+            total_format.as_pointer_value().into(),
+            module_name.as_pointer_value().into(),
+            total.into(),
         ],
         "",
     );
+    builder.build_return(None);
+    dump
+}
+
+/// Registers the dump handler at the top of `main`, or from a module
+/// constructor when the module has no `main`.
+fn register_at_exit<'a>(module: &Module<'a>, builder: &Builder<'a>, dump: FunctionValue<'a>) {
+    let cx = module.get_context();
+    let i32_type = cx.i32_type();
+    let ptr_type = cx.i8_type().ptr_type(AddressSpace::default());
+
+    let atexit = module.get_function("atexit").unwrap_or_else(|| {
+        module.add_function("atexit", i32_type.fn_type(&[ptr_type.into()], false), None)
+    });
+    // Cast to the parameter type of the declaration, which is `void ()*`
+    // rather than `i8*` if the program calls atexit itself and the module
+    // still has typed pointers.
+    let handler_type = atexit.get_type().get_param_types()[0].into_pointer_type();
+    let handler = dump
+        .as_global_value()
+        .as_pointer_value()
+        .const_cast(handler_type);
+
+    if let Some(main) = module
+        .get_function("main")
+        .filter(|main| main.count_basic_blocks() > 0)
+    {
+        let entry = main.get_first_basic_block().unwrap();
+        builder.position_before(&entry.get_first_instruction().unwrap());
+        builder.build_call(atexit, &[handler.into()], "");
+        return;
+    }
+
+    if module.get_global("llvm.global_ctors").is_some() {
+        log::warn!(
+            "{:?} already has constructors, its counts will not be printed",
+            module.get_name()
+        );
+        return;
+    }
+
+    let init = module.add_function(
+        "__kpc_icount_init",
+        cx.void_type().fn_type(&[], false),
+        Some(Linkage::Internal),
+    );
+    builder.position_at_end(cx.append_basic_block(init, "entry"));
+    builder.build_call(atexit, &[handler.into()], "");
+    builder.build_return(None);
+
+    // The verifier wants the constructor as a `void ()*`, not an `i8*`,
+    // when pointers are typed.
+    let init_pointer = init.as_global_value().as_pointer_value();
+    let ctor_type = cx.struct_type(
+        &[
+            i32_type.into(),
+            init_pointer.get_type().into(),
+            ptr_type.into(),
+        ],
+        false,
+    );
+    let ctor = ctor_type.const_named_struct(&[
+        i32_type.const_int(65535, false).into(),
+        init_pointer.into(),
+        ptr_type.const_null().into(),
+    ]);
+    let ctors = module.add_global(ctor_type.array_type(1), None, "llvm.global_ctors");
+    ctors.set_linkage(Linkage::Appending);
+    ctors.set_initializer(&ctor_type.const_array(&[ctor]));
 }
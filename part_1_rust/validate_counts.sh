@@ -0,0 +1,82 @@
+#!/usr/bin/bash
+
+# Compares the counting mode of the pass (KPC_PASS_MODE=count) with callgrind
+# on the test programs: instructions per function, their totals, and the
+# run time of each.
+
+CLANG_COMMAND="clang"
+if ! command -v $CLANG_COMMAND; then
+	CLANG_COMMAND="clang-15"
+fi
+
+cargo build || exit
+
+test_projects=(
+	"test_1.c"
+	"test_2.c"
+	"test_3.c"
+)
+
+function my_exit() {
+	echo "ERROR: $1"
+	exit 1
+}
+
+function now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+for i in "${test_projects[@]}"; do
+	printf "\n****************************\n"
+	printf "\nValidating $i\n"
+	KPC_PASS_MODE=count $CLANG_COMMAND -O0 -g -fpass-plugin=target/debug/libpart_1_rust.so ../test_files/"$i" -o counted.out || my_exit "Failed to compile $i with counters"
+	$CLANG_COMMAND -O0 -g ../test_files/"$i" -o plain.out || my_exit "Failed to compile $i"
+
+	start=$(now_ms)
+	./counted.out 2>counts.txt >/dev/null
+	counted_ms=$(($(now_ms) - start))
+	grep -q '^kpc_count_total ' counts.txt || my_exit "$i printed no counts"
+
+	start=$(now_ms)
+	valgrind --tool=callgrind --callgrind-out-file=callgrind_output ./plain.out &>/dev/null || my_exit "Failed to execute valgrind on $i: Status $?"
+	callgrind_ms=$(($(now_ms) - start))
+	callgrind_annotate --threshold=100 callgrind_output >callgrind_functions.txt || my_exit "Failed to annotate the callgrind output of $i"
+
+	# Callgrind also counts the C library and the dynamic loader, so only the
+	# functions the pass instrumented are compared.
+	awk '
+		FNR == NR {
+			if ($1 == "kpc_count") pass[$2] = $3
+			else if ($1 == "kpc_count_total") pass_total += $3
+			next
+		}
+		{
+			line = $0
+			gsub(",", "", line)
+			if (line ~ /PROGRAM TOTALS/) {
+				split(line, fields, " ")
+				program_total = fields[1]
+			} else if (match(line, /^ *[0-9]+/)) {
+				count = substr(line, RSTART, RLENGTH) + 0
+				if (match(line, /:[^ :]+ \[/)) {
+					name = substr(line, RSTART + 1, RLENGTH - 3)
+					if (name in pass) grind[name] += count
+				}
+			}
+		}
+		END {
+			printf "\n%-24s %14s %14s %8s\n", "function", "pass", "callgrind", "ratio"
+			for (name in pass) {
+				grind_total += grind[name]
+				printf "%-24s %14d %14d %8s\n", name, pass[name], grind[name],
+					grind[name] ? sprintf("%.2f", pass[name] / grind[name]) : "-"
+			}
+			printf "%-24s %14d %14d %8s\n", "total", pass_total, grind_total,
+				grind_total ? sprintf("%.2f", pass_total / grind_total) : "-"
+			printf "\nCallgrind program total (with libraries): %d\n", program_total
+		}
+	' counts.txt callgrind_functions.txt
+
+	printf "Run time: %d ms counted, %d ms under callgrind\n" "$counted_ms" "$callgrind_ms"
+	rm callgrind_output callgrind_functions.txt counts.txt counted.out plain.out
+done
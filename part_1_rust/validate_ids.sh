@@ -0,0 +1,134 @@
+#!/usr/bin/bash
+
+# Builds a program from two source files three times, first compiled one by
+# one into a shared dictionary (KPC_PASS_DICT), then instrumented once at the
+# end of full LTO (KPC_PASS_LTO=1, needs lld), then compiled one by one in
+# latency mode and linked with its runtime, and checks each time that both
+# files are in the dictionary and that every br_N the program prints is
+# listed exactly once in it. b.c branches on && and ||, whose successors
+# start with a PHI node the inserted calls have to follow.
+
+CLANG_COMMAND="clang"
+if ! command -v $CLANG_COMMAND; then
+	CLANG_COMMAND="clang-15"
+fi
+
+cargo build || exit
+PLUGIN=$(realpath target/debug/libpart_1_rust.so)
+RUNTIME=$(realpath runtime/kpc_latency.c)
+
+function my_exit() {
+	echo "ERROR: $1"
+	exit 1
+}
+
+# Fails if an id is listed more than once in dictionary $1, an id printed in
+# trace $2 is not listed, nothing was printed, or a file is not listed.
+function check_ids() {
+	awk '
+		FNR == NR {
+			if (match($0, /: br_[0-9]+ /)) listed[substr($0, RSTART + 5, RLENGTH - 6)]++
+			files[$1] = 1
+			next
+		}
+		/^br_[0-9]+$/ { printed[substr($0, 4)] = 1 }
+		END {
+			failed = 0
+			if (!("a.c" in files) || !("b.c" in files)) {
+				print "a.c and b.c are not both listed"
+				failed = 1
+			}
+			if (length(printed) == 0) {
+				print "the program printed no ids"
+				failed = 1
+			}
+			for (id in listed) {
+				if (listed[id] > 1) {
+					print "br_" id " is listed " listed[id] " times"
+					failed = 1
+				}
+			}
+			for (id in printed) {
+				if (!(id in listed)) {
+					print "br_" id " is not listed"
+					failed = 1
+				}
+			}
+			exit failed
+		}
+	' "$1" "$2"
+}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+cat >"$WORK_DIR/a.c" <<'EOF'
+int count_odd(int n);
+int in_range(int n, int low, int high);
+
+int main(int argc, char **argv) {
+	int total = 0;
+	for (int i = 0; i < argc + 4; i++) {
+		if (i % 3 == 0) {
+			total += count_odd(i);
+		}
+		total += in_range(i, 2, 4);
+	}
+	return total > 100;
+}
+EOF
+cat >"$WORK_DIR/b.c" <<'EOF'
+int count_odd(int n) {
+	int odd = 0;
+	for (int i = 0; i < n; i++) {
+		if (i % 2) {
+			odd++;
+		}
+	}
+	return odd;
+}
+
+int in_range(int n, int low, int high) {
+	if (n >= low && n <= high) {
+		return 1;
+	}
+	int outside = n < low || n > high;
+	return -outside;
+}
+EOF
+cd "$WORK_DIR" || exit
+
+printf "\n****************************\n"
+printf "\nSeparate compilation\n"
+for i in a b; do
+	KPC_PASS_DICT=dictionary.txt $CLANG_COMMAND -O0 -g -fpass-plugin="$PLUGIN" -c $i.c -o $i.o || my_exit "Failed to compile $i.c"
+done
+$CLANG_COMMAND a.o b.o -o separate.out || my_exit "Failed to link a.o and b.o"
+./separate.out >trace.txt
+cat dictionary.txt
+check_ids dictionary.txt trace.txt || my_exit "The modules' ids clash"
+printf "\n%d distinct ids printed, all listed once\n" "$(sort -u trace.txt | grep -c '^br_')"
+
+printf "\n****************************\n"
+printf "\nFull LTO\n"
+rm -f dictionary.txt
+for i in a b; do
+	KPC_PASS_LTO=1 $CLANG_COMMAND -O0 -g -flto -fpass-plugin="$PLUGIN" -c $i.c -o $i.lto.o || my_exit "Failed to compile $i.c"
+done
+KPC_PASS_LTO=1 KPC_PASS_DICT=dictionary.txt $CLANG_COMMAND -flto -fuse-ld=lld -Wl,--load-pass-plugin="$PLUGIN" a.lto.o b.lto.o -o lto.out || my_exit "Failed to link a.lto.o and b.lto.o"
+./lto.out >trace.txt
+cat dictionary.txt
+check_ids dictionary.txt trace.txt || my_exit "The merged module's ids clash"
+printf "\n%d distinct ids printed, all listed once\n" "$(sort -u trace.txt | grep -c '^br_')"
+
+printf "\n****************************\n"
+printf "\nLatency, separate compilation\n"
+rm -f dictionary.txt
+for i in a b; do
+	KPC_PASS_MODE=latency KPC_PASS_DICT=dictionary.txt $CLANG_COMMAND -O0 -g -fpass-plugin="$PLUGIN" -c $i.c -o $i.latency.o || my_exit "Failed to compile $i.c"
+done
+$CLANG_COMMAND a.latency.o b.latency.o "$RUNTIME" -o latency.out || my_exit "Failed to link a.latency.o and b.latency.o"
+./latency.out >latency.txt
+cat dictionary.txt latency.txt
+awk '$1 == "latency" { print $2 }' latency.txt >trace.txt
+check_ids dictionary.txt trace.txt || my_exit "The latency histograms' ids clash"
+printf "\n%d ids have histograms, all listed once\n" "$(wc -l <trace.txt)"
@@ -0,0 +1,129 @@
+
+#include "AnalysisIR.h"
+
+#include <algorithm>
+#include <cstring>
+
+void *Arena::allocateSlow(size_t size, size_t align) {
+  const size_t chunkSize = std::max(CHUNK_SIZE, size + align);
+  chunks.emplace_back(new char[chunkSize]);
+  bytesAllocated += chunkSize;
+  cursor = chunks.back().get();
+  end = cursor + chunkSize;
+  return allocate(size, align);
+}
+
+std::string_view Arena::copyString(std::string_view text) {
+  char *copy = static_cast<char *>(allocate(text.size() + 1, 1));
+  std::memcpy(copy, text.data(), text.size());
+  copy[text.size()] = '\0';
+  return std::string_view(copy, text.size());
+}
+
+std::string_view StringPool::intern(std::string_view text) {
+  std::unordered_set<std::string_view>::const_iterator found =
+      strings.find(text);
+  if (found != strings.end()) {
+    return *found;
+  }
+  return *strings.insert(arena.copyString(text)).first;
+}
+
+void BranchSpans::append(const BranchSpans &other) {
+  const unsigned base = targets.size();
+  for (Branch branch : other.branches) {
+    branch.firstTarget += base;
+    branches.push_back(branch);
+  }
+  targets.insert(targets.end(), other.targets.begin(), other.targets.end());
+}
+
+void BranchTable::build(const BranchSpans &completed,
+                        const std::vector<unsigned> &ids) {
+  branches.clear();
+  targetLines.clear();
+  targetIds.clear();
+
+  std::vector<unsigned> order(completed.branches.size());
+  for (unsigned branch = 0; branch < order.size(); branch++) {
+    order[branch] = branch;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return completed.branches[a].line < completed.branches[b].line;
+  });
+
+  std::vector<std::pair<unsigned, unsigned>> targets;
+  for (unsigned index : order) {
+    const Branch &branch = completed.branches[index];
+    if (!branches.empty() && branches.back().line == branch.line) {
+      continue;
+    }
+
+    targets.clear();
+    for (unsigned target = branch.firstTarget;
+         target < branch.firstTarget + branch.numTargets; target++) {
+      targets.emplace_back(completed.targets[target], ids[target]);
+    }
+    std::stable_sort(targets.begin(), targets.end(),
+                     [](const std::pair<unsigned, unsigned> &a,
+                        const std::pair<unsigned, unsigned> &b) {
+                       return a.first < b.first;
+                     });
+
+    Branch entry = branch;
+    entry.firstTarget = targetLines.size();
+    entry.numTargets = 0;
+    for (size_t target = 0; target < targets.size(); target++) {
+      if (target + 1 < targets.size() &&
+          targets[target + 1].first == targets[target].first) {
+        continue;
+      }
+      targetLines.push_back(targets[target].first);
+      targetIds.push_back(targets[target].second);
+      entry.numTargets++;
+    }
+    branches.push_back(entry);
+  }
+}
+
+const BranchTable::Branch *BranchTable::find(unsigned line) const {
+  std::vector<Branch>::const_iterator branch = std::lower_bound(
+      branches.begin(), branches.end(), line,
+      [](const Branch &branch, unsigned line) { return branch.line < line; });
+  return branch != branches.end() && branch->line == line ? &*branch
+                                                          : nullptr;
+}
+
+unsigned BranchTable::countInRange(unsigned first, unsigned last) const {
+  if (last <= first) {
+    return 0;
+  }
+  auto lineBefore = [](const Branch &branch, unsigned line) {
+    return branch.line < line;
+  };
+  return std::lower_bound(branches.begin(), branches.end(), last,
+                          lineBefore) -
+         std::lower_bound(branches.begin(), branches.end(), first,
+                          lineBefore);
+}
+
+unsigned BranchTable::findTarget(const Branch &branch, unsigned line) const {
+  for (unsigned target = 0; target < branch.numTargets; target++) {
+    if (getTargetLine(branch, target) == line) {
+      return getTargetId(branch, target);
+    }
+  }
+  return 0;
+}
+
+unsigned BranchTable::getMaxId() const {
+  return targetIds.empty()
+             ? 0
+             : *std::max_element(targetIds.begin(), targetIds.end());
+}
+
+void BranchTable::offsetIds(unsigned offset) {
+  for (unsigned &id : targetIds) {
+    id += offset;
+  }
+}
@@ -0,0 +1,186 @@
+
+#ifndef ANALYSIS_IR__H
+#define ANALYSIS_IR__H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Bump-pointer allocator for the records of one analysis session. Objects
+// are carved out of large chunks and never destroyed individually; all of
+// them go away with the arena, so only trivially destructible types may be
+// created in it.
+class Arena {
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+
+  char *cursor;
+
+  char *end;
+
+  size_t bytesAllocated;
+
+  void *allocateSlow(size_t size, size_t align);
+
+public:
+  Arena() : cursor(nullptr), end(nullptr), bytesAllocated(0) {}
+
+  Arena(const Arena &) = delete;
+
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t align) {
+    char *aligned = reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(align - 1));
+    if (cursor == nullptr || aligned + size > end) {
+      return allocateSlow(size, align);
+    }
+    cursor = aligned + size;
+    return aligned;
+  }
+
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena objects are never destroyed");
+    return new (allocate(sizeof(T), alignof(T)))
+        T{std::forward<Args>(args)...};
+  }
+
+  // Copies text into the arena; the view stays valid as long as the arena.
+  std::string_view copyString(std::string_view text);
+
+  // Bytes reserved from the system, including the unused tail of the
+  // current chunk.
+  size_t getBytesAllocated() const { return bytesAllocated; }
+};
+
+// Interns strings in an arena: equal strings share one copy, so records can
+// hold views and be compared by pointer.
+class StringPool {
+  Arena &arena;
+
+  std::unordered_set<std::string_view> strings;
+
+public:
+  explicit StringPool(Arena &arena) : arena(arena) {}
+
+  std::string_view intern(std::string_view text);
+};
+
+// A function definition of the analyzed file. Lines include the offset of
+// removed include directives.
+struct FunctionRecord {
+  unsigned defLoc;
+  unsigned endLoc;
+  std::string_view name;
+  std::string_view type;
+  bool recursive;
+
+  bool isInBody(unsigned lineNum) const {
+    return lineNum >= defLoc && lineNum <= endLoc;
+  }
+};
+
+// Completed branch points in the order traversal closed them. Targets of
+// all branch points share one array; each branch point owns a span of it.
+struct BranchSpans {
+  struct Branch {
+    unsigned line;
+    unsigned firstTarget;
+    unsigned numTargets;
+    const FunctionRecord *function;
+    // Where the statement starts and ends (the column after its last
+    // character), for code wrapped around it.
+    unsigned column;
+    unsigned endLine;
+    unsigned endColumn;
+    // A switch jumps straight to its cases, so the code marking it reached
+    // goes before the statement rather than at the start of its body.
+    bool isSwitch;
+    bool isLoop;
+  };
+
+  std::vector<Branch> branches;
+
+  std::vector<unsigned> targets;
+
+  // Adds branch with branchTargets as its targets; its span is ignored.
+  void add(Branch branch, const std::vector<unsigned> &branchTargets) {
+    branch.firstTarget = targets.size();
+    branch.numTargets = branchTargets.size();
+    branches.push_back(branch);
+    targets.insert(targets.end(), branchTargets.begin(), branchTargets.end());
+  }
+
+  // Appends the branch points of other, rebasing their spans.
+  void append(const BranchSpans &other);
+
+  void clear() {
+    std::vector<Branch>().swap(branches);
+    std::vector<unsigned>().swap(targets);
+  }
+};
+
+// The branch dictionary: one entry per branch point line, sorted by line,
+// with target lines and br_N ids in two parallel arrays so the transformer
+// can walk the file and the table together.
+class BranchTable {
+public:
+  using Branch = BranchSpans::Branch;
+
+  using const_iterator = std::vector<Branch>::const_iterator;
+
+private:
+  std::vector<Branch> branches;
+
+  std::vector<unsigned> targetLines;
+
+  std::vector<unsigned> targetIds;
+
+public:
+  static std::string formatId(unsigned id) {
+    return "br_" + std::to_string(id);
+  }
+
+  // Builds the table from completed branch points and the id of each of
+  // their targets. When branch points share a line the first completed one
+  // is kept; when targets share a line the last id is kept.
+  void build(const BranchSpans &completed, const std::vector<unsigned> &ids);
+
+  bool empty() const { return branches.empty(); }
+
+  const_iterator begin() const { return branches.begin(); }
+
+  const_iterator end() const { return branches.end(); }
+
+  // Branch point on line, or nullptr.
+  const Branch *find(unsigned line) const;
+
+  // Number of branch points on lines [first, last).
+  unsigned countInRange(unsigned first, unsigned last) const;
+
+  unsigned getTargetLine(const Branch &branch, unsigned target) const {
+    return targetLines[branch.firstTarget + target];
+  }
+
+  unsigned getTargetId(const Branch &branch, unsigned target) const {
+    return targetIds[branch.firstTarget + target];
+  }
+
+  // Id of branch's target on line, or 0 if line is not one of its targets.
+  unsigned findTarget(const Branch &branch, unsigned line) const;
+
+  unsigned getMaxId() const;
+
+  void offsetIds(unsigned offset);
+};
+
+#endif
@@ -0,0 +1,484 @@
+
+#include "AnalysisServer.h"
+#include "Common.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+// Requests are flat JSON objects; values are kept as their raw text for
+// numbers and literals and unescaped for strings.
+typedef std::map<std::string, std::string> Request;
+
+void skipSpace(const std::string &text, size_t &pos) {
+  while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+    pos++;
+  }
+}
+
+bool parseString(const std::string &text, size_t &pos, std::string &out) {
+  if (pos >= text.size() || text[pos] != '"') {
+    return false;
+  }
+  for (pos++; pos < text.size(); pos++) {
+    char c = text[pos];
+    if (c == '"') {
+      pos++;
+      return true;
+    }
+    if (c != '\\') {
+      out += c;
+      continue;
+    }
+    if (++pos >= text.size()) {
+      return false;
+    }
+    switch (text[pos]) {
+    case 'n':
+      out += '\n';
+      break;
+    case 't':
+      out += '\t';
+      break;
+    case 'r':
+      out += '\r';
+      break;
+    case 'b':
+      out += '\b';
+      break;
+    case 'f':
+      out += '\f';
+      break;
+    case 'u': {
+      if (pos + 4 >= text.size()) {
+        return false;
+      }
+      const unsigned code = std::strtoul(text.substr(pos + 1, 4).c_str(),
+                                         nullptr, 16);
+      out += code < 0x80 ? static_cast<char>(code) : '?';
+      pos += 4;
+      break;
+    }
+    default:
+      out += text[pos];
+      break;
+    }
+  }
+  return false;
+}
+
+bool parseRequest(const std::string &text, Request &request) {
+  size_t pos = 0;
+  skipSpace(text, pos);
+  if (pos >= text.size() || text[pos++] != '{') {
+    return false;
+  }
+  skipSpace(text, pos);
+  if (pos < text.size() && text[pos] == '}') {
+    return true;
+  }
+  while (pos < text.size()) {
+    std::string key, value;
+    skipSpace(text, pos);
+    if (!parseString(text, pos, key)) {
+      return false;
+    }
+    skipSpace(text, pos);
+    if (pos >= text.size() || text[pos++] != ':') {
+      return false;
+    }
+    skipSpace(text, pos);
+    if (pos < text.size() && text[pos] == '"') {
+      if (!parseString(text, pos, value)) {
+        return false;
+      }
+    } else {
+      while (pos < text.size() && text[pos] != ',' && text[pos] != '}' &&
+             !isspace(static_cast<unsigned char>(text[pos]))) {
+        value += text[pos++];
+      }
+      if (value.empty()) {
+        return false;
+      }
+    }
+    request[key] = value;
+    skipSpace(text, pos);
+    if (pos < text.size() && text[pos] == ',') {
+      pos++;
+      continue;
+    }
+    return pos < text.size() && text[pos] == '}';
+  }
+  return false;
+}
+
+std::string quote(const std::string &text) {
+  std::string out("\"");
+  for (char c : text) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+  return out + "\"";
+}
+
+// The id is echoed back verbatim, so numbers stay numbers.
+std::string replyId(const Request &request) {
+  Request::const_iterator id = request.find("id");
+  if (id == request.end()) {
+    return "null";
+  }
+  const std::string &value = id->second;
+  const bool numeric =
+      !value.empty() &&
+      value.find_first_not_of("-0123456789.eE+") == std::string::npos;
+  return numeric ? value : quote(value);
+}
+
+std::string errorReply(const std::string &id, const std::string &message) {
+  return "{\"id\":" + id + ",\"ok\":false,\"error\":" + quote(message) + "}";
+}
+
+bool sendAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t written =
+        send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    sent += written;
+  }
+  return true;
+}
+
+} // namespace
+
+AnalysisServer::AnalysisServer(Session &session, const std::string &socketPath,
+                               unsigned numWorkers)
+    : session(session), socketPath(socketPath), numWorkers(numWorkers),
+      listenFd(-1), stopping(false) {
+  sockaddr_un address;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    error = "Socket path " + socketPath + " is too long!";
+    return;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath.c_str());
+
+  unlink(socketPath.c_str());
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0 ||
+      bind(listenFd, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      listen(listenFd, SOMAXCONN) < 0) {
+    error = "Could not listen on " + socketPath + ": " + strerror(errno) + "!";
+    if (listenFd >= 0) {
+      close(listenFd);
+      listenFd = -1;
+    }
+  }
+}
+
+AnalysisServer::~AnalysisServer() {
+  if (listenFd >= 0) {
+    close(listenFd);
+  }
+  unlink(socketPath.c_str());
+}
+
+std::shared_ptr<AnalysisServer::CachedUnit>
+AnalysisServer::getUnit(const std::string &filename,
+                        std::unique_lock<std::mutex> &unitLock,
+                        std::string &error) {
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    error = "File with name: " + filename + ", does not exist!";
+    return nullptr;
+  }
+
+  std::shared_ptr<CachedUnit> unit;
+  {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    std::shared_ptr<CachedUnit> &entry = cache[filename];
+    if (entry == nullptr) {
+      entry = std::make_shared<CachedUnit>();
+    }
+    unit = entry;
+  }
+
+  unitLock = std::unique_lock<std::mutex>(unit->lock);
+  // A collector that has failed since is rebuilt as well.
+  if (unit->kpc != nullptr && unit->kpc->isParsed() &&
+      unit->mtime == info.st_mtime &&
+      unit->size == info.st_size) {
+    return unit;
+  }
+
+  unit->taint.reset();
+  unit->kpc = std::make_unique<KeyPointsCollector>(session, filename);
+  if (!unit->kpc->isParsed() || !unit->kpc->collectCursors(numWorkers)) {
+    // Keep nothing, so the next request parses the file again.
+    error = unit->kpc->getError();
+    unit->kpc.reset();
+    return nullptr;
+  }
+  unit->taint = std::make_unique<TaintAnalysis>(
+      session, unit->kpc->getTU(), filename,
+      unit->kpc->getNumIncludeDirectives());
+  unit->taint->run();
+
+  unit->mtime = info.st_mtime;
+  unit->size = info.st_size;
+  return unit;
+}
+
+std::string AnalysisServer::analyze(CachedUnit &unit) {
+  std::stringstream reply;
+
+  reply << ",\"branches\":[";
+  bool first = true;
+  const BranchTable &branchTable = unit.kpc->getBranchTable();
+  for (const BranchTable::Branch &BP : branchTable) {
+    for (unsigned target = 0; target < BP.numTargets; target++) {
+      reply << (first ? "" : ",") << "{\"id\":"
+            << quote(BranchTable::formatId(branchTable.getTargetId(BP, target)))
+            << ",\"line\":" << BP.line
+            << ",\"target\":" << branchTable.getTargetLine(BP, target) << "}";
+      first = false;
+    }
+  }
+
+  reply << "],\"calls\":[";
+  first = true;
+  for (const std::pair<const unsigned, std::string> &call :
+       unit.kpc->getFuncCalls()) {
+    reply << (first ? "" : ",") << "{\"line\":" << call.first
+          << ",\"callee\":" << quote(call.second) << "}";
+    first = false;
+  }
+
+  reply << "],\"functions\":[";
+  const CallGraph &callGraph = unit.kpc->getCallGraph();
+  for (unsigned id = 0; id < callGraph.size(); id++) {
+    const std::string &name = callGraph.getName(id);
+    const CallGraph::Summary *summary = callGraph.getSummary(name);
+    reply << (id ? "," : "") << "{\"name\":" << quote(name);
+    if (summary != nullptr) {
+      reply << ",\"recursive\":" << (summary->recursive ? "true" : "false")
+            << ",\"branches\":" << summary->branches.toVector().size()
+            << ",\"inputs\":[";
+      bool firstInput = true;
+      for (const std::string &input : summary->inputs) {
+        reply << (firstInput ? "" : ",") << quote(input);
+        firstInput = false;
+      }
+      reply << "]";
+    }
+    reply << "}";
+  }
+
+  reply << "],\"inputDependent\":[";
+  first = true;
+  for (const TaintAnalysis::BranchTaint &branch : unit.taint->getBranches()) {
+    if (branch.sources.empty()) {
+      continue;
+    }
+    reply << (first ? "" : ",") << "{\"line\":" << branch.line
+          << ",\"vars\":[";
+    for (size_t var = 0; var < branch.vars.size(); var++) {
+      reply << (var ? "," : "") << quote(branch.vars[var]);
+    }
+    reply << "],\"sources\":[";
+    for (size_t i = 0; i < branch.sources.size(); i++) {
+      const TaintAnalysis::Source &source =
+          unit.taint->getSources()[branch.sources[i]];
+      reply << (i ? "," : "") << "{\"kind\":" << quote(source.kind)
+            << ",\"var\":" << quote(source.var)
+            << ",\"line\":" << source.line << "}";
+    }
+    reply << "]}";
+    first = false;
+  }
+  reply << "]";
+
+  return reply.str();
+}
+
+std::string AnalysisServer::transform(CachedUnit &unit) {
+  if (!unit.kpc->transformProgram()) {
+    return "";
+  }
+  return ",\"output\":" + quote(unit.kpc->getModifiedProgramPath());
+}
+
+std::string AnalysisServer::queryBranch(CachedUnit &unit, unsigned line) {
+  std::stringstream reply;
+  const BranchTable &branchTable = unit.kpc->getBranchTable();
+  const BranchTable::Branch *BP = branchTable.find(line);
+  if (BP == nullptr) {
+    return "";
+  }
+
+  reply << ",\"line\":" << line << ",\"targets\":[";
+  bool first = true;
+  for (unsigned target = 0; target < BP->numTargets; target++) {
+    reply << (first ? "" : ",") << "{\"id\":"
+          << quote(BranchTable::formatId(branchTable.getTargetId(*BP, target)))
+          << ",\"line\":" << branchTable.getTargetLine(*BP, target) << "}";
+    first = false;
+  }
+
+  reply << "],\"sources\":[";
+  first = true;
+  for (const TaintAnalysis::BranchTaint &branch : unit.taint->getBranches()) {
+    if (branch.line != line) {
+      continue;
+    }
+    for (unsigned source : branch.sources) {
+      const TaintAnalysis::Source &input = unit.taint->getSources()[source];
+      reply << (first ? "" : ",") << "{\"kind\":" << quote(input.kind)
+            << ",\"var\":" << quote(input.var)
+            << ",\"line\":" << input.line << "}";
+      first = false;
+    }
+  }
+  reply << "]";
+
+  return reply.str();
+}
+
+std::string AnalysisServer::handleRequest(const std::string &line) {
+  Request request;
+  if (!parseRequest(line, request)) {
+    return errorReply("null", "Malformed request");
+  }
+  const std::string id = replyId(request);
+  const std::string cmd = request["cmd"];
+
+  if (cmd == "shutdown") {
+    stopping = true;
+    ::shutdown(listenFd, SHUT_RDWR);
+    return "{\"id\":" + id + ",\"ok\":true}";
+  }
+
+  if (cmd != "analyze" && cmd != "transform" && cmd != "branch") {
+    return errorReply(id, "Unknown command: " + cmd);
+  }
+  if (request["file"].empty()) {
+    return errorReply(id, "Missing file");
+  }
+
+  std::string error;
+  std::unique_lock<std::mutex> unitLock;
+  std::shared_ptr<CachedUnit> unit =
+      getUnit(request["file"], unitLock, error);
+  if (unit == nullptr) {
+    return errorReply(id, error);
+  }
+
+  std::string body;
+  if (cmd == "analyze") {
+    body = analyze(*unit);
+  } else if (cmd == "transform") {
+    body = transform(*unit);
+    if (body.empty()) {
+      return errorReply(id, unit->kpc->getError());
+    }
+  } else {
+    const int branchLine = std::atoi(request["line"].c_str());
+    body = queryBranch(*unit, branchLine > 0 ? branchLine : 0);
+    if (body.empty()) {
+      return errorReply(id, "No branch point at line " + request["line"]);
+    }
+  }
+  return "{\"id\":" + id + ",\"ok\":true" + body + "}";
+}
+
+void AnalysisServer::serveConnection(int clientFd) {
+  std::string pending;
+  char buffer[4096];
+  bool open = true;
+  while (open) {
+    const ssize_t received = recv(clientFd, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      break;
+    }
+    pending.append(buffer, received);
+    size_t newline;
+    while (open && (newline = pending.find('\n')) != std::string::npos) {
+      const std::string line = pending.substr(0, newline);
+      pending.erase(0, newline + 1);
+      if (line.find_first_not_of(" \t\r") != std::string::npos) {
+        open = sendAll(clientFd, handleRequest(line) + "\n");
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(connectionsLock);
+  close(clientFd);
+  clientFds.erase(clientFd);
+  connectionsDone.notify_all();
+}
+
+bool AnalysisServer::run() {
+  if (listenFd < 0) {
+    return false;
+  }
+  session.print("Listening on ", socketPath, '\n');
+  while (!stopping) {
+    const int clientFd = accept(listenFd, nullptr, nullptr);
+    if (clientFd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    std::lock_guard<std::mutex> guard(connectionsLock);
+    clientFds.insert(clientFd);
+    std::thread(&AnalysisServer::serveConnection, this, clientFd).detach();
+  }
+
+  // Let idle clients see end-of-file, then wait for requests in flight.
+  std::unique_lock<std::mutex> guard(connectionsLock);
+  for (int clientFd : clientFds) {
+    ::shutdown(clientFd, SHUT_RD);
+  }
+  connectionsDone.wait(guard, [this]() { return clientFds.empty(); });
+  return true;
+}
@@ -0,0 +1,96 @@
+
+#ifndef ANALYSIS_SERVER__H
+#define ANALYSIS_SERVER__H
+
+#include "KeyPointsCollector.h"
+#include "Session.h"
+#include "TaintAnalysis.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+// Long-lived analysis daemon. Listens on a Unix domain socket and answers
+// one JSON object per line:
+//
+//   {"id": 1, "cmd": "analyze",   "file": "prog.c"}
+//   {"id": 2, "cmd": "transform", "file": "prog.c"}
+//   {"id": 3, "cmd": "branch",    "file": "prog.c", "line": 12}
+//   {"id": 4, "cmd": "shutdown"}
+//
+// Every reply is a single JSON line carrying the request id and "ok". Parsed
+// translation units and their analyses are cached per file and reused until
+// the file's size or modification time changes; each cached file has its own
+// collector and libclang index. Each connection is served on its own thread
+// and requests for different files proceed in parallel.
+class AnalysisServer {
+
+  Session &session;
+
+  const std::string socketPath;
+
+  unsigned numWorkers;
+
+  int listenFd;
+
+  std::atomic<bool> stopping;
+
+  // Open client sockets; run() waits for all of them to close before it
+  // returns so no connection thread outlives the server.
+  std::mutex connectionsLock;
+
+  std::condition_variable connectionsDone;
+
+  std::set<int> clientFds;
+
+  std::string error;
+
+  struct CachedUnit {
+    std::mutex lock;
+    std::unique_ptr<KeyPointsCollector> kpc;
+    std::unique_ptr<TaintAnalysis> taint;
+    time_t mtime;
+    off_t size;
+
+    CachedUnit() : mtime(0), size(0) {}
+  };
+
+  std::mutex cacheLock;
+
+  std::map<std::string, std::shared_ptr<CachedUnit>> cache;
+
+  // Returns the up-to-date analysis of filename, (re)building it if needed,
+  // with the entry's lock held by the caller through unitLock.
+  std::shared_ptr<CachedUnit> getUnit(const std::string &filename,
+                                      std::unique_lock<std::mutex> &unitLock,
+                                      std::string &error);
+
+  void serveConnection(int clientFd);
+
+  std::string handleRequest(const std::string &line);
+
+  std::string analyze(CachedUnit &unit);
+
+  std::string transform(CachedUnit &unit);
+
+  std::string queryBranch(CachedUnit &unit, unsigned line);
+
+public:
+  AnalysisServer(Session &session, const std::string &socketPath,
+                 unsigned numWorkers = 1);
+
+  ~AnalysisServer();
+
+  // Accepts connections until a shutdown request arrives. Returns false if
+  // the socket could not be set up; getError() says why.
+  bool run();
+
+  const std::string &getError() const { return error; }
+};
+
+#endif
@@ -0,0 +1,184 @@
+
+#include "BranchDictionary.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char BranchDictionary::MAGIC[8];
+
+bool BranchDictionary::write(const std::string &path, const std::string &source,
+                             const std::vector<Entry> &entries) {
+  std::string strings;
+  std::map<std::string, uint32_t> interned;
+  auto intern = [&](const std::string &str) {
+    auto found = interned.find(str);
+    if (found != interned.end()) {
+      return found->second;
+    }
+    const uint32_t offset = strings.size();
+    strings += str;
+    strings += '\0';
+    interned.emplace(str, offset);
+    return offset;
+  };
+
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.recordSize = sizeof(Record);
+  header.source = intern(source);
+
+  unsigned maxId = 0;
+  for (const Entry &entry : entries) {
+    maxId = std::max(maxId, entry.id);
+  }
+  std::vector<Record> records(entries.empty() ? 0 : maxId + 1, Record{});
+  for (const Entry &entry : entries) {
+    records[entry.id] = Record{intern(entry.file), intern(entry.function),
+                               entry.branchLine, entry.targetLine};
+  }
+
+  header.numRecords = records.size();
+  header.recordsOffset = sizeof(Header);
+  header.stringsOffset = header.recordsOffset + records.size() * sizeof(Record);
+  header.stringsSize = strings.size();
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(records.data()),
+            records.size() * sizeof(Record));
+  out.write(strings.data(), strings.size());
+  return out.good();
+}
+
+BranchDictionary::BranchDictionary(const std::string &path)
+    : mapping(MAP_FAILED), mappingSize(0), header(nullptr), records(nullptr),
+      strings(nullptr) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "cannot open " + path;
+    return;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    mappingSize = info.st_size;
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (mapping == MAP_FAILED) {
+    error = "cannot map " + path;
+    return;
+  }
+  if (!validate()) {
+    error = path + ": " + error;
+    header = nullptr;
+  }
+}
+
+BranchDictionary::~BranchDictionary() {
+  if (mapping != MAP_FAILED) {
+    munmap(mapping, mappingSize);
+  }
+}
+
+bool BranchDictionary::validate() {
+  if (mappingSize < sizeof(Header)) {
+    error = "truncated header";
+    return false;
+  }
+  const char *base = static_cast<const char *>(mapping);
+  header = reinterpret_cast<const Header *>(base);
+  if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+    error = "not a branch dictionary";
+    return false;
+  }
+  if (header->version != VERSION || header->recordSize != sizeof(Record)) {
+    error = "unsupported version " + std::to_string(header->version);
+    return false;
+  }
+  // Each offset is checked against the mapping before a size is added to
+  // it, so crafted offsets near 2^64 cannot wrap around.
+  const uint64_t recordsSize = uint64_t(header->numRecords) * sizeof(Record);
+  if (header->recordsOffset < sizeof(Header) ||
+      header->recordsOffset % alignof(Record) != 0 ||
+      header->recordsOffset > mappingSize ||
+      recordsSize > mappingSize - header->recordsOffset ||
+      header->stringsOffset < header->recordsOffset + recordsSize ||
+      header->stringsOffset > mappingSize ||
+      header->stringsSize > mappingSize - header->stringsOffset ||
+      header->stringsSize == 0 ||
+      base[header->stringsOffset + header->stringsSize - 1] != '\0') {
+    error = "corrupt section table";
+    return false;
+  }
+  records = reinterpret_cast<const Record *>(base + header->recordsOffset);
+  strings = base + header->stringsOffset;
+
+  // Every string offset must land inside the table, so lookups need no
+  // further checks.
+  if (header->source >= header->stringsSize) {
+    error = "corrupt source name";
+    return false;
+  }
+  for (uint32_t id = 0; id < header->numRecords; id++) {
+    if (records[id].branchLine != 0 &&
+        (records[id].file >= header->stringsSize ||
+         records[id].function >= header->stringsSize)) {
+      error = "corrupt record for br_" + std::to_string(id);
+      return false;
+    }
+  }
+  return true;
+}
+
+const BranchDictionary::Record *BranchDictionary::find(unsigned id) const {
+  if (id >= header->numRecords || records[id].branchLine == 0) {
+    return nullptr;
+  }
+  return &records[id];
+}
+
+std::vector<BranchDictionary::Entry> BranchDictionary::getEntries() const {
+  std::vector<Entry> entries;
+  for (uint32_t id = 0; id < header->numRecords; id++) {
+    if (const Record *record = find(id)) {
+      entries.push_back(Entry{id, getString(record->file),
+                              getString(record->function), record->branchLine,
+                              record->targetLine});
+    }
+  }
+  return entries;
+}
+
+void BranchDictionary::exportText(std::ostream &out) const {
+  const std::string source(getSource());
+  out << "Branch Dictionary for: " << source << '\n';
+  out << "-----------------------" << std::string(source.size(), '-') << '\n';
+
+  // The text format lists branches by branch point line, then target line.
+  std::map<std::pair<std::string, unsigned>,
+           std::map<unsigned, std::vector<uint32_t>>>
+      ordered;
+  for (uint32_t id = 0; id < header->numRecords; id++) {
+    if (const Record *record = find(id)) {
+      ordered[{getString(record->file), record->branchLine}]
+             [record->targetLine]
+                 .push_back(id);
+    }
+  }
+  for (const auto &BP : ordered) {
+    for (const auto &target : BP.second) {
+      for (uint32_t id : target.second) {
+        out << "br_" << id << ": " << BP.first.first << ", " << BP.first.second
+            << ", " << target.first << '\n';
+      }
+    }
+  }
+}
@@ -0,0 +1,104 @@
+
+#ifndef BRANCH_DICTIONARY__H
+#define BRANCH_DICTIONARY__H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Binary branch dictionary (.bdict). Maps a br_N id to its file, function and
+// lines with a single array access, so trace decoders can mmap the file
+// instead of parsing the text dictionary. Layout, in host byte order:
+//
+//   Header   magic, version, record count, string table size and the offsets
+//            of both sections
+//   Records  one fixed-width Record per id, indexed by N; slot 0 and ids with
+//            no branch have branchLine == 0
+//   Strings  NUL-terminated source, file and function names, referenced by
+//            their offset in the table
+class BranchDictionary {
+public:
+  static constexpr char MAGIC[8] = {'K', 'P', 'C', 'B', 'D', 'I', 'C', 'T'};
+
+  static constexpr uint32_t VERSION = 1;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t numRecords;
+    uint32_t source;
+    uint64_t recordsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+  };
+
+  struct Record {
+    uint32_t file;
+    uint32_t function;
+    uint32_t branchLine;
+    uint32_t targetLine;
+  };
+
+  struct Entry {
+    unsigned id;
+    std::string file;
+    std::string function;
+    unsigned branchLine;
+    unsigned targetLine;
+  };
+
+  // Writes entries to path; source names what was analyzed (a file or a
+  // project directory). Returns false if the file could not be written.
+  static bool write(const std::string &path, const std::string &source,
+                    const std::vector<Entry> &entries);
+
+  // Maps path read-only. On failure isOpen() is false and getError() says
+  // why.
+  explicit BranchDictionary(const std::string &path);
+
+  ~BranchDictionary();
+
+  BranchDictionary(const BranchDictionary &) = delete;
+
+  BranchDictionary &operator=(const BranchDictionary &) = delete;
+
+  bool isOpen() const { return header != nullptr; }
+
+  const std::string &getError() const { return error; }
+
+  const char *getSource() const { return getString(header->source); }
+
+  // Number of record slots, i.e. the largest id plus one.
+  uint32_t size() const { return header->numRecords; }
+
+  // Record for br_<id>, or nullptr if the dictionary has no such branch.
+  const Record *find(unsigned id) const;
+
+  const char *getString(uint32_t offset) const { return strings + offset; }
+
+  // Every branch, in id order.
+  std::vector<Entry> getEntries() const;
+
+  // Writes the dictionary in the text format of writeOutputs().
+  void exportText(std::ostream &out) const;
+
+private:
+  void *mapping;
+
+  size_t mappingSize;
+
+  const Header *header;
+
+  const Record *records;
+
+  const char *strings;
+
+  std::string error;
+
+  bool validate();
+};
+
+#endif
@@ -0,0 +1,144 @@
+
+#include "CallGraph.h"
+
+#include <algorithm>
+
+unsigned CallGraph::addFunction(const std::string &name) {
+  if (MAP_FIND(ids, name)) {
+    return ids[name];
+  }
+  ids[name] = names.size();
+  names.push_back(name);
+  callees.emplace_back();
+  local.emplace_back();
+  return names.size() - 1;
+}
+
+void CallGraph::addCall(const std::string &caller, const std::string &callee) {
+  const unsigned from = addFunction(caller);
+  const unsigned to = addFunction(callee);
+  if (std::find(callees[from].begin(), callees[from].end(), to) ==
+      callees[from].end()) {
+    callees[from].push_back(to);
+  }
+}
+
+void CallGraph::addBranch(const std::string &function, unsigned branchId) {
+  local[addFunction(function)].branches.set(branchId);
+}
+
+void CallGraph::addInput(const std::string &function,
+                         const std::string &input) {
+  local[addFunction(function)].inputs.insert(input);
+}
+
+std::vector<std::string>
+CallGraph::getCallees(const std::string &name) const {
+  std::vector<std::string> result;
+  std::map<std::string, unsigned>::const_iterator it = ids.find(name);
+  if (it != ids.end()) {
+    for (unsigned callee : callees[it->second]) {
+      result.push_back(names[callee]);
+    }
+  }
+  return result;
+}
+
+void CallGraph::findComponents() {
+  // Iterative Tarjan so deep call chains cannot overflow the native stack.
+  const unsigned unvisited = ~0u;
+  std::vector<unsigned> index(names.size(), unvisited);
+  std::vector<unsigned> lowLink(names.size(), 0);
+  std::vector<bool> onStack(names.size(), false);
+  std::vector<unsigned> stack;
+  // (function, next callee to look at)
+  std::vector<std::pair<unsigned, size_t>> callStack;
+  unsigned nextIndex = 0;
+
+  components.clear();
+  for (unsigned root = 0; root < names.size(); root++) {
+    if (index[root] != unvisited) {
+      continue;
+    }
+    callStack.emplace_back(root, 0);
+    while (!callStack.empty()) {
+      const unsigned function = callStack.back().first;
+      size_t &next = callStack.back().second;
+
+      if (next == 0 && index[function] == unvisited) {
+        index[function] = lowLink[function] = nextIndex++;
+        stack.push_back(function);
+        onStack[function] = true;
+      }
+
+      if (next < callees[function].size()) {
+        const unsigned callee = callees[function][next++];
+        if (index[callee] == unvisited) {
+          callStack.emplace_back(callee, 0);
+        } else if (onStack[callee]) {
+          lowLink[function] = std::min(lowLink[function], index[callee]);
+        }
+        continue;
+      }
+
+      if (lowLink[function] == index[function]) {
+        std::vector<unsigned> component;
+        unsigned member;
+        do {
+          member = stack.back();
+          stack.pop_back();
+          onStack[member] = false;
+          component.push_back(member);
+        } while (member != function);
+        components.push_back(component);
+      }
+
+      callStack.pop_back();
+      if (!callStack.empty()) {
+        const unsigned caller = callStack.back().first;
+        lowLink[caller] = std::min(lowLink[caller], lowLink[function]);
+      }
+    }
+  }
+}
+
+void CallGraph::computeSummaries() {
+  findComponents();
+  summaries.assign(names.size(), Summary());
+
+  std::vector<unsigned> componentOf(names.size());
+  for (unsigned component = 0; component < components.size(); component++) {
+    for (unsigned member : components[component]) {
+      componentOf[member] = component;
+    }
+  }
+
+  // Tarjan emits a component only after every component it calls into, so
+  // one pass in emission order sees all callee summaries already complete.
+  for (unsigned component = 0; component < components.size(); component++) {
+    const std::vector<unsigned> &members = components[component];
+    Summary merged;
+    merged.component = component;
+    merged.recursive = members.size() > 1;
+
+    for (unsigned member : members) {
+      merged.branches.unionWith(local[member].branches);
+      merged.inputs.insert(local[member].inputs.begin(),
+                           local[member].inputs.end());
+      for (unsigned callee : callees[member]) {
+        if (callee == member) {
+          merged.recursive = true;
+        }
+        if (componentOf[callee] != component) {
+          merged.branches.unionWith(summaries[callee].branches);
+          merged.inputs.insert(summaries[callee].inputs.begin(),
+                               summaries[callee].inputs.end());
+        }
+      }
+    }
+
+    for (unsigned member : members) {
+      summaries[member] = merged;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+
+#ifndef CALL_GRAPH__H
+#define CALL_GRAPH__H
+
+#include "Common.h"
+#include "SparseBitSet.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Call graph over the functions of a translation unit. Strongly connected
+// components (Tarjan) identify direct and mutual recursion, and each
+// function gets a summary of everything reachable through its callees,
+// computed once per component in bottom-up order.
+class CallGraph {
+
+public:
+  struct Summary {
+    // br_N ids of every target reachable from the function.
+    SparseBitSet branches;
+    // Input calls (scanf, fgets, ...) made by the function or its callees.
+    std::set<std::string> inputs;
+    bool recursive;
+    unsigned component;
+
+    Summary() : recursive(false), component(0) {}
+  };
+
+private:
+  std::vector<std::string> names;
+
+  std::map<std::string, unsigned> ids;
+
+  std::vector<std::vector<unsigned>> callees;
+
+  // Facts local to each function, before summarisation.
+  std::vector<Summary> local;
+
+  std::vector<Summary> summaries;
+
+  // Components in reverse topological order: callees before callers.
+  std::vector<std::vector<unsigned>> components;
+
+  void findComponents();
+
+public:
+  unsigned addFunction(const std::string &name);
+
+  void addCall(const std::string &caller, const std::string &callee);
+
+  void addBranch(const std::string &function, unsigned branchId);
+
+  void addInput(const std::string &function, const std::string &input);
+
+  void computeSummaries();
+
+  const Summary *getSummary(const std::string &name) const {
+    std::map<std::string, unsigned>::const_iterator it = ids.find(name);
+    if (it == ids.end() || summaries.empty()) {
+      return nullptr;
+    }
+    return &summaries[it->second];
+  }
+
+  // Facts of the function itself, without its callees.
+  const Summary *getLocalFacts(const std::string &name) const {
+    std::map<std::string, unsigned>::const_iterator it = ids.find(name);
+    return it == ids.end() ? nullptr : &local[it->second];
+  }
+
+  std::vector<std::string> getCallees(const std::string &name) const;
+
+  const std::vector<std::vector<unsigned>> &getComponents() const {
+    return components;
+  }
+
+  const std::string &getName(unsigned id) const { return names[id]; }
+
+  unsigned size() const { return names.size(); }
+};
+
+#endif
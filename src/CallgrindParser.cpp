@@ -0,0 +1,386 @@
+
+#include "CallgrindParser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <sstream>
+
+namespace {
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+bool startsWith(const char *line, const char *prefix) {
+  return std::strncmp(line, prefix, std::strlen(prefix)) == 0;
+}
+
+std::string formatPercent(uint64_t part, uint64_t total) {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%.1f%%",
+           total ? 100.0 * part / total : 0.0);
+  return buffer;
+}
+
+// Whitespace-separated words of a header line such as "events: Ir Dr".
+std::vector<std::string> splitWords(const char *text) {
+  std::istringstream stream(text);
+  std::vector<std::string> words;
+  std::string word;
+  while (stream >> word) {
+    words.push_back(word);
+  }
+  return words;
+}
+
+// Reads one position: absolute ("12", "0x4005a0"), relative to the previous
+// value ("+3", "-1") or unchanged ("*").
+uint64_t readPosition(char *&cursor, uint64_t previous) {
+  while (*cursor == ' ' || *cursor == '\t') {
+    cursor++;
+  }
+  switch (*cursor) {
+  case '*':
+    cursor++;
+    return previous;
+  case '+':
+    return previous + std::strtoull(cursor + 1, &cursor, 0);
+  case '-':
+    return previous - std::strtoull(cursor + 1, &cursor, 0);
+  default:
+    return std::strtoull(cursor, &cursor, 0);
+  }
+}
+
+} // namespace
+
+CallgrindParser::CallgrindParser() : total(0), summary(0), numCostLines(0) {}
+
+uint32_t CallgrindParser::resolveName(
+    const char *spec, std::unordered_map<uint64_t, uint32_t> &compressed,
+    std::unordered_map<std::string, uint32_t> &ids,
+    std::vector<std::string> &names, bool isFile) {
+  uint64_t compressedId = 0;
+  bool isCompressed = false;
+  if (*spec == '(') {
+    char *end;
+    compressedId = std::strtoull(spec + 1, &end, 10);
+    isCompressed = *end == ')';
+    if (isCompressed) {
+      spec = end + 1;
+      while (*spec == ' ') {
+        spec++;
+      }
+      // A bare "(id)" refers back to an earlier definition.
+      if (*spec == '\0') {
+        std::unordered_map<uint64_t, uint32_t>::const_iterator found =
+            compressed.find(compressedId);
+        return found != compressed.end() ? found->second : NONE;
+      }
+    }
+  }
+
+  std::string name(spec);
+  // Recursion levels are reported as separate functions ("fact'2").
+  if (!isFile) {
+    const size_t quote = name.rfind('\'');
+    if (quote != std::string::npos && quote > 0 &&
+        std::all_of(name.begin() + quote + 1, name.end(), ::isdigit)) {
+      name.resize(quote);
+    }
+  }
+
+  uint32_t id;
+  std::unordered_map<std::string, uint32_t>::const_iterator found =
+      ids.find(name);
+  if (found != ids.end()) {
+    id = found->second;
+  } else {
+    id = isFile ? files.size() : names.size();
+    ids.emplace(name, id);
+    if (isFile) {
+      files.push_back(FileCosts{name, {}, {}, {}});
+    } else {
+      names.push_back(name);
+    }
+  }
+  if (isCompressed) {
+    compressed[compressedId] = id;
+  }
+  return id;
+}
+
+uint32_t CallgrindParser::internFile(const char *spec) {
+  std::vector<std::string> unused;
+  return resolveName(spec, compressedFiles, fileIds, unused, true);
+}
+
+uint32_t CallgrindParser::internFunction(const char *spec) {
+  return resolveName(spec, compressedFunctions, functionIds, functionNames,
+                     false);
+}
+
+void CallgrindParser::addCost(uint32_t file, uint32_t function, uint64_t line,
+                              uint64_t cost, bool isCall) {
+  if (!isCall) {
+    total += cost;
+  }
+  // Code without line information is only part of the total.
+  if (file == NONE || line == 0 || line > UINT32_MAX) {
+    return;
+  }
+  FileCosts &costs = files[file];
+  if (line >= costs.self.size()) {
+    costs.self.resize(line + 1, 0);
+    costs.calls.resize(line + 1, 0);
+    costs.function.resize(line + 1, 0);
+  }
+  (isCall ? costs.calls : costs.self)[line] += cost;
+  if (costs.function[line] == 0 && function != NONE) {
+    costs.function[line] = function + 1;
+  }
+}
+
+bool CallgrindParser::parse(const std::string &path, std::string &error) {
+  FILE *in = fopen(path.c_str(), "r");
+  if (in == nullptr) {
+    error = "Could not open " + path;
+    return false;
+  }
+
+  // Index of Ir among the events, and of the line among the positions.
+  size_t irIndex = 0;
+  size_t linePosition = 0;
+  std::vector<uint64_t> positions(1, 0);
+
+  uint32_t file = NONE;
+  uint32_t inlineFile = NONE;
+  uint32_t function = NONE;
+
+  // What the next cost line describes: the self cost of its position, the
+  // inclusive cost of a call made there, or only the source of a jump.
+  enum { COST, CALL, JUMP } next = COST;
+
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, in)) != -1) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    const char first = line[0];
+    if (first == '\0' || first == '#') {
+      continue;
+    }
+
+    if (std::isdigit(static_cast<unsigned char>(first)) || first == '+' ||
+        first == '-' || first == '*') {
+      char *cursor = line;
+      for (uint64_t &position : positions) {
+        position = readPosition(cursor, position);
+      }
+      if (next == JUMP) {
+        next = COST;
+        continue;
+      }
+      uint64_t cost = 0;
+      for (size_t event = 0; event <= irIndex; event++) {
+        while (*cursor == ' ' || *cursor == '\t') {
+          cursor++;
+        }
+        if (*cursor == '\0') {
+          cost = 0;
+          break;
+        }
+        cost = std::strtoull(cursor, &cursor, 10);
+      }
+      addCost(inlineFile != NONE ? inlineFile : file, function,
+              positions[linePosition], cost, next == CALL);
+      numCostLines++;
+      next = COST;
+    } else if (startsWith(line, "fl=")) {
+      file = internFile(line + 3);
+      inlineFile = NONE;
+    } else if (startsWith(line, "fi=") || startsWith(line, "fe=")) {
+      inlineFile = internFile(line + 3);
+    } else if (startsWith(line, "fn=")) {
+      function = internFunction(line + 3);
+      inlineFile = NONE;
+    } else if (startsWith(line, "cfi=") || startsWith(line, "cfl=")) {
+      // Only defines the name; the cost lines stay in the caller's file.
+      internFile(line + 4);
+    } else if (startsWith(line, "cfn=")) {
+      internFunction(line + 4);
+    } else if (startsWith(line, "calls=")) {
+      next = CALL;
+    } else if (startsWith(line, "jump=") || startsWith(line, "jcnd=")) {
+      next = JUMP;
+    } else if (startsWith(line, "events:")) {
+      const std::vector<std::string> events = splitWords(line + 7);
+      irIndex = std::find(events.begin(), events.end(), "Ir") - events.begin();
+      if (irIndex == events.size()) {
+        error = path + " has no Ir event";
+        break;
+      }
+    } else if (startsWith(line, "positions:")) {
+      const std::vector<std::string> names = splitWords(line + 10);
+      linePosition =
+          std::find(names.begin(), names.end(), "line") - names.begin();
+      if (linePosition == names.size()) {
+        error = path + " has no line positions";
+        break;
+      }
+      positions.assign(names.size(), 0);
+    } else if (startsWith(line, "summary:") ||
+               (startsWith(line, "totals:") && summary == 0)) {
+      const std::vector<std::string> costs =
+          splitWords(std::strchr(line, ':') + 1);
+      if (irIndex < costs.size()) {
+        summary = std::strtoull(costs[irIndex].c_str(), nullptr, 10);
+      }
+    }
+  }
+  free(line);
+  fclose(in);
+
+  if (error.empty() && numCostLines == 0) {
+    error = path + " has no cost lines; is it a callgrind output file?";
+  }
+  return error.empty();
+}
+
+const CallgrindParser::FileCosts *
+CallgrindParser::findFile(const std::string &name) const {
+  for (const FileCosts &costs : files) {
+    const std::string &path = costs.path;
+    if (path == name ||
+        (path.size() > name.size() &&
+         path.compare(path.size() - name.size(), name.size(), name) == 0 &&
+         path[path.size() - name.size() - 1] == '/') ||
+        (name.size() > path.size() &&
+         name.compare(name.size() - path.size(), path.size(), path) == 0 &&
+         name[name.size() - path.size() - 1] == '/')) {
+      return &costs;
+    }
+  }
+  return nullptr;
+}
+
+uint64_t CallgrindParser::getLineCost(const std::string &file,
+                                      unsigned line) const {
+  const FileCosts *costs = findFile(file);
+  return costs != nullptr && line < costs->self.size() ? costs->self[line] : 0;
+}
+
+std::vector<CallgrindParser::BranchCost> CallgrindParser::attribute(
+    const std::vector<BranchDictionary::Entry> &entries) const {
+  // Branch and target lines of each file bound the target regions.
+  std::unordered_map<std::string, std::vector<unsigned>> boundaries;
+  for (const BranchDictionary::Entry &entry : entries) {
+    std::vector<unsigned> &lines = boundaries[entry.file];
+    lines.push_back(entry.branchLine);
+    lines.push_back(entry.targetLine);
+  }
+  for (std::pair<const std::string, std::vector<unsigned>> &lines :
+       boundaries) {
+    std::sort(lines.second.begin(), lines.second.end());
+    lines.second.erase(std::unique(lines.second.begin(), lines.second.end()),
+                       lines.second.end());
+  }
+
+  std::vector<BranchCost> costs;
+  costs.reserve(entries.size());
+  for (const BranchDictionary::Entry &entry : entries) {
+    BranchCost cost{entry, 0, 0};
+    const FileCosts *file = findFile(entry.file);
+    if (file != nullptr) {
+      const std::vector<unsigned> &lines = boundaries[entry.file];
+      std::vector<unsigned>::const_iterator next =
+          std::upper_bound(lines.begin(), lines.end(), entry.targetLine);
+      const size_t end =
+          next == lines.end() ? file->self.size()
+                              : std::min<size_t>(*next, file->self.size());
+      for (size_t line = entry.targetLine; line < end; line++) {
+        const uint32_t function = file->function[line];
+        if (function != 0 && !entry.function.empty() &&
+            functionNames[function - 1] != entry.function) {
+          break;
+        }
+        cost.self += file->self[line];
+        cost.calls += file->calls[line];
+      }
+    }
+    costs.push_back(cost);
+  }
+  return costs;
+}
+
+void CallgrindParser::printReport(
+    std::ostream &out, const std::vector<BranchDictionary::Entry> &entries,
+    unsigned numHot) const {
+  const uint64_t runTotal = getTotal();
+  out << "Callgrind: " << runTotal << " instructions executed\n";
+
+  if (!entries.empty()) {
+    std::vector<BranchCost> costs = attribute(entries);
+    // Targets on the same line share a region; count it once.
+    uint64_t attributed = 0;
+    std::set<std::pair<std::string, unsigned>> regions;
+    for (const BranchCost &cost : costs) {
+      if (regions.emplace(cost.entry.file, cost.entry.targetLine).second) {
+        attributed += cost.self;
+      }
+    }
+    std::sort(costs.begin(), costs.end(),
+              [](const BranchCost &lhs, const BranchCost &rhs) {
+                return lhs.self + lhs.calls != rhs.self + rhs.calls
+                           ? lhs.self + lhs.calls > rhs.self + rhs.calls
+                           : lhs.entry.id < rhs.entry.id;
+              });
+    out << "\nCostliest branch targets (" << attributed
+        << " instructions in target regions):\n";
+    for (size_t i = 0; i < costs.size() && i < numHot; i++) {
+      const BranchCost &cost = costs[i];
+      out << "  br_" << cost.entry.id << ": " << cost.self << " ("
+          << formatPercent(cost.self, runTotal) << "), " << cost.calls
+          << " in calls  " << cost.entry.file << ", " << cost.entry.branchLine
+          << ", " << cost.entry.targetLine;
+      if (!cost.entry.function.empty()) {
+        out << " in " << cost.entry.function;
+      }
+      out << '\n';
+    }
+  }
+
+  struct LineCost {
+    const FileCosts *file;
+    unsigned line;
+    uint64_t self;
+  };
+  std::vector<LineCost> lines;
+  for (const FileCosts &file : files) {
+    for (unsigned line = 1; line < file.self.size(); line++) {
+      if (file.self[line] > 0) {
+        lines.push_back({&file, line, file.self[line]});
+      }
+    }
+  }
+  const size_t numLines = std::min<size_t>(numHot, lines.size());
+  std::partial_sort(lines.begin(), lines.begin() + numLines, lines.end(),
+                    [](const LineCost &lhs, const LineCost &rhs) {
+                      if (lhs.self != rhs.self) {
+                        return lhs.self > rhs.self;
+                      }
+                      return lhs.file->path != rhs.file->path
+                                 ? lhs.file->path < rhs.file->path
+                                 : lhs.line < rhs.line;
+                    });
+  out << "\nCostliest source lines:\n";
+  for (size_t i = 0; i < numLines; i++) {
+    out << "  " << lines[i].file->path << ":" << lines[i].line << ": "
+        << lines[i].self << " (" << formatPercent(lines[i].self, runTotal)
+        << "), " << lines[i].file->calls[lines[i].line] << " in calls\n";
+  }
+}
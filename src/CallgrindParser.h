@@ -0,0 +1,94 @@
+
+#ifndef CALLGRIND_PARSER__H
+#define CALLGRIND_PARSER__H
+
+#include "BranchDictionary.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Streams a callgrind output file ("callgrind.out.<pid>") and accumulates the
+// instruction cost (Ir) of every source line. Both name compression
+// ("fn=(3) main", later "fn=(3)") and position compression ("+2", "-1", "*")
+// are understood, with either "line" or "instr line" positions, so the files
+// written with --dump-instr=yes are read as well.
+//
+// A line's self cost excludes calls; the inclusive cost of the calls made on
+// it is kept separately. The line costs are then attributed to the br_N
+// targets of a branch dictionary: each target owns the lines from its target
+// line up to the next branch or target line of its file, as long as
+// callgrind places them in the target's function.
+class CallgrindParser {
+  struct FileCosts {
+    std::string path;
+    std::vector<uint64_t> self;
+    std::vector<uint64_t> calls;
+    // Function of each line with a cost, as an index into functionNames + 1.
+    std::vector<uint32_t> function;
+  };
+
+  std::vector<FileCosts> files;
+
+  std::unordered_map<std::string, uint32_t> fileIds;
+
+  std::vector<std::string> functionNames;
+
+  std::unordered_map<std::string, uint32_t> functionIds;
+
+  // Compressed ids ("(n)") to file and function indices.
+  std::unordered_map<uint64_t, uint32_t> compressedFiles;
+
+  std::unordered_map<uint64_t, uint32_t> compressedFunctions;
+
+  uint64_t total;
+
+  uint64_t summary;
+
+  uint64_t numCostLines;
+
+  uint32_t internFile(const char *spec);
+
+  uint32_t internFunction(const char *spec);
+
+  // Resolves "(id) name", "(id)" or "name" against a compressed name table.
+  uint32_t resolveName(const char *spec,
+                       std::unordered_map<uint64_t, uint32_t> &compressed,
+                       std::unordered_map<std::string, uint32_t> &ids,
+                       std::vector<std::string> &names, bool isFile);
+
+  void addCost(uint32_t file, uint32_t function, uint64_t line, uint64_t cost,
+               bool isCall);
+
+  // File of entry.file in this profile, or nullptr.
+  const FileCosts *findFile(const std::string &name) const;
+
+public:
+  struct BranchCost {
+    BranchDictionary::Entry entry;
+    uint64_t self;
+    uint64_t calls;
+  };
+
+  CallgrindParser();
+
+  bool parse(const std::string &path, std::string &error);
+
+  // Total Ir of the run, from the summary line if there is one.
+  uint64_t getTotal() const { return summary > 0 ? summary : total; }
+
+  uint64_t getLineCost(const std::string &file, unsigned line) const;
+
+  // Cost of every dictionary entry's target region, in entries order.
+  std::vector<BranchCost>
+  attribute(const std::vector<BranchDictionary::Entry> &entries) const;
+
+  // Costliest branch targets and source lines of the dictionary's files.
+  void printReport(std::ostream &out,
+                   const std::vector<BranchDictionary::Entry> &entries,
+                   unsigned numHot = 10) const;
+};
+
+#endif
@@ -0,0 +1,162 @@
+
+#include "ChunkStore.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Gear values of the rolling hash: a fixed splitmix64 sequence, so the same
+// trace is cut at the same points by every build.
+struct GearTable {
+  uint64_t values[256];
+
+  constexpr GearTable() : values() {
+    uint64_t state = 0;
+    for (unsigned i = 0; i < 256; i++) {
+      state += 0x9E3779B97F4A7C15ull;
+      uint64_t z = state;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      values[i] = z ^ (z >> 31);
+    }
+  }
+};
+
+constexpr GearTable GEAR;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t finalMix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xFF51AFD7ED558CCDull;
+  k ^= k >> 33;
+  k *= 0xC4CEB9FE1A85EC53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+} // namespace
+
+ChunkStore::ChunkStore(FILE *file, uint64_t offset)
+    : file(file), offset(offset), rolling(0), bytesAdded(0), failed(false) {
+  pending.reserve(MAX_CHUNK);
+}
+
+void ChunkStore::append(const char *data, size_t size,
+                        std::vector<uint32_t> &manifest) {
+  bytesAdded += size;
+  size_t start = 0;
+  for (size_t i = 0; i < size; i++) {
+    rolling = (rolling << 1) + GEAR.values[static_cast<unsigned char>(data[i])];
+    const size_t length = pending.size() + i + 1 - start;
+    if ((length >= MIN_CHUNK && rolling >> (64 - CUT_BITS) == 0) ||
+        length >= MAX_CHUNK) {
+      pending.insert(pending.end(), data + start, data + i + 1);
+      start = i + 1;
+      cut(manifest);
+    }
+  }
+  pending.insert(pending.end(), data + start, data + size);
+}
+
+void ChunkStore::endTrace(std::vector<uint32_t> &manifest) { cut(manifest); }
+
+void ChunkStore::cut(std::vector<uint32_t> &manifest) {
+  rolling = 0;
+  if (pending.empty()) {
+    return;
+  }
+
+  uint64_t digest[2];
+  hash(pending.data(), pending.size(), digest);
+  auto range = ids.equal_range(digest[0]);
+  for (auto id = range.first; id != range.second; ++id) {
+    const Chunk &chunk = chunks[id->second];
+    if (chunk.hash[1] == digest[1] && chunk.size == pending.size()) {
+      manifest.push_back(id->second);
+      pending.clear();
+      return;
+    }
+  }
+
+  const Chunk chunk = {
+      offset, static_cast<uint32_t>(pending.size()),
+      static_cast<uint32_t>(std::count(pending.begin(), pending.end(), '\n')),
+      {digest[0], digest[1]}};
+  if (fwrite(pending.data(), 1, pending.size(), file) != pending.size()) {
+    failed = true;
+  }
+  offset += pending.size();
+  ids.emplace(digest[0], chunks.size());
+  manifest.push_back(chunks.size());
+  chunks.push_back(chunk);
+  pending.clear();
+}
+
+// MurmurHash3, x64 128-bit variant, seed 0.
+void ChunkStore::hash(const char *data, size_t size, uint64_t out[2]) {
+  constexpr uint64_t c1 = 0x87C37B91114253D5ull;
+  constexpr uint64_t c2 = 0x4CF5AD432745937Full;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+
+  const size_t numBlocks = size / 16;
+  for (size_t block = 0; block < numBlocks; block++) {
+    uint64_t k1;
+    uint64_t k2;
+    std::memcpy(&k1, data + block * 16, 8);
+    std::memcpy(&k2, data + block * 16 + 8, 8);
+
+    k1 *= c1;
+    k1 = rotl(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = rotl(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52DCE729;
+
+    k2 *= c2;
+    k2 = rotl(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = rotl(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495AB5;
+  }
+
+  const unsigned char *tail =
+      reinterpret_cast<const unsigned char *>(data) + numBlocks * 16;
+  const size_t tailSize = size & 15;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t i = tailSize; i > 8; i--) {
+    k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+  }
+  if (tailSize > 8) {
+    k2 *= c2;
+    k2 = rotl(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+  }
+  for (size_t i = std::min<size_t>(tailSize, 8); i > 0; i--) {
+    k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+  }
+  if (tailSize > 0) {
+    k1 *= c1;
+    k1 = rotl(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= size;
+  h2 ^= size;
+  h1 += h2;
+  h2 += h1;
+  h1 = finalMix(h1);
+  h2 = finalMix(h2);
+  h1 += h2;
+  h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
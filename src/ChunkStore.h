@@ -0,0 +1,83 @@
+
+#ifndef CHUNK_STORE__H
+#define CHUNK_STORE__H
+
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+// Content-defined chunking with deduplication, for many traces of the same
+// program. A trace is cut wherever a gear rolling hash over its last 64
+// bytes has its top CUT_BITS bits clear (past a minimum chunk size, and at
+// the latest at a maximum one), so an insertion or deletion only moves the
+// cut points around it and the chunks after them are found again. Each chunk is
+// keyed by a 128-bit content hash and written to the file once, however
+// many traces contain it; a trace is kept as its manifest, the list of its
+// chunk ids.
+class ChunkStore {
+public:
+  static constexpr size_t MIN_CHUNK = 1 << 10;
+
+  static constexpr size_t MAX_CHUNK = 1 << 15;
+
+  // Cut points come on average every 2^CUT_BITS bytes past MIN_CHUNK.
+  static constexpr unsigned CUT_BITS = 12;
+
+  struct Chunk {
+    uint64_t offset;
+    uint32_t size;
+    // Newlines in the chunk, so runs can be compared in trace lines without
+    // reading the chunks they share.
+    uint32_t lines;
+    uint64_t hash[2];
+  };
+
+private:
+  FILE *file;
+
+  // Where the next new chunk goes.
+  uint64_t offset;
+
+  std::vector<Chunk> chunks;
+
+  // First half of each chunk's hash -> its id; the second half confirms.
+  std::unordered_multimap<uint64_t, uint32_t> ids;
+
+  std::vector<char> pending;
+
+  uint64_t rolling;
+
+  uint64_t bytesAdded;
+
+  bool failed;
+
+  // Ends the pending chunk and adds its id to manifest.
+  void cut(std::vector<uint32_t> &manifest);
+
+public:
+  // New chunks are written to file from offset on, its current position.
+  ChunkStore(FILE *file, uint64_t offset);
+
+  // Adds data to the current trace. Ids of the chunks it completes are
+  // appended to manifest.
+  void append(const char *data, size_t size, std::vector<uint32_t> &manifest);
+
+  // Cuts the rest of the current trace; the next append starts a new one.
+  void endTrace(std::vector<uint32_t> &manifest);
+
+  const std::vector<Chunk> &getChunks() const { return chunks; }
+
+  // End of the chunk data in the file.
+  uint64_t getOffset() const { return offset; }
+
+  // Bytes of all traces added, before deduplication.
+  uint64_t getBytesAdded() const { return bytesAdded; }
+
+  // True if a chunk could not be written.
+  bool hasFailed() const { return failed; }
+
+  static void hash(const char *data, size_t size, uint64_t out[2]);
+};
+
+#endif
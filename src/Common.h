@@ -6,22 +6,467 @@
 #define QKCURSDBG(OUT) std::cout << CXSTR(clang_getCursorKindSpelling(OUT)) << std::endl;
 
 #define OUT_DIR "out/"
-#define EXE_OUT std::string(OUT_DIR + filename + ".modified.out")
-#define MODIFIED_PROGAM_OUT std::string(OUT_DIR + filename + ".modified.c")
-#define ORIGINAL_EXE_OUT std::string(OUT_DIR + filename + ".original.out")
-
-#define VALGRIND_PARSER "valgrind_parser.py"
+// Generated files of a collector, in its session's output directory.
+#define EXE_OUT std::string(session.getOutDir() + filename + ".modified.out")
+#define MODIFIED_PROGAM_OUT                                                    \
+  std::string(session.getOutDir() + filename + ".modified.c")
+#define ORIGINAL_EXE_OUT                                                       \
+  std::string(session.getOutDir() + filename + ".original.out")
 
 
 #define MAP_FIND(MAP, KEY) MAP.find(KEY) != MAP.end()
 
 #define TRANSFORM_HEADER                                                       \
-  "#include <stdio.h>\n#define LOG(BP) printf(\"%s\\n\", BP);\n#define "       \
-  "LOG_PTR(PTR) printf(\"func_%p\\n\", PTR);\n"
+  "#include <stdio.h>\n"                                                       \
+  "#include <stdlib.h>\n"                                                      \
+  "/* Sampling of branch targets, chosen when compiling this file:\n"          \
+  " *   -DKPC_SAMPLE_EVERY=N  log every Nth hit of each target\n"              \
+  " *   -DKPC_SAMPLE_FIRST=K  log only the first K hits of each target\n"      \
+  " *   -DKPC_SAMPLE_ENABLE   log a target only once it is enabled, through\n" \
+  " *                         KPC_ENABLE=\"3,5,7\" or kpc_enable(id)\n"        \
+  " * By default every hit is logged. Calls are always logged. */\n"           \
+  "#if defined(KPC_THREADED)\n"                                                \
+  "#define KPC_TLS __thread\n"                                                 \
+  "#else\n"                                                                    \
+  "#define KPC_TLS\n"                                                          \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_SAMPLE_EVERY) || defined(KPC_SAMPLE_FIRST)\n"               \
+  "static KPC_TLS unsigned long kpc_hits[KPC_NUM_BRANCHES];\n"                 \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_SAMPLE_EVERY)\n"                                            \
+  "#define KPC_SHOULD_LOG(ID) (kpc_hits[ID]++ % (KPC_SAMPLE_EVERY) == 0)\n"    \
+  "#elif defined(KPC_SAMPLE_FIRST)\n"                                          \
+  "#define KPC_SHOULD_LOG(ID) (kpc_hits[ID] < (KPC_SAMPLE_FIRST) && ++kpc_hits[ID])\n" \
+  "#elif defined(KPC_SAMPLE_ENABLE)\n"                                         \
+  "static unsigned char kpc_enabled[KPC_NUM_BRANCHES];\n"                      \
+  "static int kpc_enabled_loaded;\n"                                           \
+  "static inline void kpc_enable(unsigned long id) {\n"                        \
+  "  if (id < KPC_NUM_BRANCHES) kpc_enabled[id] = 1;\n"                        \
+  "}\n"                                                                        \
+  "static inline int kpc_load_enabled(void) {\n"                               \
+  "  const char *ids = getenv(\"KPC_ENABLE\");\n"                              \
+  "  char *end;\n"                                                             \
+  "  kpc_enabled_loaded = 1;\n"                                                \
+  "  while (ids != NULL && *ids != '\\0') {\n"                                 \
+  "    kpc_enable(strtoul(ids, &end, 10));\n"                                  \
+  "    ids = *end != '\\0' ? end + 1 : end;\n"                                 \
+  "  }\n"                                                                      \
+  "  return 1;\n"                                                              \
+  "}\n"                                                                        \
+  "#define KPC_SHOULD_LOG(ID) ((kpc_enabled_loaded || kpc_load_enabled()) && kpc_enabled[ID])\n" \
+  "#else\n"                                                                    \
+  "#define KPC_SHOULD_LOG(ID) 1\n"                                             \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_THREADED) || defined(KPC_LATENCY)\n"                        \
+  "#include <stdint.h>\n"                                                      \
+  "#include <string.h>\n"                                                      \
+  "#include <time.h>\n"                                                        \
+  "/* Ticks of the TSC, read without a system call or fence; with\n"           \
+  " * -DKPC_CLOCK_GETTIME, or off x86, nanoseconds of CLOCK_MONOTONIC, which\n" \
+  " * the vDSO serves without entering the kernel. */\n"                       \
+  "#if (defined(__x86_64__) || defined(__i386__)) && !defined(KPC_CLOCK_GETTIME)\n" \
+  "#define KPC_TSC\n"                                                          \
+  "#endif\n"                                                                   \
+  "static inline uint64_t kpc_now(void) {\n"                                   \
+  "#if defined(KPC_TSC)\n"                                                     \
+  "  return __builtin_ia32_rdtsc();\n"                                         \
+  "#else\n"                                                                    \
+  "  struct timespec now;\n"                                                   \
+  "  clock_gettime(CLOCK_MONOTONIC, &now);\n"                                  \
+  "  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;\n"               \
+  "#endif\n"                                                                   \
+  "}\n"                                                                        \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_THREADED)\n"                                                \
+  "/* -DKPC_THREADED: every thread appends to its own buffer, pushed onto a\n" \
+  " * lock-free list the first time the thread logs; sampling counters are\n"  \
+  " * per thread. At exit the buffers are merged by timestamp and printed as\n" \
+  " * \"T<thread> <ticks>: br_N\". Join worker threads before exiting. The\n"  \
+  " * runtime is weak so all instrumented files of a program share one copy. */\n" \
+  "#define KPC_CALL 0xFFFFFFFFu\n"                                             \
+  "#define KPC_SUMMARY 0xFFFFFFFEu\n"                                          \
+  "struct kpc_event {\n"                                                       \
+  "  uint64_t time;\n"                                                         \
+  "  uint64_t seq;\n"                                                          \
+  "  uint64_t value;\n"                                                        \
+  "  uint32_t id;\n"                                                           \
+  "  uint32_t thread;\n"                                                       \
+  "};\n"                                                                       \
+  "struct kpc_buffer {\n"                                                      \
+  "  struct kpc_buffer *next;\n"                                               \
+  "  struct kpc_event *events;\n"                                              \
+  "  size_t size;\n"                                                           \
+  "  size_t capacity;\n"                                                       \
+  "  uint32_t thread;\n"                                                       \
+  "};\n"                                                                       \
+  "__attribute__((weak)) struct kpc_buffer *kpc_buffers;\n"                    \
+  "__attribute__((weak)) uint32_t kpc_num_threads;\n"                          \
+  "__attribute__((weak)) __thread struct kpc_buffer *kpc_local;\n"             \
+  "static int kpc_compare(const void *lhs, const void *rhs) {\n"               \
+  "  const struct kpc_event *a = (const struct kpc_event *)lhs;\n"             \
+  "  const struct kpc_event *b = (const struct kpc_event *)rhs;\n"             \
+  "  if (a->time != b->time) return a->time < b->time ? -1 : 1;\n"             \
+  "  if (a->thread != b->thread) return a->thread < b->thread ? -1 : 1;\n"     \
+  "  return a->seq < b->seq ? -1 : a->seq > b->seq;\n"                         \
+  "}\n"                                                                        \
+  "__attribute__((weak)) void kpc_flush(void) {\n"                             \
+  "  struct kpc_buffer *buffer;\n"                                             \
+  "  struct kpc_event *events;\n"                                              \
+  "  size_t total = 0, i;\n"                                                   \
+  "  uint64_t start;\n"                                                        \
+  "  for (buffer = kpc_buffers; buffer != NULL; buffer = buffer->next)\n"      \
+  "    total += buffer->size;\n"                                               \
+  "  events = (struct kpc_event *)malloc(total * sizeof(*events) + 1);\n"      \
+  "  if (events == NULL) return;\n"                                            \
+  "  total = 0;\n"                                                             \
+  "  for (buffer = kpc_buffers; buffer != NULL; buffer = buffer->next) {\n"    \
+  "    memcpy(events + total, buffer->events, buffer->size * sizeof(*events));\n" \
+  "    total += buffer->size;\n"                                               \
+  "  }\n"                                                                      \
+  "  qsort(events, total, sizeof(*events), kpc_compare);\n"                    \
+  "  start = total > 0 ? events[0].time : 0;\n"                                \
+  "  for (i = 0; i < total; i++) {\n"                                          \
+  "    if (events[i].id == KPC_CALL)\n"                                        \
+  "      printf(\"T%u %llu: func_%p\\n\", events[i].thread,\n"                 \
+  "             (unsigned long long)(events[i].time - start),\n"               \
+  "             (void *)(uintptr_t)events[i].value);\n"                        \
+  "    else if (events[i].id == KPC_SUMMARY) {\n"                              \
+  "      printf(\"T%u %llu: %s\\n\", events[i].thread,\n"                      \
+  "             (unsigned long long)(events[i].time - start),\n"               \
+  "             (char *)(uintptr_t)events[i].value);\n"                        \
+  "      free((void *)(uintptr_t)events[i].value);\n"                          \
+  "    } else\n"                                                               \
+  "      printf(\"T%u %llu: br_%u\\n\", events[i].thread,\n"                   \
+  "             (unsigned long long)(events[i].time - start), events[i].id);\n" \
+  "  }\n"                                                                      \
+  "  free(events);\n"                                                          \
+  "}\n"                                                                        \
+  "/* Returns NULL if the buffer cannot be allocated; the thread then drops\n" \
+  " * its events and tries again on the next one. */\n"                        \
+  "__attribute__((weak)) struct kpc_buffer *kpc_register(void) {\n"            \
+  "  struct kpc_buffer *buffer =\n"                                            \
+  "      (struct kpc_buffer *)calloc(1, sizeof(struct kpc_buffer));\n"         \
+  "  if (buffer == NULL) return NULL;\n"                                       \
+  "  buffer->thread = __atomic_fetch_add(&kpc_num_threads, 1, __ATOMIC_RELAXED);\n" \
+  "  if (buffer->thread == 0) atexit(kpc_flush);\n"                            \
+  "  buffer->next = __atomic_load_n(&kpc_buffers, __ATOMIC_RELAXED);\n"        \
+  "  while (!__atomic_compare_exchange_n(&kpc_buffers, &buffer->next, buffer, 1,\n" \
+  "                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))\n" \
+  "    ;\n"                                                                    \
+  "  return kpc_local = buffer;\n"                                             \
+  "}\n"                                                                        \
+  "__attribute__((weak)) void kpc_record(uint32_t id, const void *value) {\n"  \
+  "  struct kpc_buffer *buffer = kpc_local != NULL ? kpc_local : kpc_register();\n" \
+  "  struct kpc_event *event;\n"                                               \
+  "  if (buffer != NULL && buffer->size == buffer->capacity) {\n"              \
+  "    const size_t capacity = buffer->capacity ? 2 * buffer->capacity : 4096;\n" \
+  "    struct kpc_event *events = (struct kpc_event *)realloc(\n"              \
+  "        buffer->events, capacity * sizeof(struct kpc_event));\n"            \
+  "    if (events != NULL) {\n"                                                \
+  "      buffer->events = events;\n"                                           \
+  "      buffer->capacity = capacity;\n"                                       \
+  "    }\n"                                                                    \
+  "  }\n"                                                                      \
+  "  /* Out of memory: keep what was recorded and drop this event, as\n"       \
+  "   * kpc_flush() drops the trace if it cannot merge it. */\n"               \
+  "  if (buffer == NULL || buffer->size == buffer->capacity) {\n"              \
+  "    if (id == KPC_SUMMARY) free((void *)value);\n"                          \
+  "    return;\n"                                                              \
+  "  }\n"                                                                      \
+  "  event = &buffer->events[buffer->size];\n"                                 \
+  "  event->time = kpc_now();\n"                                               \
+  "  event->seq = buffer->size++;\n"                                           \
+  "  event->value = (uintptr_t)value;\n"                                       \
+  "  event->id = id;\n"                                                        \
+  "  event->thread = buffer->thread;\n"                                        \
+  "}\n"                                                                        \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_LATENCY)\n"                                                 \
+  "/* -DKPC_LATENCY: targets are timed instead of logged. The region of a target\n" \
+  " * lasts from its LOG to the next LOG of the same thread, and its length is\n" \
+  " * added to the target's histogram in memory. Sampling does not apply, calls\n" \
+  " * are not logged and loops are not summarized. At exit each target prints\n" \
+  " *   \"latency br_N n=COUNT ns=TOTAL bK=c ...\"\n"                          \
+  " * where bK counts the regions of 2^K to 2^(K+1)-1 ns (b0 from 0 ns). TSC\n" \
+  " * ticks are converted with a rate measured against CLOCK_MONOTONIC for a\n" \
+  " * millisecond when the first target is reached. If KPC_TIMELINE names a\n" \
+  " * file, the first KPC_TIMELINE_MAX regions are also written there as Chrome\n" \
+  " * trace events, for chrome://tracing or ui.perfetto.dev. Regions still open\n" \
+  " * in other threads at exit are dropped; join them first. */\n"             \
+  "#define KPC_BUCKETS 48\n"                                                   \
+  "#if !defined(KPC_TIMELINE_MAX)\n"                                           \
+  "#define KPC_TIMELINE_MAX (1 << 20)\n"                                       \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_THREADED)\n"                                                \
+  "#define KPC_ADD(COUNTER, VALUE)                                                \\\n" \
+  "  __atomic_fetch_add(&(COUNTER), (VALUE), __ATOMIC_RELAXED)\n"              \
+  "#else\n"                                                                    \
+  "#define KPC_ADD(COUNTER, VALUE) ((COUNTER) += (VALUE))\n"                   \
+  "#endif\n"                                                                   \
+  "struct kpc_histogram {\n"                                                   \
+  "  uint64_t count;\n"                                                        \
+  "  uint64_t ns;\n"                                                           \
+  "  uint64_t buckets[KPC_BUCKETS];\n"                                         \
+  "};\n"                                                                       \
+  "struct kpc_span {\n"                                                        \
+  "  uint64_t start;\n"                                                        \
+  "  uint64_t ns;\n"                                                           \
+  "  uint32_t id;\n"                                                           \
+  "  uint32_t thread;\n"                                                       \
+  "};\n"                                                                       \
+  "/* Shared by every instrumented file of the program, like the threaded\n"   \
+  " * runtime; each file keeps the histograms of its own targets. */\n"        \
+  "__attribute__((weak)) double kpc_ns_per_tick;\n"                            \
+  "__attribute__((weak)) uint64_t kpc_start_ticks;\n"                          \
+  "__attribute__((weak)) int kpc_latency_state;\n"                             \
+  "__attribute__((weak)) struct kpc_span *kpc_timeline;\n"                     \
+  "__attribute__((weak)) uint64_t kpc_timeline_size;\n"                        \
+  "__attribute__((weak)) uint32_t kpc_timeline_threads;\n"                     \
+  "__attribute__((weak)) KPC_TLS struct kpc_histogram *kpc_open;\n"            \
+  "__attribute__((weak)) KPC_TLS uint64_t kpc_open_start;\n"                   \
+  "__attribute__((weak)) KPC_TLS uint32_t kpc_open_id;\n"                      \
+  "__attribute__((weak)) KPC_TLS uint32_t kpc_open_thread;\n"                  \
+  "__attribute__((weak)) void kpc_timeline_write(void) {\n"                    \
+  "  const char *path = getenv(\"KPC_TIMELINE\");\n"                           \
+  "  uint64_t size = kpc_timeline_size, i;\n"                                  \
+  "  FILE *out;\n"                                                             \
+  "  if (kpc_timeline == NULL || (out = fopen(path, \"w\")) == NULL) return;\n" \
+  "  if (size > KPC_TIMELINE_MAX) size = KPC_TIMELINE_MAX;\n"                  \
+  "  fputs(\"{\\\"displayTimeUnit\\\":\\\"ns\\\",\\\"traceEvents\\\":[\", out);\n" \
+  "  for (i = 0; i < size; i++)\n"                                             \
+  "    fprintf(out,\n"                                                         \
+  "            \"%s\\n{\\\"name\\\":\\\"br_%u\\\",\\\"ph\\\":\\\"X\\\",\\\"pid\\\":1,\\\"tid\\\":%u,\"\n" \
+  "            \"\\\"ts\\\":%.3f,\\\"dur\\\":%.3f}\",\n"                       \
+  "            i > 0 ? \",\" : \"\", kpc_timeline[i].id, kpc_timeline[i].thread,\n" \
+  "            kpc_timeline[i].start / 1000.0, kpc_timeline[i].ns / 1000.0);\n" \
+  "  fputs(\"\\n]}\\n\", out);\n"                                              \
+  "  fclose(out);\n"                                                           \
+  "}\n"                                                                        \
+  "__attribute__((weak)) void kpc_latency_init(void) {\n"                      \
+  "  int expected = 0;\n"                                                      \
+  "#if defined(KPC_TSC)\n"                                                     \
+  "  struct timespec begin, now;\n"                                            \
+  "  uint64_t ticks, ns;\n"                                                    \
+  "#endif\n"                                                                   \
+  "  if (!__atomic_compare_exchange_n(&kpc_latency_state, &expected, 1, 0,\n"  \
+  "                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {\n" \
+  "    while (__atomic_load_n(&kpc_latency_state, __ATOMIC_ACQUIRE) != 2)\n"   \
+  "      ;\n"                                                                  \
+  "    return;\n"                                                              \
+  "  }\n"                                                                      \
+  "#if defined(KPC_TSC)\n"                                                     \
+  "  clock_gettime(CLOCK_MONOTONIC, &begin);\n"                                \
+  "  ticks = kpc_now();\n"                                                     \
+  "  do {\n"                                                                   \
+  "    clock_gettime(CLOCK_MONOTONIC, &now);\n"                                \
+  "    ns = (uint64_t)(now.tv_sec - begin.tv_sec) * 1000000000u + now.tv_nsec -\n" \
+  "         begin.tv_nsec;\n"                                                  \
+  "  } while (ns < 1000000);\n"                                                \
+  "  kpc_ns_per_tick = (double)ns / (kpc_now() - ticks);\n"                    \
+  "#else\n"                                                                    \
+  "  kpc_ns_per_tick = 1.0;\n"                                                 \
+  "#endif\n"                                                                   \
+  "  kpc_start_ticks = kpc_now();\n"                                           \
+  "  if (getenv(\"KPC_TIMELINE\") != NULL)\n"                                  \
+  "    kpc_timeline =\n"                                                       \
+  "        (struct kpc_span *)malloc(KPC_TIMELINE_MAX * sizeof(struct kpc_span));\n" \
+  "  /* Registered before any file's histograms, so it runs after them. */\n"  \
+  "  atexit(kpc_timeline_write);\n"                                            \
+  "  __atomic_store_n(&kpc_latency_state, 2, __ATOMIC_RELEASE);\n"             \
+  "}\n"                                                                        \
+  "/* Ends the region open in this thread, if any. */\n"                       \
+  "static inline void kpc_close(uint64_t now) {\n"                             \
+  "  struct kpc_histogram *histogram = kpc_open;\n"                            \
+  "  uint64_t ns, slot;\n"                                                     \
+  "  unsigned bucket;\n"                                                       \
+  "  if (histogram == NULL) return;\n"                                         \
+  "  kpc_open = NULL;\n"                                                       \
+  "  ns = (uint64_t)((now - kpc_open_start) * kpc_ns_per_tick);\n"             \
+  "  bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);\n"                        \
+  "  if (bucket >= KPC_BUCKETS) bucket = KPC_BUCKETS - 1;\n"                   \
+  "  KPC_ADD(histogram->count, 1);\n"                                          \
+  "  KPC_ADD(histogram->ns, ns);\n"                                            \
+  "  KPC_ADD(histogram->buckets[bucket], 1);\n"                                \
+  "  if (kpc_timeline == NULL) return;\n"                                      \
+  "  slot = __atomic_fetch_add(&kpc_timeline_size, 1, __ATOMIC_RELAXED);\n"    \
+  "  if (slot >= KPC_TIMELINE_MAX) return;\n"                                  \
+  "  if (kpc_open_thread == 0)\n"                                              \
+  "    kpc_open_thread =\n"                                                    \
+  "        __atomic_add_fetch(&kpc_timeline_threads, 1, __ATOMIC_RELAXED);\n"  \
+  "  kpc_timeline[slot].start =\n"                                             \
+  "      (uint64_t)((kpc_open_start - kpc_start_ticks) * kpc_ns_per_tick);\n"  \
+  "  kpc_timeline[slot].ns = ns;\n"                                            \
+  "  kpc_timeline[slot].id = kpc_open_id;\n"                                   \
+  "  kpc_timeline[slot].thread = kpc_open_thread - 1;\n"                       \
+  "}\n"                                                                        \
+  "static struct kpc_histogram kpc_latency[KPC_NUM_BRANCHES];\n"               \
+  "static int kpc_latency_registered;\n"                                       \
+  "static void kpc_latency_print(void) {\n"                                    \
+  "  unsigned id, bucket;\n"                                                   \
+  "  /* Whichever file's handler runs first closes the main thread's region. */\n" \
+  "  kpc_close(kpc_now());\n"                                                  \
+  "  for (id = 0; id < KPC_NUM_BRANCHES; id++) {\n"                            \
+  "    const struct kpc_histogram *histogram = &kpc_latency[id];\n"            \
+  "    if (histogram->count == 0) continue;\n"                                 \
+  "    printf(\"latency br_%u n=%llu ns=%llu\", id,\n"                         \
+  "           (unsigned long long)histogram->count,\n"                         \
+  "           (unsigned long long)histogram->ns);\n"                           \
+  "    for (bucket = 0; bucket < KPC_BUCKETS; bucket++)\n"                     \
+  "      if (histogram->buckets[bucket] != 0)\n"                               \
+  "        printf(\" b%u=%llu\", bucket,\n"                                    \
+  "               (unsigned long long)histogram->buckets[bucket]);\n"          \
+  "    putchar('\\n');\n"                                                      \
+  "  }\n"                                                                      \
+  "}\n"                                                                        \
+  "static void kpc_latency_register(void) {\n"                                 \
+  "  kpc_latency_init();\n"                                                    \
+  "  if (__atomic_exchange_n(&kpc_latency_registered, 1, __ATOMIC_ACQ_REL) == 0)\n" \
+  "    atexit(kpc_latency_print);\n"                                           \
+  "}\n"                                                                        \
+  "static inline void kpc_enter(unsigned id) {\n"                              \
+  "  uint64_t now;\n"                                                          \
+  "  if (!__atomic_load_n(&kpc_latency_registered, __ATOMIC_ACQUIRE))\n"       \
+  "    kpc_latency_register();\n"                                              \
+  "  now = kpc_now();\n"                                                       \
+  "  kpc_close(now);\n"                                                        \
+  "  kpc_open = &kpc_latency[id];\n"                                           \
+  "  kpc_open_start = now;\n"                                                  \
+  "  kpc_open_id = id;\n"                                                      \
+  "}\n"                                                                        \
+  "#define LOG(ID) { kpc_enter(ID); }\n"                                       \
+  "#define LOG_PTR(PTR)\n"                                                     \
+  "#elif defined(KPC_THREADED)\n"                                              \
+  "#define LOG(ID) { if (KPC_SHOULD_LOG(ID)) kpc_record((ID), NULL); }\n"      \
+  "#define LOG_PTR(PTR) kpc_record(KPC_CALL, (const void *)(PTR));\n"          \
+  "#else\n"                                                                    \
+  "#define LOG(ID) { if (KPC_SHOULD_LOG(ID)) printf(\"br_%u\\n\", (unsigned)(ID)); }\n" \
+  "#define LOG_PTR(PTR) printf(\"func_%p\\n\", PTR);\n"                        \
+  "#endif\n"                                                                   \
+  "/* A target line shared by several branch points logs the id that its\n"    \
+  " * function's kpc_targets holds for the last branch point reached. */\n"    \
+  "#define LOG_TARGET(COLUMN) LOG(kpc_targets[kpc_state][COLUMN])\n"           \
+  "/* Loop summaries: the targets in a loop's body are counted in counters local\n" \
+  " * to one execution of the loop, and a single record is printed when the loop\n" \
+  " * is left, whether by its condition, break, return or goto:\n"             \
+  " *   \"loop br_E xN br_A=a br_B=b\"\n"                                      \
+  " * br_E is the loop's first body target and N the number of iterations; the\n" \
+  " * other targets reached follow with their counts. Sampling does not apply to\n" \
+  " * them, and calls in the loop are still logged as they happen. */\n"       \
+  "struct kpc_loop {\n"                                                        \
+  "  const unsigned *ids;\n"                                                   \
+  "  unsigned long *counts;\n"                                                 \
+  "  unsigned size;\n"                                                         \
+  "};\n"                                                                       \
+  "static inline void kpc_loop_count(struct kpc_loop *loop, unsigned id) {\n"  \
+  "  unsigned slot;\n"                                                         \
+  "  for (slot = 0; slot < loop->size; slot++)\n"                              \
+  "    if (loop->ids[slot] == id) {\n"                                         \
+  "      loop->counts[slot]++;\n"                                              \
+  "      return;\n"                                                            \
+  "    }\n"                                                                    \
+  "}\n"                                                                        \
+  "static inline void kpc_loop_end(struct kpc_loop *loop) {\n"                 \
+  "  char *text = (char *)malloc(48 * (loop->size + 1));\n"                    \
+  "  int length;\n"                                                            \
+  "  unsigned slot;\n"                                                         \
+  "  if (text == NULL) return;\n"                                              \
+  "  length = sprintf(text, \"loop br_%u x%lu\", loop->ids[0], loop->counts[0]);\n" \
+  "  for (slot = 1; slot < loop->size; slot++)\n"                              \
+  "    if (loop->counts[slot] != 0)\n"                                         \
+  "      length += sprintf(text + length, \" br_%u=%lu\", loop->ids[slot],\n"  \
+  "                        loop->counts[slot]);\n"                             \
+  "#if defined(KPC_THREADED)\n"                                                \
+  "  kpc_record(KPC_SUMMARY, text);\n"                                         \
+  "#else\n"                                                                    \
+  "  puts(text);\n"                                                            \
+  "  free(text);\n"                                                            \
+  "#endif\n"                                                                   \
+  "}\n"                                                                        \
+  "#define KPC_LOOP_SIZE(LINE) (sizeof(kpc_loop_ids_##LINE) / sizeof(unsigned))\n" \
+  "#define KPC_LOOP_BEGIN(LINE)                                                   \\\n" \
+  "  unsigned long kpc_loop_counts_##LINE[KPC_LOOP_SIZE(LINE)] = {0};             \\\n" \
+  "  struct kpc_loop kpc_loop_##LINE __attribute__((cleanup(kpc_loop_end))) = {   \\\n" \
+  "      kpc_loop_ids_##LINE, kpc_loop_counts_##LINE, KPC_LOOP_SIZE(LINE)};\n" \
+  "#define LOG_IN_LOOP(LINE, SLOT) kpc_loop_##LINE.counts[SLOT]++;\n"          \
+  "#define LOG_TARGET_IN_LOOP(LINE, COLUMN)                                       \\\n" \
+  "  kpc_loop_count(&kpc_loop_##LINE, kpc_targets[kpc_state][COLUMN]);\n"      \
+  "#if defined(KPC_FORKSERVER)\n"                                              \
+  "/* -DKPC_FORKSERVER: if the program is started with a control socket on fd\n" \
+  " * KPC_FORKSRV_FD, main() stops before its body and serves runs instead.\n" \
+  " * Each request carries the stdin and stdout descriptors of one run; the\n" \
+  " * server forks, the child resets the trace state and runs main's body on\n" \
+  " * them, and the server replies with the child's pid and then its wait\n"   \
+  " * status. Started without the socket, the program runs normally. */\n"     \
+  "#include <fcntl.h>\n"                                                       \
+  "#include <string.h>\n"                                                      \
+  "#include <sys/socket.h>\n"                                                  \
+  "#include <sys/wait.h>\n"                                                    \
+  "#include <unistd.h>\n"                                                      \
+  "#define KPC_FORKSRV_FD 198\n"                                               \
+  "static int kpc_receive_run(int fds[2]) {\n"                                 \
+  "  char byte;\n"                                                             \
+  "  char control[CMSG_SPACE(2 * sizeof(int))];\n"                             \
+  "  struct iovec data = {&byte, 1};\n"                                        \
+  "  struct msghdr message;\n"                                                 \
+  "  struct cmsghdr *header;\n"                                                \
+  "  memset(&message, 0, sizeof(message));\n"                                  \
+  "  message.msg_iov = &data;\n"                                               \
+  "  message.msg_iovlen = 1;\n"                                                \
+  "  message.msg_control = control;\n"                                         \
+  "  message.msg_controllen = sizeof(control);\n"                              \
+  "  if (recvmsg(KPC_FORKSRV_FD, &message, 0) <= 0) return -1;\n"              \
+  "  header = CMSG_FIRSTHDR(&message);\n"                                      \
+  "  if (header == NULL || header->cmsg_type != SCM_RIGHTS ||\n"               \
+  "      header->cmsg_len != CMSG_LEN(2 * sizeof(int)))\n"                     \
+  "    return -1;\n"                                                           \
+  "  memcpy(fds, CMSG_DATA(header), 2 * sizeof(int));\n"                       \
+  "  return 0;\n"                                                              \
+  "}\n"                                                                        \
+  "static void kpc_reset_trace(void) {\n"                                      \
+  "#if defined(KPC_SAMPLE_EVERY) || defined(KPC_SAMPLE_FIRST)\n"               \
+  "  memset(kpc_hits, 0, sizeof(kpc_hits));\n"                                 \
+  "#endif\n"                                                                   \
+  "#if defined(KPC_THREADED)\n"                                                \
+  "  kpc_buffers = NULL;\n"                                                    \
+  "  kpc_local = NULL;\n"                                                      \
+  "  kpc_num_threads = 0;\n"                                                   \
+  "#endif\n"                                                                   \
+  "}\n"                                                                        \
+  "static void kpc_fork_server(void) {\n"                                      \
+  "  int fds[2], status;\n"                                                    \
+  "  pid_t pid;\n"                                                             \
+  "  if (fcntl(KPC_FORKSRV_FD, F_GETFD) < 0) return;\n"                        \
+  "  fflush(NULL);\n"                                                          \
+  "  while (kpc_receive_run(fds) == 0) {\n"                                    \
+  "    pid = fork();\n"                                                        \
+  "    if (pid == 0) {\n"                                                      \
+  "      close(KPC_FORKSRV_FD);\n"                                             \
+  "      dup2(fds[0], STDIN_FILENO);\n"                                        \
+  "      dup2(fds[1], STDOUT_FILENO);\n"                                       \
+  "      close(fds[0]);\n"                                                     \
+  "      close(fds[1]);\n"                                                     \
+  "      kpc_reset_trace();\n"                                                 \
+  "      return;\n"                                                            \
+  "    }\n"                                                                    \
+  "    close(fds[0]);\n"                                                       \
+  "    close(fds[1]);\n"                                                       \
+  "    if (write(KPC_FORKSRV_FD, &pid, sizeof(pid)) != sizeof(pid)) break;\n"  \
+  "    if (pid < 0) continue;\n"                                               \
+  "    waitpid(pid, &status, 0);\n"                                            \
+  "    if (write(KPC_FORKSRV_FD, &status, sizeof(status)) != sizeof(status))\n" \
+  "      break;\n"                                                             \
+  "  }\n"                                                                      \
+  "  _exit(0);\n"                                                              \
+  "}\n"                                                                        \
+  "#define KPC_FORK_SERVER() kpc_fork_server();\n"                             \
+  "#else\n"                                                                    \
+  "#define KPC_FORK_SERVER()\n"                                                \
+  "#endif\n"
 
-#define DECLARE_BRANCH(BRANCH) "int BRANCH_" << BRANCH << " = 0;\n"
-#define SET_BRANCH(BRANCH) "BRANCH_" << BRANCH << " = 1;\n"
+#define DECLARE_BRANCH_STATE "int kpc_state = 0;\n"
+#define SET_BRANCH_STATE(STATE) "kpc_state = " << STATE << ";\n"
 #define WRITE_LINE(LINE) LINE << '\n';
 
 #define DECLARE_FUNC_PTR(FUNC)                                                 \
-  FUNC->type << " *" << FUNC->name << "_PTR = &" << FUNC->name << ";\n"
+  "static " << FUNC->type << " *" << FUNC->name << "_PTR = &" << FUNC->name    \
+            << ";\n"
@@ -0,0 +1,387 @@
+
+#include "ComplexityProfiler.h"
+#include "TraceAnalyzer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace {
+
+// Reads of stdin among the taint analysis' sources; the first two parse
+// numbers, the others take text.
+const char *STDIN_READS[] = {"scanf", "fscanf", "fgets",  "gets", "fread",
+                             "read",  "getline", "getchar", "fgetc", "getc"};
+
+constexpr unsigned NUM_NUMERIC_READS = 2;
+
+// Index of kind in STDIN_READS, or -1.
+int findStdinRead(const std::string &kind) {
+  for (unsigned read = 0; read < sizeof(STDIN_READS) / sizeof(*STDIN_READS);
+       read++) {
+    if (kind == STDIN_READS[read]) {
+      return read;
+    }
+  }
+  return -1;
+}
+
+double evaluate(ComplexityProfiler::Model model, double n) {
+  switch (model) {
+  case ComplexityProfiler::LOG:
+    return std::log2(n);
+  case ComplexityProfiler::LINEAR:
+    return n;
+  case ComplexityProfiler::N_LOG_N:
+    return n * std::log2(n);
+  case ComplexityProfiler::QUADRATIC:
+    return n * n;
+  case ComplexityProfiler::CUBIC:
+    return n * n * n;
+  default:
+    return 1;
+  }
+}
+
+bool parseRunName(const std::string &name, size_t &input, uint64_t &n) {
+  unsigned long long value;
+  char end;
+  if (sscanf(name.c_str(), "%zu-%llu%c", &input, &value, &end) != 2) {
+    return false;
+  }
+  n = value;
+  return true;
+}
+
+} // namespace
+
+const char *ComplexityProfiler::getModelName(Model model) {
+  static const char *NAMES[NUM_MODELS] = {
+      "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)", "O(n^3)"};
+  return NAMES[model];
+}
+
+ComplexityProfiler::Fit
+ComplexityProfiler::fit(const std::vector<double> &n,
+                        const std::vector<double> &y) {
+  const size_t size = y.size();
+  double meanY = 0;
+  for (double value : y) {
+    meanY += value / size;
+  }
+  double tss = 0;
+  for (double value : y) {
+    tss += (value - meanY) * (value - meanY);
+  }
+
+  Fit best = {CONSTANT, meanY, 0, tss > 0 ? 0.0 : 1.0, 0};
+  double bestRss = tss;
+  for (unsigned model = LOG; model < NUM_MODELS; model++) {
+    std::vector<double> x(size);
+    double meanX = 0;
+    for (size_t i = 0; i < size; i++) {
+      x[i] = evaluate(static_cast<Model>(model), n[i]);
+      meanX += x[i] / size;
+    }
+    double sxx = 0;
+    double sxy = 0;
+    for (size_t i = 0; i < size; i++) {
+      sxx += (x[i] - meanX) * (x[i] - meanX);
+      sxy += (x[i] - meanX) * (y[i] - meanY);
+    }
+    // Only growth is of interest; a falling count stays a constant.
+    if (sxx <= 0 || sxy <= 0) {
+      continue;
+    }
+    const double b = sxy / sxx;
+    const double a = meanY - b * meanX;
+    double rss = 0;
+    for (size_t i = 0; i < size; i++) {
+      const double residual = y[i] - a - b * x[i];
+      rss += residual * residual;
+    }
+    // A costlier model has to fit clearly better, so exact counts of a
+    // linear loop are not called n log n over rounding.
+    if (rss < bestRss - 1e-6 * tss) {
+      best = Fit{static_cast<Model>(model), a, b, 1 - rss / tss, 0};
+      bestRss = rss;
+    }
+  }
+
+  if (size >= 2 && y[size - 2] > 0 && y[size - 1] > 0) {
+    best.slope = std::log(y[size - 1] / y[size - 2]) /
+                 std::log(n[size - 1] / n[size - 2]);
+  }
+  return best;
+}
+
+ComplexityProfiler::ComplexityProfiler(Session &session,
+                                       const std::string &filename,
+                                       unsigned numWorkers,
+                                       const CorpusRunner::Limits &limits,
+                                       uint64_t maxValue)
+    : session(session), filename(filename), numWorkers(numWorkers),
+      limits(limits), maxValue(maxValue) {}
+
+void ComplexityProfiler::findInputs(const Session::Analysis &analysis) {
+  std::vector<bool> seminal(analysis.taintSources.size(), false);
+  for (const TaintAnalysis::BranchTaint &branch : analysis.taintedBranches) {
+    for (unsigned source : branch.sources) {
+      if (source < seminal.size()) {
+        seminal[source] = true;
+      }
+    }
+  }
+
+  for (size_t source = 0; source < analysis.taintSources.size(); source++) {
+    const TaintAnalysis::Source &found = analysis.taintSources[source];
+    // Results of reads such as getchar() have no variable of their own.
+    const std::string name =
+        found.var.empty() ? found.kind + "@" + std::to_string(found.line)
+                          : found.var;
+    size_t input = 0;
+    while (input < inputs.size() && inputs[input].name != name) {
+      input++;
+    }
+    if (input == inputs.size()) {
+      inputs.push_back(Input{name, found.kind, found.line, false});
+    }
+    inputs[input].seminal = inputs[input].seminal || seminal[source];
+
+    const int read = findStdinRead(found.kind);
+    if (read >= 0) {
+      reads.push_back(
+          Read{found.line, read < static_cast<int>(NUM_NUMERIC_READS), input});
+    }
+  }
+  std::stable_sort(
+      reads.begin(), reads.end(),
+      [](const Read &a, const Read &b) { return a.line < b.line; });
+}
+
+std::string ComplexityProfiler::makeStdin(size_t input, uint64_t n) const {
+  std::string text;
+  for (const Read &read : reads) {
+    const uint64_t value = read.input == input ? n : BASE_VALUE;
+    text += read.numeric ? std::to_string(value) : std::string(value, 'a');
+    text += '\n';
+  }
+  return text;
+}
+
+bool ComplexityProfiler::compile(const std::string &source,
+                                 const std::string &executable,
+                                 std::string &error) const {
+#if defined(__clang__)
+  std::string c_compiler("clang");
+#elif defined(__GNUC__)
+  std::string c_compiler("gcc");
+#endif
+  if (c_compiler.empty()) {
+    const char *cc = std::getenv("CC");
+    if (cc == nullptr || *cc == '\0') {
+      error = "No viable C compiler found on system!";
+      return false;
+    }
+    c_compiler = cc;
+  }
+  const std::string command =
+      c_compiler + " -w -O0 " + source + " -o " + executable;
+  if (system(command.c_str()) != 0) {
+    error = "There was an error compiling " + source;
+    return false;
+  }
+  return true;
+}
+
+bool ComplexityProfiler::run(std::string &error) {
+  namespace fs = std::filesystem;
+
+  Session::Analysis analysis;
+  if (!session.analyze(filename, analysis, error, numWorkers)) {
+    return false;
+  }
+  findInputs(analysis);
+
+  std::vector<size_t> swept;
+  for (size_t input = 0; input < inputs.size(); input++) {
+    if (!inputs[input].seminal) {
+      continue;
+    }
+    const bool fromStdin =
+        std::any_of(reads.begin(), reads.end(),
+                    [input](const Read &read) { return read.input == input; });
+    if (fromStdin) {
+      swept.push_back(input);
+    } else {
+      session.print("Not swept: ", inputs[input].name, " (",
+                    inputs[input].kind, ", line ", inputs[input].line,
+                    ") is not read from stdin\n");
+    }
+  }
+  if (swept.empty()) {
+    session.print("No seminal input of ", filename, " is read from stdin.\n");
+    return true;
+  }
+
+  const fs::path directory =
+      fs::path(session.getOutDir()) /
+      (fs::path(filename).filename().string() + ".complexity");
+  const fs::path inputDir = directory / "inputs";
+  std::error_code code;
+  fs::remove_all(inputDir, code);
+  fs::create_directories(inputDir, code);
+  if (code) {
+    error = "cannot create " + inputDir.string();
+    return false;
+  }
+
+  std::vector<uint64_t> values;
+  for (uint64_t n = 1; n <= maxValue; n *= 2) {
+    values.push_back(n);
+  }
+  for (size_t input : swept) {
+    for (uint64_t n : values) {
+      const fs::path path =
+          inputDir / (std::to_string(input) + "-" + std::to_string(n));
+      std::ofstream(path, std::ios::binary) << makeStdin(input, n);
+    }
+  }
+
+  const std::string source = (directory / "program.c").string();
+  const std::string executable = (directory / "program").string();
+  std::ofstream(source) << analysis.instrumentedProgram;
+  if (!compile(source, executable, error)) {
+    return false;
+  }
+
+  const std::string storePath = (directory / "runs").string();
+  CorpusRunner runner(session, executable, inputDir.string(), numWorkers,
+                      limits);
+  if (!runner.run(storePath, error)) {
+    return false;
+  }
+  CorpusRunner::Store store(storePath);
+  if (!store.isOpen()) {
+    error = store.getError();
+    return false;
+  }
+
+  // Hits of every dictionary entry, by input and value.
+  std::vector<std::map<uint64_t, std::vector<uint64_t>>> hits(inputs.size());
+  std::vector<uint64_t> firstTimeout(inputs.size(), UINT64_MAX);
+  const std::string tracePath = (directory / "trace").string();
+  for (const CorpusRunner::Entry &entry : store.getEntries()) {
+    size_t input;
+    uint64_t n;
+    if (!parseRunName(store.getName(entry), input, n) ||
+        input >= inputs.size()) {
+      continue;
+    }
+    if (entry.timedOut) {
+      firstTimeout[input] = std::min(firstTimeout[input], n);
+      continue;
+    }
+    {
+      std::ofstream trace(tracePath, std::ios::binary);
+      store.writeTrace(store.getName(entry), trace);
+    }
+    TraceAnalyzer analyzer;
+    if (!analyzer.analyze(tracePath, error)) {
+      return false;
+    }
+    std::vector<uint64_t> &counts = hits[input][n];
+    for (const BranchDictionary::Entry &branch : analysis.branches) {
+      counts.push_back(analyzer.getBranchHits(branch.id));
+    }
+  }
+  fs::remove(tracePath, code);
+
+  std::ostringstream report;
+  report << "\nComplexity of " << filename << " over n = " << values.front()
+         << " .. " << values.back() << ", other inputs at " << BASE_VALUE
+         << ":\n";
+  for (size_t input : swept) {
+    report << "\nInput " << inputs[input].name << " (" << inputs[input].kind
+           << ", line " << inputs[input].line << "):\n";
+    // Values past a timeout would only fit the runs that finished.
+    std::vector<double> n;
+    std::vector<const std::vector<uint64_t> *> runs;
+    for (const auto &run : hits[input]) {
+      if (run.first < firstTimeout[input]) {
+        n.push_back(run.first);
+        runs.push_back(&run.second);
+      }
+    }
+    if (firstTimeout[input] != UINT64_MAX) {
+      report << "  runs timed out from n = " << firstTimeout[input] << '\n';
+    }
+    if (n.size() < 3) {
+      report << "  too few runs to fit\n";
+      continue;
+    }
+
+    struct Result {
+      size_t branch;
+      Fit fit;
+      double last;
+    };
+    std::vector<Result> results;
+    std::vector<double> work(n.size(), 0);
+    unsigned numConstant = 0;
+    for (size_t branch = 0; branch < analysis.branches.size(); branch++) {
+      std::vector<double> y(n.size());
+      for (size_t run = 0; run < n.size(); run++) {
+        y[run] = (*runs[run])[branch];
+        work[run] += y[run];
+      }
+      if (std::all_of(y.begin(), y.end(), [](double v) { return v == 0; })) {
+        continue;
+      }
+      const Fit fitted = fit(n, y);
+      if (fitted.model == CONSTANT) {
+        numConstant++;
+      } else {
+        results.push_back(Result{branch, fitted, y.back()});
+      }
+    }
+    std::stable_sort(results.begin(), results.end(),
+                     [](const Result &a, const Result &b) {
+                       return a.fit.model != b.fit.model
+                                  ? a.fit.model > b.fit.model
+                                  : a.last > b.last;
+                     });
+
+    char numbers[64];
+    for (const Result &result : results) {
+      const BranchDictionary::Entry &branch = analysis.branches[result.branch];
+      snprintf(numbers, sizeof(numbers), "slope %.2f, R^2 %.3f",
+               result.fit.slope, result.fit.r2);
+      report << "  br_" << branch.id << ": "
+             << getModelName(result.fit.model) << ", "
+             << (*runs.front())[result.branch] << " -> "
+             << static_cast<uint64_t>(result.last) << " hits, " << numbers
+             << "  " << branch.file << ", " << branch.branchLine << ", "
+             << branch.targetLine << " in " << branch.function
+             << (result.fit.model > LINEAR ? "  <- superlinear" : "")
+             << '\n';
+    }
+    if (numConstant > 0) {
+      report << "  " << numConstant
+             << (numConstant == 1 ? " target" : " targets") << " constant\n";
+    }
+    const Fit total = fit(n, work);
+    snprintf(numbers, sizeof(numbers), "slope %.2f", total.slope);
+    report << "  All targets: " << getModelName(total.model) << ", "
+           << static_cast<uint64_t>(work.front()) << " -> "
+           << static_cast<uint64_t>(work.back()) << " hits, " << numbers
+           << '\n';
+  }
+  session.print(report.str());
+  return true;
+}
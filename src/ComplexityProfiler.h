@@ -0,0 +1,93 @@
+
+#ifndef COMPLEXITY_PROFILER__H
+#define COMPLEXITY_PROFILER__H
+
+#include "CorpusRunner.h"
+#include "Session.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Empirical complexity of a program in its seminal inputs. The stdin inputs
+// that the taint analysis finds reaching branch conditions are swept over
+// powers of two, one at a time with the others held at BASE_VALUE; numbers
+// are written for scanf and fscanf, lines of that many characters for the
+// other reads. The instrumented program runs once per value on a
+// CorpusRunner pool, and the hit counts of every target are fitted against
+// the growth models below, so targets whose work grows faster than
+// expected show up before a large input reaches them. Inputs that come
+// from argv, getenv or files are listed but not swept.
+class ComplexityProfiler {
+public:
+  enum Model { CONSTANT, LOG, LINEAR, N_LOG_N, QUADRATIC, CUBIC, NUM_MODELS };
+
+  // y = a + b * model(n), by least squares.
+  struct Fit {
+    Model model;
+    double a;
+    double b;
+    double r2;
+    // Slope of log y over log n between the two largest values, an
+    // estimate of the local exponent.
+    double slope;
+  };
+
+  static constexpr uint64_t BASE_VALUE = 16;
+
+  static const char *getModelName(Model model);
+
+  // Picks the simplest model that fits the points best; n must be positive
+  // and increasing.
+  static Fit fit(const std::vector<double> &n, const std::vector<double> &y);
+
+private:
+  Session &session;
+
+  const std::string filename;
+
+  unsigned numWorkers;
+
+  CorpusRunner::Limits limits;
+
+  uint64_t maxValue;
+
+  // A variable (or a read's result) whose sources are swept together.
+  struct Input {
+    std::string name;
+    std::string kind;
+    unsigned line;
+    bool seminal;
+  };
+
+  // Stdin reads in line order, each with its input.
+  struct Read {
+    unsigned line;
+    bool numeric;
+    size_t input;
+  };
+
+  std::vector<Input> inputs;
+
+  std::vector<Read> reads;
+
+  void findInputs(const Session::Analysis &analysis);
+
+  // Stdin of the run that gives input the value n.
+  std::string makeStdin(size_t input, uint64_t n) const;
+
+  bool compile(const std::string &source, const std::string &executable,
+               std::string &error) const;
+
+public:
+  ComplexityProfiler(
+      Session &session, const std::string &filename, unsigned numWorkers = 1,
+      const CorpusRunner::Limits &limits = CorpusRunner::Limits(),
+      uint64_t maxValue = 1024);
+
+  // Analyzes and instruments the file, runs the sweep and reports the fits
+  // through the session. Generated files go to <out>/<file>.complexity/.
+  bool run(std::string &error);
+};
+
+#endif
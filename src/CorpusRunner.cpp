@@ -0,0 +1,568 @@
+
+#include "CorpusRunner.h"
+#include "Session.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char MAGIC[8] = {'K', 'P', 'C', 'R', 'U', 'N', 'S', '\0'};
+
+constexpr uint32_t VERSION = 2;
+
+// Descriptor the emitted header's fork server reads requests from.
+constexpr int FORKSRV_FD = 198;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct Trailer {
+  uint64_t chunkTableOffset;
+  uint64_t manifestsOffset;
+  uint64_t numManifestIds;
+  uint64_t indexOffset;
+  uint32_t numChunks;
+  uint32_t numEntries;
+  uint32_t namesSize;
+  uint32_t reserved;
+  char magic[8];
+};
+
+uint64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void setLimit(int resource, rlim_t value) {
+  struct rlimit limit = {value, value};
+  setrlimit(resource, &limit);
+}
+
+} // namespace
+
+CorpusRunner::CorpusRunner(Session &session, const std::string &executable,
+                           const std::string &inputDir, unsigned numWorkers,
+                           const Limits &limits, bool useForkServer)
+    : session(session), executable(executable), inputDir(inputDir),
+      numWorkers(std::max(1u, numWorkers)), limits(limits),
+      useForkServer(useForkServer) {}
+
+void CorpusRunner::setUpChild(int in, int out) const {
+  const int null = open("/dev/null", O_WRONLY);
+  if (in < 0 || out < 0 || null < 0) {
+    _exit(127);
+  }
+  dup2(in, STDIN_FILENO);
+  dup2(out, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+  close(in);
+  close(out);
+  close(null);
+
+  if (limits.memoryMB > 0) {
+    setLimit(RLIMIT_AS, static_cast<rlim_t>(limits.memoryMB) << 20);
+  }
+  if (limits.cpuSeconds > 0) {
+    setLimit(RLIMIT_CPU, limits.cpuSeconds);
+  }
+  setLimit(RLIMIT_CORE, 0);
+}
+
+pid_t CorpusRunner::launch(const std::string &input,
+                           const std::string &outputPath) const {
+  const pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  // Child: its own process group so a timeout kills anything it spawned.
+  setpgid(0, 0);
+  setUpChild(open(input.c_str(), O_RDONLY),
+             open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+  execl(executable.c_str(), executable.c_str(), static_cast<char *>(nullptr));
+  _exit(127);
+}
+
+bool CorpusRunner::startServer(Server &server, std::string &error) const {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+    error = "socketpair failed: " + std::string(strerror(errno));
+    return false;
+  }
+  server.pid = fork();
+  if (server.pid == 0) {
+    setpgid(0, 0);
+    dup2(sockets[1], FORKSRV_FD);
+    setUpChild(open("/dev/null", O_RDONLY), open("/dev/null", O_WRONLY));
+    execl(executable.c_str(), executable.c_str(), static_cast<char *>(nullptr));
+    _exit(127);
+  }
+  close(sockets[1]);
+  if (server.pid < 0) {
+    close(sockets[0]);
+    error = "fork failed: " + std::string(strerror(errno));
+    return false;
+  }
+  server.fd = sockets[0];
+  server.busy = false;
+  return true;
+}
+
+bool CorpusRunner::sendRun(Server &server, const std::string &input,
+                           const std::string &outputPath,
+                           std::string &error) const {
+  int fds[2] = {open(input.c_str(), O_RDONLY | O_CLOEXEC),
+                open(outputPath.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+  if (fds[0] < 0 || fds[1] < 0) {
+    error = "cannot open the files of run " + input;
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return false;
+  }
+
+  char byte = 0;
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec data = {&byte, 1};
+  struct msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  const bool sent = sendmsg(server.fd, &message, MSG_NOSIGNAL) == 1;
+  close(fds[0]);
+  close(fds[1]);
+  pid_t pid;
+  if (!sent || read(server.fd, &pid, sizeof(pid)) != sizeof(pid)) {
+    error = executable + " does not run a fork server; build it with "
+                         "-DKPC_FORKSERVER";
+    return false;
+  }
+  if (pid < 0) {
+    error = "the fork server could not fork";
+    return false;
+  }
+  server.run.pid = pid;
+  return true;
+}
+
+void CorpusRunner::stopServer(Server &server) const {
+  // Closing the socket ends the server's request loop.
+  close(server.fd);
+  int status;
+  waitpid(server.pid, &status, 0);
+}
+
+bool CorpusRunner::run(const std::string &storePath, std::string &error) {
+  std::error_code ec;
+  std::vector<std::string> inputs;
+  for (const fs::directory_entry &entry :
+       fs::directory_iterator(inputDir, ec)) {
+    if (entry.is_regular_file()) {
+      inputs.push_back(entry.path().filename().string());
+    }
+  }
+  if (ec) {
+    error = "cannot read " + inputDir + ": " + ec.message();
+    return false;
+  }
+  std::sort(inputs.begin(), inputs.end());
+
+  if (access(executable.c_str(), X_OK) != 0) {
+    error = executable + " is not executable";
+    return false;
+  }
+
+  FILE *store = fopen(storePath.c_str(), "wb");
+  if (store == nullptr) {
+    error = "cannot create " + storePath;
+    return false;
+  }
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  fwrite(&header, sizeof(header), 1, store);
+  ChunkStore chunkStore(store, sizeof(header));
+  std::vector<uint32_t> manifests;
+
+  // Each run writes its trace to a private file next to the store, which
+  // is appended to the store once the run ends.
+  const fs::path scratch = storePath + ".runs";
+  fs::create_directories(scratch, ec);
+
+  std::vector<Entry> entries(inputs.size(), Entry{});
+  std::vector<Run> running;
+  std::vector<char> buffer(1 << 16);
+  size_t next = 0;
+  unsigned numFailed = 0;
+  unsigned numTimedOut = 0;
+
+  auto finish = [&](const Run &run, int status) {
+    Entry &entry = entries[run.input];
+    entry.wallMs = static_cast<uint32_t>(nowMs() - run.startMs);
+    entry.timedOut = run.timedOut;
+    entry.status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                     : -static_cast<int32_t>(WTERMSIG(status));
+    numFailed += entry.status != 0 && !run.timedOut;
+    numTimedOut += run.timedOut;
+
+    entry.manifest = manifests.size();
+    const uint64_t bytesBefore = chunkStore.getBytesAdded();
+    if (FILE *trace = fopen(run.outputPath.c_str(), "rb")) {
+      size_t numRead;
+      while ((numRead = fread(buffer.data(), 1, buffer.size(), trace)) > 0) {
+        chunkStore.append(buffer.data(), numRead, manifests);
+      }
+      fclose(trace);
+    }
+    chunkStore.endTrace(manifests);
+    entry.numChunks = manifests.size() - entry.manifest;
+    entry.traceSize = chunkStore.getBytesAdded() - bytesBefore;
+    unlink(run.outputPath.c_str());
+  };
+
+  std::vector<Server> servers;
+  if (useForkServer) {
+    servers.resize(numWorkers);
+    for (size_t i = 0; i < servers.size(); i++) {
+      if (!startServer(servers[i], error)) {
+        servers.resize(i);
+        break;
+      }
+    }
+  }
+
+  auto timedOut = [this](const Run &run) {
+    return limits.timeout > 0 && !run.timedOut &&
+           nowMs() - run.startMs >= limits.timeout * 1000ull;
+  };
+
+  while (useForkServer && !servers.empty()) {
+    bool anyBusy = false;
+    for (Server &server : servers) {
+      if (!server.busy && error.empty() && next < inputs.size()) {
+        server.run = Run{0, next, "", nowMs(), false};
+        server.run.outputPath =
+            (scratch / (std::to_string(next) + ".trace")).string();
+        if (!sendRun(server, (fs::path(inputDir) / inputs[next]).string(),
+                     server.run.outputPath, error)) {
+          break;
+        }
+        server.run.startMs = nowMs();
+        server.busy = true;
+        next++;
+      }
+      anyBusy |= server.busy;
+    }
+    if (!anyBusy) {
+      break;
+    }
+
+    std::vector<struct pollfd> fds;
+    for (const Server &server : servers) {
+      fds.push_back({server.fd, static_cast<short>(server.busy ? POLLIN : 0),
+                     0});
+    }
+    poll(fds.data(), fds.size(), 2);
+    for (size_t i = 0; i < servers.size(); i++) {
+      Server &server = servers[i];
+      if (!server.busy) {
+        continue;
+      }
+      if (fds[i].revents != 0) {
+        int status;
+        if (read(server.fd, &status, sizeof(status)) != sizeof(status)) {
+          error = "a fork server exited unexpectedly";
+          status = W_EXITCODE(127, 0);
+        }
+        finish(server.run, status);
+        server.busy = false;
+      } else if (timedOut(server.run)) {
+        kill(server.run.pid, SIGKILL);
+        server.run.timedOut = true;
+      }
+    }
+  }
+  for (Server &server : servers) {
+    stopServer(server);
+  }
+
+  while (!useForkServer && (next < inputs.size() || !running.empty())) {
+    while (error.empty() && running.size() < numWorkers &&
+           next < inputs.size()) {
+      const std::string outputPath =
+          (scratch / (std::to_string(next) + ".trace")).string();
+      const pid_t pid =
+          launch((fs::path(inputDir) / inputs[next]).string(), outputPath);
+      if (pid < 0) {
+        error = "fork failed: " + std::string(strerror(errno));
+        break;
+      }
+      running.push_back(Run{pid, next++, outputPath, nowMs(), false});
+    }
+    if (running.empty() && !error.empty()) {
+      break;
+    }
+
+    bool reaped = false;
+    for (size_t i = 0; i < running.size();) {
+      int status;
+      if (waitpid(running[i].pid, &status, WNOHANG) == running[i].pid) {
+        // Take down anything the run left behind in its process group.
+        kill(-running[i].pid, SIGKILL);
+        finish(running[i], status);
+        running.erase(running.begin() + i);
+        reaped = true;
+        continue;
+      }
+      if (timedOut(running[i])) {
+        kill(-running[i].pid, SIGKILL);
+        running[i].timedOut = true;
+      }
+      i++;
+    }
+    if (!reaped) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+  fs::remove_all(scratch, ec);
+
+  // Index, sorted by input name since inputs were numbered in that order.
+  std::string names;
+  for (size_t input = 0; input < next; input++) {
+    entries[input].name = names.size();
+    names += inputs[input];
+    names += '\0';
+  }
+  const std::vector<ChunkStore::Chunk> &chunks = chunkStore.getChunks();
+  Trailer trailer = {};
+  trailer.chunkTableOffset = chunkStore.getOffset();
+  trailer.numChunks = chunks.size();
+  trailer.manifestsOffset =
+      trailer.chunkTableOffset + chunks.size() * sizeof(ChunkStore::Chunk);
+  trailer.numManifestIds = manifests.size();
+  trailer.indexOffset =
+      trailer.manifestsOffset + manifests.size() * sizeof(uint32_t);
+  trailer.numEntries = next;
+  trailer.namesSize = names.size();
+  std::memcpy(trailer.magic, MAGIC, sizeof(MAGIC));
+  fwrite(chunks.data(), sizeof(ChunkStore::Chunk), chunks.size(), store);
+  fwrite(manifests.data(), sizeof(uint32_t), manifests.size(), store);
+  fwrite(entries.data(), sizeof(Entry), next, store);
+  fwrite(names.data(), 1, names.size(), store);
+  fwrite(&trailer, sizeof(trailer), 1, store);
+  if (fclose(store) != 0 || chunkStore.hasFailed()) {
+    error = "error writing " + storePath;
+    return false;
+  }
+
+  session.print("Ran ", next, " of ", inputs.size(), " inputs on ", numWorkers,
+                " workers: ", next - numFailed - numTimedOut, " ok, ",
+                numFailed, " failed, ", numTimedOut,
+                " timed out. Results: ", storePath, " (",
+                chunkStore.getBytesAdded(), " trace bytes stored in ",
+                trailer.chunkTableOffset - sizeof(header), ")\n");
+  return error.empty();
+}
+
+CorpusRunner::Store::Store(const std::string &path)
+    : file(fopen(path.c_str(), "rb")) {
+  if (file == nullptr) {
+    error = "cannot open " + path;
+    return;
+  }
+
+  Header header;
+  Trailer trailer;
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+               std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+               header.version == VERSION &&
+               fseeko(file, -static_cast<off_t>(sizeof(trailer)), SEEK_END) ==
+                   0 &&
+               fread(&trailer, sizeof(trailer), 1, file) == 1 &&
+               std::memcmp(trailer.magic, MAGIC, sizeof(MAGIC)) == 0;
+  if (valid) {
+    chunks.resize(trailer.numChunks);
+    manifests.resize(trailer.numManifestIds);
+    entries.resize(trailer.numEntries);
+    names.resize(trailer.namesSize);
+    // The sections follow each other, so they are read in one pass.
+    valid = fseeko(file, trailer.chunkTableOffset, SEEK_SET) == 0 &&
+            fread(chunks.data(), sizeof(ChunkStore::Chunk), chunks.size(),
+                  file) == chunks.size() &&
+            fread(manifests.data(), sizeof(uint32_t), manifests.size(),
+                  file) == manifests.size() &&
+            fread(entries.data(), sizeof(Entry), entries.size(), file) ==
+                entries.size() &&
+            fread(&names[0], 1, names.size(), file) == names.size() &&
+            (names.empty() || names.back() == '\0');
+  }
+  for (size_t id = 0; valid && id < chunks.size(); id++) {
+    valid = chunks[id].offset + chunks[id].size <= trailer.chunkTableOffset;
+  }
+  for (size_t id = 0; valid && id < manifests.size(); id++) {
+    valid = manifests[id] < chunks.size();
+  }
+  for (const Entry &entry : entries) {
+    valid = valid && entry.name < names.size() &&
+            entry.manifest + entry.numChunks <= manifests.size();
+  }
+  if (!valid) {
+    error = path + ": not a corpus result store";
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+CorpusRunner::Store::~Store() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+const CorpusRunner::Entry *
+CorpusRunner::Store::find(const std::string &name) const {
+  // Entries are sorted by name.
+  auto entry = std::lower_bound(
+      entries.begin(), entries.end(), name,
+      [this](const Entry &entry, const std::string &name) {
+        return getName(entry) < name;
+      });
+  return entry != entries.end() && getName(*entry) == name ? &*entry
+                                                           : nullptr;
+}
+
+bool CorpusRunner::Store::readChunk(uint32_t id,
+                                    std::vector<char> &buffer) const {
+  const ChunkStore::Chunk &chunk = chunks[id];
+  buffer.resize(chunk.size);
+  return fseeko(file, chunk.offset, SEEK_SET) == 0 &&
+         fread(buffer.data(), 1, chunk.size, file) == chunk.size;
+}
+
+bool CorpusRunner::Store::writeTrace(const std::string &name,
+                                     std::ostream &out) const {
+  const Entry *entry = find(name);
+  if (entry == nullptr) {
+    return false;
+  }
+  std::vector<char> buffer;
+  for (uint64_t chunk = entry->manifest;
+       chunk < entry->manifest + entry->numChunks; chunk++) {
+    if (!readChunk(manifests[chunk], buffer)) {
+      return false;
+    }
+    out.write(buffer.data(), buffer.size());
+  }
+  return true;
+}
+
+bool CorpusRunner::Store::comparePrefix(const std::string &first,
+                                        const std::string &second,
+                                        Prefix &prefix) const {
+  const Entry *a = find(first);
+  const Entry *b = find(second);
+  if (a == nullptr || b == nullptr) {
+    return false;
+  }
+  prefix = Prefix{0, 0};
+
+  uint64_t chunkA = a->manifest;
+  uint64_t chunkB = b->manifest;
+  const uint64_t endA = a->manifest + a->numChunks;
+  const uint64_t endB = b->manifest + b->numChunks;
+  for (; chunkA < endA && chunkB < endB &&
+         manifests[chunkA] == manifests[chunkB];
+       chunkA++, chunkB++) {
+    prefix.bytes += chunks[manifests[chunkA]].size;
+    prefix.lines += chunks[manifests[chunkA]].lines;
+  }
+
+  // Past the shared chunks the cut points may differ, so the rest is
+  // compared as two byte streams.
+  std::vector<char> bufferA;
+  std::vector<char> bufferB;
+  size_t posA = 0;
+  size_t posB = 0;
+  while (true) {
+    if (posA == bufferA.size()) {
+      if (chunkA == endA || !readChunk(manifests[chunkA++], bufferA)) {
+        break;
+      }
+      posA = 0;
+    }
+    if (posB == bufferB.size()) {
+      if (chunkB == endB || !readChunk(manifests[chunkB++], bufferB)) {
+        break;
+      }
+      posB = 0;
+    }
+    const size_t length =
+        std::min(bufferA.size() - posA, bufferB.size() - posB);
+    const auto mismatch =
+        std::mismatch(bufferA.begin() + posA, bufferA.begin() + posA + length,
+                      bufferB.begin() + posB);
+    const size_t same = mismatch.first - (bufferA.begin() + posA);
+    prefix.bytes += same;
+    prefix.lines += std::count(bufferA.begin() + posA, mismatch.first, '\n');
+    if (same < length) {
+      break;
+    }
+    posA += length;
+    posB += length;
+  }
+  return true;
+}
+
+void CorpusRunner::Store::printIndex(std::ostream &out) const {
+  for (const Entry &entry : entries) {
+    out << getName(entry) << ": ";
+    if (entry.timedOut) {
+      out << "timed out";
+    } else if (entry.status < 0) {
+      out << "killed by signal " << -entry.status;
+    } else {
+      out << "exit " << entry.status;
+    }
+    out << ", " << entry.wallMs << " ms, " << entry.traceSize
+        << " trace bytes\n";
+  }
+
+  uint64_t traceBytes = 0;
+  uint64_t storedBytes = 0;
+  for (const Entry &entry : entries) {
+    traceBytes += entry.traceSize;
+  }
+  for (const ChunkStore::Chunk &chunk : chunks) {
+    storedBytes += chunk.size;
+  }
+  out << entries.size() << " runs, " << traceBytes << " trace bytes in "
+      << chunks.size() << " distinct chunks of " << storedBytes
+      << " bytes\n";
+}
@@ -0,0 +1,173 @@
+
+#ifndef CORPUS_RUNNER__H
+#define CORPUS_RUNNER__H
+
+#include "ChunkStore.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+class Session;
+
+// Runs an instrumented executable once per file of an input directory, with
+// the file as its stdin, on a bounded pool of child processes. Each child
+// gets rlimits and a wall-clock timeout. The traces the runs print are
+// collected into a single result store, deduplicated across runs by a
+// ChunkStore:
+//
+//   Header       magic "KPCRUNS", version
+//   Chunks       every distinct chunk of the traces, once, as first seen
+//   Chunk table  one ChunkStore::Chunk per chunk
+//   Manifests    the chunk ids of every run's trace, run after run
+//   Index        one Entry per input, sorted by input name
+//   Names        NUL-terminated input names, referenced by offset
+//   Trailer      offsets and sizes of the sections above, magic
+//
+// The trailer sits at the end so the store can be written in one pass. Runs
+// that behave alike share most of their chunks, so a sweep costs disk in
+// proportion to its distinct behavior; any run's trace is rebuilt from its
+// manifest without reading the others.
+//
+// With a fork server, each worker starts the binary once (built with
+// -DKPC_FORKSERVER) and sends it one request per input over a socket
+// pair, so a run costs a fork instead of an exec and the program's startup.
+class CorpusRunner {
+public:
+  struct Limits {
+    // Wall-clock seconds before a run is killed; 0 disables the timeout.
+    unsigned timeout;
+    // Address space limit in MiB; 0 leaves it unlimited.
+    unsigned memoryMB;
+    // CPU seconds, enforced by the kernel as a backstop for the timeout.
+    unsigned cpuSeconds;
+
+    Limits() : timeout(10), memoryMB(0), cpuSeconds(0) {}
+  };
+
+  struct Entry {
+    // The trace's chunk ids are manifests [manifest, manifest + numChunks).
+    uint64_t manifest;
+    uint64_t traceSize;
+    uint32_t name;
+    // Exit code, or the negated signal number if the run was killed.
+    int32_t status;
+    uint32_t wallMs;
+    uint32_t timedOut;
+    uint32_t numChunks;
+    uint32_t reserved;
+  };
+
+  // Length of the longest common prefix of two traces.
+  struct Prefix {
+    uint64_t bytes;
+    uint64_t lines;
+  };
+
+  // Reads the index of a store written by run().
+  class Store {
+    FILE *file;
+
+    std::vector<Entry> entries;
+
+    std::string names;
+
+    std::vector<ChunkStore::Chunk> chunks;
+
+    std::vector<uint32_t> manifests;
+
+    std::string error;
+
+    bool readChunk(uint32_t id, std::vector<char> &buffer) const;
+
+  public:
+    explicit Store(const std::string &path);
+
+    ~Store();
+
+    Store(const Store &) = delete;
+
+    Store &operator=(const Store &) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+
+    const std::string &getError() const { return error; }
+
+    const std::vector<Entry> &getEntries() const { return entries; }
+
+    const char *getName(const Entry &entry) const {
+      return names.c_str() + entry.name;
+    }
+
+    // Entry of the run on input name, or nullptr.
+    const Entry *find(const std::string &name) const;
+
+    // Copies the trace of the run on input name to out.
+    bool writeTrace(const std::string &name, std::ostream &out) const;
+
+    // Common prefix of the traces of the runs on inputs first and second.
+    // The chunks both manifests start with are skipped unread; only from
+    // the first differing chunk on are bytes compared.
+    bool comparePrefix(const std::string &first, const std::string &second,
+                       Prefix &prefix) const;
+
+    void printIndex(std::ostream &out) const;
+  };
+
+private:
+  Session &session;
+
+  const std::string executable;
+
+  const std::string inputDir;
+
+  unsigned numWorkers;
+
+  Limits limits;
+
+  bool useForkServer;
+
+  struct Run {
+    pid_t pid;
+    size_t input;
+    std::string outputPath;
+    uint64_t startMs;
+    bool timedOut;
+  };
+
+  // A fork server and the run it is serving, if any.
+  struct Server {
+    pid_t pid;
+    int fd;
+    bool busy;
+    Run run;
+  };
+
+  // Child side of both modes: stdio redirection and rlimits.
+  void setUpChild(int in, int out) const;
+
+  pid_t launch(const std::string &input, const std::string &outputPath) const;
+
+  bool startServer(Server &server, std::string &error) const;
+
+  // Hands one input to an idle server and fills in the run's pid.
+  bool sendRun(Server &server, const std::string &input,
+               const std::string &outputPath, std::string &error) const;
+
+  void stopServer(Server &server) const;
+
+public:
+  CorpusRunner(Session &session, const std::string &executable,
+               const std::string &inputDir, unsigned numWorkers = 1,
+               const Limits &limits = Limits(), bool useForkServer = false);
+
+  // Runs every input and writes the store to storePath, then prints a
+  // summary of the runs through the session. Returns false, with the reason
+  // in error, if the runs could not be started or stored.
+  bool run(const std::string &storePath, std::string &error);
+};
+
+#endif
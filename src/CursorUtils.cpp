@@ -0,0 +1,76 @@
+
+#include "CursorUtils.h"
+
+#include <cstring>
+
+namespace cursor_utils {
+
+std::string getSpelling(CXCursor C) {
+  CXString spelling = clang_getCursorSpelling(C);
+  std::string result(CXSTR(spelling));
+  clang_disposeString(spelling);
+  return result;
+}
+
+std::vector<CXCursor> getChildren(CXCursor C) {
+  std::vector<CXCursor> children;
+  clang_visitChildren(
+      C,
+      [](CXCursor current, CXCursor parent, CXClientData data) {
+        static_cast<std::vector<CXCursor> *>(data)->push_back(current);
+        return CXChildVisit_Continue;
+      },
+      &children);
+  return children;
+}
+
+bool isVariable(CXCursor C) {
+  const CXCursorKind kind = clang_getCursorKind(C);
+  return kind == CXCursor_VarDecl || kind == CXCursor_ParmDecl;
+}
+
+Location getLocation(CXCursor C) {
+  Location location;
+  clang_getSpellingLocation(clang_getCursorLocation(C), &location.file,
+                            nullptr, nullptr, &location.offset);
+  return location;
+}
+
+std::string getBinaryOperator(CXTranslationUnit tu, CXCursor lhs,
+                              CXCursor rhs) {
+  CXSourceRange between =
+      clang_getRange(clang_getRangeEnd(clang_getCursorExtent(lhs)),
+                     clang_getRangeStart(clang_getCursorExtent(rhs)));
+  CXToken *tokens;
+  unsigned numTokens;
+  clang_tokenize(tu, between, &tokens, &numTokens);
+
+  std::string op;
+  for (unsigned i = 0; i < numTokens && op.empty(); i++) {
+    if (clang_getTokenKind(tokens[i]) != CXToken_Punctuation) {
+      continue;
+    }
+    CXString spelling = clang_getTokenSpelling(tu, tokens[i]);
+    if (strcmp(CXSTR(spelling), "(") && strcmp(CXSTR(spelling), ")")) {
+      op = CXSTR(spelling);
+    }
+    clang_disposeString(spelling);
+  }
+  clang_disposeTokens(tu, tokens, numTokens);
+  return op;
+}
+
+std::string getFirstToken(CXTranslationUnit tu, CXCursor C) {
+  CXToken *token = clang_getToken(
+      tu, clang_getRangeStart(clang_getCursorExtent(C)));
+  if (token == nullptr) {
+    return "";
+  }
+  CXString spelling = clang_getTokenSpelling(tu, *token);
+  std::string result(CXSTR(spelling));
+  clang_disposeString(spelling);
+  clang_disposeTokens(tu, token, 1);
+  return result;
+}
+
+} // namespace cursor_utils
@@ -0,0 +1,52 @@
+
+#ifndef CURSOR_UTILS__H
+#define CURSOR_UTILS__H
+
+#include "Common.h"
+#include <clang-c/Index.h>
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Small libclang helpers shared by the whole-TU analyses.
+namespace cursor_utils {
+
+std::string getSpelling(CXCursor C);
+
+std::vector<CXCursor> getChildren(CXCursor C);
+
+bool isVariable(CXCursor C);
+
+// Where a cursor is spelled. Offsets alone are not unique in a translation
+// unit: every included header has its own.
+struct Location {
+  CXFile file;
+  unsigned offset;
+
+  bool operator==(const Location &other) const {
+    return file == other.file && offset == other.offset;
+  }
+};
+
+struct LocationHash {
+  size_t operator()(const Location &location) const {
+    return std::hash<const void *>()(location.file) * 31 + location.offset;
+  }
+};
+
+Location getLocation(CXCursor C);
+
+// Spelling of a binary operator: the only token between the operands apart
+// from parentheses.
+std::string getBinaryOperator(CXTranslationUnit tu, CXCursor lhs,
+                              CXCursor rhs);
+
+// Spelling of the first token of C, which for a prefix unary operator is the
+// operator itself.
+std::string getFirstToken(CXTranslationUnit tu, CXCursor C);
+
+} // namespace cursor_utils
+
+#endif
@@ -1,23 +1,44 @@
 
 #include "FeatureDetector.h"
+#include "TaintAnalysis.h"
 
 #include <clang-c/Index.h>
-#include <iostream>
 #include <fstream>
 #include <iterator>
 
-FeatureDetector::FeatureDetector( const std::string &filename, bool debug )
-    : filename(std::move(filename)), debug(debug) {
+FeatureDetector::FeatureDetector( Session &session, const std::string &filename, bool debug,
+                                  unsigned numWorkers, bool streaming )
+    : session(session), filename(filename), index(nullptr), translationUnit(nullptr),
+      debug(debug), streaming(streaming) {
 
-    kpc = new KeyPointsCollector( std::string(filename), false );
+    kpc = new KeyPointsCollector( session, filename, false );
     
-    kpc->collectCursors();
-    cursorObjs = kpc->getCursorObjs();
+    if ( !kpc->isParsed() || !kpc->collectCursors( numWorkers ) ) {
+        error = kpc->getError();
+        delete kpc;
+        kpc = nullptr;
+        return;
+    }
     varDecls = kpc->getVarDecls();
     count = 0;
 
+    if ( streaming ) {
+        translationUnit = kpc->getTU();
+        cxFile = *kpc->getCXFile();
+        return;
+    }
+    cursorObjs = kpc->getCursorObjs();
+    index = clang_createIndex( 0, 0 );
+
+    // Reuse the PCH if the collector was parsed with it, so the system
+    // headers are not parsed a second time and the file sees the same
+    // declarations.
+    std::vector<const char *> args;
+    for ( const std::string &arg : kpc->getParseArgs() ) {
+        args.push_back( arg.c_str() );
+    }
     translationUnit =
-        clang_parseTranslationUnit( index, filename.c_str(), nullptr, 0,
+        clang_parseTranslationUnit( index, filename.c_str(), args.data(), args.size(),
                                    nullptr, 0, CXTranslationUnit_None );
     cxFile = clang_getFile( translationUnit, filename.c_str() );
 }
@@ -54,11 +75,11 @@ CXChildVisitResult FeatureDetector::ifStmtBranch(CXCursor current,
                     CXString parent_kind_spelling = clang_getCursorKindSpelling( parent.kind );
                     CXString current_kind_spelling = clang_getCursorKindSpelling( current.kind );
 
-                    std::cout << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
-                              << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
-                              << "      Type: " << clang_getCString(type_spelling) << "\n"
-                              << "      Token: " << clang_getCString(token_spelling) << "\n"
-                              << "      Line " << line << "\n\n";
+                    instance->report << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
+                                     << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
+                                     << "      Type: " << clang_getCString(type_spelling) << "\n"
+                                     << "      Token: " << clang_getCString(token_spelling) << "\n"
+                                     << "      Line " << line << "\n\n";
 
                     clang_disposeString( parent_kind_spelling );
                     clang_disposeString( current_kind_spelling );
@@ -109,11 +130,11 @@ CXChildVisitResult FeatureDetector::forStmtBranch(CXCursor current,
                     CXString parent_kind_spelling = clang_getCursorKindSpelling( parent.kind );
                     CXString current_kind_spelling = clang_getCursorKindSpelling( current.kind );
 
-                    std::cout << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
-                              << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
-                              << "      Type: " << clang_getCString(type_spelling) << "\n"
-                              << "      Token: " << clang_getCString(token_spelling) << "\n"
-                              << "      Line " << line << "\n\n";
+                    instance->report << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
+                                     << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
+                                     << "      Type: " << clang_getCString(type_spelling) << "\n"
+                                     << "      Token: " << clang_getCString(token_spelling) << "\n"
+                                     << "      Line " << line << "\n\n";
 
                     clang_disposeString( parent_kind_spelling );
                     clang_disposeString( current_kind_spelling );
@@ -127,11 +148,11 @@ CXChildVisitResult FeatureDetector::forStmtBranch(CXCursor current,
                     CXString parent_kind_spelling = clang_getCursorKindSpelling( parent.kind );
                     CXString current_kind_spelling = clang_getCursorKindSpelling( current.kind );
 
-                    std::cout << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
-                              << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
-                              << "      Type: " << clang_getCString(type_spelling) << "\n"
-                              << "      Token: " << clang_getCString(token_spelling) << "\n"
-                              << "      Line " << line << "\n\n";
+                    instance->report << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
+                                     << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
+                                     << "      Type: " << clang_getCString(type_spelling) << "\n"
+                                     << "      Token: " << clang_getCString(token_spelling) << "\n"
+                                     << "      Line " << line << "\n\n";
                     
                     clang_disposeString( parent_kind_spelling );
                     clang_disposeString( current_kind_spelling );
@@ -184,11 +205,11 @@ CXChildVisitResult FeatureDetector::whileStmtBranch(CXCursor current,
                     CXString parent_kind_spelling = clang_getCursorKindSpelling( parent.kind );
                     CXString current_kind_spelling = clang_getCursorKindSpelling( current.kind );
 
-                    std::cout << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
-                            << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
-                            << "      Type: " << clang_getCString(type_spelling) << "\n"
-                            << "      Token: " << clang_getCString(token_spelling) << "\n"
-                            << "      Line " << line << "\n\n";
+                    instance->report << "  Kind: " << clang_getCString(parent_kind_spelling) << "\n"
+                                     << "    Kind: " << clang_getCString(current_kind_spelling) << "\n"
+                                     << "      Type: " << clang_getCString(type_spelling) << "\n"
+                                     << "      Token: " << clang_getCString(token_spelling) << "\n"
+                                     << "      Line " << line << "\n\n";
 
                     clang_disposeString( parent_kind_spelling );
                     clang_disposeString( current_kind_spelling );
@@ -227,104 +248,172 @@ void FeatureDetector::getDeclLocation( std::string name, int index, std::string
             temp.type = type;
             SeminalInputFeatures.push_back( temp );
         } else if ( debug ) {
-            std::cout << "Variable was not found.\n\n";
+            report << "Variable was not found.\n\n";
         }
     } else if ( debug ) {
-        std::cout << "Variable is already accounted for.\n\n";
+        report << "Variable is already accounted for.\n\n";
     }
 }
 
 void FeatureDetector::printSeminalInputFeatures() {
     for ( int i = 0; i < SeminalInputFeatures.size(); i++ ) {
         if ( SeminalInputFeatures[ i ].type == "FILE *" ) {
-            std::cout << "Line " << SeminalInputFeatures[ i ].line << ": size of file "
-                  << SeminalInputFeatures[ i ].name << "\n";
+            report << "Line " << SeminalInputFeatures[ i ].line << ": size of file "
+                   << SeminalInputFeatures[ i ].name << "\n";
         } else {
-            std::cout << "Line " << SeminalInputFeatures[ i ].line << ": "
-                  << SeminalInputFeatures[ i ].name << "\n";
+            report << "Line " << SeminalInputFeatures[ i ].line << ": "
+                   << SeminalInputFeatures[ i ].name << "\n";
         }
     }
 }
 
-void FeatureDetector::cursorFinder() {
+void FeatureDetector::printFunctionSummaries() {
+    const CallGraph &callGraph = kpc->getCallGraph();
+
+    report << "Function Summaries: \n";
+    for ( unsigned id = 0; id < callGraph.size(); id++ ) {
+        const std::string &name = callGraph.getName( id );
+        const CallGraph::Summary *summary = callGraph.getSummary( name );
+        if ( summary == nullptr ) {
+            continue;
+        }
+
+        report << name << ( summary->recursive ? " (recursive)" : "" )
+               << ": " << summary->branches.toVector().size() << " reachable branches";
+        if ( !summary->inputs.empty() ) {
+            report << ", reads";
+            for ( const std::string &input : summary->inputs ) {
+                report << " " << input;
+            }
+        }
+        report << "\n";
+    }
+    report << "\n";
+}
+
+void FeatureDetector::release() {
+    if ( translationUnit != nullptr && !streaming ) {
+        clang_disposeTranslationUnit( translationUnit );
+    }
+    translationUnit = nullptr;
+    if ( index != nullptr ) {
+        clang_disposeIndex( index );
+        index = nullptr;
+    }
+    delete kpc;
+    kpc = nullptr;
+}
+
+bool FeatureDetector::cursorFinder() {
+
+    if ( !isOpen() ) {
+        return false;
+    }
 
     
     if ( debug ) {
-        std::cout << "Variable Declarations: \n";
+        report << "Variable Declarations: \n";
         for( const std::pair<std::string, unsigned> var : varDecls ) {
-            std::cout << var.second << ": " << var.first << "\n";
+            report << var.second << ": " << var.first << "\n";
         }
-        std::cout << "\n";
+        report << "\n";
     }
 
-    for ( int i = 0; i < cursorObjs.size(); i++ ) {
+    const std::vector<CXCursor> &cursors = streaming ? kpc->getCursorObjs() : cursorObjs;
+    for ( int i = 0; i < cursors.size(); i++ ) {
 
-        if ( !clang_Cursor_isNull( cursorObjs[i] ) ) {
+        if ( !clang_Cursor_isNull( cursors[i] ) ) {
             if ( debug ) {
-                CXString kind_spelling = clang_getCursorKindSpelling( cursorObjs[i].kind );
-                std::cout << "Kind: " << clang_getCString(kind_spelling) << "\n";
+                CXString kind_spelling = clang_getCursorKindSpelling( cursors[i].kind );
+                report << "Kind: " << clang_getCString(kind_spelling) << "\n";
                 clang_disposeString( kind_spelling );
             }
 
-            switch ( cursorObjs[i].kind ) {
+            switch ( cursors[i].kind ) {
                 case CXCursor_IfStmt:
-                    clang_visitChildren( cursorObjs[i], this->ifStmtBranch, this );
+                    clang_visitChildren( cursors[i], this->ifStmtBranch, this );
                     break;
                 case CXCursor_ForStmt:
-                    clang_visitChildren( cursorObjs[i], this->forStmtBranch, this );
+                    clang_visitChildren( cursors[i], this->forStmtBranch, this );
                     break;
                 case CXCursor_WhileStmt:
-                    clang_visitChildren( cursorObjs[i], this->whileStmtBranch, this );
+                    clang_visitChildren( cursors[i], this->whileStmtBranch, this );
                     break;
                 default:
                     break;
             }
 
             if ( debug ) {
-                std::cout << "\n";
+                report << "\n";
             }
         }
     }
 
-    clang_disposeTranslationUnit( translationUnit );
-    clang_disposeIndex( index );
-    delete kpc;
+    if ( debug ) {
+        printFunctionSummaries();
+    }
+
+    // Follow inputs through assignments and calls rather than relying on the
+    // first identifier in each condition.
+    TaintAnalysis taint( session, kpc->getTU(), filename, kpc->getNumIncludeDirectives(), debug );
+    taint.run();
+
+    bool written = true;
+    if ( streaming ) {
+        // Nothing below needs the AST.
+        kpc->releaseTranslationUnit();
+        written = kpc->writeOutputs();
+        if ( !written ) {
+            error = kpc->getError();
+        }
+    }
+    release();
 
     printSeminalInputFeatures();
+
+    report << "\nInput-dependent branches:\n";
+    taint.printReport( report );
+    session.print( report.str() );
+    report.str( "" );
+    return written;
 }
 
 void FeatureDetector::findCursorAtLine( int branchLine ) {
 
+    if ( !isOpen() ) {
+        return;
+    }
+
     if ( branchLine != -1 ) {
     
         CXSourceLocation location;
         unsigned line;
 
-        
-        for ( int i = 0; i < cursorObjs.size(); i++ ) {
+        const std::vector<CXCursor> &cursors = streaming ? kpc->getCursorObjs() : cursorObjs;
+        for ( int i = 0; i < cursors.size(); i++ ) {
 
-            if ( !clang_Cursor_isNull( cursorObjs[i] ) ) {
+            if ( !clang_Cursor_isNull( cursors[i] ) ) {
                 if ( debug ) {
-                    CXString kind_spelling = clang_getCursorKindSpelling( cursorObjs[i].kind );
-                    std::cout << "Kind: " << clang_getCString(kind_spelling) << "\n";
+                    CXString kind_spelling = clang_getCursorKindSpelling( cursors[i].kind );
+                    report << "Kind: " << clang_getCString(kind_spelling) << "\n";
                     clang_disposeString( kind_spelling );
                 }
 
                 
-                location = clang_getCursorLocation( cursorObjs[i] );
+                location = clang_getCursorLocation( cursors[i] );
                 clang_getExpansionLocation( location, &cxFile, &line, nullptr, nullptr );
                 line += kpc->getNumIncludeDirectives();
 
                 if ( line == branchLine ) {
-                    switch ( cursorObjs[i].kind ) {
+                    switch ( cursors[i].kind ) {
                         case CXCursor_IfStmt:
-                            clang_visitChildren( cursorObjs[i], this->ifStmtBranch, this );
+                            clang_visitChildren( cursors[i], this->ifStmtBranch, this );
                             break;
                         case CXCursor_ForStmt:
-                            clang_visitChildren( cursorObjs[i], this->forStmtBranch, this );
+                            clang_visitChildren( cursors[i], this->forStmtBranch, this );
                             break;
                         case CXCursor_WhileStmt:
-                            clang_visitChildren( cursorObjs[i], this->whileStmtBranch, this );
+                            clang_visitChildren( cursors[i], this->whileStmtBranch, this );
                             break;
                         default:
                             break;
@@ -333,18 +422,18 @@ void FeatureDetector::findCursorAtLine( int branchLine ) {
                 }
 
                 if ( debug ) {
-                    std::cout << "\n";
+                    report << "\n";
                 }
             }
         }
 
     } else {
-        std::cout << "No branch points detected.\n";
+        report << "No branch points detected.\n";
     }
 
-    clang_disposeTranslationUnit( translationUnit );
-    clang_disposeIndex( index );
-    delete kpc;
+    release();
 
     printSeminalInputFeatures();
+    session.print( report.str() );
+    report.str( "" );
 }
@@ -1,5 +1,7 @@
 
 #include "KeyPointsCollector.h"
+#include "Session.h"
+#include <sstream>
 #include <string>
 #include <vector>
 #include <map>
@@ -7,6 +9,7 @@
 
 class FeatureDetector {
 
+    Session &session;
    
     std::string filename;
 
@@ -18,7 +21,7 @@ class FeatureDetector {
     std::vector<CXCursor> cursorObjs;
 
    
-    inline static CXIndex index = clang_createIndex(0, 0);
+    CXIndex index;
 
    
     CXTranslationUnit translationUnit;
@@ -45,13 +48,40 @@ class FeatureDetector {
     
     void printSeminalInputFeatures();
 
+    void printFunctionSummaries();
+
     bool debug;
 
+    // Streaming mode: the collector's TU is the only one parsed, cursors are
+    // not copied, and the TU is disposed of before the dictionary and the
+    // instrumented program are written.
+    bool streaming;
+
+    // Findings are gathered here and handed to the session in one piece.
+    std::ostringstream report;
+
+    std::string error;
+
+    void release();
+
 public:
 
-    FeatureDetector( const std::string &fileName, bool debug = false );
+    FeatureDetector( Session &session, const std::string &fileName, bool debug = false,
+                     unsigned numWorkers = 1, bool streaming = false );
+
+    FeatureDetector( const FeatureDetector & ) = delete;
+
+    FeatureDetector &operator=( const FeatureDetector & ) = delete;
+
+    ~FeatureDetector() { release(); }
+
+    // False if the file could not be parsed; getError() says why.
+    bool isOpen() const { return kpc != nullptr; }
+
+    const std::string &getError() const { return error; }
 
-    void cursorFinder();
+    // Returns false if the outputs of streaming mode could not be written.
+    bool cursorFinder();
 
     void findCursorAtLine( int branchLine );
 
@@ -2,102 +2,142 @@
 #include "KeyPointsCollector.h"
 
 #include <algorithm>
+#include <cctype>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
+#include <thread>
 
+#include "CallgrindParser.h"
 #include "Common.h"
+#include "PointsToAnalysis.h"
+#include "PrecompiledHeader.h"
+#include "TaintAnalysis.h"
 
-KeyPointsCollector::KeyPointsCollector(const std::string &filename, bool debug)
-    : filename(std::move(filename)), debug(debug) {
+KeyPointsCollector::KeyPointsCollector(
+    Session &session, const std::string &filename, bool debug,
+    const std::vector<std::string> &compileArgs)
+    : session(session), filename(std::move(filename)), index(nullptr),
+      translationUnit(nullptr), debug(debug), parseArgs(compileArgs),
+      strings(arena), branchCount(0) {
 
   std::ifstream file(filename);
   if (file.good()) {
     file.close();
 
-   
-    std::stringstream formatCommand;
-    formatCommand << "clang-format -i --style=file:file_format_style "
-                  << filename;
-    system(formatCommand.str().c_str());
-
-    removeIncludeDirectives();
-
+    if (session.getFormatSources()) {
+      std::stringstream formatCommand;
+      formatCommand << "clang-format -i --style=file:file_format_style "
+                    << filename;
+      system(formatCommand.str().c_str());
+    }
 
-    translationUnit = clang_createTranslationUnitFromSourceFile(
-        KPCIndex, filename.c_str(), 0, nullptr, 0, nullptr);
+    index = clang_createIndex(0, 0);
 
-    reInsertIncludeDirectives();
+    // With real compile flags the headers can be found, so the file is
+    // parsed as written. Without them the common system headers come from
+    // the shared PCH if the file includes no others; includes are stripped
+    // if the PCH is unavailable, does not cover them, or the file has errors
+    // against it.
+    if (!compileArgs.empty()) {
+      readSource();
+      translationUnit = parseSource(index);
+    } else {
+      const std::string &pch = PrecompiledHeader::getPath();
+      translationUnit = nullptr;
+      readSource();
+      if (!pch.empty() && PrecompiledHeader::coversIncludes(strippedSource)) {
+        parseArgs = {"-include-pch", pch};
+        translationUnit = parseSource(index);
+        if (translationUnit != nullptr &&
+            PrecompiledHeader::hasErrors(translationUnit)) {
+          clang_disposeTranslationUnit(translationUnit);
+          translationUnit = nullptr;
+        }
+      }
+      if (translationUnit == nullptr) {
+        // Without headers clang still predeclares the C library functions
+        // it knows, which then clash with globals gcc accepts (int index;).
+        parseArgs = {"-fno-builtin"};
+        removeIncludeDirectives();
+        translationUnit = parseSource(index);
+      }
+    }
 
 
     if (translationUnit == nullptr) {
-      std::cerr
-          << "There was an error parsing the translation unit! Exiting...\n";
-      exit(EXIT_FAILURE);
+      error = "There was an error parsing the translation unit of " + filename;
+      return;
     }
-    std::cout << "Translation unit for file: " << filename
-              << " successfully parsed.\n";
+    session.print("Translation unit for file: ", filename,
+                  " successfully parsed.\n");
 
 
     rootCursor = clang_getTranslationUnitCursor(translationUnit);
     cxFile = clang_getFile(translationUnit, filename.c_str());
-    branchCount = 0;
  
   } else {
-    std::cerr << "File with name: " << filename
-              << ", does not exist! Exiting...\n";
-    exit(EXIT_FAILURE);
+    error = "File with name: " + filename + ", does not exist!";
   }
 }
 
 KeyPointsCollector::~KeyPointsCollector() {
-  clang_disposeTranslationUnit(translationUnit);
+  if (translationUnit != nullptr) {
+    clang_disposeTranslationUnit(translationUnit);
+  }
+  if (index != nullptr) {
+    clang_disposeIndex(index);
+  }
+}
+
+void KeyPointsCollector::releaseTranslationUnit() {
+  if (translationUnit != nullptr) {
+    clang_disposeTranslationUnit(translationUnit);
+    translationUnit = nullptr;
+  }
+  std::vector<CXCursor>().swap(cursorObjs);
+  std::string().swap(strippedSource);
+}
+
+void KeyPointsCollector::readSource() {
+  std::ifstream source(filename);
+  strippedSource.assign(std::istreambuf_iterator<char>(source),
+                        std::istreambuf_iterator<char>());
 }
 
 void KeyPointsCollector::removeIncludeDirectives() {
+  // The file on disk is left untouched; the stripped text is handed to
+  // libclang as an unsaved buffer, so concurrent collectors never race on a
+  // shared temporary file.
   std::ifstream file(filename);
-  std::ofstream tempFile("temp.c");
   std::string currentLine;
   const std::string includeStr("#include");
+  strippedSource.clear();
   unsigned lineNum = 1;
 
-  if (file.good() && tempFile.good()) {
+  if (file.good()) {
     while (getline(file, currentLine)) {
       if (currentLine.find(includeStr) == 0) {
         addIncludeDirective(lineNum++, currentLine);
         continue;
       }
       lineNum++;
-      tempFile << currentLine << '\n';
+      strippedSource += currentLine + '\n';
     }
   }
-  std::remove(filename.c_str());
-  std::rename("temp.c", filename.c_str());
 }
 
-void KeyPointsCollector::reInsertIncludeDirectives() {
-  std::ifstream file(filename);
-  std::ofstream tempFile("temp.c");
-  std::string currentLine;
-  const std::string includeStr("#include");
-  unsigned lineNum = 1;
-
-  if (file.good() && tempFile.good()) {
-    while (getline(file, currentLine)) {
-      if (MAP_FIND(includeDirectives, lineNum)) {
-        while(MAP_FIND(includeDirectives, lineNum)) {
-          tempFile << includeDirectives[lineNum++] << '\n';
-        }
-        tempFile << currentLine << '\n';
-      } else {
-        lineNum++;
-        tempFile << currentLine << '\n';
-      }
-    }
+CXTranslationUnit KeyPointsCollector::parseSource(CXIndex index) {
+  std::vector<const char *> args;
+  for (const std::string &arg : parseArgs) {
+    args.push_back(arg.c_str());
   }
-
-  std::remove(filename.c_str());
-  std::rename("temp.c", filename.c_str());
+  CXUnsavedFile source = {filename.c_str(), strippedSource.c_str(),
+                          strippedSource.size()};
+  return clang_parseTranslationUnit(
+      index, filename.c_str(), args.data(), args.size(), &source, 1,
+      CXTranslationUnit_DetailedPreprocessingRecord);
 }
 
 bool KeyPointsCollector::isBranchPointOrCallExpr(const CXCursorKind K) {
@@ -114,6 +154,26 @@ bool KeyPointsCollector::isBranchPointOrCallExpr(const CXCursorKind K) {
   }
 }
 
+CXCursor KeyPointsCollector::skipCaseLabels(CXCursor C) {
+  while (clang_getCursorKind(C) == CXCursor_CaseStmt ||
+         clang_getCursorKind(C) == CXCursor_DefaultStmt) {
+    // The labeled statement is the last child, after the case value.
+    CXCursor statement = clang_getNullCursor();
+    clang_visitChildren(
+        C,
+        [](CXCursor current, CXCursor, CXClientData data) {
+          *static_cast<CXCursor *>(data) = current;
+          return CXChildVisit_Continue;
+        },
+        &statement);
+    if (clang_Cursor_isNull(statement)) {
+      break;
+    }
+    C = statement;
+  }
+  return C;
+}
+
 bool KeyPointsCollector::isFunctionPtr(const CXCursor C) {
   CXType cursorType = clang_getCursorType(C);
   if (cursorType.kind == CXType_Pointer) {
@@ -123,20 +183,22 @@ bool KeyPointsCollector::isFunctionPtr(const CXCursor C) {
   return false;
 }
 
-bool KeyPointsCollector::checkChildAgainstStackTop(CXCursor child) {
+bool KeyPointsCollector::TraversalState::checkChildAgainstStackTop(
+    CXCursor child) {
   unsigned childLineNum;
   unsigned childColNum;
   BranchPointInfo *currBranch = getCurrentBranch();
   CXSourceLocation childLoc = clang_getCursorLocation(child);
-  clang_getSpellingLocation(childLoc, getCXFile(), &childLineNum, &childColNum,
+  clang_getSpellingLocation(childLoc, &cxFile, &childLineNum, &childColNum,
                             nullptr);
 
-  if (inCurrentFunction(childLineNum)) {
+  if (inCurrentFunction(childLineNum + kpc->getNumIncludeDirectives())) {
     if (childLineNum > currBranch->compoundEndLineNum ||
         (childLineNum == currBranch->compoundEndLineNum &&
          childColNum > currBranch->compoundEndColumnNum)) {
-      getCurrentBranch()->addTarget(childLineNum + getNumIncludeDirectives());
-      if (debug) {
+      getCurrentBranch()->addTarget(childLineNum +
+                                    kpc->getNumIncludeDirectives());
+      if (kpc->debug) {
         printFoundTargetPoint();
       }
       return true;
@@ -149,14 +211,26 @@ bool KeyPointsCollector::checkChildAgainstStackTop(CXCursor child) {
 
 CXChildVisitResult KeyPointsCollector::VisitorFunctionCore(CXCursor current,
                                                            CXCursor parent,
-                                                           CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+                                                           CXClientData data) {
+  TraversalState *state = static_cast<TraversalState *>(data);
+  KeyPointsCollector *instance = state->kpc;
   const CXCursorKind currKind = clang_getCursorKind(current);
   const CXCursorKind parrKind = clang_getCursorKind(parent);
 
   
   if (currKind == CXCursor_CallExpr) {
-    clang_visitChildren(parent, &KeyPointsCollector::VisitCallExpr, kpc);
+    // Every call of the expression is an edge of the call graph, including
+    // those in the arguments of another call.
+    VisitCallGraphEdge(current, parent, data);
+    clang_visitChildren(current, &KeyPointsCollector::VisitCallGraphEdge,
+                        data);
+    // The call map logs one callee per line. Resolve it from the call
+    // itself; only look into the callee expression and arguments (e.g. a
+    // call through a pointer wrapped in another call) when its name is not a
+    // known function.
+    if (VisitCallExpr(current, parent, data) == CXChildVisit_Recurse) {
+      clang_visitChildren(current, &KeyPointsCollector::VisitCallExpr, data);
+    }
     return CXChildVisit_Continue;
   }
 
@@ -164,41 +238,69 @@ CXChildVisitResult KeyPointsCollector::VisitorFunctionCore(CXCursor current,
   if (instance->isBranchPointOrCallExpr(parrKind) &&
       currKind == CXCursor_CompoundStmt) {
     
-    instance->addCursor(parent);
-    instance->pushNewBranchPoint();
+    state->result->cursors.push_back(parent);
+    state->pushNewBranchPoint();
     CXSourceLocation loc = clang_getCursorLocation(parent);
-    clang_getSpellingLocation(loc, instance->getCXFile(),
-                              instance->getCurrentBranch()->getBranchPointOut(),
-                              nullptr, nullptr);
-    instance->getCurrentBranch()->branchPoint +=
+    clang_getSpellingLocation(loc, &state->cxFile,
+                              state->getCurrentBranch()->getBranchPointOut(),
+                              &state->getCurrentBranch()->column, nullptr);
+    state->getCurrentBranch()->branchPoint +=
         instance->getNumIncludeDirectives();
+    state->getCurrentBranch()->isSwitch = parrKind == CXCursor_SwitchStmt;
+    state->getCurrentBranch()->isLoop = parrKind == CXCursor_ForStmt ||
+                                        parrKind == CXCursor_WhileStmt ||
+                                        parrKind == CXCursor_DoStmt;
 
     if (instance->debug) {
-      instance->printFoundBranchPoint(parrKind);
+      state->printFoundBranchPoint(parrKind);
     }
 
-    clang_visitChildren(current, &KeyPointsCollector::VisitCompoundStmt, kpc);
+    clang_visitChildren(current, &KeyPointsCollector::VisitCompoundStmt, data);
 
-    BranchPointInfo *currBranch = instance->getCurrentBranch();
+    // The end column keeps what follows the body on its last line, such as
+    // a do-while condition, from being taken for the fall-through target.
+    BranchPointInfo *currBranch = state->getCurrentBranch();
     CXSourceLocation parentEnd =
         clang_getRangeEnd(clang_getCursorExtent(parent));
-    clang_getSpellingLocation(parentEnd, instance->getCXFile(),
-                              &(currBranch->compoundEndLineNum), nullptr,
-                              nullptr);
+    clang_getSpellingLocation(parentEnd, &state->cxFile,
+                              &(currBranch->compoundEndLineNum),
+                              &(currBranch->compoundEndColumnNum), nullptr);
+
+    // A do-while ends at its semicolon, which is not part of its extent.
+    if (parrKind == CXCursor_DoStmt) {
+      if (CXToken *next = clang_getToken(state->tu, parentEnd)) {
+        CXString spelling = clang_getTokenSpelling(state->tu, *next);
+        if (std::string(CXSTR(spelling)) == ";") {
+          currBranch->compoundEndColumnNum++;
+        }
+        clang_disposeString(spelling);
+        clang_disposeTokens(state->tu, next, 1);
+      }
+    }
   }
 
-  if (instance->compoundStmtFoundYet() &&
-      instance->getCurrentBranch()->compoundEndLineNum != 0 &&
-      instance->checkChildAgainstStackTop(current)) {
-    instance->addCompletedBranch();
+  if (state->compoundStmtFoundYet() &&
+      state->getCurrentBranch()->compoundEndLineNum != 0 &&
+      state->checkChildAgainstStackTop(current)) {
+    state->addCompletedBranch();
   }
 
   if (currKind == CXCursor_FunctionDecl) {
-    clang_visitChildren(current, &KeyPointsCollector::VisitFuncDecl, kpc);
+    unsigned begLineNum;
+    clang_getSpellingLocation(
+        clang_getRangeStart(clang_getCursorExtent(current)), &state->cxFile,
+        &begLineNum, nullptr, nullptr);
+    const FunctionRecord *function =
+        instance->getFunctionAtLine(begLineNum +
+                                    instance->getNumIncludeDirectives());
+    if (function != nullptr) {
+      state->currentFunction = function;
+    }
   }
 
   if (currKind == CXCursor_VarDecl || currKind == CXCursor_ParmDecl) {
-    clang_visitChildren(parent, &KeyPointsCollector::VisitVarOrParamDecl, kpc);
+    clang_visitChildren(parent, &KeyPointsCollector::VisitVarOrParamDecl,
+                        data);
   }
 
   return CXChildVisit_Recurse;
@@ -206,417 +308,891 @@ CXChildVisitResult KeyPointsCollector::VisitorFunctionCore(CXCursor current,
 
 CXChildVisitResult KeyPointsCollector::VisitCompoundStmt(CXCursor current,
                                                          CXCursor parent,
-                                                         CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+                                                         CXClientData data) {
+  TraversalState *state = static_cast<TraversalState *>(data);
+  KeyPointsCollector *instance = state->kpc;
   const CXCursorKind currKind = clang_getCursorKind(current);
   const CXCursorKind parrKind = clang_getCursorKind(parent);
+  // Only ever called on the children of a branch point's body.
   if (parrKind != CXCursor_CompoundStmt) {
-    std::cerr << "Compound statement visitor called when cursor is not "
-                 "compound stmt!\n";
-    exit(EXIT_FAILURE);
+    return CXChildVisit_Break;
   }
   unsigned targetLineNumber;
-  CXSourceLocation loc = clang_getCursorLocation(current);
-  clang_getSpellingLocation(loc, instance->getCXFile(), &targetLineNumber,
-                            nullptr, nullptr);
+  CXSourceLocation loc = clang_getCursorLocation(skipCaseLabels(current));
+  clang_getSpellingLocation(loc, &state->cxFile, &targetLineNumber, nullptr,
+                            nullptr);
 
-  instance->getCurrentBranch()->addTarget(targetLineNumber +
-                                          instance->getNumIncludeDirectives());
+  state->getCurrentBranch()->addTarget(targetLineNumber +
+                                       instance->getNumIncludeDirectives());
   if (instance->debug) {
-    instance->printFoundTargetPoint();
+    state->printFoundTargetPoint();
   }
   return CXChildVisit_Continue;
 }
 
+CXChildVisitResult KeyPointsCollector::VisitCallGraphEdge(CXCursor current,
+                                                          CXCursor parent,
+                                                          CXClientData data) {
+  if (clang_getCursorKind(current) != CXCursor_CallExpr) {
+    return CXChildVisit_Recurse;
+  }
+  TraversalState *state = static_cast<TraversalState *>(data);
+  KeyPointsCollector *instance = state->kpc;
+
+  CXString calleeStr = clang_getCursorSpelling(current);
+  std::string calleeName(CXSTR(calleeStr));
+  clang_disposeString(calleeStr);
+  if (TaintAnalysis::isInputCall(calleeName)) {
+    state->result->inputs.insert(calleeName);
+  }
+
+  // A call through a pointer references the pointer; its targets are added
+  // by resolveIndirectCalls().
+  CXCursor callee = clang_getCursorReferenced(current);
+  if (clang_getCursorKind(callee) == CXCursor_FunctionDecl &&
+      MAP_FIND(instance->funcDeclsString, calleeName)) {
+    state->result->callees.push_back(calleeName);
+  }
+  return CXChildVisit_Recurse;
+}
+
 CXChildVisitResult KeyPointsCollector::VisitCallExpr(CXCursor current,
                                                      CXCursor parent,
-                                                     CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+                                                     CXClientData data) {
+  TraversalState *state = static_cast<TraversalState *>(data);
+  KeyPointsCollector *instance = state->kpc;
 
   CXSourceLocation callExprLoc = clang_getCursorLocation(current);
-  CXToken *calleeNameTok = clang_getToken(instance->getTU(), callExprLoc);
-  CXString calleeNameStr =
-      clang_getTokenSpelling(instance->getTU(), *calleeNameTok);
+  CXToken *calleeNameTok = clang_getToken(state->tu, callExprLoc);
+  CXString calleeNameStr = clang_getTokenSpelling(state->tu, *calleeNameTok);
   std::string calleeName(clang_getCString(calleeNameStr));
 
   if (MAP_FIND(instance->funcDeclsString, calleeName)) {
     unsigned callLocLine;
-    clang_getSpellingLocation(callExprLoc, instance->getCXFile(), &callLocLine,
+    clang_getSpellingLocation(callExprLoc, &state->cxFile, &callLocLine,
                               nullptr, nullptr);
-    instance->addCall(callLocLine + instance->getNumIncludeDirectives(),
-                      calleeName);
-
-    if (instance->getFunctionByName(calleeName)->isInBody(callLocLine)) {
-      instance->getFunctionByName(calleeName)->setRecursive();
-    }
-    clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
+    state->result->calls[callLocLine + instance->getNumIncludeDirectives()] =
+        calleeName;
+    clang_disposeTokens(state->tu, calleeNameTok, 1);
     clang_disposeString(calleeNameStr);
 
-    return CXChildVisit_Break;
-  } else if (MAP_FIND(instance->funcPtrs, calleeName)) {
-    unsigned callLocLine;
-    clang_getSpellingLocation(callExprLoc, instance->getCXFile(), &callLocLine,
-                              nullptr, nullptr);
-    instance->addCall(callLocLine + instance->getNumIncludeDirectives(),
-                      instance->funcPtrs[calleeName]);
-    clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
-    clang_disposeString(calleeNameStr);
     return CXChildVisit_Break;
   }
   clang_disposeString(calleeNameStr);
-  clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
+  clang_disposeTokens(state->tu, calleeNameTok, 1);
 
   return CXChildVisit_Recurse;
 }
 
-CXChildVisitResult KeyPointsCollector::VisitFuncPtr(CXCursor current,
-                                                    CXCursor parent,
-                                                    CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+CXChildVisitResult KeyPointsCollector::VisitVarOrParamDecl(CXCursor current,
+                                                           CXCursor parent,
+                                                           CXClientData data) {
+  TraversalState *state = static_cast<TraversalState *>(data);
+  KeyPointsCollector *instance = state->kpc;
 
-  CXSourceLocation funcPtrLoc = clang_getCursorLocation(parent);
-  CXToken *funcPtrTok = clang_getToken(instance->getTU(), funcPtrLoc);
-  CXString funcPtrStr = clang_getTokenSpelling(instance->getTU(), *funcPtrTok);
-  std::string funcPtrName(clang_getCString(funcPtrStr));
+  unsigned varDeclLineNum;
+  CXSourceLocation varDeclLoc = clang_getCursorLocation(current);
 
-  if (!(MAP_FIND(instance->funcPtrs, funcPtrName)) &&
-      instance->currFuncPtrId.empty()) {
-    instance->currFuncPtrId = funcPtrName;
+  // A redeclared library function inherits attributes from its header
+  // declaration; those have no tokens in this file.
+  if (!clang_Location_isFromMainFile(varDeclLoc)) {
+    return CXChildVisit_Continue;
   }
+  clang_getSpellingLocation(varDeclLoc, &state->cxFile, &varDeclLineNum,
+                            nullptr, nullptr);
 
+  // Function pointers are not input variables; their targets are resolved
+  // by resolveIndirectCalls().
+  if (instance->isFunctionPtr(current)) {
+    return CXChildVisit_Break;
+  }
 
-  CXSourceLocation funcPteeLoc = clang_getCursorLocation(current);
-  CXToken *funcPteeTok = clang_getToken(instance->getTU(), funcPteeLoc);
-  CXString funcPteeStr =
-      clang_getTokenSpelling(instance->getTU(), *funcPteeTok);
-  std::string funcPteeName(clang_getCString(funcPteeStr));
+  CXToken *varDeclToken = clang_getToken(state->tu, varDeclLoc);
+  CXString varNameStr = clang_getTokenSpelling(state->tu, *varDeclToken);
+  std::string varName(CXSTR(varNameStr));
 
-  if (instance->getFunctionByName(funcPteeName) != nullptr) {
-    instance->funcPtrs[instance->currFuncPtrId] = funcPteeName;
-    instance->currFuncPtrId.clear();
-    clang_disposeTokens(instance->getTU(), funcPtrTok, 1);
-    clang_disposeTokens(instance->getTU(), funcPteeTok, 1);
-    clang_disposeString(funcPtrStr);
-    clang_disposeString(funcPteeStr);
-    return CXChildVisit_Break;
+  if (state->seenVars.insert(varName).second) {
+    if (instance->debug) {
+      instance->session.print(
+          "Found ",
+          (current.kind == CXCursor_VarDecl ? "VarDecl" : "ParamDecl"), ": ",
+          varName, " at line # ", varDeclLineNum, '\n');
+    }
+    state->result->varDecls.emplace_back(
+        varName, varDeclLineNum + instance->getNumIncludeDirectives());
   }
+  clang_disposeString(varNameStr);
+  clang_disposeTokens(state->tu, varDeclToken, 1);
+  return CXChildVisit_Break;
+}
 
-  clang_disposeString(funcPtrStr);
-  clang_disposeString(funcPteeStr);
-  clang_disposeTokens(instance->getTU(), funcPtrTok, 1);
-  clang_disposeTokens(instance->getTU(), funcPteeTok, 1);
+void KeyPointsCollector::recordFunctionDecl(CXCursor C) {
+  CXType funcReturnType = clang_getResultType(clang_getCursorType(C));
 
-  return CXChildVisit_Recurse;
+  CXString funcReturnTypeSpelling = clang_getTypeSpelling(funcReturnType);
+  unsigned begLineNum, endLineNum;
+  CXSourceRange funcRange = clang_getCursorExtent(C);
+  CXSourceLocation funcBeg = clang_getRangeStart(funcRange);
+  CXSourceLocation funcEnd = clang_getRangeEnd(funcRange);
+  clang_getSpellingLocation(funcBeg, getCXFile(), &begLineNum, nullptr,
+                            nullptr);
+  clang_getSpellingLocation(funcEnd, getCXFile(), &endLineNum, nullptr,
+                            nullptr);
+
+  CXToken *funcDeclToken =
+      clang_getToken(getTU(), clang_getCursorLocation(C));
+  CXString funcNameStr = clang_getTokenSpelling(getTU(), *funcDeclToken);
+  std::string funcName(CXSTR(funcNameStr));
+
+  callGraph.addFunction(funcName);
+  addFuncDecl(arena.create<FunctionRecord>(
+      begLineNum + getNumIncludeDirectives(),
+      endLineNum + getNumIncludeDirectives(), arena.copyString(funcName),
+      strings.intern(clang_getCString(funcReturnTypeSpelling)), false));
+  if (debug) {
+    session.print("Found FunctionDecl: ", funcName, " of return type: ",
+                  clang_getCString(funcReturnTypeSpelling),
+                  " on line #: ", begLineNum, '\n');
+  }
+  clang_disposeString(funcNameStr);
+  clang_disposeTokens(getTU(), funcDeclToken, 1);
+  clang_disposeString(funcReturnTypeSpelling);
 }
 
-CXChildVisitResult KeyPointsCollector::VisitVarOrParamDecl(CXCursor current,
-                                                           CXCursor parent,
-                                                           CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+std::vector<CXCursor> KeyPointsCollector::collectUnits() {
+  struct UnitCollector {
+    KeyPointsCollector *kpc;
+    std::vector<CXCursor> units;
+    std::vector<CXCursor> globals;
+  } collector{this};
+
+  clang_visitChildren(
+      rootCursor,
+      [](CXCursor current, CXCursor parent, CXClientData data) {
+        UnitCollector *collector = static_cast<UnitCollector *>(data);
+        // Declarations pulled in from headers are not part of any unit.
+        if (!clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
+          return CXChildVisit_Continue;
+        }
+        switch (clang_getCursorKind(current)) {
+        case CXCursor_FunctionDecl:
+          collector->kpc->recordFunctionDecl(current);
+          collector->units.push_back(current);
+          break;
+        case CXCursor_VarDecl:
+          collector->globals.push_back(current);
+          break;
+        default:
+          break;
+        }
+        return CXChildVisit_Continue;
+      },
+      &collector);
+
+  // File-scope variables are visible from every unit, so they are resolved
+  // here rather than by whichever worker gets there first.
+  TraversalState state(this, translationUnit);
+  UnitResult globals;
+  state.reset(&globals);
+  for (const CXCursor &global : collector.globals) {
+    VisitVarOrParamDecl(global, rootCursor, &state);
+  }
+  for (const std::pair<std::string, unsigned> &var : globals.varDecls) {
+    addVarDeclToMap(var.first, var.second);
+  }
 
-  unsigned varDeclLineNum;
-  CXSourceLocation varDeclLoc = clang_getCursorLocation(current);
-  clang_getSpellingLocation(varDeclLoc, instance->getCXFile(), &varDeclLineNum,
-                            nullptr, nullptr);
+  return collector.units;
+}
 
-  if (instance->isFunctionPtr(current)) {
-    clang_visitChildren(current, &KeyPointsCollector::VisitFuncPtr, kpc);
-    return CXChildVisit_Break;
+void KeyPointsCollector::traverseUnit(TraversalState &state, CXCursor unit) {
+  CXCursor root = clang_getTranslationUnitCursor(state.tu);
+  if (VisitorFunctionCore(unit, root, &state) == CXChildVisit_Recurse) {
+    clang_visitChildren(unit, &KeyPointsCollector::VisitorFunctionCore, &state);
   }
 
-  CXToken *varDeclToken = clang_getToken(instance->getTU(), varDeclLoc);
-  std::string varName =
-      CXSTR(clang_getTokenSpelling(instance->getTU(), *varDeclToken));
+  // Branch points still open here have no later statement in their function
+  // to serve as the fall-through target; close them with the targets found.
+  while (state.compoundStmtFoundYet()) {
+    state.addCompletedBranch();
+  }
 
-  std::map<std::string, unsigned> varMap = instance->getVarDecls();
+  if (state.currentFunction != nullptr) {
+    state.result->function = std::string(state.currentFunction->name);
+  }
+}
 
-  if (varMap.find(varName) == varMap.end()) {
-    if (instance->debug) {
-      std::cout << "Found "
-                << (current.kind == CXCursor_VarDecl ? "VarDecl" : "ParamDecl")
-                << ": " << varName << " at line # " << varDeclLineNum << '\n';
+void KeyPointsCollector::mergeUnit(TraversalState &state, UnitResult &unit) {
+  for (const CXCursor &cursor : unit.cursors) {
+    if (state.tu == translationUnit) {
+      addCursor(cursor);
+      continue;
     }
-    instance->addVarDeclToMap(varName, varDeclLineNum +
-                                           instance->getNumIncludeDirectives());
+    // Cursors from a worker's private TU are re-resolved in the main TU so
+    // they stay valid once the worker TU is disposed.
+    unsigned line, column;
+    clang_getSpellingLocation(clang_getCursorLocation(cursor), nullptr, &line,
+                              &column, nullptr);
+    addCursor(clang_getCursor(
+        translationUnit,
+        clang_getLocation(translationUnit, cxFile, line, column)));
   }
-  clang_disposeTokens(instance->getTU(), varDeclToken, 1);
-  return CXChildVisit_Break;
-}
 
-CXChildVisitResult KeyPointsCollector::VisitFuncDecl(CXCursor current,
-                                                     CXCursor parent,
-                                                     CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
-
-  if (clang_getCursorKind(parent) == CXCursor_FunctionDecl) {
-    CXType funcReturnType = clang_getResultType(clang_getCursorType(parent));
-
-    CXString funcReturnTypeSpelling = clang_getTypeSpelling(funcReturnType);
-    unsigned begLineNum, endLineNum;
-    CXSourceRange funcRange = clang_getCursorExtent(parent);
-    CXSourceLocation funcBeg = clang_getRangeStart(funcRange);
-    CXSourceLocation funcEnd = clang_getRangeEnd(funcRange);
-    clang_getSpellingLocation(funcBeg, instance->getCXFile(), &begLineNum,
-                              nullptr, nullptr);
-    clang_getSpellingLocation(funcEnd, instance->getCXFile(), &endLineNum,
-                              nullptr, nullptr);
+  branchPoints.append(unit.branchPoints);
 
-    CXToken *funcDeclToken =
-        clang_getToken(instance->getTU(), clang_getCursorLocation(parent));
-    std::string funcName =
-        CXSTR(clang_getTokenSpelling(instance->getTU(), *funcDeclToken));
+  for (const std::pair<const unsigned, std::string> &call : unit.calls) {
+    addCall(call.first, call.second);
+  }
 
-    instance->addFuncDecl(std::make_shared<FunctionDeclInfo>(
-        begLineNum + instance->getNumIncludeDirectives(),
-        endLineNum + instance->getNumIncludeDirectives(), funcName,
-        clang_getCString(funcReturnTypeSpelling)));
-    instance->currentFunction = instance->getFunctionByName(funcName);
-    if (instance->debug) {
-      std::cout << "Found FunctionDecl: " << funcName << " of return type: "
-                << clang_getCString(funcReturnTypeSpelling)
-                << " on line #: " << begLineNum << '\n';
+  for (const std::pair<std::string, unsigned> &var : unit.varDecls) {
+    if (!(MAP_FIND(varDecls, var.first))) {
+      addVarDeclToMap(var.first, var.second);
     }
-    clang_disposeTokens(instance->getTU(), funcDeclToken, 1);
-    clang_disposeString(funcReturnTypeSpelling);
   }
 
-  return CXChildVisit_Break;
+  if (!unit.function.empty()) {
+    for (const std::string &callee : unit.callees) {
+      callGraph.addCall(unit.function, callee);
+    }
+    for (const std::string &input : unit.inputs) {
+      callGraph.addInput(unit.function, input);
+    }
+  }
 }
 
-void KeyPointsCollector::collectCursors() {
-  clang_visitChildren(rootCursor, this->VisitorFunctionCore, this);
-  addBranchesToDictionary();
+bool KeyPointsCollector::collectCursors(unsigned numWorkers) {
+  if (translationUnit == nullptr) {
+    if (error.empty()) {
+      error = "The translation unit of " + filename + " has been released";
+    }
+    return false;
+  }
+
+  const std::vector<CXCursor> units = collectUnits();
+  std::vector<UnitResult> results(units.size());
+
+  if (numWorkers > units.size()) {
+    numWorkers = units.size();
+  }
+
+  if (numWorkers <= 1) {
+    TraversalState state(this, translationUnit);
+    for (size_t unit = 0; unit < units.size(); unit++) {
+      state.reset(&results[unit]);
+      traverseUnit(state, units[unit]);
+    }
+    for (UnitResult &result : results) {
+      mergeUnit(state, result);
+    }
+    resolveIndirectCalls();
+    addBranchesToDictionary();
+    summarizeCallGraph();
+    return true;
+  }
+
+  // Worker 0 reuses the main TU; every other worker parses its own copy from
+  // the in-memory source, so the top-level cursor order (and thus unit
+  // numbering) matches the main TU.
+  std::vector<CXIndex> workerIndices(numWorkers);
+  std::vector<CXTranslationUnit> workerTUs(numWorkers);
+  std::vector<std::unique_ptr<TraversalState>> workerStates(numWorkers);
+  std::vector<std::thread> workers;
+
+  for (unsigned worker = 0; worker < numWorkers; worker++) {
+    workers.emplace_back([&, worker]() {
+      if (worker == 0) {
+        workerTUs[worker] = translationUnit;
+      } else {
+        workerIndices[worker] = clang_createIndex(0, 0);
+        workerTUs[worker] = parseSource(workerIndices[worker]);
+      }
+      if (workerTUs[worker] == nullptr) {
+        return;
+      }
+      workerStates[worker] =
+          std::make_unique<TraversalState>(this, workerTUs[worker]);
+
+      struct UnitWalker {
+        KeyPointsCollector *kpc;
+        TraversalState *state;
+        std::vector<UnitResult> *results;
+        unsigned worker;
+        unsigned numWorkers;
+        size_t unit;
+      } walker{this,   workerStates[worker].get(), &results, worker,
+               numWorkers, 0};
+
+      clang_visitChildren(
+          clang_getTranslationUnitCursor(workerTUs[worker]),
+          [](CXCursor current, CXCursor parent, CXClientData data) {
+            UnitWalker *walker = static_cast<UnitWalker *>(data);
+            if (clang_getCursorKind(current) != CXCursor_FunctionDecl ||
+                !clang_Location_isFromMainFile(
+                    clang_getCursorLocation(current))) {
+              return CXChildVisit_Continue;
+            }
+            if (walker->unit % walker->numWorkers == walker->worker) {
+              walker->state->reset(&(*walker->results)[walker->unit]);
+              walker->kpc->traverseUnit(*walker->state, current);
+            }
+            walker->unit++;
+            return CXChildVisit_Continue;
+          },
+          &walker);
+    });
+  }
+
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  for (unsigned worker = 0; worker < numWorkers && error.empty(); worker++) {
+    if (workerTUs[worker] == nullptr) {
+      error = "There was an error parsing the translation unit for worker " +
+              std::to_string(worker);
+    }
+  }
+
+  if (error.empty()) {
+    for (size_t unit = 0; unit < units.size(); unit++) {
+      mergeUnit(*workerStates[unit % numWorkers], results[unit]);
+    }
+    resolveIndirectCalls();
+    addBranchesToDictionary();
+    summarizeCallGraph();
+  }
+
+  for (unsigned worker = 1; worker < numWorkers; worker++) {
+    if (workerTUs[worker] != nullptr) {
+      clang_disposeTranslationUnit(workerTUs[worker]);
+    }
+    clang_disposeIndex(workerIndices[worker]);
+  }
+  return error.empty();
 }
 
-void KeyPointsCollector::printFoundBranchPoint(const CXCursorKind K) {
-  std::cout << "Found branch point: " << CXSTR(clang_getCursorKindSpelling(K))
-            << " at line#: " << getCurrentBranch()->branchPoint << '\n';
+void KeyPointsCollector::TraversalState::printFoundBranchPoint(
+    const CXCursorKind K) {
+  kpc->session.print("Found branch point: ",
+                     CXSTR(clang_getCursorKindSpelling(K)),
+                     " at line#: ", getCurrentBranch()->branchPoint, '\n');
 }
 
-void KeyPointsCollector::printFoundTargetPoint() {
+void KeyPointsCollector::TraversalState::printFoundTargetPoint() {
   BranchPointInfo *currentBranch = getCurrentBranch();
-  std::cout << "Found target for line branch #: " << currentBranch->branchPoint
-            << " at line#: " << currentBranch->targetLineNumbers.back() << '\n';
+  kpc->session.print("Found target for line branch #: ",
+                     currentBranch->branchPoint, " at line#: ",
+                     currentBranch->targetLineNumbers.back(), '\n');
 }
 
 void KeyPointsCollector::printCursorKind(const CXCursorKind K) {
-  std::cout << "Found cursor: " << CXSTR(clang_getCursorKindSpelling(K))
-            << '\n';
+  session.print("Found cursor: ", CXSTR(clang_getCursorKindSpelling(K)),
+                '\n');
+}
+
+void KeyPointsCollector::writeDictionaryEntries(
+    std::ostream &dictFile, const BranchTable::Branch &BP) const {
+  for (unsigned target = 0; target < BP.numTargets; target++) {
+    dictFile << BranchTable::formatId(branchTable.getTargetId(BP, target))
+             << ": " << filename << ", " << BP.line << ", "
+             << branchTable.getTargetLine(BP, target) << '\n';
+  }
 }
 
-void KeyPointsCollector::createDictionaryFile() {
-  std::ofstream dictFile(std::string(OUT_DIR + filename + ".branch_dict"));
+bool KeyPointsCollector::writeOutputs() {
+  const bool wroteBinary = createBinaryDictionaryFile();
+
+  std::ofstream dictFile(session.getOutDir() + filename + ".branch_dict");
   dictFile << "Branch Dictionary for: " << filename << '\n';
   dictFile << "-----------------------" << std::string(filename.size(), '-')
            << '\n';
+  const bool transformed = transformProgram(&dictFile);
+  dictFile.close();
+  return wroteBinary && transformed;
+}
 
-  const std::map<unsigned, std::map<unsigned, std::string>> &branchDict =
-      getBranchDictionary();
+std::string KeyPointsCollector::getFunctionContaining(unsigned lineNum) const {
+  auto function = funcDecls.upper_bound(lineNum);
+  if (function == funcDecls.begin()) {
+    return "";
+  }
+  --function;
+  return function->second->isInBody(lineNum)
+             ? std::string(function->second->name)
+             : "";
+}
 
-  for (const std::pair<unsigned, std::map<unsigned, std::string>> &BP :
-       branchDict) {
-    for (const std::pair<unsigned, std::string> &targets : BP.second) {
-      dictFile << targets.second << ": " << filename << ", " << BP.first << ", "
-               << targets.first << '\n';
+std::vector<BranchDictionary::Entry>
+KeyPointsCollector::getDictionaryEntries() const {
+  std::vector<BranchDictionary::Entry> entries;
+  for (const BranchTable::Branch &BP : branchTable) {
+    const std::string function = getFunctionContaining(BP.line);
+    for (unsigned target = 0; target < BP.numTargets; target++) {
+      entries.push_back({branchTable.getTargetId(BP, target), filename,
+                         function, BP.line,
+                         branchTable.getTargetLine(BP, target)});
     }
   }
+  return entries;
+}
 
-  dictFile.close();
+std::map<unsigned, std::map<unsigned, std::string>>
+KeyPointsCollector::getBranchDictionary() const {
+  std::map<unsigned, std::map<unsigned, std::string>> dictionary;
+  for (const BranchTable::Branch &BP : branchTable) {
+    std::map<unsigned, std::string> &targets = dictionary[BP.line];
+    for (unsigned target = 0; target < BP.numTargets; target++) {
+      targets[branchTable.getTargetLine(BP, target)] =
+          BranchTable::formatId(branchTable.getTargetId(BP, target));
+    }
+  }
+  return dictionary;
 }
 
-void KeyPointsCollector::addCompletedBranch() {
-  branchPoints.push_back(branchPointStack.top());
-  branchPointStack.pop();
+bool KeyPointsCollector::createBinaryDictionaryFile() {
+  const std::string path(session.getOutDir() + filename + ".bdict");
+  if (!BranchDictionary::write(path, filename, getDictionaryEntries())) {
+    error = "Could not write the branch dictionary " + path;
+    return false;
+  }
+  return true;
 }
 
 void KeyPointsCollector::addBranchesToDictionary() {
-  for (std::vector<BranchPointInfo>::reverse_iterator branchPoint =
-           branchPoints.rbegin();
-       branchPoint != branchPoints.rend(); branchPoint++) {
-    std::map<unsigned, std::string> targetsAndIds;
-    for (const unsigned &target : branchPoint->targetLineNumbers) {
-      targetsAndIds[target] = "br_" + std::to_string(++branchCount);
+  // Targets are numbered from the last completed branch point back.
+  std::vector<unsigned> ids(branchPoints.targets.size());
+  for (size_t branch = branchPoints.branches.size(); branch-- > 0;) {
+    const BranchSpans::Branch &BP = branchPoints.branches[branch];
+    for (unsigned target = BP.firstTarget;
+         target < BP.firstTarget + BP.numTargets; target++) {
+      ids[target] = ++branchCount;
+      if (BP.function != nullptr) {
+        callGraph.addBranch(std::string(BP.function->name), branchCount);
+      }
     }
-    branchDictionary[branchPoint->branchPoint] = targetsAndIds;
   }
+  branchTable.build(branchPoints, ids);
+  branchPoints.clear();
 }
 
-void KeyPointsCollector::transformProgram() {
-  std::ifstream originalProgram(filename);
+void KeyPointsCollector::offsetBranchIds(unsigned offset) {
+  branchTable.offsetIds(offset);
+}
+
+void KeyPointsCollector::resolveIndirectCalls() {
+  PointsToAnalysis pointsTo(translationUnit, filename,
+                            getNumIncludeDirectives());
+  pointsTo.run();
+
+  for (const PointsToAnalysis::IndirectCall &call :
+       pointsTo.getIndirectCalls()) {
+    if (!call.pointer.empty()) {
+      addIndirectCall(call.line, call.pointer);
+    } else if (call.targets.size() == 1 &&
+               !(MAP_FIND(functionCalls, call.line))) {
+      addCall(call.line, call.targets[0]);
+    }
+    if (!call.caller.empty()) {
+      for (const std::string &target : call.targets) {
+        callGraph.addCall(call.caller, target);
+      }
+    }
+  }
+
+  if (debug) {
+    std::ostringstream report;
+    pointsTo.printReport(report);
+    session.print(report.str());
+  }
+}
+
+void KeyPointsCollector::summarizeCallGraph() {
+  callGraph.computeSummaries();
+  for (const std::pair<const unsigned, FunctionRecord *> &decl : funcDecls) {
+    const CallGraph::Summary *summary =
+        callGraph.getSummary(std::string(decl.second->name));
+    if (summary != nullptr && summary->recursive) {
+      decl.second->recursive = true;
+    }
+  }
+}
+
+bool KeyPointsCollector::transformProgram(std::ostream *dictFile) {
   std::ofstream modifiedProgram(MODIFIED_PROGAM_OUT);
+  if (!modifiedProgram.good()) {
+    error = "Could not open " + MODIFIED_PROGAM_OUT + " for writing";
+    return false;
+  }
+  transformProgram(modifiedProgram, dictFile);
+  if (!error.empty()) {
+    return false;
+  }
+  modifiedProgram.close();
+  if (!modifiedProgram.good()) {
+    error = "Could not write " + MODIFIED_PROGAM_OUT;
+    return false;
+  }
+  return true;
+}
 
-  if (originalProgram.good() && modifiedProgram.good()) {
-    modifiedProgram << TRANSFORM_HEADER;
+void KeyPointsCollector::transformProgram(std::ostream &modifiedProgram,
+                                          std::ostream *dictFile) {
+  std::ifstream originalProgram(filename);
+
+  if (originalProgram.good()) {
+    if (session.getLatency()) {
+      modifiedProgram << "#define KPC_LATENCY\n";
+    }
+    // Sizes the per-target sampling state of the emitted header.
+    modifiedProgram << "#define KPC_NUM_BRANCHES "
+                    << branchTable.getMaxId() + 1 << '\n'
+                    << TRANSFORM_HEADER;
 
     unsigned lineNum = 1;
 
     std::string currentLine;
 
-    std::shared_ptr<FunctionDeclInfo> currentTransformFunction = nullptr;
+    const FunctionRecord *currentTransformFunction = nullptr;
 
-    int branchCountCurrFunc;
+    TargetPlan plan;
 
-    std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> funcDecls =
-        getFuncDecls();
+    // Functions whose file-scope _PTR alias has been declared. A prototype
+    // and the definition after it share one.
+    std::set<std::string_view> aliasedFunctions;
 
-    std::map<unsigned, std::string> funcCalls = getFuncCalls();
+    // Functions and branch points are both sorted by line, so they are
+    // walked in step with the file instead of looked up per line.
+    std::map<unsigned, FunctionRecord *>::const_iterator nextFunction =
+        funcDecls.begin();
 
-    std::map<unsigned, std::map<unsigned, std::string>> branchDict =
-        getBranchDictionary();
-
-    std::vector<unsigned> foundPoints;
+    BranchTable::const_iterator nextBranch = branchTable.begin();
 
     while (getline(originalProgram, currentLine)) {
-      if (MAP_FIND(funcDecls, lineNum - 1)) {
-        currentTransformFunction = funcDecls[lineNum - 1];
+      while (nextFunction != funcDecls.end() &&
+             nextFunction->first < lineNum - 1) {
+        ++nextFunction;
+      }
+      while (nextBranch != branchTable.end() &&
+             nextBranch->line < lineNum - 1) {
+        ++nextBranch;
+      }
+
+      if (nextFunction != funcDecls.end() &&
+          nextFunction->first == lineNum - 1) {
+        currentTransformFunction = nextFunction->second;
 
+        // A one-line declaration has no body to declare this alias in.
         if (currentTransformFunction->name.compare("main") &&
             currentTransformFunction->recursive &&
-            currentTransformFunction->type != "void") {
+            currentTransformFunction->type != "void" &&
+            currentTransformFunction->defLoc !=
+                currentTransformFunction->endLoc) {
           modifiedProgram << DECLARE_FUNC_PTR(currentTransformFunction);
         }
 
-        foundPoints.clear();
-        branchCountCurrFunc = 0;
-        insertFunctionBranchPointDecls(
-            modifiedProgram, currentTransformFunction, &branchCountCurrFunc);
+        insertFunctionBranchState(modifiedProgram, currentTransformFunction,
+                                  nextBranch, plan);
+
+        // With -DKPC_FORKSERVER main's body is where the fork server waits.
+        if (!currentTransformFunction->name.compare("main")) {
+          modifiedProgram << "KPC_FORK_SERVER()\n";
+        }
       }
 
       if (currentTransformFunction != nullptr &&
           (lineNum - 1) == currentTransformFunction->endLoc &&
-          currentTransformFunction->name.compare("main")) {
+          currentTransformFunction->name.compare("main") &&
+          aliasedFunctions.insert(currentTransformFunction->name).second) {
         modifiedProgram << DECLARE_FUNC_PTR(currentTransformFunction);
       }
 
-      if (MAP_FIND(branchDict, lineNum - 1)) {
-        modifiedProgram << SET_BRANCH(foundPoints.size());
-        foundPoints.push_back(lineNum - 1);
+      if (dictFile != nullptr && nextBranch != branchTable.end() &&
+          nextBranch->line == lineNum - 1) {
+        writeDictionaryEntries(*dictFile, *nextBranch);
       }
 
+      // Right to left, so the columns of the rest stay valid.
+      std::map<unsigned, std::map<unsigned, std::string>>::const_iterator
+          splices = plan.splices.find(lineNum);
+      if (splices != plan.splices.end()) {
+        for (auto splice = splices->second.rbegin();
+             splice != splices->second.rend(); ++splice) {
+          currentLine.insert(
+              std::min<size_t>(splice->first - 1, currentLine.size()),
+              splice->second);
+        }
+      }
 
-      std::vector<unsigned> foundPointsIdxCurrentLine;
-
-      if (!foundPoints.empty()) {
-        for (int idx = foundPoints.size() - 1; idx >= 0; --idx) {
-          std::map<unsigned, std::string> targets =
-              branchDict[foundPoints[idx]];
+      const size_t labelLength = getLabelLength(currentLine);
+      modifiedProgram << currentLine.substr(0, labelLength);
 
-          if (MAP_FIND(targets, lineNum)) {
-            foundPointsIdxCurrentLine.push_back(idx);
-          }
-        }
+      std::map<unsigned, unsigned>::const_iterator found =
+          plan.bodyStates.find(lineNum);
+      if (found != plan.bodyStates.end()) {
+        modifiedProgram << SET_BRANCH_STATE(found->second);
       }
-      switch (foundPointsIdxCurrentLine.size()) {
-      case 0:
-        break;
-    
-      case 1: {
-       
-        if (foundPointsIdxCurrentLine[0] + 1 < branchCountCurrFunc) {
-          modifiedProgram << "if (";
-          for (int successive = foundPointsIdxCurrentLine[0] + 1;
-               successive < branchCountCurrFunc; successive++) {
-            modifiedProgram << "!BRANCH_" << successive;
-            if (branchCountCurrFunc - successive > 1)
-              modifiedProgram << " && ";
-          }
-          modifiedProgram
-              << ") LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-              << "\");";
-        }
-        else {
-          modifiedProgram
-              << "LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-              << "\");";
+
+      std::map<unsigned, unsigned>::const_iterator loop =
+          plan.loops.find(lineNum);
+      if (loop != plan.loops.end()) {
+        if ((found = plan.slots.find(lineNum)) != plan.slots.end()) {
+          modifiedProgram << "LOG_IN_LOOP(" << loop->second << ", "
+                          << found->second << ");";
+        } else if ((found = plan.columns.find(lineNum)) !=
+                   plan.columns.end()) {
+          modifiedProgram << "LOG_TARGET_IN_LOOP(" << loop->second << ", "
+                          << found->second << ");";
         }
-        break;
-      }
-      case 2: {
-        modifiedProgram
-            << "if (BRANCH_" << foundPointsIdxCurrentLine[0] << ") {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-            << "\")} else {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[1]]][lineNum]
-            << "\")}";
-        break;
+      } else if ((found = plan.ids.find(lineNum)) != plan.ids.end()) {
+        modifiedProgram << "LOG(" << found->second << ");";
+      } else if ((found = plan.columns.find(lineNum)) != plan.columns.end()) {
+        modifiedProgram << "LOG_TARGET(" << found->second << ");";
       }
-      default: {
-        modifiedProgram
-            << "if (BRANCH_" << foundPointsIdxCurrentLine[0] << ") {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-            << "\")}";
-
-        for (int successive = 1;
-             successive < foundPointsIdxCurrentLine.size() - 1; successive++) {
-          modifiedProgram
-              << " else if (BRANCH_" << foundPointsIdxCurrentLine[successive]
-              << ") {LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[successive]]]
-                           [lineNum]
-              << "\")}";
-        }
 
-        // Insert final else for the last branch point.
-        modifiedProgram
-            << "else {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine
-                                          [foundPointsIdxCurrentLine.size() -
-                                           1]]][lineNum]
-            << "\")}";
-
-      } break;
+      if ((found = plan.switchStates.find(lineNum)) !=
+          plan.switchStates.end()) {
+        modifiedProgram << SET_BRANCH_STATE(found->second);
       }
 
-      if (MAP_FIND(funcCalls, lineNum)) {
-        modifiedProgram << "LOG_PTR(" << funcCalls[lineNum] << "_PTR"
+      if (MAP_FIND(functionCalls, lineNum)) {
+        modifiedProgram << "LOG_PTR(" << functionCalls[lineNum] << "_PTR"
                         << ");\n";
       }
 
+      if (MAP_FIND(indirectCalls, lineNum)) {
+        modifiedProgram << "LOG_PTR(" << indirectCalls[lineNum] << ");\n";
+      }
+
 
-      modifiedProgram << WRITE_LINE(currentLine);
+      modifiedProgram << WRITE_LINE(currentLine.substr(labelLength));
       lineNum++;
     }
 
+    // Branch points the walk did not reach still belong in the dictionary.
+    for (; dictFile != nullptr && nextBranch != branchTable.end();
+         ++nextBranch) {
+      if (nextBranch->line >= lineNum - 1) {
+        writeDictionaryEntries(*dictFile, *nextBranch);
+      }
+    }
+
     originalProgram.close();
-    modifiedProgram.close();
 
   } else {
-    std::cerr << "Error opening program files for transformation!\n";
-    exit(EXIT_FAILURE);
+    error = "Could not open " + filename + " for transformation";
   }
 }
 
-void KeyPointsCollector::insertFunctionBranchPointDecls(
-    std::ofstream &program, std::shared_ptr<FunctionDeclInfo> function,
-    int *branchCount) {
-  for (int lineNum = function->defLoc; lineNum < function->endLoc; lineNum++) {
-    if (MAP_FIND(getBranchDictionary(), lineNum)) {
-      program << DECLARE_BRANCH((*branchCount)++);
+void KeyPointsCollector::insertFunctionBranchState(
+    std::ostream &program, const FunctionRecord *function,
+    BranchTable::const_iterator firstBranch, TargetPlan &plan) {
+  plan.bodyStates.clear();
+  plan.switchStates.clear();
+  plan.ids.clear();
+  plan.columns.clear();
+  plan.loops.clear();
+  plan.slots.clear();
+  plan.splices.clear();
+
+  const unsigned numBranchPoints =
+      branchTable.countInRange(function->defLoc, function->endLoc);
+  if (numBranchPoints == 0) {
+    program << '\n';
+    return;
+  }
+
+  // (state, id) of every branch point targeting a line, from branch points
+  // above the line only.
+  std::map<unsigned, std::vector<std::pair<unsigned, unsigned>>> candidates;
+  BranchTable::const_iterator BP = firstBranch;
+  for (unsigned state = 1; state <= numBranchPoints; state++, ++BP) {
+    if (BP->isSwitch) {
+      plan.switchStates[BP->line] = state;
+    } else {
+      plan.bodyStates[BP->line + 1] = state;
+    }
+    for (unsigned target = 0; target < BP->numTargets; target++) {
+      const unsigned line = branchTable.getTargetLine(*BP, target);
+      if (line > BP->line) {
+        candidates[line].emplace_back(state,
+                                      branchTable.getTargetId(*BP, target));
+      }
+    }
+  }
+
+  std::vector<const std::vector<std::pair<unsigned, unsigned>> *> shared;
+  for (const auto &line : candidates) {
+    if (line.second.size() == 1) {
+      plan.ids[line.first] = line.second[0].second;
+    } else {
+      plan.columns[line.first] = shared.size();
+      shared.push_back(&line.second);
     }
   }
+
+  program << DECLARE_BRANCH_STATE;
+  if (!shared.empty()) {
+    // A shared line logs the branch point last reached if it targets the
+    // line, else the nearest one above it that does, else the first one.
+    program << "static const unsigned kpc_targets[" << numBranchPoints + 1
+            << "][" << shared.size() << "] = {";
+    for (unsigned state = 0; state <= numBranchPoints; state++) {
+      program << (state > 0 ? ", {" : "{");
+      for (size_t column = 0; column < shared.size(); column++) {
+        unsigned id = shared[column]->front().second;
+        for (const std::pair<unsigned, unsigned> &candidate : *shared[column]) {
+          if (candidate.first <= state) {
+            id = candidate.second;
+          }
+        }
+        program << (column > 0 ? ", " : "") << id;
+      }
+      program << '}';
+    }
+    program << "};\n";
+  }
+  if (session.getLoopSummaries() && !session.getLatency()) {
+    planLoopSummaries(program, firstBranch, numBranchPoints, candidates, plan);
+  }
   program << '\n';
 }
 
-void KeyPointsCollector::compileModified() {
+void KeyPointsCollector::planLoopSummaries(
+    std::ostream &program, BranchTable::const_iterator firstBranch,
+    unsigned numBranchPoints,
+    const std::map<unsigned, std::vector<std::pair<unsigned, unsigned>>>
+        &candidates,
+    TargetPlan &plan) {
+  // A loop whose body shares its line has no line inside it to count on.
+  std::vector<const BranchTable::Branch *> loops;
+  BranchTable::const_iterator BP = firstBranch;
+  for (unsigned state = 1; state <= numBranchPoints; state++, ++BP) {
+    if (BP->isLoop && BP->endLine > BP->line && BP->column > 0 &&
+        BP->endColumn > 0) {
+      loops.push_back(&*BP);
+    }
+  }
+
+  // Ids counted by each loop, its first body target first: that one is
+  // reached once per iteration.
+  std::map<unsigned, std::vector<unsigned>> loopIds;
+  for (const BranchTable::Branch *loop : loops) {
+    unsigned entryLine = 0;
+    unsigned entryId = 0;
+    for (unsigned target = 0; target < loop->numTargets; target++) {
+      const unsigned line = branchTable.getTargetLine(*loop, target);
+      if (line > loop->line && line <= loop->endLine &&
+          (entryLine == 0 || line < entryLine)) {
+        entryLine = line;
+        entryId = branchTable.getTargetId(*loop, target);
+      }
+    }
+    if (entryLine != 0) {
+      loopIds[loop->line].push_back(entryId);
+    }
+  }
+
+  for (const auto &line : candidates) {
+    const BranchTable::Branch *innermost = nullptr;
+    for (const BranchTable::Branch *loop : loops) {
+      if (loop->line < line.first && line.first <= loop->endLine &&
+          MAP_FIND(loopIds, loop->line)) {
+        innermost = loop;
+      }
+    }
+    if (innermost == nullptr) {
+      continue;
+    }
+
+    std::vector<unsigned> &ids = loopIds[innermost->line];
+    plan.loops[line.first] = innermost->line;
+    for (const std::pair<unsigned, unsigned> &candidate : line.second) {
+      std::vector<unsigned>::iterator slot =
+          std::find(ids.begin(), ids.end(), candidate.second);
+      if (slot == ids.end()) {
+        slot = ids.insert(ids.end(), candidate.second);
+      }
+      if (line.second.size() == 1) {
+        plan.slots[line.first] = slot - ids.begin();
+      }
+    }
+  }
+
+  for (const BranchTable::Branch *loop : loops) {
+    std::map<unsigned, std::vector<unsigned>>::const_iterator ids =
+        loopIds.find(loop->line);
+    if (ids == loopIds.end()) {
+      continue;
+    }
+    program << "static const unsigned kpc_loop_ids_" << loop->line << "[] = {";
+    for (size_t slot = 0; slot < ids->second.size(); slot++) {
+      program << (slot > 0 ? ", " : "") << ids->second[slot];
+    }
+    program << "};\n";
+
+    plan.splices[loop->line][loop->column] =
+        "{ KPC_LOOP_BEGIN(" + std::to_string(loop->line) + ") ";
+    plan.splices[loop->endLine][loop->endColumn] = " }";
+  }
+}
+
+size_t KeyPointsCollector::getLabelLength(const std::string &line) {
+  size_t length = 0;
+  while (true) {
+    const size_t start = line.find_first_not_of(" \t", length);
+    size_t pos;
+    if (start != std::string::npos && line.compare(start, 4, "case") == 0) {
+      pos = start + 4;
+    } else if (start != std::string::npos &&
+               line.compare(start, 7, "default") == 0) {
+      pos = start + 7;
+    } else {
+      return length;
+    }
+    if (pos < line.size() && (std::isalnum(line[pos]) || line[pos] == '_')) {
+      return length;
+    }
+
+    // The label ends at its colon; each ?: in the case value uses one more.
+    unsigned colons = 1;
+    for (; pos < line.size(); pos++) {
+      if (line[pos] == '\'') {
+        for (pos++; pos < line.size() && line[pos] != '\''; pos++) {
+          if (line[pos] == '\\') {
+            pos++;
+          }
+        }
+      } else if (line[pos] == '?') {
+        colons++;
+      } else if (line[pos] == ':' && --colons == 0) {
+        break;
+      }
+    }
+    if (pos >= line.size()) {
+      return length;
+    }
+    length = pos + 1;
+  }
+}
+
+bool KeyPointsCollector::compileModified() {
 #if defined(__clang__)
   std::string c_compiler("clang");
 #elif defined(__GNUC__)
   std::string c_compiler("gcc");
 #endif
   if (c_compiler.empty()) {
-    c_compiler = std::getenv("CC");
-    if (c_compiler.empty()) {
-      std::cerr << "No viable C compiler found on system!\n";
-      exit(EXIT_FAILURE);
+    const char *cc = std::getenv("CC");
+    if (cc == nullptr || *cc == '\0') {
+      error = "No viable C compiler found on system!";
+      return false;
     }
+    c_compiler = cc;
   }
-  std::cout << "C compiler is: " << c_compiler << '\n';
+  session.print("C compiler is: ", c_compiler, '\n');
 
   if (!static_cast<bool>(std::ifstream(MODIFIED_PROGAM_OUT).good())) {
-    std::cerr << "Transformed program has not been created yet!\n";
-    exit(EXIT_FAILURE);
+    error = "Transformed program has not been created yet!";
+    return false;
   }
 
   std::stringstream compilationCommand;
@@ -626,92 +1202,78 @@ void KeyPointsCollector::compileModified() {
   bool compiled = static_cast<bool>(system(compilationCommand.str().c_str()));
 
   if (compiled == EXIT_SUCCESS) {
-    std::cout << "Compilation Successful" << '\n';
-  } else {
-    std::cerr << "There was an error with compilation, exiting!\n";
-    exit(EXIT_FAILURE);
+    session.print("Compilation Successful\n");
+    return true;
   }
+  error = "There was an error compiling " + MODIFIED_PROGAM_OUT;
+  return false;
 }
 
-void KeyPointsCollector::invokeValgrind() {
+bool KeyPointsCollector::invokeValgrind() {
 #if defined(__clang__)
   std::string c_compiler("clang");
 #elif defined(__GNUC__)
   std::string c_compiler("gcc");
 #endif
   if (c_compiler.empty()) {
-    c_compiler = std::getenv("CC");
-    if (c_compiler.empty()) {
-      std::cerr << "No viable C compiler found on system!\n";
-      exit(EXIT_FAILURE);
+    const char *cc = std::getenv("CC");
+    if (cc == nullptr || *cc == '\0') {
+      error = "No viable C compiler found on system!";
+      return false;
     }
+    c_compiler = cc;
   }
 
   if (!static_cast<bool>(std::ifstream(filename).good())) {
-    std::cerr << "No program to compile!\n";
-    exit(EXIT_FAILURE);
+    error = "No program to compile!";
+    return false;
   }
 
   std::stringstream shellCommandStream;
-  shellCommandStream << c_compiler << " -O0 " << filename << " -o "
+  shellCommandStream << c_compiler << " -O0 -g " << filename << " -o "
                      << ORIGINAL_EXE_OUT;
 
   bool compiled = static_cast<bool>(system(shellCommandStream.str().c_str()));
 
   if (compiled == EXIT_SUCCESS) {
-    std::cout << "Compilation Successful" << '\n';
+    session.print("Compilation Successful\n");
   } else {
-    std::cerr << "There was an error with compilation, exiting!\n";
-    exit(EXIT_FAILURE);
+    error = "There was an error compiling " + filename;
+    return false;
   }
 
-  const std::string valgrindLogFile(OUT_DIR + filename + ".VALGRIND_OUT");
+  const std::string valgrindLogFile(session.getOutDir() + filename +
+                                    ".VALGRIND_OUT");
+  const std::string callgrindFile(session.getOutDir() + filename +
+                                  ".callgrind");
   shellCommandStream.str("");
   shellCommandStream.clear();
-  shellCommandStream << "valgrind --tool=callgrind --dump-instr=yes --log-file="
-                     << valgrindLogFile << " " << ORIGINAL_EXE_OUT;
+  shellCommandStream << "valgrind --tool=callgrind --dump-instr=yes "
+                     << "--callgrind-out-file=" << callgrindFile
+                     << " --log-file=" << valgrindLogFile << " "
+                     << ORIGINAL_EXE_OUT;
 
   bool valgrind = static_cast<bool>(system(shellCommandStream.str().c_str()));
 
-  if (valgrind == EXIT_SUCCESS) {
-    std::cout << "Valgrind invoked successfully\n";
-    system("rm -r callgrind*");
-    shellCommandStream.str("");
-    shellCommandStream.clear();
-    shellCommandStream << "python3 " << VALGRIND_PARSER << " "
-                       << valgrindLogFile;
-    system(shellCommandStream.str().c_str());
-  }
-}
-
-void KeyPointsCollector::executeToolchain() {
-  collectCursors();
-  createDictionaryFile();
-  transformProgram();
-  compileModified();
-  std::cout << "\nToolchain was successful, the branch dicitonary, modified "
-               "file, and executable have been written to the "
-            << OUT_DIR << " directory \n";
-
-  char decision;
-  std::cout << "\nWould you like to invoke Valgrind? (y/n) ";
-  std::cin >> decision;
-  if (decision == 'y') {
-    invokeValgrind();
+  if (valgrind != EXIT_SUCCESS) {
+    error = "Valgrind failed; see " + valgrindLogFile;
+    return false;
   }
-
-  std::cout << "\nWould you like to out put the branch pointer trace for the "
-               "program? (y/n) ";
-  std::cin >> decision;
-  if (decision == 'y') {
-    system(EXE_OUT.c_str());
+  session.print("Valgrind invoked successfully\n");
+  CallgrindParser profile;
+  if (!profile.parse(callgrindFile, error)) {
+    return false;
   }
+  std::ostringstream report;
+  profile.printReport(report, getDictionaryEntries());
+  session.print(report.str());
+  return true;
 }
 
 std::string KeyPointsCollector::getBPTrace() {
-  collectCursors();
-  transformProgram();
-  compileModified();
+  if (!collectCursors() || !transformProgram() || !compileModified()) {
+    return "";
+  }
   std::vector<char> buffer(128);
   std::string result;
   std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(EXE_OUT.c_str(), "r"),
@@ -2,18 +2,24 @@
 #ifndef KEY_POINTS_COLLECTOR__H
 #define KEY_POINTS_COLLECTOR__H
 
+#include "AnalysisIR.h"
+#include "BranchDictionary.h"
+#include "CallGraph.h"
 #include "Common.h"
+#include "Session.h"
 #include <clang-c/Index.h>
 
 #include <iostream>
 #include <map>
 #include <memory>
-#include <stack>
+#include <set>
 #include <string>
 #include <vector>
 
 class KeyPointsCollector {
 
+  Session &session;
+
   const std::string filename;
 
   
@@ -24,10 +30,14 @@ class KeyPointsCollector {
 
   void addCursor(CXCursor const &C) { cursorObjs.push_back(C); }
 
-  inline static CXIndex KPCIndex = clang_createIndex(0, 0);
+  // Owned by this collector, so collectors never share libclang state.
+  CXIndex index;
 
   CXTranslationUnit translationUnit;
 
+  // Why parsing or the last failed step did not succeed.
+  std::string error;
+
   CXCursor rootCursor;
 
   bool debug;
@@ -38,84 +48,67 @@ class KeyPointsCollector {
     includeDirectives[lineNum] = includeDirective;
   }
 
+  // Source text as parsed (include directives removed only when neither
+  // compile flags nor the shared PCH are available); the main and worker TUs
+  // are parsed from this buffer so their line numbers match.
+  std::string strippedSource;
+
+  // Compiler arguments from a compilation database, without the compiler
+  // and the input file, "-include-pch" for the shared system header PCH, or
+  // "-fno-builtin" when the includes are stripped.
+  std::vector<std::string> parseArgs;
+
+  void readSource();
+
   void removeIncludeDirectives();
 
-  void reInsertIncludeDirectives();
+  CXTranslationUnit parseSource(CXIndex index);
 
   static CXChildVisitResult
-  VisitorFunctionCore(CXCursor current, CXCursor parent, CXClientData kpc);
+  VisitorFunctionCore(CXCursor current, CXCursor parent, CXClientData state);
 
   
   static CXChildVisitResult VisitCompoundStmt(CXCursor current, CXCursor parent,
-                                              CXClientData kpc);
+                                              CXClientData state);
 
   static CXChildVisitResult VisitCallExpr(CXCursor current, CXCursor parent,
-                                          CXClientData kpc);
-
-  static CXChildVisitResult VisitFuncDecl(CXCursor current, CXCursor parent,
-                                          CXClientData kpc);
+                                          CXClientData state);
 
+  // Records the callee and input read of every call below a call, itself
+  // included.
   static CXChildVisitResult
-  VisitVarOrParamDecl(CXCursor current, CXCursor parent, CXClientData kpc);
+  VisitCallGraphEdge(CXCursor current, CXCursor parent, CXClientData state);
 
-  static CXChildVisitResult VisitFuncPtr(CXCursor current, CXCursor parent,
-                                         CXClientData kpc);
-
-
-  std::map<std::string, std::string> funcPtrs;
-
-  std::string currFuncPtrId;
-
-  std::string isFunctionPtr(const std::string &id) {
-    if (MAP_FIND(funcPtrs, id)) {
-      return funcPtrs[id];
-    }
-    return nullptr;
-  }
-
-  
-  void addFuncPtr(const std::string &id, const std::string &func) {
-    funcPtrs[id] = func;
-  }
-
-  struct FunctionDeclInfo {
-    unsigned defLoc;
-    unsigned endLoc;
-    const std::string name;
-    const std::string type;
-    bool recursive;
-
-    FunctionDeclInfo(unsigned defLoc, unsigned endLoc, const std::string &name,
-                     const std::string &type)
-        : defLoc(defLoc), endLoc(endLoc), name(std::move(name)),
-          type(std::move(type)) {}
+  static CXChildVisitResult
+  VisitVarOrParamDecl(CXCursor current, CXCursor parent, CXClientData state);
 
-    void setRecursive() { recursive = true; }
+  // Function records and their interned names and types live in the arena
+  // and are freed together with the collector.
+  Arena arena;
 
-    bool isInBody(unsigned lineNum) {
-      return lineNum >= defLoc && lineNum <= endLoc;
-    }
-  };
+  StringPool strings;
 
-  void addFuncDecl(std::shared_ptr<FunctionDeclInfo> decl) {
+  void addFuncDecl(FunctionRecord *decl) {
     funcDecls[decl->defLoc] = decl;
     funcDeclsString[decl->name] = decl;
   }
 
-  std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> funcDecls;
+  std::map<unsigned, FunctionRecord *> funcDecls;
 
-  std::map<std::string, std::shared_ptr<FunctionDeclInfo>> funcDeclsString;
-  std::shared_ptr<FunctionDeclInfo> getFunctionByName(const std::string &name) {
+  std::map<std::string_view, FunctionRecord *> funcDeclsString;
+
+  FunctionRecord *getFunctionByName(const std::string &name) {
     if (MAP_FIND(funcDeclsString, name)) {
       return funcDeclsString[name];
     }
     return nullptr;
   }
 
-  std::shared_ptr<FunctionDeclInfo> currentFunction;
-
-  bool inCurrentFunction(unsigned lineNumber) const {
-    return currentFunction->isInBody(lineNumber);
+  FunctionRecord *getFunctionAtLine(unsigned lineNum) {
+    if (MAP_FIND(funcDecls, lineNum)) {
+      return funcDecls[lineNum];
+    }
+    return nullptr;
   }
 
   std::map<unsigned, std::string> functionCalls;
@@ -124,12 +117,23 @@ class KeyPointsCollector {
     functionCalls[lineNum] = calleeName;
   }
 
+  // Callees logged by name rather than through a _PTR alias: function
+  // pointer variables, so the trace shows the target actually taken, and
+  // functions defined in another translation unit of the project.
+  std::map<unsigned, std::string> indirectCalls;
+
+  void addIndirectCall(unsigned lineNum, const std::string &pointerName) {
+    indirectCalls[lineNum] = pointerName;
+  }
+
   std::map<std::string, unsigned> varDecls;
 
   void addVarDeclToMap(const std::string name, unsigned lineNum) {
     varDecls[name] = lineNum;
   }
 
+  // A branch point still being traversed. Completed ones are moved into a
+  // BranchSpans.
   struct BranchPointInfo {
     unsigned branchPoint;
     std::vector<unsigned> targetLineNumbers;
@@ -138,67 +142,229 @@ class KeyPointsCollector {
  
     unsigned compoundEndColumnNum;
 
+    unsigned column;
+
+    const FunctionRecord *function;
+
+    bool isSwitch;
+
+    bool isLoop;
+
     BranchPointInfo()
-        : branchPoint(0), compoundEndLineNum(0), compoundEndColumnNum(0) {}
+        : branchPoint(0), compoundEndLineNum(0), compoundEndColumnNum(0),
+          column(0), function(nullptr), isSwitch(false), isLoop(false) {}
 
     unsigned *getBranchPointOut() { return &branchPoint; }
     void addTarget(unsigned target) { targetLineNumbers.push_back(target); }
   };
 
-  unsigned branchCount;
-  
-  std::stack<BranchPointInfo> branchPointStack;
+  // Everything a single top-level cursor contributes to the analysis. Units
+  // are traversed independently and merged back in source order, so the
+  // result does not depend on how units were spread across workers.
+  struct UnitResult {
+    std::vector<CXCursor> cursors;
+    BranchSpans branchPoints;
+    std::map<unsigned, std::string> calls;
+    std::vector<std::pair<std::string, unsigned>> varDecls;
+    std::string function;
+    std::vector<std::string> callees;
+    std::set<std::string> inputs;
+  };
 
-  std::vector<BranchPointInfo> branchPoints;
+  // Private traversal state of one worker. Each worker owns its translation
+  // unit so libclang is never entered concurrently on the same TU.
+  struct TraversalState {
+    KeyPointsCollector *kpc;
+    CXTranslationUnit tu;
+    CXFile cxFile;
+
+    // Open branch points, innermost last. Slots above depth are kept so
+    // their target vectors are reused by the next branch point.
+    std::vector<BranchPointInfo> branchPointStack;
+    size_t depth;
+    const FunctionRecord *currentFunction;
+    std::set<std::string> seenVars;
+
+    UnitResult *result;
+
+    TraversalState(KeyPointsCollector *kpc, CXTranslationUnit tu)
+        : kpc(kpc), tu(tu), depth(0), currentFunction(nullptr),
+          result(nullptr) {
+      cxFile = clang_getFile(tu, kpc->filename.c_str());
+    }
 
- 
-  void pushNewBranchPoint() { branchPointStack.push(BranchPointInfo()); }
+    void reset(UnitResult *unit) {
+      depth = 0;
+      currentFunction = nullptr;
+      seenVars.clear();
+      result = unit;
+    }
 
-  std::map<unsigned, std::map<unsigned, std::string>> branchDictionary;
+    void pushNewBranchPoint() {
+      if (depth == branchPointStack.size()) {
+        branchPointStack.emplace_back();
+      }
+      BranchPointInfo &branch = branchPointStack[depth++];
+      branch.branchPoint = 0;
+      branch.targetLineNumbers.clear();
+      branch.compoundEndLineNum = 0;
+      branch.compoundEndColumnNum = 0;
+      branch.column = 0;
+      branch.function = currentFunction;
+      branch.isSwitch = false;
+      branch.isLoop = false;
+    }
 
-  void addBranchesToDictionary();
+    bool compoundStmtFoundYet() const { return depth > 0; }
 
-  void printFoundBranchPoint(const CXCursorKind K);
+    BranchPointInfo *getCurrentBranch() {
+      return &branchPointStack[depth - 1];
+    }
 
-  void printFoundTargetPoint();
+    void addCompletedBranch() {
+      const BranchPointInfo &branch = branchPointStack[--depth];
+      BranchSpans::Branch completed{};
+      completed.line = branch.branchPoint;
+      completed.function = branch.function;
+      completed.column = branch.column;
+      completed.endLine =
+          branch.compoundEndLineNum + kpc->getNumIncludeDirectives();
+      completed.endColumn = branch.compoundEndColumnNum;
+      completed.isSwitch = branch.isSwitch;
+      completed.isLoop = branch.isLoop;
+      result->branchPoints.add(completed, branch.targetLineNumbers);
+    }
 
-  void printCursorKind(const CXCursorKind K);
+    bool inCurrentFunction(unsigned lineNumber) const {
+      return currentFunction != nullptr &&
+             currentFunction->isInBody(lineNumber);
+    }
 
-  bool isBranchPointOrCallExpr(const CXCursorKind K);
+    bool checkChildAgainstStackTop(CXCursor child);
 
-  bool isFunctionPtr(const CXCursor C);
+    void printFoundBranchPoint(const CXCursorKind K);
 
- 
-  bool compoundStmtFoundYet() const { return !branchPointStack.empty(); }
+    void printFoundTargetPoint();
+  };
 
+  unsigned branchCount;
 
-  bool checkChildAgainstStackTop(CXCursor child);
+  // Branch points of all units in completion order, until they are numbered
+  // into branchTable.
+  BranchSpans branchPoints;
 
- 
-  BranchPointInfo *getCurrentBranch() { return &branchPointStack.top(); }
+  BranchTable branchTable;
 
+  void addBranchesToDictionary();
 
-  void addCompletedBranch();
+  // Resolves calls through function pointers, tables and struct fields with
+  // a whole-TU points-to analysis and adds them to the call map and graph.
+  void resolveIndirectCalls();
 
-  void createDictionaryFile();
+  CallGraph callGraph;
 
-  void
-  insertFunctionBranchPointDecls(std::ofstream &program,
-                                 std::shared_ptr<FunctionDeclInfo> function,
-                                 int *branchCount);
+  // Summarises the call graph and marks every function that is part of a
+  // recursive cycle, direct or mutual.
+  void summarizeCallGraph();
+
+  void printCursorKind(const CXCursorKind K);
+
+  bool isBranchPointOrCallExpr(const CXCursorKind K);
+
+  bool isFunctionPtr(const CXCursor C);
+
+  // Statement a case or default label (or a run of them) applies to, so
+  // that switch targets are logged where the jump lands rather than before
+  // the label. Other cursors are returned unchanged.
+  static CXCursor skipCaseLabels(CXCursor C);
+
+  // Records a top-level function declaration so that every unit can resolve
+  // callees regardless of which worker traverses it.
+  void recordFunctionDecl(CXCursor C);
+
+  // Serial pass over the top-level cursors only: fills the declaration
+  // tables and returns the function cursors that make up the work units.
+  std::vector<CXCursor> collectUnits();
+
+  void traverseUnit(TraversalState &state, CXCursor unit);
+
+  void mergeUnit(TraversalState &state, UnitResult &unit);
+
+  // Writes the text dictionary entries of one branch point.
+  void writeDictionaryEntries(std::ostream &dictFile,
+                              const BranchTable::Branch &BP) const;
+
+  bool createBinaryDictionaryFile();
+
+  // How the target lines of one function are logged. Branch points are
+  // numbered from 1 in line order and kpc_state holds the last one reached.
+  // A line targeted by a single branch point logs its id directly; a line
+  // shared by several looks the id up in kpc_targets[kpc_state][column].
+  struct TargetPlan {
+    // Lines before which kpc_state is set: the start of a branch point's
+    // body, or the switch statement itself.
+    std::map<unsigned, unsigned> bodyStates;
+    std::map<unsigned, unsigned> switchStates;
+
+    std::map<unsigned, unsigned> ids;
+    std::map<unsigned, unsigned> columns;
+
+    // With loop summaries: the innermost summarized loop (by its line) of
+    // each target line inside one, the counter slot of those with a single
+    // id, and the text spliced in at a column of a line to open and close
+    // each loop's block.
+    std::map<unsigned, unsigned> loops;
+    std::map<unsigned, unsigned> slots;
+    std::map<unsigned, std::map<unsigned, std::string>> splices;
+  };
+
+  // Declares kpc_state and kpc_targets for the function whose branch points
+  // start at firstBranch, and fills plan. With loop summaries, also declares
+  // the ids counted by each of the function's loops.
+  void insertFunctionBranchState(std::ostream &program,
+                                 const FunctionRecord *function,
+                                 BranchTable::const_iterator firstBranch,
+                                 TargetPlan &plan);
+
+  // Wraps every loop of the function with a body spanning lines in a block
+  // holding its counters, and assigns their target lines to them.
+  void planLoopSummaries(
+      std::ostream &program, BranchTable::const_iterator firstBranch,
+      unsigned numBranchPoints,
+      const std::map<unsigned, std::vector<std::pair<unsigned, unsigned>>>
+          &candidates,
+      TargetPlan &plan);
+
+  // Length of the case and default labels line starts with, which must stay
+  // ahead of anything inserted into it.
+  static size_t getLabelLength(const std::string &line);
 
 public:
   
-  KeyPointsCollector(const std::string &fileName, bool debug = false);
+  // Parses fileName; check isParsed() before using the collector. Output
+  // goes to the session's sink and generated files to its directory.
+  KeyPointsCollector(Session &session, const std::string &fileName,
+                     bool debug = false,
+                     const std::vector<std::string> &compileArgs = {});
 
   ~KeyPointsCollector();
 
+  KeyPointsCollector(const KeyPointsCollector &) = delete;
+
+  KeyPointsCollector &operator=(const KeyPointsCollector &) = delete;
+
+  bool isParsed() const { return index != nullptr && error.empty(); }
+
+  // Arguments the file was parsed with: compile flags, the PCH, or none.
+  const std::vector<std::string> &getParseArgs() const { return parseArgs; }
+
+  const std::string &getError() const { return error; }
+
 
   const std::vector<CXCursor> &getCursorObjs() const { return cursorObjs; }
 
 
-  const std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> &
-  getFuncDecls() const {
+  const std::map<unsigned, FunctionRecord *> &getFuncDecls() const {
     return funcDecls;
   }
 
@@ -206,6 +372,34 @@ public:
     return functionCalls;
   }
 
+  const std::map<unsigned, std::string> &getIndirectCalls() const {
+    return indirectCalls;
+  }
+
+  // Logs a call to a function defined in another translation unit, unless
+  // the line already logs a call.
+  void addExternalCall(unsigned lineNum, const std::string &calleeName) {
+    if (!(MAP_FIND(functionCalls, lineNum)) &&
+        !(MAP_FIND(indirectCalls, lineNum))) {
+      addIndirectCall(lineNum, calleeName);
+    }
+  }
+
+  unsigned getBranchCount() const { return branchCount; }
+
+  // Name of the function whose body contains lineNum, or an empty string.
+  std::string getFunctionContaining(unsigned lineNum) const;
+
+  // Dictionary entries for every br_N id, for BranchDictionary::write().
+  std::vector<BranchDictionary::Entry> getDictionaryEntries() const;
+
+  // Shifts every br_N id by offset so dictionaries of several translation
+  // units can be merged without clashes. Call graph summaries keep the
+  // local ids.
+  void offsetBranchIds(unsigned offset);
+
+  const CallGraph &getCallGraph() const { return callGraph; }
+
 
   const std::map<std::string, unsigned> &getVarDecls() const {
     return varDecls;
@@ -216,24 +410,49 @@ public:
   
   CXTranslationUnit &getTU() { return translationUnit; }
 
-  const std::map<unsigned, std::map<unsigned, std::string>> &
-  getBranchDictionary() {
-    return branchDictionary;
-  }
+  const BranchTable &getBranchTable() const { return branchTable; }
+
+  // The branch table as branch line -> target line -> br_N id, built on
+  // demand.
+  std::map<unsigned, std::map<unsigned, std::string>>
+  getBranchDictionary() const;
 
   
-  void invokeValgrind();
+  // The steps below return false with getError() set when they fail.
+
+  bool invokeValgrind();
 
+  // Output of the instrumented program, or an empty string on failure.
   std::string getBPTrace();
   
-  void compileModified();
+  bool compileModified();
 
-  void transformProgram();
+  // Writes the instrumented program to the session's directory. If dictFile
+  // is given, the text dictionary is written to it in the same pass, each
+  // branch point's entries as the transform reaches it.
+  bool transformProgram(std::ostream *dictFile = nullptr);
 
-  
-  void collectCursors();
+  // Writes the instrumented program to modifiedProgram.
+  void transformProgram(std::ostream &modifiedProgram,
+                        std::ostream *dictFile);
+
+  // Writes the binary and text dictionaries and the instrumented program.
+  // Needs only the collected results, so it may follow
+  // releaseTranslationUnit().
+  bool writeOutputs();
+
+  // Disposes of the TU, the cursors into it and the parsed source once
+  // collection and any TU-based analysis are done. The collected tables stay
+  // valid.
+  void releaseTranslationUnit();
 
-  void executeToolchain();
+  std::string getModifiedProgramPath() const { return MODIFIED_PROGAM_OUT; }
+
+  
+  // Traverses every function in the file. With numWorkers > 1 the functions
+  // are split across threads, each parsing a private copy of the TU; the
+  // results and br_N numbering are identical to a serial run.
+  bool collectCursors(unsigned numWorkers = 1);
 
 
   unsigned getNumIncludeDirectives() const {
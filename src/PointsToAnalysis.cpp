@@ -0,0 +1,554 @@
+
+#include "PointsToAnalysis.h"
+#include "CursorUtils.h"
+
+#include <algorithm>
+
+using namespace cursor_utils;
+
+namespace {
+
+CXType getCanonicalType(CXCursor C) {
+  return clang_getCanonicalType(clang_getCursorType(C));
+}
+
+bool isArrayType(CXType type) {
+  switch (clang_getCanonicalType(type).kind) {
+  case CXType_ConstantArray:
+  case CXType_IncompleteArray:
+  case CXType_VariableArray:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool isFunctionType(CXType type) {
+  const CXTypeKind kind = clang_getCanonicalType(type).kind;
+  return kind == CXType_FunctionProto || kind == CXType_FunctionNoProto;
+}
+
+// Whether values of this type can carry a pointer, directly or in a field
+// or element.
+bool mayHoldPointer(CXType type) {
+  const CXTypeKind kind = clang_getCanonicalType(type).kind;
+  return kind == CXType_Pointer || kind == CXType_Record || isArrayType(type);
+}
+
+bool isTransparent(CXCursorKind kind) {
+  return kind == CXCursor_UnexposedExpr || kind == CXCursor_ParenExpr ||
+         kind == CXCursor_CStyleCastExpr;
+}
+
+// `.field = value` and `[index] = value` inside an initializer list.
+bool isDesignatedInit(CXCursor C) {
+  return clang_getCursorKind(C) == CXCursor_UnexposedExpr &&
+         getCanonicalType(C).kind == CXType_Void &&
+         getChildren(C).size() > 1;
+}
+
+} // namespace
+
+PointsToAnalysis::PointsToAnalysis(CXTranslationUnit translationUnit,
+                                   const std::string &filename,
+                                   unsigned lineOffset)
+    : translationUnit(translationUnit), lineOffset(lineOffset) {
+  cxFile = clang_getFile(translationUnit, filename.c_str());
+}
+
+unsigned PointsToAnalysis::newCell() {
+  cells.push_back(Cell{static_cast<unsigned>(cells.size()), 0, NONE, NONE});
+  return cells.size() - 1;
+}
+
+unsigned PointsToAnalysis::find(unsigned node) {
+  unsigned root = node;
+  while (cells[root].parent != root) {
+    root = cells[root].parent;
+  }
+  while (cells[node].parent != root) {
+    const unsigned next = cells[node].parent;
+    cells[node].parent = root;
+    node = next;
+  }
+  return root;
+}
+
+void PointsToAnalysis::unify(unsigned a, unsigned b) {
+  // Joining two classes joins their pointees and signatures in turn; a
+  // worklist keeps that from recursing on long pointer chains.
+  pendingUnions.emplace_back(a, b);
+  while (!pendingUnions.empty()) {
+    unsigned x = find(pendingUnions.back().first);
+    unsigned y = find(pendingUnions.back().second);
+    pendingUnions.pop_back();
+    if (x == y) {
+      continue;
+    }
+    if (cells[x].rank < cells[y].rank) {
+      std::swap(x, y);
+    }
+    cells[y].parent = x;
+    if (cells[x].rank == cells[y].rank) {
+      cells[x].rank++;
+    }
+
+    if (cells[x].pointee == NONE) {
+      cells[x].pointee = cells[y].pointee;
+    } else if (cells[y].pointee != NONE) {
+      pendingUnions.emplace_back(cells[x].pointee, cells[y].pointee);
+    }
+
+    if (cells[x].signature == NONE) {
+      cells[x].signature = cells[y].signature;
+    } else if (cells[y].signature != NONE) {
+      Signature &kept = signatures[cells[x].signature];
+      const Signature &merged = signatures[cells[y].signature];
+      for (size_t param = 0; param < merged.params.size(); param++) {
+        if (param < kept.params.size()) {
+          pendingUnions.emplace_back(kept.params[param],
+                                     merged.params[param]);
+        } else {
+          kept.params.push_back(merged.params[param]);
+        }
+      }
+      pendingUnions.emplace_back(kept.ret, merged.ret);
+    }
+  }
+}
+
+unsigned PointsToAnalysis::getPointee(unsigned node) {
+  const unsigned root = find(node);
+  if (cells[root].pointee == NONE) {
+    const unsigned pointee = newCell();
+    cells[root].pointee = pointee;
+  }
+  return find(cells[root].pointee);
+}
+
+unsigned PointsToAnalysis::getSignature(unsigned node, unsigned numParams) {
+  const unsigned root = find(node);
+  if (cells[root].signature == NONE) {
+    const unsigned ret = newCell();
+    cells[root].signature = signatures.size();
+    signatures.push_back(Signature{{}, ret});
+  }
+  const unsigned signature = cells[root].signature;
+  while (signatures[signature].params.size() < numParams) {
+    const unsigned param = newCell();
+    signatures[signature].params.push_back(param);
+  }
+  return signature;
+}
+
+unsigned PointsToAnalysis::getLine(CXCursor C) {
+  unsigned line;
+  clang_getSpellingLocation(clang_getCursorLocation(C), nullptr, &line,
+                            nullptr, nullptr);
+  return line + lineOffset;
+}
+
+unsigned PointsToAnalysis::getDeclNode(CXCursor decl) {
+  // Not the abstract location of getLocation(): where decl is spelled.
+  const cursor_utils::Location spelled = cursor_utils::getLocation(decl);
+  if (MAP_FIND(declNodes, spelled)) {
+    return declNodes[spelled];
+  }
+  const unsigned node = newCell();
+  declNodes[spelled] = node;
+  return node;
+}
+
+unsigned PointsToAnalysis::getReturnNode(const std::string &function) {
+  if (MAP_FIND(returnNodes, function)) {
+    return returnNodes[function];
+  }
+  const unsigned node = newCell();
+  returnNodes[function] = node;
+  return node;
+}
+
+unsigned PointsToAnalysis::getFunctionNode(CXCursor function) {
+  const std::string name = getSpelling(function);
+  if (MAP_FIND(functionNodes, name)) {
+    return functionNodes[name];
+  }
+
+  // Parameters are bound to the definition's ParmDecls, which are the ones
+  // the body refers to; prototypes only stand in for external functions.
+  CXCursor definition = clang_getCursorDefinition(function);
+  if (!clang_Cursor_isNull(definition)) {
+    function = definition;
+  }
+
+  Signature signature{{}, getReturnNode(name)};
+  const int numParams = clang_Cursor_getNumArguments(function);
+  for (int param = 0; param < numParams; param++) {
+    signature.params.push_back(
+        getDeclNode(clang_Cursor_getArgument(function, param)));
+  }
+
+  const unsigned node = newCell();
+  cells[node].signature = signatures.size();
+  signatures.push_back(signature);
+  functionNodes[name] = node;
+  return node;
+}
+
+unsigned PointsToAnalysis::getLocation(CXCursor C) {
+  const CXCursorKind kind = clang_getCursorKind(C);
+  if (isTransparent(kind)) {
+    const std::vector<CXCursor> children = getChildren(C);
+    return children.empty() ? NONE : getLocation(children.back());
+  }
+
+  switch (kind) {
+  case CXCursor_DeclRefExpr: {
+    CXCursor decl = clang_getCursorReferenced(C);
+    if (clang_getCursorKind(decl) == CXCursor_FunctionDecl) {
+      return getFunctionNode(decl);
+    }
+    return isVariable(decl) ? getDeclNode(decl) : NONE;
+  }
+  case CXCursor_MemberRefExpr: {
+    CXCursor field = clang_getCursorReferenced(C);
+    return clang_getCursorKind(field) == CXCursor_FieldDecl
+               ? getDeclNode(field)
+               : NONE;
+  }
+  case CXCursor_ArraySubscriptExpr: {
+    // Every element shares the location the base pointer or array points
+    // to; `i[a]` puts the base second.
+    const std::vector<CXCursor> operands = getChildren(C);
+    if (operands.size() != 2) {
+      return NONE;
+    }
+    const bool baseFirst = getCanonicalType(operands[0]).kind ==
+                           CXType_Pointer;
+    return getValue(operands[baseFirst ? 0 : 1]);
+  }
+  case CXCursor_UnaryOperator: {
+    const std::vector<CXCursor> operands = getChildren(C);
+    if (operands.empty() || getFirstToken(translationUnit, C) != "*") {
+      return NONE;
+    }
+    return getValue(operands[0]);
+  }
+  default:
+    return NONE;
+  }
+}
+
+unsigned PointsToAnalysis::getValue(CXCursor C) {
+  const CXCursorKind kind = clang_getCursorKind(C);
+  if (isTransparent(kind)) {
+    const std::vector<CXCursor> children = getChildren(C);
+    return children.empty() ? NONE : getValue(children.back());
+  }
+
+  const std::vector<CXCursor> operands = getChildren(C);
+  switch (kind) {
+  case CXCursor_UnaryOperator:
+    if (operands.empty()) {
+      return NONE;
+    }
+    if (getFirstToken(translationUnit, C) == "&") {
+      return getLocation(operands[0]);
+    }
+    if (getFirstToken(translationUnit, C) != "*") {
+      // ++p, p--, ... still point where p does.
+      return getValue(operands[0]);
+    }
+    // Dereferences are lvalues like the cases below.
+    [[fallthrough]];
+  case CXCursor_DeclRefExpr:
+  case CXCursor_MemberRefExpr:
+  case CXCursor_ArraySubscriptExpr: {
+    const unsigned location = getLocation(C);
+    if (location == NONE) {
+      return NONE;
+    }
+    // Arrays decay to their element location and function designators to
+    // the function itself; anything else reads what the location holds.
+    CXType type = clang_getCursorType(C);
+    if (isArrayType(type) || isFunctionType(type)) {
+      return location;
+    }
+    return getPointee(location);
+  }
+  case CXCursor_CallExpr: {
+    if (operands.empty()) {
+      return NONE;
+    }
+    const unsigned callee = getValue(operands[0]);
+    if (callee == NONE) {
+      return NONE;
+    }
+    const int numArgs = clang_Cursor_getNumArguments(C);
+    const unsigned signature =
+        getSignature(callee, numArgs > 0 ? numArgs : 0);
+    return getPointee(signatures[signature].ret);
+  }
+  case CXCursor_BinaryOperator: {
+    if (operands.size() != 2) {
+      return NONE;
+    }
+    const std::string op =
+        getBinaryOperator(translationUnit, operands[0], operands[1]);
+    if (op == "=" || op == ",") {
+      return getValue(operands[1]);
+    }
+    if (op != "+" && op != "-") {
+      return NONE;
+    }
+    // Pointer arithmetic points wherever either operand does.
+    [[fallthrough]];
+  }
+  case CXCursor_ConditionalOperator: {
+    unsigned value = NONE;
+    for (size_t operand = kind == CXCursor_ConditionalOperator ? 1 : 0;
+         operand < operands.size(); operand++) {
+      const unsigned operandValue = getValue(operands[operand]);
+      if (value == NONE) {
+        value = operandValue;
+      } else if (operandValue != NONE) {
+        unify(value, operandValue);
+        value = find(value);
+      }
+    }
+    return value;
+  }
+  case CXCursor_CompoundAssignOperator:
+    return operands.empty() ? NONE : getValue(operands[0]);
+  default:
+    return NONE;
+  }
+}
+
+void PointsToAnalysis::assign(unsigned location, unsigned value) {
+  if (location != NONE && value != NONE) {
+    unify(getPointee(location), value);
+  }
+}
+
+void PointsToAnalysis::initialize(unsigned location, CXType type,
+                                  CXCursor init) {
+  type = clang_getCanonicalType(type);
+  if (clang_getCursorKind(init) != CXCursor_InitListExpr) {
+    if (type.kind != CXType_Record) {
+      assign(location, getValue(init));
+    }
+    return;
+  }
+
+  const std::vector<CXCursor> elements = getChildren(init);
+  if (isArrayType(type)) {
+    CXType elementType = clang_getArrayElementType(type);
+    for (const CXCursor &element : elements) {
+      initialize(location, elementType,
+                 isDesignatedInit(element) ? getChildren(element).back()
+                                           : element);
+    }
+    return;
+  }
+
+  if (type.kind != CXType_Record) {
+    if (!elements.empty()) {
+      initialize(location, type, elements[0]);
+    }
+    return;
+  }
+
+  std::vector<CXCursor> fields;
+  clang_Type_visitFields(
+      type,
+      [](CXCursor field, CXClientData data) {
+        static_cast<std::vector<CXCursor> *>(data)->push_back(field);
+        return CXVisit_Continue;
+      },
+      &fields);
+
+  size_t next = 0;
+  for (const CXCursor &element : elements) {
+    if (!isDesignatedInit(element)) {
+      if (next < fields.size()) {
+        initialize(getDeclNode(fields[next]),
+                   clang_getCursorType(fields[next]), element);
+        next++;
+      }
+      continue;
+    }
+
+    // Positional initializers resume after the designated field; for a
+    // nested designator (.a.b = x) only the innermost field matters.
+    const std::vector<CXCursor> designation = getChildren(element);
+    CXCursor field = clang_getNullCursor();
+    for (size_t i = 0; i + 1 < designation.size(); i++) {
+      if (clang_getCursorKind(designation[i]) == CXCursor_MemberRef) {
+        field = clang_getCursorReferenced(designation[i]);
+      }
+    }
+    if (clang_Cursor_isNull(field)) {
+      continue;
+    }
+    initialize(getDeclNode(field), clang_getCursorType(field),
+               designation.back());
+    for (size_t i = 0; i < fields.size(); i++) {
+      if (clang_equalCursors(fields[i], field)) {
+        next = i + 1;
+      }
+    }
+  }
+}
+
+void PointsToAnalysis::visitCall(CXCursor call) {
+  const std::vector<CXCursor> children = getChildren(call);
+  if (children.empty()) {
+    return;
+  }
+
+  // Direct calls go through the same signature binding as indirect ones:
+  // the callee is just a class holding a single function.
+  const unsigned callee = getValue(children[0]);
+  const int numArgs = clang_Cursor_getNumArguments(call);
+  if (callee != NONE) {
+    const unsigned signature = getSignature(callee, numArgs > 0 ? numArgs : 0);
+    for (int arg = 0; arg < numArgs; arg++) {
+      const unsigned value = getValue(clang_Cursor_getArgument(call, arg));
+      assign(signatures[signature].params[arg], value);
+    }
+  }
+
+  if (clang_getCursorKind(clang_getCursorReferenced(call)) ==
+      CXCursor_FunctionDecl) {
+    return;
+  }
+
+  CallSite site{getLine(call), currentFunction, "", callee};
+  CXCursor pointer = children[0];
+  while (isTransparent(clang_getCursorKind(pointer)) ||
+         (clang_getCursorKind(pointer) == CXCursor_UnaryOperator &&
+          getFirstToken(translationUnit, pointer) == "*")) {
+    const std::vector<CXCursor> inner = getChildren(pointer);
+    if (inner.empty()) {
+      break;
+    }
+    pointer = inner.back();
+  }
+  if (clang_getCursorKind(pointer) == CXCursor_DeclRefExpr) {
+    CXCursor decl = clang_getCursorReferenced(pointer);
+    if (isVariable(decl) && getLine(decl) < site.line) {
+      site.pointer = getSpelling(decl);
+    }
+  }
+  callSites.push_back(site);
+}
+
+CXChildVisitResult PointsToAnalysis::VisitStatement(CXCursor current,
+                                                    CXCursor parent,
+                                                    CXClientData pta) {
+  PointsToAnalysis *instance = static_cast<PointsToAnalysis *>(pta);
+
+  switch (clang_getCursorKind(current)) {
+  case CXCursor_VarDecl: {
+    CXCursor init = clang_Cursor_getVarDeclInitializer(current);
+    if (!clang_Cursor_isNull(init) &&
+        mayHoldPointer(clang_getCursorType(current))) {
+      instance->initialize(instance->getDeclNode(current),
+                           clang_getCursorType(current), init);
+    }
+    break;
+  }
+  case CXCursor_BinaryOperator: {
+    const std::vector<CXCursor> operands = getChildren(current);
+    if (operands.size() == 2 &&
+        getCanonicalType(operands[0]).kind == CXType_Pointer &&
+        getBinaryOperator(instance->translationUnit, operands[0],
+                          operands[1]) == "=") {
+      instance->assign(instance->getLocation(operands[0]),
+                       instance->getValue(operands[1]));
+    }
+    break;
+  }
+  case CXCursor_CallExpr:
+    instance->visitCall(current);
+    break;
+  case CXCursor_ReturnStmt: {
+    const std::vector<CXCursor> value = getChildren(current);
+    if (!value.empty()) {
+      instance->assign(instance->getReturnNode(instance->currentFunction),
+                       instance->getValue(value[0]));
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  return CXChildVisit_Recurse;
+}
+
+void PointsToAnalysis::resolveCalls() {
+  std::unordered_map<unsigned, std::vector<std::string>> functionsByClass;
+  for (const std::pair<const std::string, unsigned> &function :
+       functionNodes) {
+    functionsByClass[find(function.second)].push_back(function.first);
+  }
+
+  for (const CallSite &site : callSites) {
+    IndirectCall call{site.line, site.caller, site.pointer, {}};
+    if (site.callee != NONE && MAP_FIND(functionsByClass, find(site.callee))) {
+      call.targets = functionsByClass[find(site.callee)];
+      std::sort(call.targets.begin(), call.targets.end());
+    }
+    indirectCalls.push_back(call);
+  }
+}
+
+void PointsToAnalysis::run() {
+  clang_visitChildren(
+      clang_getTranslationUnitCursor(translationUnit),
+      [](CXCursor current, CXCursor parent, CXClientData pta) {
+        PointsToAnalysis *instance = static_cast<PointsToAnalysis *>(pta);
+        if (!clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
+          return CXChildVisit_Continue;
+        }
+        switch (clang_getCursorKind(current)) {
+        case CXCursor_FunctionDecl:
+          if (clang_isCursorDefinition(current)) {
+            instance->currentFunction = getSpelling(current);
+            clang_visitChildren(current, &PointsToAnalysis::VisitStatement,
+                                pta);
+          }
+          break;
+        case CXCursor_VarDecl:
+          instance->currentFunction.clear();
+          VisitStatement(current, parent, pta);
+          break;
+        default:
+          break;
+        }
+        return CXChildVisit_Continue;
+      },
+      this);
+
+  resolveCalls();
+}
+
+void PointsToAnalysis::printReport(std::ostream &out) const {
+  if (indirectCalls.empty()) {
+    out << "No indirect calls found.\n";
+    return;
+  }
+  for (const IndirectCall &call : indirectCalls) {
+    out << "Line " << call.line << " in " << call.caller << ": "
+        << (call.pointer.empty() ? "<expr>" : call.pointer) << " ->";
+    if (call.targets.empty()) {
+      out << " (unresolved)";
+    }
+    for (size_t target = 0; target < call.targets.size(); target++) {
+      out << (target ? ", " : " ") << call.targets[target];
+    }
+    out << '\n';
+  }
+}
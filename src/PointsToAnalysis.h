@@ -0,0 +1,139 @@
+
+#ifndef POINTS_TO_ANALYSIS__H
+#define POINTS_TO_ANALYSIS__H
+
+#include "Common.h"
+#include "CursorUtils.h"
+#include <clang-c/Index.h>
+
+#include <climits>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Steensgaard-style (unification based) points-to analysis over a
+// translation unit, used to resolve the targets of indirect calls.
+//
+// Every variable, struct field, function and function return value is an
+// abstract location. Locations are kept in a union-find forest where each
+// class has at most one pointee class and, for functions, one signature
+// (parameter and return locations). Assignments, initializers, argument
+// passing and returns unify pointee classes, so the whole program is
+// processed in a single pass in near-linear time. Arrays are collapsed into
+// one element and fields are distinguished by declaration only, so
+// `table[i]`, `ops->run` and `ops.run` resolve wherever the table or struct
+// was filled in.
+class PointsToAnalysis {
+
+public:
+  struct IndirectCall {
+    unsigned line;
+    std::string caller;
+    // Spelling of the callee when it is a plain variable or parameter
+    // declared on an earlier line, otherwise empty.
+    std::string pointer;
+    std::vector<std::string> targets;
+  };
+
+private:
+  static constexpr unsigned NONE = UINT_MAX;
+
+  CXTranslationUnit translationUnit;
+
+  CXFile cxFile;
+
+  unsigned lineOffset;
+
+  struct Cell {
+    unsigned parent;
+    unsigned rank;
+    unsigned pointee;
+    unsigned signature;
+  };
+
+  std::vector<Cell> cells;
+
+  struct Signature {
+    std::vector<unsigned> params;
+    unsigned ret;
+  };
+
+  std::vector<Signature> signatures;
+
+  // Variable and field locations keyed by where their declaration is
+  // spelled.
+  std::unordered_map<cursor_utils::Location, unsigned,
+                     cursor_utils::LocationHash>
+      declNodes;
+
+  std::unordered_map<std::string, unsigned> functionNodes;
+
+  std::unordered_map<std::string, unsigned> returnNodes;
+
+  struct CallSite {
+    unsigned line;
+    std::string caller;
+    std::string pointer;
+    unsigned callee;
+  };
+
+  std::vector<CallSite> callSites;
+
+  std::vector<IndirectCall> indirectCalls;
+
+  std::string currentFunction;
+
+  std::vector<std::pair<unsigned, unsigned>> pendingUnions;
+
+  unsigned newCell();
+
+  unsigned find(unsigned node);
+
+  void unify(unsigned a, unsigned b);
+
+  unsigned getPointee(unsigned node);
+
+  unsigned getSignature(unsigned node, unsigned numParams);
+
+  unsigned getDeclNode(CXCursor decl);
+
+  unsigned getFunctionNode(CXCursor function);
+
+  unsigned getReturnNode(const std::string &function);
+
+  unsigned getLine(CXCursor C);
+
+  // Class of locations the value of the expression C may point to, or NONE
+  // if the expression cannot hold a pointer.
+  unsigned getValue(CXCursor C);
+
+  // Class of the location the lvalue expression C designates.
+  unsigned getLocation(CXCursor C);
+
+  void assign(unsigned location, unsigned value);
+
+  void initialize(unsigned location, CXType type, CXCursor init);
+
+  void visitCall(CXCursor call);
+
+  static CXChildVisitResult VisitStatement(CXCursor current, CXCursor parent,
+                                           CXClientData pta);
+
+  void resolveCalls();
+
+public:
+  PointsToAnalysis(CXTranslationUnit translationUnit,
+                   const std::string &filename, unsigned lineOffset = 0);
+
+  void run();
+
+  const std::vector<IndirectCall> &getIndirectCalls() const {
+    return indirectCalls;
+  }
+
+  void printReport(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,142 @@
+
+#include "PrecompiledHeader.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <system_error>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Headers a typical input includes. Each is guarded by __has_include so one
+// missing header does not cost the whole PCH.
+const char *const commonHeaders[] = {
+    "assert.h", "ctype.h",  "errno.h",  "limits.h", "math.h",
+    "stdarg.h", "stdbool.h", "stddef.h", "stdint.h", "stdio.h",
+    "stdlib.h", "string.h", "time.h",   "unistd.h",
+};
+
+// Owns the per-process directory holding the header and its PCH and removes
+// it at exit.
+struct TempDir {
+  fs::path path;
+
+  ~TempDir() {
+    if (!path.empty()) {
+      std::error_code ec;
+      fs::remove_all(path, ec);
+    }
+  }
+};
+
+TempDir tempDir;
+
+} // namespace
+
+std::string PrecompiledHeader::build() {
+  std::error_code ec;
+  tempDir.path =
+      fs::temp_directory_path(ec) / ("kpc-pch-" + std::to_string(getpid()));
+  if (ec || !fs::create_directories(tempDir.path, ec) || ec) {
+    return "";
+  }
+
+  const fs::path header = tempDir.path / "common.h";
+  const fs::path pch = tempDir.path / "common.pch";
+  {
+    std::ofstream out(header);
+    for (const char *name : commonHeaders) {
+      out << "#if __has_include(<" << name << ">)\n"
+          << "#include <" << name << ">\n"
+          << "#endif\n";
+    }
+    if (!out.good()) {
+      return "";
+    }
+  }
+
+  CXIndex index = clang_createIndex(0, 0);
+  const char *args[] = {"-x", "c-header"};
+  CXTranslationUnit tu = clang_parseTranslationUnit(
+      index, header.c_str(), args, 2, nullptr, 0,
+      CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+
+  bool saved = false;
+  if (tu != nullptr) {
+    bool hasErrors = false;
+    for (unsigned i = 0; i < clang_getNumDiagnostics(tu); i++) {
+      CXDiagnostic diag = clang_getDiagnostic(tu, i);
+      hasErrors |= clang_getDiagnosticSeverity(diag) >= CXDiagnostic_Error;
+      clang_disposeDiagnostic(diag);
+    }
+    saved = !hasErrors &&
+            clang_saveTranslationUnit(tu, pch.c_str(),
+                                      clang_defaultSaveOptions(tu)) ==
+                CXSaveError_None;
+    clang_disposeTranslationUnit(tu);
+  }
+  clang_disposeIndex(index);
+
+  return saved ? pch.string() : "";
+}
+
+const std::string &PrecompiledHeader::getPath() {
+  static std::once_flag built;
+  static std::string path;
+  std::call_once(built, [] { path = build(); });
+  return path;
+}
+
+bool PrecompiledHeader::coversIncludes(const std::string &source) {
+  std::istringstream lines(source);
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream directive(line);
+    std::string hash, keyword;
+    directive >> hash;
+    if (hash == "#") {
+      directive >> keyword;
+    } else if (hash.size() > 1 && hash[0] == '#') {
+      keyword = hash.substr(1);
+    }
+    if (keyword.compare(0, 7, "include") != 0) {
+      continue;
+    }
+    // "#include<stdio.h>" leaves the header name in the keyword.
+    std::string name = keyword.substr(7);
+    if (name.empty()) {
+      directive >> name;
+    }
+    if (name.empty() || name[0] == '"') {
+      continue;
+    }
+    const std::size_t end = name.find('>');
+    if (name[0] != '<' || end == std::string::npos ||
+        std::none_of(std::begin(commonHeaders), std::end(commonHeaders),
+                     [&name, end](const char *header) {
+                       return name.compare(1, end - 1, header) == 0;
+                     })) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PrecompiledHeader::hasErrors(CXTranslationUnit tu) {
+  bool failed = false;
+  for (unsigned i = 0; i < clang_getNumDiagnostics(tu) && !failed; i++) {
+    CXDiagnostic diag = clang_getDiagnostic(tu, i);
+    const CXDiagnosticSeverity severity = clang_getDiagnosticSeverity(diag);
+    failed = severity == CXDiagnostic_Fatal ||
+             (severity == CXDiagnostic_Error &&
+              clang_Location_isFromMainFile(clang_getDiagnosticLocation(diag)));
+    clang_disposeDiagnostic(diag);
+  }
+  return failed;
+}
@@ -0,0 +1,36 @@
+
+#ifndef PRECOMPILED_HEADER__H
+#define PRECOMPILED_HEADER__H
+
+#include <clang-c/Index.h>
+
+#include <string>
+
+// A precompiled header holding the common C library headers (stdio, stdlib,
+// string, ...). It is built the first time it is asked for and shared by
+// every translation unit parsed in the process, so sources can be parsed with
+// their include directives intact at close to the cost of a stripped parse:
+// the system headers they include are already defined by the PCH and their
+// include guards skip them.
+class PrecompiledHeader {
+
+  static std::string build();
+
+public:
+  // Path of the .pch file, or an empty string if it could not be built, in
+  // which case callers fall back to stripping include directives.
+  static const std::string &getPath();
+
+  // True if every system header the source includes is in the PCH, so
+  // parsing against it declares nothing the file would not see anyway.
+  // Quoted includes are the program's own headers and are parsed as usual.
+  static bool coversIncludes(const std::string &source);
+
+  // True if parsing stopped on a fatal error, e.g. a missing header or a PCH
+  // that does not match the source's language options, or if the main file
+  // has an error, e.g. a global that clashes with a declaration of a PCH
+  // header the file does not include (int index; against <strings.h>).
+  static bool hasErrors(CXTranslationUnit tu);
+};
+
+#endif
@@ -0,0 +1,352 @@
+
+#include "ProjectAnalyzer.h"
+#include "CursorUtils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Flags whose operand is a path relative to the command's directory.
+const char *PATH_FLAGS[] = {"-I",       "-isystem", "-iquote",
+                            "-idirafter", "-include", "-imacros"};
+
+std::string resolvePath(const fs::path &directory, const std::string &path) {
+  const fs::path resolved(path);
+  return resolved.is_absolute()
+             ? path
+             : (directory / resolved).lexically_normal().string();
+}
+
+std::string getUSR(CXCursor C) {
+  CXString usr = clang_getCursorUSR(C);
+  std::string result(CXSTR(usr));
+  clang_disposeString(usr);
+  return result;
+}
+
+} // namespace
+
+ProjectAnalyzer::ProjectAnalyzer(Session &session,
+                                 const std::string &databaseDir,
+                                 unsigned numWorkers, bool debug)
+    : session(session), databaseDir(databaseDir), numWorkers(numWorkers),
+      debug(debug) {}
+
+bool ProjectAnalyzer::loadDatabase() {
+  CXCompilationDatabase_Error status;
+  CXCompilationDatabase database =
+      clang_CompilationDatabase_fromDirectory(databaseDir.c_str(), &status);
+  if (status != CXCompilationDatabase_NoError) {
+    error = "Could not load compile_commands.json from: " + databaseDir + "!";
+    return false;
+  }
+
+  CXCompileCommands commands =
+      clang_CompilationDatabase_getAllCompileCommands(database);
+  std::set<std::string> seen;
+  for (unsigned i = 0; i < clang_CompileCommands_getSize(commands); i++) {
+    CXCompileCommand command = clang_CompileCommands_getCommand(commands, i);
+    CXString directoryStr = clang_CompileCommand_getDirectory(command);
+    CXString fileStr = clang_CompileCommand_getFilename(command);
+    const fs::path directory(CXSTR(directoryStr));
+    const std::string source = resolvePath(directory, CXSTR(fileStr));
+    clang_disposeString(directoryStr);
+    clang_disposeString(fileStr);
+
+    // A file compiled twice (e.g. for two targets) is analysed once.
+    if (!seen.insert(source).second) {
+      continue;
+    }
+
+    Unit unit;
+    unit.filename = fs::proximate(source).string();
+    unit.firstBranchId = 0;
+
+    // Drop the compiler, the input and the output; paths are made absolute
+    // since the parse does not run in the command's directory.
+    const unsigned numArgs = clang_CompileCommand_getNumArgs(command);
+    for (unsigned arg = 1; arg < numArgs; arg++) {
+      CXString argStr = clang_CompileCommand_getArg(command, arg);
+      const std::string value(CXSTR(argStr));
+      clang_disposeString(argStr);
+
+      if (value == "-c" || resolvePath(directory, value) == source) {
+        continue;
+      }
+      if (value == "-o") {
+        arg++;
+        continue;
+      }
+      if (value.compare(0, 2, "-o") == 0) {
+        continue;
+      }
+
+      bool isPathFlag = false;
+      for (const char *flag : PATH_FLAGS) {
+        const std::string flagStr(flag);
+        if (value == flagStr && arg + 1 < numArgs) {
+          CXString pathStr = clang_CompileCommand_getArg(command, ++arg);
+          unit.args.push_back(flagStr);
+          unit.args.push_back(resolvePath(directory, CXSTR(pathStr)));
+          clang_disposeString(pathStr);
+          isPathFlag = true;
+          break;
+        }
+        if (value.size() > flagStr.size() &&
+            value.compare(0, flagStr.size(), flagStr) == 0) {
+          unit.args.push_back(
+              flagStr + resolvePath(directory, value.substr(flagStr.size())));
+          isPathFlag = true;
+          break;
+        }
+      }
+      if (!isPathFlag) {
+        unit.args.push_back(value);
+      }
+    }
+    // Always non-empty, which tells the collector to keep the includes.
+    unit.args.push_back("-fsyntax-only");
+
+    units.push_back(std::move(unit));
+  }
+
+  clang_CompileCommands_dispose(commands);
+  clang_CompilationDatabase_dispose(database);
+
+  if (units.empty()) {
+    error = "No translation units found in: " + databaseDir + "!";
+    return false;
+  }
+  return true;
+}
+
+CXChildVisitResult ProjectAnalyzer::VisitCalls(CXCursor current,
+                                               CXCursor parent,
+                                               CXClientData data) {
+  CallScan *scan = static_cast<CallScan *>(data);
+  if (clang_getCursorKind(current) != CXCursor_CallExpr) {
+    return CXChildVisit_Recurse;
+  }
+
+  CXCursor callee = clang_getCursorReferenced(current);
+  if (clang_getCursorKind(callee) == CXCursor_FunctionDecl) {
+    unsigned line;
+    clang_getSpellingLocation(clang_getCursorLocation(current), nullptr, &line,
+                              nullptr, nullptr);
+    const std::string name = cursor_utils::getSpelling(callee);
+    const std::string usr = getUSR(callee);
+    scan->unit->usrs.emplace(name, usr);
+    scan->unit->calls.push_back(
+        Call{line + scan->unit->kpc->getNumIncludeDirectives(), scan->caller,
+             usr, name});
+  }
+  return CXChildVisit_Recurse;
+}
+
+bool ProjectAnalyzer::analyzeUnit(Unit &unit, std::string &error) {
+  unit.kpc = std::make_unique<KeyPointsCollector>(session, unit.filename,
+                                                  false, unit.args);
+  if (!unit.kpc->isParsed() || !unit.kpc->collectCursors()) {
+    error = unit.kpc->getError();
+    return false;
+  }
+
+  CallScan scan{&unit, ""};
+  clang_visitChildren(
+      clang_getTranslationUnitCursor(unit.kpc->getTU()),
+      [](CXCursor current, CXCursor parent, CXClientData data) {
+        CallScan *scan = static_cast<CallScan *>(data);
+        if (clang_getCursorKind(current) != CXCursor_FunctionDecl ||
+            !clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
+          return CXChildVisit_Continue;
+        }
+        const std::string name = cursor_utils::getSpelling(current);
+        const std::string usr = getUSR(current);
+        scan->unit->usrs[name] = usr;
+        if (clang_isCursorDefinition(current)) {
+          scan->unit->definitions.insert(usr);
+          scan->caller = name;
+          clang_visitChildren(current, &ProjectAnalyzer::VisitCalls, scan);
+        }
+        return CXChildVisit_Continue;
+      },
+      &scan);
+  return true;
+}
+
+std::string ProjectAnalyzer::getGraphName(const Unit &unit,
+                                          const std::string &name) const {
+  std::map<std::string, std::string>::const_iterator usr =
+      unit.usrs.find(name);
+  if (usr == unit.usrs.end() || usr->second == "c:@F@" + name) {
+    return name;
+  }
+  return unit.filename + ":" + name;
+}
+
+void ProjectAnalyzer::linkUnits() {
+  for (size_t unit = 0; unit < units.size(); unit++) {
+    for (const std::string &usr : units[unit].definitions) {
+      if (!definitions.emplace(usr, unit).second && debug) {
+        session.print("Duplicate definition of ", usr, " in ",
+                      units[unit].filename, '\n');
+      }
+    }
+  }
+
+  unsigned nextBranchId = 0;
+  for (size_t index = 0; index < units.size(); index++) {
+    Unit &unit = units[index];
+    unit.firstBranchId = nextBranchId;
+    unit.kpc->offsetBranchIds(nextBranchId);
+    nextBranchId += unit.kpc->getBranchCount();
+
+    const CallGraph &local = unit.kpc->getCallGraph();
+    for (unsigned id = 0; id < local.size(); id++) {
+      const std::string &name = local.getName(id);
+      if (!(MAP_FIND(unit.usrs, name)) ||
+          !unit.definitions.count(unit.usrs[name])) {
+        continue;
+      }
+      const std::string graphName = getGraphName(unit, name);
+      callGraph.addFunction(graphName);
+
+      const CallGraph::Summary *facts = local.getLocalFacts(name);
+      facts->branches.forEach([&](unsigned branch) {
+        callGraph.addBranch(graphName, branch + unit.firstBranchId);
+      });
+      for (const std::string &input : facts->inputs) {
+        callGraph.addInput(graphName, input);
+      }
+      // Edges the collector resolved itself, including indirect calls.
+      for (const std::string &callee : local.getCallees(name)) {
+        if (MAP_FIND(unit.usrs, callee) &&
+            MAP_FIND(definitions, unit.usrs[callee])) {
+          callGraph.addCall(
+              graphName,
+              getGraphName(units[definitions[unit.usrs[callee]]], callee));
+        }
+      }
+    }
+
+    for (const Call &call : unit.calls) {
+      if (!(MAP_FIND(definitions, call.calleeUSR))) {
+        continue;
+      }
+      const size_t calleeUnit = definitions[call.calleeUSR];
+      callGraph.addCall(getGraphName(unit, call.caller),
+                        getGraphName(units[calleeUnit], call.callee));
+      if (calleeUnit != index) {
+        unit.kpc->addExternalCall(call.line, call.callee);
+      }
+    }
+  }
+
+  callGraph.computeSummaries();
+}
+
+bool ProjectAnalyzer::run() {
+  if (!loadDatabase()) {
+    return false;
+  }
+
+  // First failure of each unit, reported after all workers have stopped.
+  std::vector<std::string> errors(units.size());
+  std::atomic<size_t> nextUnit(0);
+  std::vector<std::thread> workers;
+  const unsigned numThreads =
+      std::max(1u, std::min<unsigned>(numWorkers, units.size()));
+  for (unsigned worker = 0; worker < numThreads; worker++) {
+    workers.emplace_back([&]() {
+      for (size_t unit = nextUnit++; unit < units.size(); unit = nextUnit++) {
+        analyzeUnit(units[unit], errors[unit]);
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  for (const std::string &unitError : errors) {
+    if (!unitError.empty()) {
+      error = unitError;
+      return false;
+    }
+  }
+
+  linkUnits();
+  return true;
+}
+
+void ProjectAnalyzer::createDictionaryFile(const std::string &path) const {
+  std::ofstream dictFile(path);
+  dictFile << "Branch Dictionary for: " << databaseDir << '\n';
+  dictFile << "-----------------------" << std::string(databaseDir.size(), '-')
+           << '\n';
+
+  for (const Unit &unit : units) {
+    const BranchTable &branchTable = unit.kpc->getBranchTable();
+    for (const BranchTable::Branch &BP : branchTable) {
+      for (unsigned target = 0; target < BP.numTargets; target++) {
+        dictFile << BranchTable::formatId(branchTable.getTargetId(BP, target))
+                 << ": " << unit.filename << ", " << BP.line << ", "
+                 << branchTable.getTargetLine(BP, target) << '\n';
+      }
+    }
+  }
+
+  dictFile.close();
+}
+
+bool ProjectAnalyzer::createBinaryDictionaryFile(
+    const std::string &path) const {
+  std::vector<BranchDictionary::Entry> entries;
+  for (const Unit &unit : units) {
+    for (BranchDictionary::Entry &entry : unit.kpc->getDictionaryEntries()) {
+      entry.file = unit.filename;
+      entries.push_back(std::move(entry));
+    }
+  }
+  return BranchDictionary::write(path, databaseDir, entries);
+}
+
+bool ProjectAnalyzer::transformProgram() {
+  for (Unit &unit : units) {
+    const fs::path output(unit.kpc->getModifiedProgramPath());
+    if (output.has_parent_path()) {
+      fs::create_directories(output.parent_path());
+    }
+    if (!unit.kpc->transformProgram()) {
+      error = unit.kpc->getError();
+      return false;
+    }
+  }
+  return true;
+}
+
+void ProjectAnalyzer::printFunctionSummaries(std::ostream &out) const {
+  out << "Function Summaries: \n";
+  for (unsigned id = 0; id < callGraph.size(); id++) {
+    const std::string &name = callGraph.getName(id);
+    const CallGraph::Summary *summary = callGraph.getSummary(name);
+    if (summary == nullptr) {
+      continue;
+    }
+    out << name << (summary->recursive ? " (recursive)" : "") << ": "
+        << summary->branches.toVector().size() << " reachable branches";
+    if (!summary->inputs.empty()) {
+      out << ", reads";
+      for (const std::string &input : summary->inputs) {
+        out << " " << input;
+      }
+    }
+    out << '\n';
+  }
+}
@@ -0,0 +1,99 @@
+
+#ifndef PROJECT_ANALYZER__H
+#define PROJECT_ANALYZER__H
+
+#include "CallGraph.h"
+#include "KeyPointsCollector.h"
+#include "Session.h"
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+// Whole-program analysis driven by a compile_commands.json. Every translation
+// unit is parsed with its own compiler flags (includes intact) on a pool of
+// threads, then the units are linked: functions are identified by USR, so a
+// call into another file gets a call graph edge and a trace entry, and br_N
+// ids are offset per unit so the merged dictionary is globally unique.
+class ProjectAnalyzer {
+
+  Session &session;
+
+  const std::string databaseDir;
+
+  unsigned numWorkers;
+
+  bool debug;
+
+  struct Call {
+    unsigned line;
+    std::string caller;
+    std::string calleeUSR;
+    std::string callee;
+  };
+
+  struct Unit {
+    std::string filename;
+    std::vector<std::string> args;
+    std::unique_ptr<KeyPointsCollector> kpc;
+
+    // Function name -> USR for every function declared or called here.
+    std::map<std::string, std::string> usrs;
+    std::set<std::string> definitions;
+    std::vector<Call> calls;
+
+    unsigned firstBranchId;
+  };
+
+  std::vector<Unit> units;
+
+  struct CallScan {
+    Unit *unit;
+    std::string caller;
+  };
+
+  // USR -> index of the unit that defines the function.
+  std::map<std::string, size_t> definitions;
+
+  CallGraph callGraph;
+
+  std::string error;
+
+  bool loadDatabase();
+
+  // Returns false with error set if the unit could not be parsed.
+  bool analyzeUnit(Unit &unit, std::string &error);
+
+  static CXChildVisitResult VisitCalls(CXCursor current, CXCursor parent,
+                                       CXClientData data);
+
+  // Name of a function in the project call graph: external functions keep
+  // their name, file-local (static) ones are qualified with their file.
+  std::string getGraphName(const Unit &unit, const std::string &name) const;
+
+  void linkUnits();
+
+public:
+  ProjectAnalyzer(Session &session, const std::string &databaseDir,
+                  unsigned numWorkers = 1, bool debug = false);
+
+  // Returns false if the database could not be loaded or a unit could not be
+  // parsed; getError() says why.
+  bool run();
+
+  const std::string &getError() const { return error; }
+
+  void createDictionaryFile(const std::string &path) const;
+
+  // Writes the merged dictionary in the binary BranchDictionary format.
+  bool createBinaryDictionaryFile(const std::string &path) const;
+
+  bool transformProgram();
+
+  void printFunctionSummaries(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,36 @@
+
+#include "Session.h"
+#include "KeyPointsCollector.h"
+
+Session::Session(std::ostream &out, const std::string &outDir,
+                 bool formatSources)
+    : out(out), outDir(outDir), formatSources(formatSources),
+      loopSummaries(false), latency(false) {}
+
+bool Session::analyze(const std::string &filename, Analysis &result,
+                      std::string &error, unsigned numWorkers,
+                      const std::vector<std::string> &compileArgs) {
+  KeyPointsCollector kpc(*this, filename, false, compileArgs);
+  if (!kpc.isParsed() || !kpc.collectCursors(numWorkers)) {
+    error = kpc.getError();
+    return false;
+  }
+
+  TaintAnalysis taint(*this, kpc.getTU(), filename,
+                      kpc.getNumIncludeDirectives());
+  taint.run();
+
+  std::ostringstream instrumented;
+  kpc.transformProgram(instrumented, nullptr);
+  if (!kpc.getError().empty()) {
+    error = kpc.getError();
+    return false;
+  }
+
+  result.branches = kpc.getDictionaryEntries();
+  result.calls = kpc.getFuncCalls();
+  result.taintSources = taint.getSources();
+  result.taintedBranches = taint.getBranches();
+  result.instrumentedProgram = instrumented.str();
+  return true;
+}
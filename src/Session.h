@@ -0,0 +1,103 @@
+
+#ifndef SESSION__H
+#define SESSION__H
+
+#include "BranchDictionary.h"
+#include "Common.h"
+#include "TaintAnalysis.h"
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Entry point of libkpc, the analysis as a library. A session holds what an
+// analysis needs from its host instead of process-wide state: the sink for
+// progress, debug output and reports, the directory generated files go to,
+// and whether sources may be reformatted in place. Nothing reached through
+// a session exits the process; failures come back as return values with a
+// message.
+//
+// Every collector owns its libclang index and translation units, so any
+// number of analyses may run at once on one session or on several. Output
+// of concurrent analyses is written to the sink a message at a time.
+class Session {
+  std::ostream &out;
+
+  const std::string outDir;
+
+  bool formatSources;
+
+  bool loopSummaries;
+
+  bool latency;
+
+  std::mutex outputLock;
+
+public:
+  // Everything analyze() finds in a file.
+  struct Analysis {
+    std::vector<BranchDictionary::Entry> branches;
+
+    // Line -> callee of the calls the instrumented program logs.
+    std::map<unsigned, std::string> calls;
+
+    std::vector<TaintAnalysis::Source> taintSources;
+
+    std::vector<TaintAnalysis::BranchTaint> taintedBranches;
+
+    // The file instrumented with LOG calls, as transformProgram() would
+    // write it.
+    std::string instrumentedProgram;
+  };
+
+  // outDir must end with a '/'. formatSources runs clang-format on each file
+  // before it is parsed, rewriting it in place, as the command line tool
+  // always has.
+  explicit Session(std::ostream &out, const std::string &outDir = OUT_DIR,
+                   bool formatSources = false);
+
+  Session(const Session &) = delete;
+
+  Session &operator=(const Session &) = delete;
+
+  const std::string &getOutDir() const { return outDir; }
+
+  // Set before any analysis starts. Hosts that serve other programs, like
+  // the analysis server, must leave the files they are asked about alone.
+  void setFormatSources(bool enabled) { formatSources = enabled; }
+
+  bool getFormatSources() const { return formatSources; }
+
+  // Instrument loops to print one summary per execution rather than an
+  // event per target reached in them. Set before any analysis starts.
+  void setLoopSummaries(bool enabled) { loopSummaries = enabled; }
+
+  bool getLoopSummaries() const { return loopSummaries; }
+
+  // Instrument targets to time their regions into histograms instead of
+  // logging them (KPC_LATENCY in the emitted header). Loops are then not
+  // summarized, since the regions in them would go untimed.
+  void setLatency(bool enabled) { latency = enabled; }
+
+  bool getLatency() const { return latency; }
+
+  // Writes the arguments to the sink as one message.
+  template <typename... Args> void print(const Args &...args) {
+    std::ostringstream text;
+    (text << ... << args);
+    std::lock_guard<std::mutex> guard(outputLock);
+    out << text.str();
+  }
+
+  // Analyzes filename and instruments it in memory; nothing is written to
+  // outDir. compileArgs are the file's compiler flags, if known. Returns
+  // false with error set if the file cannot be read or parsed.
+  bool analyze(const std::string &filename, Analysis &result,
+               std::string &error, unsigned numWorkers = 1,
+               const std::vector<std::string> &compileArgs = {});
+};
+
+#endif
@@ -0,0 +1,111 @@
+
+#ifndef SPARSE_BIT_SET__H
+#define SPARSE_BIT_SET__H
+
+#include <cstdint>
+#include <vector>
+
+// Set of small integers stored as sorted (block, 64-bit word) pairs, so an
+// empty or mostly-empty set costs nothing and unions only touch the blocks
+// that are actually populated.
+class SparseBitSet {
+
+  struct Block {
+    uint32_t index;
+    uint64_t bits;
+  };
+
+  std::vector<Block> blocks;
+
+public:
+  void set(unsigned bit) {
+    const uint32_t index = bit / 64;
+    const uint64_t mask = uint64_t(1) << (bit % 64);
+    std::vector<Block>::iterator it = blocks.begin();
+    while (it != blocks.end() && it->index < index) {
+      ++it;
+    }
+    if (it != blocks.end() && it->index == index) {
+      it->bits |= mask;
+    } else {
+      blocks.insert(it, Block{index, mask});
+    }
+  }
+
+  bool test(unsigned bit) const {
+    const uint32_t index = bit / 64;
+    for (const Block &block : blocks) {
+      if (block.index == index) {
+        return block.bits & (uint64_t(1) << (bit % 64));
+      }
+      if (block.index > index) {
+        break;
+      }
+    }
+    return false;
+  }
+
+  bool empty() const { return blocks.empty(); }
+
+  bool contains(const SparseBitSet &other) const {
+    size_t i = 0;
+    for (const Block &block : other.blocks) {
+      while (i < blocks.size() && blocks[i].index < block.index) {
+        i++;
+      }
+      if (i == blocks.size() || blocks[i].index != block.index ||
+          (block.bits & ~blocks[i].bits)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Adds every bit of other to this set; returns true if anything changed.
+  bool unionWith(const SparseBitSet &other) {
+    if (contains(other)) {
+      return false;
+    }
+    std::vector<Block> merged;
+    merged.reserve(blocks.size() + other.blocks.size());
+    bool changed = false;
+    size_t i = 0, j = 0;
+    while (i < blocks.size() || j < other.blocks.size()) {
+      if (j == other.blocks.size() ||
+          (i < blocks.size() && blocks[i].index < other.blocks[j].index)) {
+        merged.push_back(blocks[i++]);
+      } else if (i == blocks.size() ||
+                 other.blocks[j].index < blocks[i].index) {
+        merged.push_back(other.blocks[j++]);
+        changed = true;
+      } else {
+        const uint64_t bits = blocks[i].bits | other.blocks[j].bits;
+        changed |= bits != blocks[i].bits;
+        merged.push_back(Block{blocks[i].index, bits});
+        i++;
+        j++;
+      }
+    }
+    blocks.swap(merged);
+    return changed;
+  }
+
+  // Calls F(bit) for every set bit in increasing order.
+  template <typename F> void forEach(F f) const {
+    for (const Block &block : blocks) {
+      uint64_t bits = block.bits;
+      while (bits) {
+        f(block.index * 64 + __builtin_ctzll(bits));
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  std::vector<unsigned> toVector() const {
+    std::vector<unsigned> bits;
+    forEach([&bits](unsigned bit) { bits.push_back(bit); });
+    return bits;
+  }
+};
+
+#endif
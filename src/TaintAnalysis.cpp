@@ -0,0 +1,401 @@
+
+#include "TaintAnalysis.h"
+#include "CursorUtils.h"
+#include "Session.h"
+
+#include <algorithm>
+
+using namespace cursor_utils;
+
+namespace {
+
+// Library calls that write input into one of their arguments. The range is
+// inclusive; a last index of -1 means "every remaining argument".
+struct OutParamSource {
+  const char *name;
+  int firstArg;
+  int lastArg;
+};
+
+const OutParamSource OUT_PARAM_SOURCES[] = {
+    {"scanf", 1, -1}, {"fscanf", 2, -1}, {"fgets", 0, 0},
+    {"gets", 0, 0},   {"fread", 0, 0},   {"read", 1, 1},
+    {"getline", 0, 0}};
+
+// Library calls whose return value is itself an input.
+const char *RETURN_SOURCES[] = {"fopen", "getenv", "getchar", "fgetc", "getc"};
+
+const OutParamSource *findOutParamSource(const std::string &name) {
+  for (const OutParamSource &source : OUT_PARAM_SOURCES) {
+    if (name == source.name) {
+      return &source;
+    }
+  }
+  return nullptr;
+}
+
+bool isReturnSource(const std::string &name) {
+  for (const char *source : RETURN_SOURCES) {
+    if (name == source) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+bool TaintAnalysis::isInputCall(const std::string &name) {
+  return findOutParamSource(name) != nullptr || isReturnSource(name);
+}
+
+TaintAnalysis::TaintAnalysis(Session &session,
+                             CXTranslationUnit translationUnit,
+                             const std::string &filename, unsigned lineOffset,
+                             bool debug)
+    : session(session), translationUnit(translationUnit),
+      lineOffset(lineOffset), debug(debug) {
+  cxFile = clang_getFile(translationUnit, filename.c_str());
+}
+
+unsigned TaintAnalysis::newNode(const std::string &name, unsigned line) {
+  nodes.push_back(Node{name, line, SparseBitSet(), {}});
+  return nodes.size() - 1;
+}
+
+unsigned TaintAnalysis::getLine(CXCursor C) {
+  unsigned line;
+  clang_getSpellingLocation(clang_getCursorLocation(C), nullptr, &line,
+                            nullptr, nullptr);
+  return line + lineOffset;
+}
+
+unsigned TaintAnalysis::getVarNode(CXCursor decl) {
+  const Location location = getLocation(decl);
+  if (MAP_FIND(varNodes, location)) {
+    return varNodes[location];
+  }
+  const unsigned node = newNode(getSpelling(decl), getLine(decl));
+  varNodes[location] = node;
+  return node;
+}
+
+unsigned TaintAnalysis::getReturnNode(const std::string &function) {
+  if (MAP_FIND(returnNodes, function)) {
+    return returnNodes[function];
+  }
+  const unsigned node = newNode(function + "()", 0);
+  returnNodes[function] = node;
+  return node;
+}
+
+unsigned TaintAnalysis::getSourceNode(CXCursor site, const std::string &kind,
+                                      const std::string &var) {
+  const Location location = getLocation(site);
+  if (MAP_FIND(sourceNodes, location)) {
+    return sourceNodes[location];
+  }
+  const unsigned line = getLine(site);
+  const unsigned node = newNode(kind, line);
+  nodes[node].taint.set(sources.size());
+  sources.push_back(Source{kind, var, line});
+  sourceNodes[location] = node;
+  if (debug) {
+    session.print("Found input: ", kind, var.empty() ? "" : " -> ", var,
+                  " at line #: ", line, '\n');
+  }
+  return node;
+}
+
+void TaintAnalysis::collectUses(CXCursor C, std::vector<unsigned> &uses) {
+  struct UseCollector {
+    TaintAnalysis *ta;
+    std::vector<unsigned> *uses;
+  } collector{this, &uses};
+
+  auto visit = [](CXCursor current, CXCursor parent, CXClientData data) {
+    UseCollector *collector = static_cast<UseCollector *>(data);
+    TaintAnalysis *ta = collector->ta;
+
+    switch (clang_getCursorKind(current)) {
+    case CXCursor_DeclRefExpr: {
+      CXCursor decl = clang_getCursorReferenced(current);
+      if (isVariable(decl)) {
+        collector->uses->push_back(ta->getVarNode(decl));
+      }
+      return CXChildVisit_Continue;
+    }
+    case CXCursor_CallExpr: {
+      const std::string callee = getSpelling(current);
+      if (isReturnSource(callee)) {
+        collector->uses->push_back(ta->getSourceNode(current, callee, ""));
+        return CXChildVisit_Continue;
+      }
+      CXCursor definition =
+          clang_getCursorDefinition(clang_getCursorReferenced(current));
+      if (!clang_Cursor_isNull(definition)) {
+        collector->uses->push_back(ta->getReturnNode(callee));
+        return CXChildVisit_Continue;
+      }
+      // No body to look into: assume the result depends on every argument.
+      const int numArgs = clang_Cursor_getNumArguments(current);
+      for (int arg = 0; arg < numArgs; arg++) {
+        ta->collectUses(clang_Cursor_getArgument(current, arg),
+                        *collector->uses);
+      }
+      return CXChildVisit_Continue;
+    }
+    default:
+      return CXChildVisit_Recurse;
+    }
+  };
+
+  // The root itself may be a reference or a call, so wrap it the same way
+  // its descendants are handled.
+  if (visit(C, clang_getNullCursor(), &collector) == CXChildVisit_Recurse) {
+    clang_visitChildren(C, visit, &collector);
+  }
+}
+
+bool TaintAnalysis::getDefinedVar(CXCursor C, unsigned *node) {
+  // For a[i], *p and s.f the first variable reached is the base object,
+  // which is what the assignment (weakly) updates.
+  if (clang_getCursorKind(C) == CXCursor_DeclRefExpr) {
+    CXCursor decl = clang_getCursorReferenced(C);
+    if (isVariable(decl)) {
+      *node = getVarNode(decl);
+      return true;
+    }
+    return false;
+  }
+  for (const CXCursor &child : getChildren(C)) {
+    if (getDefinedVar(child, node)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaintAnalysis::visitCall(CXCursor call) {
+  const std::string callee = getSpelling(call);
+  const int numArgs = clang_Cursor_getNumArguments(call);
+
+  if (const OutParamSource *source = findOutParamSource(callee)) {
+    const int lastArg = source->lastArg < 0 ? numArgs - 1 : source->lastArg;
+    for (int arg = source->firstArg; arg <= lastArg && arg < numArgs; arg++) {
+      CXCursor argument = clang_Cursor_getArgument(call, arg);
+      unsigned var;
+      if (getDefinedVar(argument, &var)) {
+        const std::string name = nodes[var].name;
+        addDefUse(var, getSourceNode(argument, callee, name));
+      }
+    }
+    return;
+  }
+
+  if (callee == "sscanf" && numArgs > 2) {
+    std::vector<unsigned> uses;
+    collectUses(clang_Cursor_getArgument(call, 0), uses);
+    for (int arg = 2; arg < numArgs; arg++) {
+      unsigned var;
+      if (getDefinedVar(clang_Cursor_getArgument(call, arg), &var)) {
+        addDefUses(var, uses);
+      }
+    }
+    return;
+  }
+
+  CXCursor definition =
+      clang_getCursorDefinition(clang_getCursorReferenced(call));
+  if (clang_Cursor_isNull(definition)) {
+    return;
+  }
+  const int numParams = clang_Cursor_getNumArguments(definition);
+  for (int arg = 0; arg < numArgs && arg < numParams; arg++) {
+    std::vector<unsigned> uses;
+    collectUses(clang_Cursor_getArgument(call, arg), uses);
+    addDefUses(getVarNode(clang_Cursor_getArgument(definition, arg)), uses);
+  }
+}
+
+void TaintAnalysis::visitBranch(CXCursor branch) {
+  const CXCursorKind kind = clang_getCursorKind(branch);
+  const std::vector<CXCursor> children = getChildren(branch);
+  if (children.empty()) {
+    return;
+  }
+
+  // libclang omits absent for-loop clauses, so for a ForStmt every child but
+  // the body counts as the condition; the trip count depends on all of them.
+  std::vector<CXCursor> condition;
+  switch (kind) {
+  case CXCursor_DoStmt:
+    condition.push_back(children.back());
+    break;
+  case CXCursor_ForStmt:
+    condition.assign(children.begin(), children.end() - 1);
+    break;
+  default:
+    condition.push_back(children.front());
+    break;
+  }
+
+  BranchUses uses{getLine(branch), kind, {}};
+  for (const CXCursor &part : condition) {
+    collectUses(part, uses.uses);
+  }
+  branchUses.push_back(uses);
+}
+
+CXChildVisitResult TaintAnalysis::VisitStatement(CXCursor current,
+                                                 CXCursor parent,
+                                                 CXClientData ta) {
+  TaintAnalysis *instance = static_cast<TaintAnalysis *>(ta);
+
+  switch (clang_getCursorKind(current)) {
+  case CXCursor_VarDecl: {
+    std::vector<unsigned> uses;
+    for (const CXCursor &child : getChildren(current)) {
+      instance->collectUses(child, uses);
+    }
+    instance->addDefUses(instance->getVarNode(current), uses);
+    break;
+  }
+  case CXCursor_BinaryOperator:
+  case CXCursor_CompoundAssignOperator: {
+    const std::vector<CXCursor> operands = getChildren(current);
+    if (operands.size() != 2) {
+      break;
+    }
+    if (clang_getCursorKind(current) == CXCursor_BinaryOperator &&
+        getBinaryOperator(instance->translationUnit, operands[0],
+                          operands[1]) != "=") {
+      break;
+    }
+    unsigned var;
+    if (instance->getDefinedVar(operands[0], &var)) {
+      std::vector<unsigned> uses;
+      instance->collectUses(operands[1], uses);
+      instance->addDefUses(var, uses);
+    }
+    break;
+  }
+  case CXCursor_CallExpr:
+    instance->visitCall(current);
+    break;
+  case CXCursor_ReturnStmt: {
+    std::vector<unsigned> uses;
+    for (const CXCursor &child : getChildren(current)) {
+      instance->collectUses(child, uses);
+    }
+    instance->addDefUses(instance->getReturnNode(instance->currentFunction),
+                         uses);
+    break;
+  }
+  case CXCursor_IfStmt:
+  case CXCursor_ForStmt:
+  case CXCursor_WhileStmt:
+  case CXCursor_DoStmt:
+  case CXCursor_SwitchStmt:
+    instance->visitBranch(current);
+    break;
+  default:
+    break;
+  }
+
+  return CXChildVisit_Recurse;
+}
+
+void TaintAnalysis::visitFunction(CXCursor function) {
+  currentFunction = getSpelling(function);
+
+  if (currentFunction == "main" && clang_Cursor_getNumArguments(function) > 1) {
+    CXCursor argv = clang_Cursor_getArgument(function, 1);
+    addDefUse(getVarNode(argv), getSourceNode(argv, "argv", ""));
+  }
+
+  clang_visitChildren(function, &TaintAnalysis::VisitStatement, this);
+}
+
+void TaintAnalysis::propagate() {
+  std::vector<unsigned> worklist;
+  std::vector<bool> queued(nodes.size(), false);
+  for (const std::pair<const Location, unsigned> &source : sourceNodes) {
+    worklist.push_back(source.second);
+    queued[source.second] = true;
+  }
+
+  while (!worklist.empty()) {
+    const unsigned node = worklist.back();
+    worklist.pop_back();
+    queued[node] = false;
+    for (unsigned user : nodes[node].users) {
+      if (nodes[user].taint.unionWith(nodes[node].taint) && !queued[user]) {
+        worklist.push_back(user);
+        queued[user] = true;
+      }
+    }
+  }
+}
+
+void TaintAnalysis::run() {
+  clang_visitChildren(
+      clang_getTranslationUnitCursor(translationUnit),
+      [](CXCursor current, CXCursor parent, CXClientData ta) {
+        if (clang_getCursorKind(current) == CXCursor_FunctionDecl &&
+            clang_isCursorDefinition(current) &&
+            clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
+          static_cast<TaintAnalysis *>(ta)->visitFunction(current);
+        }
+        return CXChildVisit_Continue;
+      },
+      this);
+
+  propagate();
+
+  for (const BranchUses &branch : branchUses) {
+    BranchTaint result{branch.line, branch.kind, {}, {}};
+    SparseBitSet taint;
+    for (unsigned use : branch.uses) {
+      if (nodes[use].taint.empty()) {
+        continue;
+      }
+      taint.unionWith(nodes[use].taint);
+      if (std::find(result.vars.begin(), result.vars.end(), nodes[use].name) ==
+          result.vars.end()) {
+        result.vars.push_back(nodes[use].name);
+      }
+    }
+    result.sources = taint.toVector();
+    branches.push_back(result);
+  }
+}
+
+void TaintAnalysis::printReport(std::ostream &out) const {
+  bool found = false;
+  for (const BranchTaint &branch : branches) {
+    if (branch.sources.empty()) {
+      continue;
+    }
+    found = true;
+    CXString kind = clang_getCursorKindSpelling(branch.kind);
+    out << "Line " << branch.line << " (" << CXSTR(kind) << "):";
+    clang_disposeString(kind);
+    for (size_t var = 0; var < branch.vars.size(); var++) {
+      out << (var ? ", " : " ") << branch.vars[var];
+    }
+    out << " <-";
+    for (size_t i = 0; i < branch.sources.size(); i++) {
+      const Source &source = sources[branch.sources[i]];
+      out << (i ? ", " : " ") << source.kind;
+      if (!source.var.empty()) {
+        out << "(" << source.var << ")";
+      }
+      out << " at line " << source.line;
+    }
+    out << '\n';
+  }
+  if (!found) {
+    out << "No input-dependent branches found.\n";
+  }
+}
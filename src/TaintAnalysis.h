@@ -0,0 +1,141 @@
+
+#ifndef TAINT_ANALYSIS__H
+#define TAINT_ANALYSIS__H
+
+#include "Common.h"
+#include "CursorUtils.h"
+#include "SparseBitSet.h"
+#include <clang-c/Index.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Session;
+
+// Flow-insensitive def-use analysis over a translation unit that tracks
+// which program inputs (scanf, fgets, fopen, getenv, argv, ...) can reach
+// each branch condition. Every variable, function return value and input
+// site is a node; assignments, initializers, argument passing and returns
+// add def-use edges, and taint is propagated along them with a worklist
+// over sparse bitsets indexed by input.
+class TaintAnalysis {
+
+public:
+  struct Source {
+    std::string kind;
+    std::string var;
+    unsigned line;
+  };
+
+  struct BranchTaint {
+    unsigned line;
+    CXCursorKind kind;
+    std::vector<std::string> vars;
+    std::vector<unsigned> sources;
+  };
+
+private:
+  Session &session;
+
+  CXTranslationUnit translationUnit;
+
+  CXFile cxFile;
+
+  unsigned lineOffset;
+
+  bool debug;
+
+  struct Node {
+    std::string name;
+    unsigned line;
+    SparseBitSet taint;
+    std::vector<unsigned> users;
+  };
+
+  std::vector<Node> nodes;
+
+  // Variable nodes keyed by the location of their declaration.
+  std::unordered_map<cursor_utils::Location, unsigned,
+                     cursor_utils::LocationHash>
+      varNodes;
+
+  std::unordered_map<std::string, unsigned> returnNodes;
+
+  // Source nodes keyed by the location of the input call site.
+  std::unordered_map<cursor_utils::Location, unsigned,
+                     cursor_utils::LocationHash>
+      sourceNodes;
+
+  std::vector<Source> sources;
+
+  struct BranchUses {
+    unsigned line;
+    CXCursorKind kind;
+    std::vector<unsigned> uses;
+  };
+
+  std::vector<BranchUses> branchUses;
+
+  std::vector<BranchTaint> branches;
+
+  std::string currentFunction;
+
+  unsigned newNode(const std::string &name, unsigned line);
+
+  unsigned getVarNode(CXCursor decl);
+
+  unsigned getReturnNode(const std::string &function);
+
+  unsigned getSourceNode(CXCursor site, const std::string &kind,
+                         const std::string &var);
+
+  void addDefUse(unsigned def, unsigned use) {
+    nodes[use].users.push_back(def);
+  }
+
+  void addDefUses(unsigned def, const std::vector<unsigned> &uses) {
+    for (unsigned use : uses) {
+      addDefUse(def, use);
+    }
+  }
+
+  unsigned getLine(CXCursor C);
+
+  // Nodes whose values flow into the expression rooted at C.
+  void collectUses(CXCursor C, std::vector<unsigned> &uses);
+
+  // Variable node that an assignment to the expression C defines, if any.
+  bool getDefinedVar(CXCursor C, unsigned *node);
+
+  void visitCall(CXCursor call);
+
+  void visitBranch(CXCursor branch);
+
+  void visitFunction(CXCursor function);
+
+  static CXChildVisitResult VisitStatement(CXCursor current, CXCursor parent,
+                                           CXClientData ta);
+
+  void propagate();
+
+public:
+  TaintAnalysis(Session &session, CXTranslationUnit translationUnit,
+                const std::string &filename, unsigned lineOffset = 0,
+                bool debug = false);
+
+  void run();
+
+  // True for library calls this analysis treats as program inputs.
+  static bool isInputCall(const std::string &name);
+
+  const std::vector<Source> &getSources() const { return sources; }
+
+  const std::vector<BranchTaint> &getBranches() const { return branches; }
+
+  void printReport(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,612 @@
+
+#include "TraceAnalyzer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string_view>
+
+constexpr char TraceAnalyzer::MAGIC[8];
+
+namespace {
+
+// Events gathered before a counting pass, and bytes per read.
+constexpr size_t BLOCK_SIZE = 1 << 16;
+
+constexpr size_t READ_SIZE = 1 << 20;
+
+constexpr uint64_t MAX_THREADS = 1 << 16;
+
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+std::string formatPercent(uint64_t part, uint64_t total) {
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%.1f%%",
+           total ? 100.0 * part / total : 0.0);
+  return buffer;
+}
+
+std::string formatDuration(uint64_t ns) {
+  char buffer[32];
+  if (ns < 10000) {
+    snprintf(buffer, sizeof(buffer), "%llu ns",
+             static_cast<unsigned long long>(ns));
+  } else if (ns < 10000000) {
+    snprintf(buffer, sizeof(buffer), "%.1f us", ns / 1e3);
+  } else if (ns < 10000000000) {
+    snprintf(buffer, sizeof(buffer), "%.1f ms", ns / 1e6);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%.1f s", ns / 1e9);
+  }
+  return buffer;
+}
+
+std::string formatAddress(uint64_t address) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "func_0x%llx",
+           static_cast<unsigned long long>(address));
+  return buffer;
+}
+
+} // namespace
+
+TraceAnalyzer::TraceAnalyzer(const BranchDictionary *dictionary)
+    : dictionary(dictionary), lastBranch(0), currentThread(0), numCalls(0),
+      numUnknown(0), numSkipped(0), packed(nullptr) {
+  block.reserve(BLOCK_SIZE);
+}
+
+void TraceAnalyzer::pack(uint32_t word) {
+  packBuffer.push_back(word);
+  if (packBuffer.size() == BLOCK_SIZE) {
+    flushPacked();
+  }
+}
+
+void TraceAnalyzer::flushPacked() {
+  fwrite(packBuffer.data(), sizeof(uint32_t), packBuffer.size(), packed);
+  packBuffer.clear();
+}
+
+void TraceAnalyzer::switchThread(uint32_t thread) {
+  if (thread >= threadLastBranch.size()) {
+    threadLastBranch.resize(thread + 1, 0);
+  }
+  threadLastBranch[currentThread] = lastBranch;
+  lastBranch = threadLastBranch[thread];
+  currentThread = thread;
+}
+
+void TraceAnalyzer::addBranch(uint32_t id) {
+  if (packed != nullptr) {
+    pack(id);
+  }
+  lastBranch = id;
+  if (id >= MAX_ID) {
+    numUnknown++;
+    return;
+  }
+  block.push_back(id);
+  if (block.size() == BLOCK_SIZE) {
+    countBlock();
+  }
+}
+
+void TraceAnalyzer::addBranches(uint32_t id, uint64_t count) {
+  lastBranch = id;
+  if (id >= MAX_ID) {
+    numUnknown += count;
+    return;
+  }
+  if (id >= lanes[0].size()) {
+    for (std::vector<uint64_t> &lane : lanes) {
+      lane.resize(id + 1, 0);
+    }
+  }
+  lanes[0][id] += count;
+}
+
+void TraceAnalyzer::addCall(uint64_t address) {
+  if (packed != nullptr) {
+    pack(CALL_MARKER);
+    pack(static_cast<uint32_t>(address));
+    pack(static_cast<uint32_t>(address >> 32));
+  }
+  numCalls++;
+  calls[{lastBranch, address}]++;
+}
+
+// Histogram of the block. Hot loops log the same id many times in a row, and
+// a single counter array would then serialise on the load-increment-store of
+// one slot; spreading neighbouring ids over NUM_LANES arrays lets those
+// updates proceed independently. The lanes are summed after the trace ends.
+void TraceAnalyzer::countBlock() {
+  if (block.empty()) {
+    return;
+  }
+  const uint32_t maxId = *std::max_element(block.begin(), block.end());
+  if (maxId >= lanes[0].size()) {
+    for (std::vector<uint64_t> &lane : lanes) {
+      lane.resize(maxId + 1, 0);
+    }
+  }
+
+  const uint32_t *ids = block.data();
+  const size_t size = block.size();
+  uint64_t *lane0 = lanes[0].data();
+  uint64_t *lane1 = lanes[1].data();
+  uint64_t *lane2 = lanes[2].data();
+  uint64_t *lane3 = lanes[3].data();
+  size_t i = 0;
+  for (; i + NUM_LANES <= size; i += NUM_LANES) {
+    lane0[ids[i]]++;
+    lane1[ids[i + 1]]++;
+    lane2[ids[i + 2]]++;
+    lane3[ids[i + 3]]++;
+  }
+  for (; i < size; i++) {
+    lane0[ids[i]]++;
+  }
+  block.clear();
+}
+
+namespace {
+
+bool parseNumber(std::string_view digits, int base, uint64_t &value) {
+  value = 0;
+  if (digits.empty()) {
+    return false;
+  }
+  for (char c : digits) {
+    unsigned digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    value = value * base + digit;
+  }
+  return true;
+}
+
+} // namespace
+
+bool TraceAnalyzer::parseSummary(std::string_view items) {
+  // "br_E xN" for the loop's first body target, then "br_A=a" per target.
+  unsigned position = 0;
+  uint64_t id = 0;
+  uint64_t count = 0;
+  while (!items.empty()) {
+    const size_t space = items.find(' ');
+    const std::string_view item = items.substr(0, space);
+    items.remove_prefix(space == std::string_view::npos ? items.size()
+                                                        : space + 1);
+    if (position == 1) {
+      if (item.empty() || item[0] != 'x' ||
+          !parseNumber(item.substr(1), 10, count)) {
+        return false;
+      }
+    } else {
+      const size_t idEnd = position == 0 ? item.size() : item.find('=');
+      if (item.compare(0, 3, "br_") != 0 ||
+          idEnd == std::string_view::npos ||
+          !parseNumber(item.substr(3, idEnd - 3), 10, id) ||
+          id >= CALL_MARKER ||
+          (position > 0 &&
+           !parseNumber(item.substr(idEnd + 1), 10, count))) {
+        return false;
+      }
+    }
+    if (position > 0) {
+      addBranches(static_cast<uint32_t>(id), count);
+    }
+    position++;
+  }
+  return position >= 2;
+}
+
+bool TraceAnalyzer::parseLatency(std::string_view items) {
+  // "br_N", then "n=C", "ns=T" and a "bK=c" per non-empty bucket.
+  uint64_t id = 0;
+  Latency latency;
+  unsigned position = 0;
+  while (!items.empty()) {
+    const size_t space = items.find(' ');
+    const std::string_view item = items.substr(0, space);
+    items.remove_prefix(space == std::string_view::npos ? items.size()
+                                                        : space + 1);
+    const size_t equals = item.find('=');
+    uint64_t value = 0;
+    if (position == 0) {
+      if (item.compare(0, 3, "br_") != 0 ||
+          !parseNumber(item.substr(3), 10, id) || id >= CALL_MARKER) {
+        return false;
+      }
+    } else if (equals == std::string_view::npos ||
+               !parseNumber(item.substr(equals + 1), 10, value)) {
+      return false;
+    } else if (item.substr(0, equals) == "n") {
+      latency.count = value;
+    } else if (item.substr(0, equals) == "ns") {
+      latency.ns = value;
+    } else {
+      uint64_t bucket;
+      if (item[0] != 'b' ||
+          !parseNumber(item.substr(1, equals - 1), 10, bucket) ||
+          bucket >= NUM_BUCKETS) {
+        return false;
+      }
+      latency.buckets[bucket] = value;
+    }
+    position++;
+  }
+  if (position < 3) {
+    return false;
+  }
+
+  addBranches(static_cast<uint32_t>(id), latency.count);
+  // Histograms of the same target, as in the traces of several runs
+  // concatenated, add up.
+  Latency &total = latencies[static_cast<uint32_t>(id)];
+  total.count += latency.count;
+  total.ns += latency.ns;
+  for (unsigned bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+    total.buckets[bucket] += latency.buckets[bucket];
+  }
+  return true;
+}
+
+uint64_t TraceAnalyzer::getPercentile(const Latency &latency,
+                                      double fraction) {
+  uint64_t seen = 0;
+  for (unsigned bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+    seen += latency.buckets[bucket];
+    if (seen > 0 && seen >= fraction * latency.count) {
+      return (uint64_t(2) << bucket) - 1;
+    }
+  }
+  return 0;
+}
+
+void TraceAnalyzer::parseLine(const char *begin, const char *end) {
+  std::string_view line(begin, end - begin);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+
+  uint64_t value;
+  if (line.size() > 1 && line[0] == 'T' && line[1] >= '0' && line[1] <= '9') {
+    const size_t space = line.find(' ');
+    const size_t colon = line.find(": ");
+    if (space == std::string_view::npos || colon == std::string_view::npos ||
+        !parseNumber(line.substr(1, space - 1), 10, value) ||
+        value >= MAX_THREADS) {
+      numSkipped++;
+      return;
+    }
+    if (value != currentThread) {
+      switchThread(static_cast<uint32_t>(value));
+    }
+    line.remove_prefix(colon + 2);
+  }
+
+  if (line.compare(0, 5, "loop ") == 0) {
+    if (!parseSummary(line.substr(5))) {
+      numSkipped++;
+    }
+    return;
+  }
+
+  if (line.compare(0, 8, "latency ") == 0) {
+    if (!parseLatency(line.substr(8))) {
+      numSkipped++;
+    }
+    return;
+  }
+
+  if (line.compare(0, 5, "func_") == 0) {
+    std::string_view address = line.substr(5);
+    if (address.compare(0, 2, "0x") == 0) {
+      address.remove_prefix(2);
+    }
+    // printf("%p", NULL) prints "(nil)" with glibc.
+    if (address == "(nil)") {
+      addCall(0);
+    } else if (parseNumber(address, 16, value)) {
+      addCall(value);
+    } else {
+      numSkipped++;
+    }
+    return;
+  }
+
+  size_t id = line.compare(0, 3, "br_") == 0 ? 0 : line.rfind(": br_");
+  if (id == std::string_view::npos) {
+    numSkipped++;
+    return;
+  }
+  id += id == 0 ? 3 : 5;
+  if (parseNumber(line.substr(id), 10, value) && value < CALL_MARKER) {
+    addBranch(static_cast<uint32_t>(value));
+  } else {
+    numSkipped++;
+  }
+}
+
+void TraceAnalyzer::readText(FILE *in, const char *prefix, size_t prefixSize) {
+  // Holds the unfinished last line of each read in front of the next one.
+  std::vector<char> buffer(prefix, prefix + prefixSize);
+  size_t carried = prefixSize;
+  for (;;) {
+    buffer.resize(carried + READ_SIZE);
+    const size_t numRead = fread(buffer.data() + carried, 1, READ_SIZE, in);
+    const size_t size = carried + numRead;
+    const char *begin = buffer.data();
+    const char *end = begin + size;
+    while (const char *newline =
+               static_cast<const char *>(memchr(begin, '\n', end - begin))) {
+      parseLine(begin, newline);
+      begin = newline + 1;
+    }
+    carried = end - begin;
+    if (numRead == 0) {
+      if (carried > 0) {
+        parseLine(begin, end);
+      }
+      return;
+    }
+    std::memmove(buffer.data(), begin, carried);
+  }
+}
+
+bool TraceAnalyzer::readBinary(FILE *in, std::string &error) {
+  BinaryHeader header;
+  if (fread(reinterpret_cast<char *>(&header) + sizeof(MAGIC), 1,
+            sizeof(header) - sizeof(MAGIC), in) !=
+      sizeof(header) - sizeof(MAGIC)) {
+    error = "truncated trace header";
+    return false;
+  }
+  if (header.version != VERSION) {
+    error = "unsupported trace version " + std::to_string(header.version);
+    return false;
+  }
+
+  std::vector<uint32_t> words(READ_SIZE / sizeof(uint32_t));
+  // Words still expected for a call: the two halves of its address.
+  unsigned pending = 0;
+  uint64_t address = 0;
+  size_t numRead;
+  while ((numRead = fread(words.data(), sizeof(uint32_t), words.size(), in)) >
+         0) {
+    for (size_t i = 0; i < numRead; i++) {
+      const uint32_t word = words[i];
+      if (pending == 2) {
+        address = word;
+        pending = 1;
+      } else if (pending == 1) {
+        addCall(address | static_cast<uint64_t>(word) << 32);
+        pending = 0;
+      } else if (word == CALL_MARKER) {
+        pending = 2;
+      } else {
+        addBranch(word);
+      }
+    }
+  }
+  if (pending != 0) {
+    error = "trace ends inside a call record";
+    return false;
+  }
+  return true;
+}
+
+bool TraceAnalyzer::analyze(const std::string &path, std::string &error,
+                            const std::string &packPath) {
+  FILE *in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+  if (in == nullptr) {
+    error = "cannot open " + path;
+    return false;
+  }
+  if (!packPath.empty()) {
+    packed = fopen(packPath.c_str(), "wb");
+    if (packed == nullptr) {
+      error = "cannot create " + packPath;
+      if (in != stdin) {
+        fclose(in);
+      }
+      return false;
+    }
+    BinaryHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    fwrite(&header, sizeof(header), 1, packed);
+  }
+
+  char magic[sizeof(MAGIC)];
+  const size_t numRead = fread(magic, 1, sizeof(magic), in);
+  bool ok = true;
+  if (numRead == sizeof(magic) &&
+      std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0) {
+    ok = readBinary(in, error);
+  } else {
+    readText(in, magic, numRead);
+  }
+  if (ferror(in)) {
+    error = "error reading " + path;
+    ok = false;
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+
+  if (packed != nullptr) {
+    flushPacked();
+    if (fclose(packed) != 0) {
+      error = "error writing " + packPath;
+      ok = false;
+    }
+    packed = nullptr;
+  }
+
+  countBlock();
+  branchHits.assign(lanes[0].size(), 0);
+  for (const std::vector<uint64_t> &lane : lanes) {
+    for (size_t id = 0; id < lane.size(); id++) {
+      branchHits[id] += lane[id];
+    }
+  }
+  return ok;
+}
+
+std::string TraceAnalyzer::getFunction(uint32_t id) const {
+  if (dictionary != nullptr) {
+    if (const BranchDictionary::Record *record = dictionary->find(id)) {
+      const char *function = dictionary->getString(record->function);
+      return *function ? function : "<global>";
+    }
+  }
+  return id == 0 ? "<entry>" : "br_" + std::to_string(id);
+}
+
+void TraceAnalyzer::printReport(std::ostream &out, unsigned numHot) const {
+  uint64_t total = 0;
+  std::vector<uint32_t> hit;
+  for (uint32_t id = 0; id < branchHits.size(); id++) {
+    if (branchHits[id] > 0) {
+      total += branchHits[id];
+      hit.push_back(id);
+    }
+  }
+  out << "Trace: " << total << " branch hits over " << hit.size()
+      << " targets, " << numCalls << " calls";
+  if (numUnknown > 0) {
+    out << ", " << numUnknown << " out-of-range ids";
+  }
+  if (numSkipped > 0) {
+    out << ", " << numSkipped << " other lines";
+  }
+  out << '\n';
+
+  std::sort(hit.begin(), hit.end(), [this](uint32_t lhs, uint32_t rhs) {
+    return branchHits[lhs] != branchHits[rhs]
+               ? branchHits[lhs] > branchHits[rhs]
+               : lhs < rhs;
+  });
+  out << "\nHot branches:\n";
+  for (size_t i = 0; i < hit.size() && i < numHot; i++) {
+    const uint32_t id = hit[i];
+    out << "  br_" << id << ": " << branchHits[id] << " ("
+        << formatPercent(branchHits[id], total) << ")";
+    if (dictionary != nullptr) {
+      if (const BranchDictionary::Record *record = dictionary->find(id)) {
+        out << "  " << dictionary->getString(record->file) << ", "
+            << record->branchLine << ", " << record->targetLine << " in "
+            << getFunction(id);
+      } else {
+        out << "  not in the dictionary";
+      }
+    }
+    out << '\n';
+  }
+
+  if (!latencies.empty()) {
+    uint64_t totalNs = 0;
+    std::vector<std::pair<uint32_t, const Latency *>> slowest;
+    for (const std::pair<const uint32_t, Latency> &latency : latencies) {
+      totalNs += latency.second.ns;
+      slowest.emplace_back(latency.first, &latency.second);
+    }
+    std::stable_sort(slowest.begin(), slowest.end(),
+                     [](const auto &lhs, const auto &rhs) {
+                       return lhs.second->ns > rhs.second->ns;
+                     });
+    out << "\nSlowest branches (" << formatDuration(totalNs)
+        << " in timed regions):\n";
+    for (size_t i = 0; i < slowest.size() && i < numHot; i++) {
+      const uint32_t id = slowest[i].first;
+      const Latency &latency = *slowest[i].second;
+      out << "  br_" << id << ": " << formatDuration(latency.ns) << " ("
+          << formatPercent(latency.ns, totalNs) << "), " << latency.count
+          << " regions, mean "
+          << formatDuration(latency.count ? latency.ns / latency.count : 0)
+          << ", p50 < " << formatDuration(getPercentile(latency, 0.5) + 1)
+          << ", p99 < " << formatDuration(getPercentile(latency, 0.99) + 1);
+      if (dictionary != nullptr) {
+        if (const BranchDictionary::Record *record = dictionary->find(id)) {
+          out << "  " << dictionary->getString(record->file) << ", "
+              << record->branchLine << ", " << record->targetLine << " in "
+              << getFunction(id);
+        }
+      }
+      out << '\n';
+    }
+  }
+
+  if (dictionary != nullptr) {
+    struct Coverage {
+      unsigned targets = 0;
+      unsigned taken = 0;
+    };
+    std::map<std::string, Coverage> functions;
+    std::vector<uint32_t> neverTaken;
+    unsigned numTargets = 0;
+    for (uint32_t id = 0; id < dictionary->size(); id++) {
+      const BranchDictionary::Record *record = dictionary->find(id);
+      if (record == nullptr) {
+        continue;
+      }
+      numTargets++;
+      Coverage &coverage =
+          functions[std::string(dictionary->getString(record->file)) + ":" +
+                    getFunction(id)];
+      coverage.targets++;
+      if (getBranchHits(id) > 0) {
+        coverage.taken++;
+      } else {
+        neverTaken.push_back(id);
+      }
+    }
+
+    out << "\nNever-taken targets (" << neverTaken.size() << " of "
+        << numTargets << "):\n";
+    for (uint32_t id : neverTaken) {
+      const BranchDictionary::Record *record = dictionary->find(id);
+      out << "  br_" << id << ": " << dictionary->getString(record->file)
+          << ", " << record->branchLine << ", " << record->targetLine << " in "
+          << getFunction(id) << '\n';
+    }
+
+    out << "\nFunction coverage:\n";
+    for (const std::pair<const std::string, Coverage> &function : functions) {
+      out << "  " << function.first << ": " << function.second.taken << "/"
+          << function.second.targets << " targets ("
+          << formatPercent(function.second.taken, function.second.targets)
+          << ")\n";
+    }
+  }
+
+  std::map<std::pair<std::string, uint64_t>, uint64_t> edges;
+  for (const auto &call : calls) {
+    edges[{getFunction(call.first.first), call.first.second}] += call.second;
+  }
+  std::vector<std::pair<std::pair<std::string, uint64_t>, uint64_t>> sorted(
+      edges.begin(), edges.end());
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const auto &lhs, const auto &rhs) {
+                     return lhs.second > rhs.second;
+                   });
+  out << "\nCall edges:\n";
+  for (const auto &edge : sorted) {
+    out << "  " << edge.first.first << " -> " << formatAddress(edge.first.second)
+        << ": " << edge.second << '\n';
+  }
+}
@@ -0,0 +1,151 @@
+
+#ifndef TRACE_ANALYZER__H
+#define TRACE_ANALYZER__H
+
+#include "BranchDictionary.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Streaming analytics over the trace printed by an instrumented program.
+// The trace is read in fixed-size blocks, so its size is bounded by the disk
+// rather than by memory; only the per-id counters are kept.
+//
+// Two input formats are accepted:
+//
+//   text     one event per line: "br_N" (also "... : br_N" as printed by the
+//            Rust pass) or "func_<address>", optionally prefixed with
+//            "T<thread> <ticks>: " by the threaded runtime; a loop summary
+//            "loop br_E xN br_A=a ..." adds its counts, and a latency
+//            histogram "latency br_N n=C ns=T bK=c ..." its count and region
+//            times (packed copies leave both out); other program output is
+//            skipped
+//   binary   the 16-byte header "KPCTRACE", version, reserved, followed by
+//            host-order uint32 words: a branch id, or CALL_MARKER followed
+//            by the two halves (low, high) of the callee's address
+//
+// Branch ids are gathered into a block and counted in one pass; each call is
+// attributed to the function of the branch its thread took last before it.
+class TraceAnalyzer {
+public:
+  static constexpr char MAGIC[8] = {'K', 'P', 'C', 'T', 'R', 'A', 'C', 'E'};
+
+  static constexpr uint32_t VERSION = 1;
+
+  static constexpr uint32_t CALL_MARKER = 0xFFFFFFFF;
+
+private:
+  const BranchDictionary *dictionary;
+
+  // Ids past this are counted as unknown rather than growing the counters
+  // without bound on a corrupt trace.
+  static constexpr uint32_t MAX_ID = 1u << 24;
+
+  // Branch ids of the current block, waiting to be counted.
+  std::vector<uint32_t> block;
+
+  // Interleaved sub-histograms; see countBlock().
+  static constexpr unsigned NUM_LANES = 4;
+
+  std::vector<uint64_t> lanes[NUM_LANES];
+
+  std::vector<uint64_t> branchHits;
+
+  // (last branch id, callee address) -> number of calls.
+  struct EdgeHash {
+    size_t operator()(const std::pair<uint32_t, uint64_t> &edge) const {
+      return std::hash<uint64_t>()(edge.second * 31 + edge.first);
+    }
+  };
+
+  std::unordered_map<std::pair<uint32_t, uint64_t>, uint64_t, EdgeHash> calls;
+
+  uint32_t lastBranch;
+
+  // Last branch of every other thread of a threaded trace, and the thread
+  // whose events are being read.
+  std::vector<uint32_t> threadLastBranch;
+
+  uint32_t currentThread;
+
+  void switchThread(uint32_t thread);
+
+  uint64_t numCalls;
+
+  uint64_t numUnknown;
+
+  uint64_t numSkipped;
+
+  // Binary copy of the trace being read, if requested.
+  FILE *packed;
+
+  std::vector<uint32_t> packBuffer;
+
+  void pack(uint32_t word);
+
+  void flushPacked();
+
+  void addBranch(uint32_t id);
+
+  // Adds count hits of id at once, as a loop summary reports them.
+  void addBranches(uint32_t id, uint64_t count);
+
+  // Parses the items of a loop summary after its "loop ".
+  bool parseSummary(std::string_view items);
+
+  // Region times of the targets of a latency trace; bucket K counts the
+  // regions of 2^K to 2^(K+1)-1 ns.
+  static constexpr unsigned NUM_BUCKETS = 48;
+
+  struct Latency {
+    uint64_t count = 0;
+    uint64_t ns = 0;
+    uint64_t buckets[NUM_BUCKETS] = {};
+  };
+
+  std::map<uint32_t, Latency> latencies;
+
+  // Parses a latency histogram after its "latency ".
+  bool parseLatency(std::string_view items);
+
+  // Upper bound of the region time below which fraction of the regions fall.
+  static uint64_t getPercentile(const Latency &latency, double fraction);
+
+  void addCall(uint64_t address);
+
+  void countBlock();
+
+  void parseLine(const char *begin, const char *end);
+
+  void readText(FILE *in, const char *prefix, size_t prefixSize);
+
+  bool readBinary(FILE *in, std::string &error);
+
+  std::string getFunction(uint32_t id) const;
+
+public:
+  explicit TraceAnalyzer(const BranchDictionary *dictionary = nullptr);
+
+  // Streams the trace at path ("-" for stdin) into the counters. If packPath
+  // is given, the events are also written there in the binary format.
+  bool analyze(const std::string &path, std::string &error,
+               const std::string &packPath = "");
+
+  uint64_t getBranchHits(uint32_t id) const {
+    return id < branchHits.size() ? branchHits[id] : 0;
+  }
+
+  // Hot branches, slowest branches of a latency trace, never-taken targets,
+  // per-function coverage and call edges; the targets and coverage need a
+  // dictionary.
+  void printReport(std::ostream &out, unsigned numHot = 10) const;
+};
+
+#endif
@@ -1,29 +1,374 @@
 
+#include "AnalysisServer.h"
+#include "BranchDictionary.h"
+#include "CallgrindParser.h"
+#include "ComplexityProfiler.h"
+#include "CorpusRunner.h"
 #include "FeatureDetector.h"
 #include "KeyPointsCollector.h"
+#include "ProjectAnalyzer.h"
+#include "Session.h"
+#include "TraceAnalyzer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <sys/resource.h>
+
+void usage( const char *exe )
+{
+    std::cerr << "Usage: " << exe << " [-d] [-j <workers>] [--stream] [--loop-summary] [--latency] [--stats] <file.c>\n"
+              << "       " << exe << " [-d] [-j <workers>] [--dict-text] [--loop-summary] [--latency] --project <dir>\n"
+              << "       " << exe << " [-j <workers>] --serve <socket>\n"
+              << "       " << exe << " --dump-dict <file.bdict>\n"
+              << "       " << exe << " --trace-stats <trace> [--dict <file.bdict>] [--top <n>] [--pack <out>]\n"
+              << "       " << exe << " --callgrind <callgrind.out> [--dict <file.bdict>] [--top <n>]\n"
+              << "       " << exe << " [-j <workers>] --corpus <dir> --exe <binary> [--timeout <s>] [--mem-limit <MiB>]\n"
+              << "              [--cpu-limit <s>] [--fork-server] [-o <store>]\n"
+              << "       " << exe << " --corpus-list <store> | --corpus-trace <store> <input>\n"
+              << "       " << exe << " --corpus-diff <store> <input> <input>\n"
+              << "       " << exe << " [-j <workers>] --complexity <file.c> [--sweep-max <n>] [--timeout <s>]\n"
+              << "  -d            turn the debugger on\n"
+              << "  -j <workers>  number of threads used to analyze functions\n"
+              << "  --stream      parse the file once, release the AST as soon as the analysis is done, and\n"
+              << "                write the branch dictionary and modified file in one pass\n"
+              << "  --loop-summary\n"
+              << "                instrument loops to print one summary of their targets per execution\n"
+              << "  --latency     instrument targets to time their regions into histograms printed at exit\n"
+              << "                (KPC_TIMELINE=<file> also writes a Chrome trace-event timeline)\n"
+              << "  --stats       print the wall time and peak memory of the run\n"
+              << "  --project     analyze every file in <dir>/compile_commands.json\n"
+              << "  --serve       answer JSON-lines requests on a Unix socket\n"
+              << "  --dict-text   also write the branch dictionary as text\n"
+              << "  --dump-dict   print a binary branch dictionary as text\n"
+              << "  --trace-stats count branch and call hits in a text or binary trace ('-' for stdin)\n"
+              << "  --callgrind   report the instruction cost of each line and branch target in a callgrind profile\n"
+              << "  --dict        branch dictionary used to name and cover the trace's branches, or to\n"
+              << "                attribute the profile's cost to them\n"
+              << "  --top <n>     number of hot branches reported (default 10)\n"
+              << "  --pack <out>  also write the trace in the compact binary format\n"
+              << "  --corpus      run <binary> once per file in <dir>, the file as stdin, -j at a time\n"
+              << "  --timeout     seconds before a run is killed (default 10, 0 for none)\n"
+              << "  --mem-limit   address space limit of each run\n"
+              << "  --cpu-limit   CPU time limit of each run\n"
+              << "  --fork-server fork each run from a server started once (binary built with -DKPC_FORKSERVER)\n"
+              << "  -o <store>    result store of --corpus (default " OUT_DIR "corpus.runs)\n"
+              << "  --corpus-list print the runs in a result store\n"
+              << "  --corpus-trace print the trace of one input from a result store\n"
+              << "  --corpus-diff print how long a prefix the traces of two inputs share\n"
+              << "  --complexity  sweep the seminal stdin inputs of <file.c> over powers of two, run them\n"
+              << "                -j at a time and fit the growth of every branch target's hits\n"
+              << "  --sweep-max   largest value of the sweep (default 1024)\n"
+              << "With no arguments the file name and debug flag are prompted for.\n";
+}
+
+// Wall time since start and peak resident set size of the process.
+void printStats( std::chrono::steady_clock::time_point start )
+{
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    const long long wallMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start ).count();
+    std::cout << "\nWall time: " << wallMs << " ms\n"
+              << "Peak memory: " << usage.ru_maxrss << " KiB\n";
+}
+
+// Follow-up prompts of the interactive mode: profile the original program
+// with Valgrind and print the trace of the instrumented one. Each step parses
+// the file afresh, since a collector's cursors are collected only once.
+bool runToolchain( Session &session, const std::string &filename )
+{
+    char decision;
+    std::cout << "\nWould you like to invoke Valgrind? (y/n) ";
+    std::cin >> decision;
+    if ( decision == 'y' ) {
+        KeyPointsCollector kpc( session, filename, false );
+        if ( !kpc.isParsed() || !kpc.collectCursors() || !kpc.invokeValgrind() ) {
+            std::cerr << kpc.getError() << '\n';
+            return false;
+        }
+    }
+
+    std::cout << "\nWould you like to output the branch pointer trace for the program? (y/n) ";
+    std::cin >> decision;
+    if ( decision == 'y' ) {
+        KeyPointsCollector kpc( session, filename, false );
+        const std::string trace = kpc.isParsed() ? kpc.getBPTrace() : "";
+        if ( !kpc.getError().empty() ) {
+            std::cerr << kpc.getError() << '\n';
+            return false;
+        }
+        std::cout << trace;
+    }
+    return true;
+}
 
 int main( int argc, char *argv[] )
 {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     std::string filename;
-    std::cout << "Enter file name: ";
-    std::cin >> filename;
-
-    // Debugger on or off
-    bool debug;
-    std::string debugStr;
-    std::cout << "Want the debugger on? (y/n): ";
-    std::cin >> debugStr;
-
-    if ( debugStr == "y" ) {
-        debug = true;
-    } else if ( debugStr == "n" ) {
-        debug = false;
+    std::string socketPath;
+    std::string projectDir;
+    std::string dictPath;
+    std::string tracePath;
+    std::string traceDictPath;
+    std::string profilePath;
+    std::string packPath;
+    unsigned numHot = 10;
+    std::string corpusDir;
+    std::string corpusExe;
+    std::string storePath = OUT_DIR "corpus.runs";
+    std::string listPath;
+    std::string tracedInput;
+    std::string comparedInput;
+    std::string complexityPath;
+    uint64_t sweepMax = 1024;
+    CorpusRunner::Limits limits;
+    bool debug = false;
+    bool dictText = false;
+    bool forkServer = false;
+    bool streaming = false;
+    bool stats = false;
+    unsigned numWorkers = 1;
+
+    // The command line tool reports on stdout and formats the file it is
+    // given in place; the server and project modes leave sources alone.
+    Session session( std::cout, OUT_DIR, true );
+
+    if ( argc > 1 ) {
+        for ( int i = 1; i < argc; i++ ) {
+            std::string arg( argv[i] );
+            if ( arg == "-d" ) {
+                debug = true;
+            } else if ( arg == "-j" && i + 1 < argc ) {
+                numWorkers = std::max( 1, std::atoi( argv[++i] ) );
+            } else if ( arg == "--serve" && i + 1 < argc ) {
+                socketPath = argv[++i];
+            } else if ( arg == "--project" && i + 1 < argc ) {
+                projectDir = argv[++i];
+            } else if ( arg == "--stream" ) {
+                streaming = true;
+            } else if ( arg == "--loop-summary" ) {
+                session.setLoopSummaries( true );
+            } else if ( arg == "--latency" ) {
+                session.setLatency( true );
+            } else if ( arg == "--stats" ) {
+                stats = true;
+            } else if ( arg == "--dict-text" ) {
+                dictText = true;
+            } else if ( arg == "--dump-dict" && i + 1 < argc ) {
+                dictPath = argv[++i];
+            } else if ( arg == "--trace-stats" && i + 1 < argc ) {
+                tracePath = argv[++i];
+            } else if ( arg == "--callgrind" && i + 1 < argc ) {
+                profilePath = argv[++i];
+            } else if ( arg == "--dict" && i + 1 < argc ) {
+                traceDictPath = argv[++i];
+            } else if ( arg == "--top" && i + 1 < argc ) {
+                numHot = std::max( 0, std::atoi( argv[++i] ) );
+            } else if ( arg == "--pack" && i + 1 < argc ) {
+                packPath = argv[++i];
+            } else if ( arg == "--corpus" && i + 1 < argc ) {
+                corpusDir = argv[++i];
+            } else if ( arg == "--exe" && i + 1 < argc ) {
+                corpusExe = argv[++i];
+            } else if ( arg == "--timeout" && i + 1 < argc ) {
+                limits.timeout = std::max( 0, std::atoi( argv[++i] ) );
+            } else if ( arg == "--mem-limit" && i + 1 < argc ) {
+                limits.memoryMB = std::max( 0, std::atoi( argv[++i] ) );
+            } else if ( arg == "--cpu-limit" && i + 1 < argc ) {
+                limits.cpuSeconds = std::max( 0, std::atoi( argv[++i] ) );
+            } else if ( arg == "--fork-server" ) {
+                forkServer = true;
+            } else if ( arg == "-o" && i + 1 < argc ) {
+                storePath = argv[++i];
+            } else if ( arg == "--corpus-list" && i + 1 < argc ) {
+                listPath = argv[++i];
+            } else if ( arg == "--corpus-trace" && i + 2 < argc ) {
+                listPath = argv[++i];
+                tracedInput = argv[++i];
+            } else if ( arg == "--complexity" && i + 1 < argc ) {
+                complexityPath = argv[++i];
+            } else if ( arg == "--sweep-max" && i + 1 < argc ) {
+                sweepMax = std::max( 1LL, std::atoll( argv[++i] ) );
+            } else if ( arg == "--corpus-diff" && i + 3 < argc ) {
+                listPath = argv[++i];
+                tracedInput = argv[++i];
+                comparedInput = argv[++i];
+            } else if ( arg[0] != '-' && filename.empty() ) {
+                filename = arg;
+            } else {
+                usage( argv[0] );
+                return EXIT_FAILURE;
+            }
+        }
+        if ( !socketPath.empty() || !projectDir.empty() ) {
+            session.setFormatSources( false );
+        }
+        if ( !dictPath.empty() ) {
+            BranchDictionary dictionary( dictPath );
+            if ( !dictionary.isOpen() ) {
+                std::cerr << dictionary.getError() << '\n';
+                return EXIT_FAILURE;
+            }
+            dictionary.exportText( std::cout );
+            return EXIT_SUCCESS;
+        }
+        if ( !corpusDir.empty() ) {
+            if ( corpusExe.empty() ) {
+                usage( argv[0] );
+                return EXIT_FAILURE;
+            }
+            CorpusRunner runner( session, corpusExe, corpusDir, numWorkers, limits, forkServer );
+            std::string error;
+            if ( !runner.run( storePath, error ) ) {
+                std::cerr << error << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        if ( !listPath.empty() ) {
+            CorpusRunner::Store store( listPath );
+            if ( !store.isOpen() ) {
+                std::cerr << store.getError() << '\n';
+                return EXIT_FAILURE;
+            }
+            if ( !comparedInput.empty() ) {
+                CorpusRunner::Prefix prefix;
+                if ( !store.comparePrefix( tracedInput, comparedInput, prefix ) ) {
+                    std::cerr << "No run for input " << tracedInput << " or " << comparedInput << " in "
+                              << listPath << '\n';
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Common prefix: " << prefix.bytes << " bytes, " << prefix.lines << " lines\n"
+                          << tracedInput << ": " << store.find( tracedInput )->traceSize << " bytes\n"
+                          << comparedInput << ": " << store.find( comparedInput )->traceSize << " bytes\n";
+            } else if ( tracedInput.empty() ) {
+                store.printIndex( std::cout );
+            } else if ( !store.writeTrace( tracedInput, std::cout ) ) {
+                std::cerr << "No run for input " << tracedInput << " in " << listPath << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        if ( !profilePath.empty() ) {
+            std::vector<BranchDictionary::Entry> entries;
+            if ( !traceDictPath.empty() ) {
+                BranchDictionary dictionary( traceDictPath );
+                if ( !dictionary.isOpen() ) {
+                    std::cerr << dictionary.getError() << '\n';
+                    return EXIT_FAILURE;
+                }
+                entries = dictionary.getEntries();
+            }
+            CallgrindParser profile;
+            std::string error;
+            if ( !profile.parse( profilePath, error ) ) {
+                std::cerr << error << '\n';
+                return EXIT_FAILURE;
+            }
+            profile.printReport( std::cout, entries, numHot );
+            return EXIT_SUCCESS;
+        }
+        if ( !tracePath.empty() ) {
+            std::unique_ptr<BranchDictionary> dictionary;
+            if ( !traceDictPath.empty() ) {
+                dictionary.reset( new BranchDictionary( traceDictPath ) );
+                if ( !dictionary->isOpen() ) {
+                    std::cerr << dictionary->getError() << '\n';
+                    return EXIT_FAILURE;
+                }
+            }
+            TraceAnalyzer analyzer( dictionary.get() );
+            std::string error;
+            if ( !analyzer.analyze( tracePath, error, packPath ) ) {
+                std::cerr << error << '\n';
+                return EXIT_FAILURE;
+            }
+            analyzer.printReport( std::cout, numHot );
+            return EXIT_SUCCESS;
+        }
+        if ( !complexityPath.empty() ) {
+            ComplexityProfiler profiler( session, complexityPath, numWorkers, limits, sweepMax );
+            std::string error;
+            if ( !profiler.run( error ) ) {
+                std::cerr << error << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        if ( !projectDir.empty() && filename.empty() && socketPath.empty() ) {
+            ProjectAnalyzer project( session, projectDir, numWorkers, debug );
+            if ( !project.run() ) {
+                std::cerr << project.getError() << '\n';
+                return EXIT_FAILURE;
+            }
+            if ( !project.createBinaryDictionaryFile( OUT_DIR "project.bdict" ) ) {
+                std::cerr << "Could not write " << OUT_DIR "project.bdict\n";
+                return EXIT_FAILURE;
+            }
+            if ( dictText ) {
+                project.createDictionaryFile( OUT_DIR "project.branch_dict" );
+            }
+            if ( !project.transformProgram() ) {
+                std::cerr << project.getError() << '\n';
+                return EXIT_FAILURE;
+            }
+            if ( debug ) {
+                project.printFunctionSummaries( std::cout );
+            }
+            std::cout << "The project branch dictionary and modified files have been written to the "
+                      << OUT_DIR << " directory\n";
+            if ( stats ) {
+                printStats( start );
+            }
+            return EXIT_SUCCESS;
+        }
+        if ( !socketPath.empty() && filename.empty() && projectDir.empty() ) {
+            AnalysisServer server( session, socketPath, numWorkers );
+            if ( !server.run() ) {
+                std::cerr << server.getError() << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        if ( filename.empty() || !socketPath.empty() || !projectDir.empty() ) {
+            usage( argv[0] );
+            return EXIT_FAILURE;
+        }
+    } else {
+        std::cout << "Enter file name: ";
+        std::cin >> filename;
+
+        // Debugger on or off
+        std::string debugStr;
+        std::cout << "Want the debugger on? (y/n): ";
+        std::cin >> debugStr;
+
+        if ( debugStr == "y" ) {
+            debug = true;
+        } else if ( debugStr == "n" ) {
+            debug = false;
+        }
     }
 
-    FeatureDetector detector( filename, debug );
-    detector.cursorFinder();
+    FeatureDetector detector( session, filename, debug, numWorkers, streaming );
+    if ( !detector.isOpen() || !detector.cursorFinder() ) {
+        std::cerr << detector.getError() << '\n';
+        return EXIT_FAILURE;
+    }
+    if ( streaming ) {
+        std::cout << "\nThe branch dictionary and modified file have been written to the "
+                  << OUT_DIR << " directory\n";
+    }
+    if ( argc == 1 && !runToolchain( session, filename ) ) {
+        return EXIT_FAILURE;
+    }
+    if ( stats ) {
+        printStats( start );
+    }
 
     return EXIT_SUCCESS;
 
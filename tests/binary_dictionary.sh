@@ -0,0 +1,75 @@
+# The binary dictionary (.bdict) of an analyzed file must read back as the
+# text dictionary written with it, and --dump-dict must reject damaged or
+# crafted files with an error instead of reading outside the mapping.
+# Header fields are patched in little-endian order.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+int classify(int n) {
+  if (n < 0) {
+    return -1;
+  }
+  switch (n) {
+  case 0:
+    return 0;
+  case 1:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+int main() {
+  int n;
+  scanf("%d", &n);
+  for (int i = 0; i < n; i++) {
+    printf("%d\n", classify(i));
+  }
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream >/dev/null 2>&1
+"$EXE" --dump-dict out/prog.c.bdict >dumped.txt
+cat dumped.txt
+cmp -s out/prog.c.branch_dict dumped.txt && echo "round trip: same as the text dictionary"
+
+# Writes the bytes of hex string $3 over file $1 at offset $2.
+function patch() {
+	printf "$(echo "$3" | sed 's/../\\x&/g')" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# Copies the dictionary, applies patch $2 (offset and bytes), and dumps it.
+function dump_patched() {
+	echo
+	echo "$1:"
+	cp out/prog.c.bdict bad.bdict
+	[ -n "$2" ] && patch bad.bdict $2
+	"$EXE" --dump-dict bad.bdict
+	echo "exit $?"
+}
+
+dump_patched "bad magic" "0 58"
+dump_patched "bad version" "8 02000000"
+dump_patched "records overlapping the header" "24 0000000000000000"
+dump_patched "misaligned records" "24 3100000000000000"
+dump_patched "records offset near 2^64" "24 f0ffffffffffffff"
+dump_patched "records past the strings" "16 ff000000"
+dump_patched "strings offset near 2^64" "32 f8ffffffffffffff"
+dump_patched "strings size near 2^64" "40 f8ffffffffffffff"
+dump_patched "empty string table" "40 0000000000000000"
+dump_patched "source name outside the strings" "20 ffff0000"
+dump_patched "function name outside the strings" "68 ffff0000"
+
+echo
+echo "truncated header:"
+head -c 20 out/prog.c.bdict >bad.bdict
+"$EXE" --dump-dict bad.bdict
+echo "exit $?"
+
+echo
+echo "unterminated strings:"
+cp out/prog.c.bdict bad.bdict
+patch bad.bdict $(($(wc -c <bad.bdict) - 1)) 78
+"$EXE" --dump-dict bad.bdict
+echo "exit $?"
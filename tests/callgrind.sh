@@ -0,0 +1,142 @@
+# --callgrind over hand-written profiles of a small program, with and without
+# its dictionary: compressed file and function names defined once and reused,
+# inlined code (fi=/fe=), relative and repeated positions (+N, -N, *), call
+# costs (calls=), jumps (jump=/jcnd=), recursion suffixes and instruction
+# addresses, then profiles the parser must reject.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+int helper(int x) {
+  return x * 2;
+}
+
+int main() {
+  int n;
+  scanf("%d", &n);
+  if (n > 0) {
+    n = helper(n);
+    n = n + 1;
+  } else {
+    n = -n;
+  }
+  printf("%d\n", n);
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+# Ir is the second event. helper'2 is a recursive call of helper; myprog.c
+# must not be taken for prog.c. The summary line gives the total.
+cat >lines.out <<'EOF'
+# callgrind format
+version: 1
+creator: hand-written
+cmd: ./prog
+positions: line
+events: Dr Ir
+summary: 50 400
+
+fl=(1) /home/user/prog.c
+fn=(1) helper
+3 1 4
++1 2 6
+fn=(2) helper'2
+4 0 3
+fn=(3) main
+7 0 5
++2 3 20
+cfi=(2) /usr/include/stdio.h
+cfn=(4) __isoc99_scanf
+calls=1 0
+* 0 100
++1 1 8
+jcnd=1/1 14
+* 0 0
++1 2 9
+cfi=(1)
+cfn=(1)
+calls=1 3
+* 0 13
++1 1 11
++2 0 7
+jump=1 16
+* 0 0
+fi=(3) /home/user/prog.h
+2 0 30
+fe=(1)
+16 1 12
+cfn=(5) printf
+calls=1 0
+* 0 150
++1 0 2
+-3 0 1
+
+fl=(4) /home/user/myprog.c
+fn=(6) other
+14 0 60
+
+totals: 50 400
+EOF
+
+echo
+echo "line positions, no dictionary:"
+"$EXE" --callgrind lines.out
+echo "exit $?"
+
+echo
+echo "line positions, with the dictionary:"
+"$EXE" --callgrind lines.out --dict out/prog.c.bdict --top 3
+echo "exit $?"
+
+# Written with --dump-instr=yes; without a summary the totals line counts.
+cat >instr.out <<'EOF'
+positions: instr line
+events: Ir
+fl=(1) prog.c
+fn=(1) main
+0x401136 9 20
++4 +1 8
++2 * 5
++0x10 +4 7
+-0x8 +3 16
+fn=(2) main'3
+0x401200 17 1
+totals: 70
+EOF
+
+echo
+echo "instruction positions, with the dictionary:"
+"$EXE" --callgrind instr.out --dict out/prog.c.bdict
+echo "exit $?"
+
+# Without a summary or totals line, the cost lines give the total.
+grep -v totals instr.out >nototals.out
+echo
+echo "no totals line:"
+"$EXE" --callgrind nototals.out
+echo "exit $?"
+
+echo
+echo "no Ir event:"
+printf 'events: Dr Dw\nfl=prog.c\n9 1 2\n' >bad.out
+"$EXE" --callgrind bad.out
+echo "exit $?"
+
+echo
+echo "no line positions:"
+printf 'positions: instr\nevents: Ir\nfl=prog.c\n0x401136 20\n' >bad.out
+"$EXE" --callgrind bad.out
+echo "exit $?"
+
+echo
+echo "no cost lines:"
+printf 'events: Ir\nfl=prog.c\n' >bad.out
+"$EXE" --callgrind bad.out
+echo "exit $?"
+
+echo
+echo "missing file:"
+"$EXE" --callgrind missing.out
+echo "exit $?"
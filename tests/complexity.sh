@@ -0,0 +1,52 @@
+# --complexity sweeps the stdin inputs of a program whose loop bodies grow in
+# n as each of the models of ComplexityProfiler::fit (constant, log n, n,
+# n log n, n^2 and n^3), which must be told apart from their exact hit
+# counts. Targets first reached past some n, and the branch on m, are steps
+# that no model fits well.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+int main() {
+  int n, m;
+  long work = 0;
+  if (scanf("%d %d", &n, &m) != 2) {
+    return 1;
+  }
+  if (m > 100) {
+    work++;
+  }
+  for (int k = 1; k < n; k *= 2) {
+    work++;
+  }
+  for (int i = 0; i < n; i++) {
+    work++;
+  }
+  for (int i = 0; i < n; i++) {
+    for (int k = 1; k < n; k *= 2) {
+      work++;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      work++;
+    }
+  }
+  for (int i = 0; i < n / 4; i++) {
+    for (int j = 0; j < n / 4; j++) {
+      for (int k = 0; k < n / 4; k++) {
+        work++;
+      }
+    }
+  }
+  printf("%ld\n", work);
+  return 0;
+}
+EOF
+"$EXE" -j 2 --complexity prog.c --sweep-max 256 2>/dev/null
+echo "exit $?"
+
+echo
+echo "missing file:"
+"$EXE" --complexity missing.c
+echo "exit $?"
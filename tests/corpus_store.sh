@@ -0,0 +1,85 @@
+# The result store of --corpus: traces that repeat or share a prefix with
+# another must be stored once (chunk deduplication), every trace must read
+# back byte for byte (--corpus-trace), and --corpus-diff must find how long
+# a prefix two traces share, inside a chunk as well as on a chunk boundary.
+
+# Stands in for an instrumented program: reads "<length> <split>" and prints
+# <length> pseudo-random trace lines, which from line <split> on depend on
+# the split, so inputs with the same split print the same trace.
+cat >prog.c <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+
+int main() {
+  unsigned length, split;
+  if (scanf("%u %u", &length, &split) != 2) {
+    return 1;
+  }
+  if (length == 0) {
+    abort();
+  }
+  for (unsigned i = 0; i < length; i++) {
+    unsigned value = i * 2654435761u;
+    if (i >= split) {
+      value ^= split * 40503u;
+    }
+    printf("br_%u\n", value % 1000);
+  }
+  return 0;
+}
+EOF
+$CC -w prog.c -o prog
+
+mkdir inputs
+echo "20000 20000" >inputs/a
+echo "20000 20000" >inputs/a_copy
+echo "20000 9000" >inputs/split
+echo "12000 20000" >inputs/prefix
+echo "0 0" >inputs/crash
+echo "x" >inputs/bad
+
+"$EXE" -j 2 --corpus inputs --exe ./prog -o runs.store
+echo "exit $?"
+
+echo
+echo "runs:"
+"$EXE" --corpus-list runs.store >list.txt
+echo "exit $?"
+head -n -1 list.txt | sed 's/, [0-9]* ms,/, <t> ms,/' | sort
+tail -n 1 list.txt
+
+echo
+echo "traces read back:"
+for input in a a_copy split prefix; do
+	./prog <inputs/$input >expected.txt
+	"$EXE" --corpus-trace runs.store $input >trace.txt
+	cmp -s expected.txt trace.txt && echo "$input: same as the program's output"
+done
+
+# Bytes and lines of output that inputs $1 and $2 share, counted directly:
+# up to the first byte that differs, or all of the shorter output.
+function shared() {
+	./prog <inputs/$1 >first.txt
+	./prog <inputs/$2 >second.txt
+	local bytes=$(cmp -l first.txt second.txt 2>/dev/null | awk 'NR == 1 { print $1 - 1 }')
+	if [ -z "$bytes" ]; then
+		bytes=$(wc -c <first.txt)
+		[ "$(wc -c <second.txt)" -lt "$bytes" ] && bytes=$(wc -c <second.txt)
+	fi
+	echo "counted: $bytes bytes, $(head -c $bytes first.txt | wc -l) lines"
+}
+
+for pair in "a a_copy" "a split" "a prefix" "split prefix"; do
+	echo
+	echo "diff $pair:"
+	"$EXE" --corpus-diff runs.store $pair
+	echo "exit $?"
+	shared $pair
+done
+
+echo
+echo "unknown input:"
+"$EXE" --corpus-trace runs.store missing
+echo "exit $?"
+"$EXE" --corpus-diff runs.store a missing
+echo "exit $?"
@@ -0,0 +1,68 @@
+# The -DKPC_LATENCY runtime (--latency): every target reached gets a
+# histogram whose count is the number of times it was entered and whose
+# buckets add up to that count; with KPC_TIMELINE each region is also one
+# trace event. Times vary from run to run, so only counts are compared.
+# Then the same with -DKPC_THREADED and two threads.
+
+cat >prog.c <<'EOF'
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+long n;
+
+void *work(void *arg) {
+  long odd = 0;
+  for (long i = 0; i < n; i++) {
+    if (i % 2) {
+      odd++;
+    }
+  }
+  return arg;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[2];
+  n = argc > 1 ? atol(argv[1]) : 10;
+  if (argc > 2) {
+    for (int t = 0; t < 2; t++) {
+      pthread_create(&threads[t], NULL, work, NULL);
+    }
+    for (int t = 0; t < 2; t++) {
+      pthread_join(threads[t], NULL);
+    }
+  } else {
+    work(NULL);
+  }
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream --latency >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+# Prints each histogram's id and count, and whether its buckets add up.
+function counts() {
+	awk '$1 == "latency" {
+		sum = 0
+		for (i = 5; i <= NF; i++) {
+			split($i, bucket, "=")
+			sum += bucket[2]
+		}
+		print $2, $3, sum == substr($3, 3) ? "buckets add up" : "buckets add up to " sum
+	}' "$1" | sort -V
+}
+
+echo
+echo "latency:"
+$CC -w -DKPC_LATENCY out/prog.c.modified.c -o prog -lpthread &&
+	KPC_TIMELINE=timeline.json ./prog 10 >latency.txt
+echo "exit $?"
+counts latency.txt
+echo "timeline events: $(grep -c '"ph":"X"' timeline.json), of $(awk '$1 == "latency" { n += substr($3, 3) } END { print n }' latency.txt) regions"
+
+echo
+echo "latency, -DKPC_THREADED, two threads:"
+$CC -w -DKPC_LATENCY -DKPC_THREADED out/prog.c.modified.c -o prog -lpthread &&
+	./prog 1000 threads >latency.txt
+echo "exit $?"
+counts latency.txt
@@ -0,0 +1,15 @@
+/* A global named like index() of <strings.h>, which is not included here.
+ * Neither the PCH of common headers nor clang's predeclared library
+ * functions may hide it. */
+
+#include <stdio.h>
+
+int index;
+
+int main() {
+  scanf("%d", &index);
+  if (index > 3) {
+    printf("big\n");
+  }
+  return 0;
+}
@@ -0,0 +1,14 @@
+/* A global named like y1() of <math.h>, which is in the PCH of common
+ * headers but not included here. */
+
+#include <stdio.h>
+
+int y1;
+
+int main() {
+  scanf("%d", &y1);
+  if (y1 > 3) {
+    printf("big\n");
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+# Loop summaries (--loop-summary): one "loop br_E xN ..." record per
+# execution of a loop, printed when the loop is left by its condition, by
+# break or by return, for nested loops as well; calls in a loop are still
+# logged as they happen. Then the same run with -DKPC_THREADED, where the
+# records go through the thread's buffer.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+void report(int i) { printf("report %d\n", i); }
+
+int find(int n, int wanted) {
+  for (int i = 0; i < n; i++) {
+    if (i == wanted) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main() {
+  int n;
+  if (scanf("%d", &n) != 1) {
+    return 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (i % 3 == 0) {
+      report(i);
+    }
+    for (int j = 0; j < i; j++) {
+      if (j == 2) {
+        break;
+      }
+    }
+  }
+  int k = 0;
+  while (k < n) {
+    k += 2;
+  }
+  printf("found %d\n", find(n, 4));
+  printf("found %d\n", find(n, n));
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream --loop-summary >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+echo
+echo "summaries:"
+$CC -w out/prog.c.modified.c -o prog && echo 6 | ./prog | sed 's/^func_.*/func_<report>/'
+
+echo
+echo "summaries, -DKPC_THREADED:"
+$CC -w -DKPC_THREADED out/prog.c.modified.c -o prog -lpthread &&
+	echo 6 | ./prog | sed 's/^T[0-9]* [0-9]*: /T: /; s/func_.*/func_<report>/'
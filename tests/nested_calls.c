@@ -0,0 +1,34 @@
+/* Calls nested in another call's arguments are call-graph edges: f is
+ * recursive through g(f(n - 1)), and main reaches the branches of fib,
+ * is_odd and f through printf's arguments. */
+#include <stdio.h>
+
+int g(int x) { return x + 1; }
+
+int f(int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  return g(f(n - 1));
+}
+
+int fib(int n) {
+  if (n < 2) {
+    return n;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+int is_odd(int n) {
+  if (n % 2) {
+    return 1;
+  }
+  return 0;
+}
+
+int main() {
+  int n;
+  scanf("%d", &n);
+  printf("%d %d %d\n", fib(5), is_odd(4), f(n));
+  return 0;
+}
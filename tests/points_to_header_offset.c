@@ -0,0 +1,20 @@
+/* main reaches quiet but not loud. fp is spelled at the offset of handler
+ * in points_to_header_offset.h. */
+#include <stdio.h>
+#include "points_to_header_offset.h"
+
+static void quiet(void) {}
+
+static void loud(void) {
+  if (getchar() != EOF) {
+    puts("loud");
+  }
+}
+
+void install(void) { handler = loud; }
+
+int main() {
+  void (*fp)(void) = quiet;
+  fp();
+  return 0;
+}
@@ -0,0 +1,7 @@
+/* As long as points_to_header_offset.c up to fp, so that handler is at the
+ * same offset. Keyed by offset alone, the two were one points-to cell and
+ * a call through fp also reached every function assigned to handler. The
+ * dashes pad it.
+ * ---------------------------------------------------------------------
+ */
+extern void (*handler)(void);
@@ -0,0 +1,26 @@
+/* A prototype and the definition of a recursive function share one _PTR
+ * alias in the instrumented program, which must still compile. */
+#include <stdio.h>
+
+int is_even(int n);
+
+int is_odd(int n) {
+  if (n == 0) {
+    return 0;
+  }
+  return is_even(n - 1);
+}
+
+int is_even(int n) {
+  if (n == 0) {
+    return 1;
+  }
+  return is_odd(n - 1);
+}
+
+int main() {
+  int n;
+  scanf("%d", &n);
+  printf("%d\n", is_even(n));
+  return 0;
+}
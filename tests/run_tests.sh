@@ -0,0 +1,62 @@
+#!/usr/bin/bash
+
+# Golden-output tests of the analyses. Every NAME.c here is analyzed with
+# "FeatureDetector -d --stream" in a scratch directory; the report must match
+# NAME.expected and the instrumented program must compile. Every other
+# NAME.sh is run in a scratch directory with EXE, CC and TESTS_DIR set, for
+# the modes that take more than a C file; what it prints must match
+# NAME.expected.
+#
+#   tests/run_tests.sh [FeatureDetector]    (or: make check)
+#
+# With UPDATE=1 the .expected files are rewritten from the current reports.
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+EXE=$(realpath "${1:-$TESTS_DIR/../bin/FeatureDetector}")
+CC=${CC:-cc}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+shopt -s nullglob
+failed=0
+for source in "$TESTS_DIR"/*.c; do
+	name=$(basename "$source" .c)
+	rm -rf "${WORK_DIR:?}"/*
+	mkdir "$WORK_DIR/out"
+	cp "$source" "$TESTS_DIR"/*.h "$WORK_DIR"
+
+	(cd "$WORK_DIR" && "$EXE" "$name.c" -d --stream 2>/dev/null) >"$WORK_DIR/report.txt"
+	if [ -n "$UPDATE" ]; then
+		cp "$WORK_DIR/report.txt" "$TESTS_DIR/$name.expected"
+	elif ! diff -u "$TESTS_DIR/$name.expected" "$WORK_DIR/report.txt"; then
+		echo "FAIL: $name: report differs"
+		failed=1
+		continue
+	fi
+
+	if ! $CC -fsyntax-only -w -I "$WORK_DIR" "$WORK_DIR/out/$name.c.modified.c"; then
+		echo "FAIL: $name: instrumented program does not compile"
+		failed=1
+		continue
+	fi
+	echo "PASS: $name"
+done
+
+export EXE CC TESTS_DIR
+for script in "$TESTS_DIR"/*.sh; do
+	name=$(basename "$script" .sh)
+	[ "$name" = run_tests ] && continue
+	rm -rf "${WORK_DIR:?}"/*
+	mkdir "$WORK_DIR/out"
+
+	(cd "$WORK_DIR" && bash "$script" 2>&1) >"$WORK_DIR/report.txt"
+	if [ -n "$UPDATE" ]; then
+		cp "$WORK_DIR/report.txt" "$TESTS_DIR/$name.expected"
+	elif ! diff -u "$TESTS_DIR/$name.expected" "$WORK_DIR/report.txt"; then
+		echo "FAIL: $name: output differs"
+		failed=1
+		continue
+	fi
+	echo "PASS: $name"
+done
+exit $failed
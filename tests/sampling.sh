@@ -0,0 +1,38 @@
+# The sampling modes of the emitted header: how often each target of a loop
+# is logged by default, with -DKPC_SAMPLE_EVERY, -DKPC_SAMPLE_FIRST and
+# -DKPC_SAMPLE_ENABLE. Calls are always logged.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+void fizz(int i) { printf("fizz %d\n", i); }
+
+int main() {
+  int n;
+  if (scanf("%d", &n) != 1) {
+    return 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (i % 3 == 0) {
+      fizz(i);
+    }
+  }
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+# Builds the instrumented program with the flags given, runs it on 10, and
+# counts the lines it logged.
+function run() {
+	echo
+	echo "${*:-no flags}${KPC_ENABLE:+ KPC_ENABLE=$KPC_ENABLE}:"
+	$CC -w "$@" out/prog.c.modified.c -o prog || return
+	echo 10 | ./prog | grep -v '^fizz ' | sed 's/^func_.*/func_<fizz>/' | sort | uniq -c
+}
+
+run
+run -DKPC_SAMPLE_EVERY=3
+run -DKPC_SAMPLE_FIRST=2
+KPC_ENABLE=3,6 run -DKPC_SAMPLE_ENABLE
@@ -0,0 +1,16 @@
+/* Only the second branch depends on input. count is spelled at the offset
+ * of verbose in taint_header_offset.h. */
+#include <stdio.h>
+#include "taint_header_offset.h"
+
+int main() {
+  int count;
+  scanf("%d", &count);
+  if (verbose) {
+    printf("verbose\n");
+  }
+  if (count > 0) {
+    printf("positive\n");
+  }
+  return 0;
+}
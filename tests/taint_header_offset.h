@@ -0,0 +1,6 @@
+/* As long as taint_header_offset.c up to count, so that verbose is at the
+ * same offset; keyed by offset alone, the two were one taint node. The
+ * dashes pad it.
+ * ------
+ */
+extern int verbose;
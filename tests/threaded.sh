@@ -0,0 +1,64 @@
+# The -DKPC_THREADED runtime: main and two threads log into their own buffers,
+# which are merged by timestamp at exit; sampling counters are per thread.
+# Then the buffers outgrow an address space limit, which must cost the events
+# that do not fit rather than crash the program.
+
+cat >prog.c <<'EOF'
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+long n;
+
+void *work(void *arg) {
+  long odd = 0;
+  for (long i = 0; i < n; i++) {
+    if (i % 2) {
+      odd++;
+    }
+  }
+  return arg;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[2];
+  n = argc > 1 ? atol(argv[1]) : 10;
+  for (int t = 0; t < 2; t++) {
+    pthread_create(&threads[t], NULL, work, NULL);
+  }
+  for (int t = 0; t < 2; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+# Counts the events of trace $1 per id, and checks that they are merged in
+# time order, and names the threads that logged.
+function summarize() {
+	sed 's/^T[0-9]* [0-9]*: //' "$1" | sort | uniq -c
+	awk '
+		{ split($2, time, ":"); if (time[1] + 0 < last) unordered = 1; last = time[1] + 0; threads[$1] = 1 }
+		END { print length(threads) " threads, " (unordered ? "not " : "") "in time order" }
+	' "$1"
+}
+
+echo
+echo "-DKPC_THREADED:"
+$CC -w -DKPC_THREADED out/prog.c.modified.c -o prog -pthread || exit
+./prog 10 >trace.txt
+summarize trace.txt
+
+echo
+echo "-DKPC_THREADED -DKPC_SAMPLE_FIRST=2:"
+$CC -w -DKPC_THREADED -DKPC_SAMPLE_FIRST=2 out/prog.c.modified.c -o prog -pthread || exit
+./prog 10 >trace.txt
+summarize trace.txt
+
+echo
+echo "-DKPC_THREADED out of memory:"
+$CC -w -DKPC_THREADED out/prog.c.modified.c -o prog -pthread || exit
+(ulimit -v 200000 && ./prog 3000000 >trace.txt)
+echo "exit $?"
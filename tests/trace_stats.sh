@@ -0,0 +1,84 @@
+# --trace-stats over a text trace with every kind of line the runtimes
+# print, then over the binary copy --pack wrote of it, which must count the
+# same branches and calls (loop summaries and latency histograms are left
+# out of packed copies), then over damaged binary traces.
+
+cat >prog.c <<'EOF'
+#include <stdio.h>
+
+void report(int n) { printf("%d\n", n); }
+
+int main() {
+  int n;
+  scanf("%d", &n);
+  if (n > 0) {
+    report(n);
+  } else {
+    report(-n);
+  }
+  for (int i = 0; i < n; i++) {
+    if (i % 2) {
+      report(i);
+    }
+  }
+  return 0;
+}
+EOF
+"$EXE" prog.c --stream >/dev/null 2>&1
+cat out/prog.c.branch_dict
+
+# Ends without a newline, as a program killed mid-line leaves it.
+printf '%s\n' \
+	"br_1" \
+	"output of the program" \
+	"func_0x401136" \
+	"prog.c {8, 9}: br_1" \
+	"func_0x401136" \
+	"T1 1200: br_3" \
+	"T1 1300: func_(nil)" \
+	"T2 1400: br_2" \
+	"T2 1500: func_0x401136" \
+	"T1 1600: func_0x401136" \
+	"loop br_3 x4 br_3=4 br_5=2" \
+	"latency br_5 n=4 ns=4000 b9=3 b11=1" \
+	"br_99" \
+	"br_x" \
+	"Tx 1: br_1" >trace.txt
+printf 'br_2' >>trace.txt
+
+echo
+echo "text:"
+"$EXE" --trace-stats trace.txt --dict out/prog.c.bdict --pack trace.bin >text.txt
+echo "exit $?"
+cat text.txt
+
+echo
+echo "binary:"
+"$EXE" --trace-stats trace.bin --dict out/prog.c.bdict >binary.txt
+echo "exit $?"
+diff text.txt binary.txt
+
+echo
+echo "stdin, no dictionary:"
+"$EXE" --trace-stats - <trace.txt
+echo "exit $?"
+
+echo
+echo "truncated header:"
+head -c 12 trace.bin >bad.bin
+"$EXE" --trace-stats bad.bin
+echo "exit $?"
+
+echo
+echo "bad version:"
+cp trace.bin bad.bin
+printf '\x02' | dd of=bad.bin bs=1 seek=8 conv=notrunc status=none
+"$EXE" --trace-stats bad.bin
+echo "exit $?"
+
+echo
+echo "call record cut short:"
+cp trace.bin bad.bin
+printf '\xff\xff\xff\xff\x36\x11\x40\x00' >>bad.bin
+"$EXE" --trace-stats bad.bin
+echo "exit $?"